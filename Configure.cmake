@@ -163,6 +163,16 @@ IF(NOT YELLA_LZ4_LIB)
     MESSAGE(FATAL_ERROR "Set LZ4_LIB_DIR")
 ENDIF()
 
+# xxHash
+FIND_PATH(YELLA_XXHASH_INCLUDE_DIR xxhash.h PATHS "${XXHASH_INCLUDE_DIR}")
+IF(NOT YELLA_XXHASH_INCLUDE_DIR)
+    MESSAGE(FATAL_ERROR "Set XXHASH_INCLUDE_DIR")
+ENDIF()
+FIND_LIBRARY(YELLA_XXHASH_LIB xxhash PATHS "${XXHASH_LIB_DIR}")
+IF(NOT YELLA_XXHASH_LIB)
+    MESSAGE(FATAL_ERROR "Set XXHASH_LIB_DIR")
+ENDIF()
+
 # Chucho
 FIND_PATH(YELLA_CHUCHO_INCLUDE_DIR chucho/log.h PATHS "${CHUCHO_INCLUDE_DIR}")
 IF(NOT YELLA_CHUCHO_INCLUDE_DIR)
@@ -223,7 +233,7 @@ ENDIF()
 FIND_PACKAGE(ICU REQUIRED COMPONENTS uc i18n io data)
 
 # libfswatch
-IF(YELLA_LINUX OR YELLA_MACINTOSH OR YELLA_LINUX)
+IF(YELLA_MACINTOSH)
     SET(YELLA_LIBFSWATCH TRUE)
 ENDIF()
 IF(YELLA_LIBFSWATCH)
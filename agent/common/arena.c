@@ -0,0 +1,153 @@
+/*
+ * Copyright 2016 Will Mason
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "common/arena.h"
+#include <unicode/ustring.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct block
+{
+    struct block* next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) unsigned char mem[];
+} block;
+
+struct yella_arena
+{
+    size_t block_size;
+    block* blocks;
+    block* current;
+    block* large;
+};
+
+static block* create_block(size_t sz)
+{
+    block* result;
+
+    result = malloc(sizeof(block) + sz);
+    result->next = NULL;
+    result->size = sz;
+    result->used = 0;
+    return result;
+}
+
+static void destroy_blocks(block* blk)
+{
+    block* next;
+
+    while (blk != NULL)
+    {
+        next = blk->next;
+        free(blk);
+        blk = next;
+    }
+}
+
+void* yella_arena_alloc(yella_arena* ar, size_t sz)
+{
+    block* blk;
+    void* result;
+
+    sz = (sz + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    if (sz > ar->block_size)
+    {
+        blk = create_block(sz);
+        blk->used = sz;
+        blk->next = ar->large;
+        ar->large = blk;
+        return blk->mem;
+    }
+    /* Blocks kept from before a reset are used in order before new ones are made */
+    while (ar->current->size - ar->current->used < sz)
+    {
+        if (ar->current->next == NULL)
+            ar->current->next = create_block(ar->block_size);
+        ar->current = ar->current->next;
+    }
+    result = ar->current->mem + ar->current->used;
+    ar->current->used += sz;
+    return result;
+}
+
+void* yella_arena_calloc(yella_arena* ar, size_t sz)
+{
+    void* result;
+
+    result = yella_arena_alloc(ar, sz);
+    memset(result, 0, sz);
+    return result;
+}
+
+size_t yella_arena_capacity(const yella_arena* const ar)
+{
+    size_t result;
+    block* blk;
+
+    result = 0;
+    for (blk = ar->blocks; blk != NULL; blk = blk->next)
+        result += blk->size;
+    for (blk = ar->large; blk != NULL; blk = blk->next)
+        result += blk->size;
+    return result;
+}
+
+UChar* yella_arena_copy_string(yella_arena* ar, const UChar* const str)
+{
+    size_t sz;
+    UChar* result;
+
+    sz = (u_strlen(str) + 1) * sizeof(UChar);
+    result = yella_arena_alloc(ar, sz);
+    memcpy(result, str, sz);
+    return result;
+}
+
+yella_arena* yella_create_arena(size_t block_size)
+{
+    yella_arena* result;
+
+    result = malloc(sizeof(yella_arena));
+    result->block_size = (block_size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+    result->blocks = create_block(result->block_size);
+    result->current = result->blocks;
+    result->large = NULL;
+    return result;
+}
+
+void yella_destroy_arena(yella_arena* ar)
+{
+    if (ar != NULL)
+    {
+        destroy_blocks(ar->blocks);
+        destroy_blocks(ar->large);
+        free(ar);
+    }
+}
+
+void yella_reset_arena(yella_arena* ar)
+{
+    block* blk;
+
+    for (blk = ar->blocks; blk != NULL; blk = blk->next)
+        blk->used = 0;
+    ar->current = ar->blocks;
+    destroy_blocks(ar->large);
+    ar->large = NULL;
+}
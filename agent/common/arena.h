@@ -0,0 +1,52 @@
+/*
+ * Copyright 2016 Will Mason
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#if !defined(ARENA_H__)
+#define ARENA_H__
+
+#include "export.h"
+#include <unicode/utypes.h>
+#include <stddef.h>
+
+#if defined(__cplusplus)
+extern "C"
+{
+#endif
+
+/*
+ * A region allocator for short-lived objects. Memory is carved from large
+ * blocks and is never freed piece by piece. Resetting the arena makes all of
+ * it available again at once, and the blocks are kept for the next round,
+ * so a long-running caller settles into a steady state without touching the
+ * heap. Allocations bigger than a block get their own, which a reset frees.
+ */
+typedef struct yella_arena yella_arena;
+
+/* The memory is suitably aligned for any type */
+YELLA_EXPORT void* yella_arena_alloc(yella_arena* ar, size_t sz);
+YELLA_EXPORT void* yella_arena_calloc(yella_arena* ar, size_t sz);
+/* Returns the number of bytes the arena holds from the heap */
+YELLA_EXPORT size_t yella_arena_capacity(const yella_arena* const ar);
+YELLA_EXPORT UChar* yella_arena_copy_string(yella_arena* ar, const UChar* const str);
+YELLA_EXPORT yella_arena* yella_create_arena(size_t block_size);
+YELLA_EXPORT void yella_destroy_arena(yella_arena* ar);
+YELLA_EXPORT void yella_reset_arena(yella_arena* ar);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif
@@ -45,9 +45,40 @@ typedef enum
     YELLA_FILE_TYPE_WHITEOUT
 } yella_file_type;
 
+typedef enum
+{
+    /* Chosen by file size */
+    YELLA_READ_STRATEGY_AUTOMATIC,
+    /* The historical BUFSIZ reads, mostly useful for comparison */
+    YELLA_READ_STRATEGY_SMALL_BUFFER,
+    /* Large page-aligned reads with sequential read-ahead advice */
+    YELLA_READ_STRATEGY_LARGE_BUFFER,
+    /* The whole file is mapped. A file truncated while mapped raises
+     * SIGBUS, so this is never chosen automatically. */
+    YELLA_READ_STRATEGY_MAPPED,
+    /* Large reads that leave the page cache as they found it, as far as
+     * the platform allows, so that reading big files does not evict
+     * other processes' working sets */
+    YELLA_READ_STRATEGY_CACHE_NEUTRAL
+} yella_read_strategy;
+
+/* Uses YELLA_READ_STRATEGY_AUTOMATIC */
 YELLA_EXPORT yella_rc yella_apply_function_to_file_contents(const UChar* const name,
                                                             void(*func)(const uint8_t* const, size_t, void*),
                                                             void* udata);
+YELLA_EXPORT yella_rc yella_apply_function_to_file_contents_with_strategy(const UChar* const name,
+                                                                          yella_read_strategy strategy,
+                                                                          void(*func)(const uint8_t* const, size_t, void*),
+                                                                          void* udata);
+/* Only the bytes from offset up to offset + length, or the end of the
+ * file, are given to the function. The mapped strategy is treated as
+ * the large buffer strategy. */
+YELLA_EXPORT yella_rc yella_apply_function_to_file_range(const UChar* const name,
+                                                         uint64_t offset,
+                                                         uint64_t length,
+                                                         yella_read_strategy strategy,
+                                                         void(*func)(const uint8_t* const, size_t, void*),
+                                                         void* udata);
 YELLA_EXPORT uds yella_base_name(const UChar* const path);
 YELLA_EXPORT uds yella_remove_duplicate_dir_seps(const UChar* const name);
 YELLA_EXPORT yella_rc yella_create_directory(const UChar* const name);
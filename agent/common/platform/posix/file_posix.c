@@ -14,6 +14,11 @@
  *    limitations under the License.
  */
 
+#if defined(__linux__)
+/* For O_NOATIME and O_DIRECT */
+#define _GNU_SOURCE
+#endif
+
 #include "common/file.h"
 #include "common/uds_util.h"
 #include "common/text_util.h"
@@ -28,6 +33,7 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <sys/mman.h>
 
 const UChar* YELLA_DIR_SEP = u"/";
 
@@ -102,18 +108,149 @@ static const UChar* yella_last_not(const UChar* const str, UChar c)
     return (result < str) ? NULL : result;
 }
 
-yella_rc yella_apply_function_to_file_contents(const UChar* const name,
-                                               void(*func)(const uint8_t* const, size_t, void*),
-                                               void* udata)
+/* Reads are this size once a file is bigger than it */
+#define YELLA_LARGE_READ_SIZE (1024 * 1024)
+/* Mapped files are handed to the function in pieces of this size */
+#define YELLA_MAPPED_CHUNK_SIZE (4 * 1024 * 1024)
+
+static int open_for_contents(const char* const utf8, int extra_flags)
 {
-    uint8_t buf[BUFSIZ];
     int fd;
-    char* utf8;
+
+#if defined(O_NOATIME)
+    /* Only the owner or a privileged process may avoid updating the access time */
+    fd = open(utf8, O_RDONLY | O_NOFOLLOW | O_NOATIME | extra_flags);
+    if (fd != -1 || errno != EPERM)
+        return fd;
+#endif
+    fd = open(utf8, O_RDONLY | O_NOFOLLOW | extra_flags);
+    return fd;
+}
+
+/* On return *drop_behind tells whether the caller must drop pages from
+ * the cache itself, because the cache could not be bypassed */
+static int open_cache_neutral(const char* const utf8, bool* drop_behind)
+{
+    int fd;
+
+    *drop_behind = false;
+#if defined(O_DIRECT)
+    /* Not every file system supports direct I/O */
+    fd = open_for_contents(utf8, O_DIRECT);
+    if (fd != -1 || errno != EINVAL)
+        return fd;
+#endif
+    fd = open_for_contents(utf8, 0);
+#if defined(F_NOCACHE)
+    if (fd != -1 && fcntl(fd, F_NOCACHE, 1) == 0)
+        return fd;
+#endif
+    *drop_behind = true;
+    return fd;
+}
+
+/* Direct I/O can still refuse a read whose offset or length is not
+ * aligned to what the file system wants. The descriptor is then switched
+ * to ordinary reads, and the caller drops pages from the cache itself. */
+static bool leave_direct_io(int fd)
+{
+#if defined(O_DIRECT)
+    int flags;
+
+    flags = fcntl(fd, F_GETFL);
+    if (flags != -1 && (flags & O_DIRECT) != 0)
+        return fcntl(fd, F_SETFL, flags & ~O_DIRECT) == 0;
+#endif
+    return false;
+}
+
+static bool read_buffered(int fd,
+                          off_t offset,
+                          uint64_t limit,
+                          size_t buf_size,
+                          bool drop_behind,
+                          void(*func)(const uint8_t* const, size_t, void*),
+                          void* udata)
+{
+    uint8_t* buf;
     ssize_t num_read;
+
+    if (posix_memalign((void**)&buf, sysconf(_SC_PAGESIZE), buf_size) != 0)
+        return false;
+    if (offset != 0 && lseek(fd, offset, SEEK_SET) == -1)
+    {
+        free(buf);
+        return false;
+    }
+    num_read = 0;
+    while (limit > 0)
+    {
+        num_read = read(fd, buf, (limit < buf_size) ? limit : buf_size);
+        if (num_read == -1 && errno == EINVAL && leave_direct_io(fd))
+        {
+            drop_behind = true;
+            continue;
+        }
+        if (num_read <= 0)
+            break;
+        limit -= num_read;
+        func(buf, num_read, udata);
+#if defined(POSIX_FADV_DONTNEED)
+        if (drop_behind)
+            posix_fadvise(fd, offset, num_read, POSIX_FADV_DONTNEED);
+#endif
+        offset += num_read;
+    }
+    free(buf);
+    return num_read >= 0;
+}
+
+static bool read_mapped(int fd,
+                        size_t file_size,
+                        void(*func)(const uint8_t* const, size_t, void*),
+                        void* udata)
+{
+    uint8_t* mem;
+    size_t offset;
+    size_t len;
+
+    mem = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mem == MAP_FAILED)
+        return false;
+    madvise(mem, file_size, MADV_SEQUENTIAL);
+    for (offset = 0; offset < file_size; offset += len)
+    {
+        len = file_size - offset;
+        if (len > YELLA_MAPPED_CHUNK_SIZE)
+            len = YELLA_MAPPED_CHUNK_SIZE;
+        func(mem + offset, len, udata);
+    }
+    munmap(mem, file_size);
+    return true;
+}
+
+static yella_rc apply_function_to_file_range(const UChar* const name,
+                                             uint64_t offset,
+                                             uint64_t length,
+                                             yella_read_strategy strategy,
+                                             void(*func)(const uint8_t* const, size_t, void*),
+                                             void* udata)
+{
+    int fd;
+    char* utf8;
+    struct stat info;
+    size_t page_size;
+    size_t buf_size;
+    bool ok;
+    bool drop_behind;
     yella_rc yrc;
 
     utf8 = yella_to_utf8(name);
-    fd = open(utf8, O_RDONLY | O_NOFOLLOW);
+    drop_behind = false;
+    if (strategy == YELLA_READ_STRATEGY_CACHE_NEUTRAL)
+        fd = open_cache_neutral(utf8, &drop_behind);
+    else
+        fd = open_for_contents(utf8, 0);
     if (fd == -1)
     {
         if (errno == EACCES)
@@ -129,14 +266,38 @@ yella_rc yella_apply_function_to_file_contents(const UChar* const name,
     }
     else
     {
-        while (true)
+        if (fstat(fd, &info) != 0)
+            info.st_size = 0;
+        /* Empty files and special files that report no size cannot be mapped */
+        if (strategy == YELLA_READ_STRATEGY_MAPPED && (info.st_size == 0 || offset != 0 || length != UINT64_MAX))
+            strategy = YELLA_READ_STRATEGY_LARGE_BUFFER;
+        if (strategy == YELLA_READ_STRATEGY_MAPPED)
         {
-            num_read = read(fd, buf, sizeof(buf));
-            if (num_read <= 0)
-                break;
-            func(buf, num_read, udata);
+            ok = read_mapped(fd, info.st_size, func, udata);
+        }
+        else if (strategy == YELLA_READ_STRATEGY_SMALL_BUFFER)
+        {
+            ok = read_buffered(fd, offset, length, BUFSIZ, false, func, udata);
+        }
+        else
+        {
+            /* Files that fit in one large read get a buffer just big enough
+             * to hold them. Page multiples also satisfy direct I/O. */
+            page_size = sysconf(_SC_PAGESIZE);
+            buf_size = YELLA_LARGE_READ_SIZE;
+            if (info.st_size > 0 && info.st_size < YELLA_LARGE_READ_SIZE)
+                buf_size = ((info.st_size / page_size) + 1) * page_size;
+#if defined(POSIX_FADV_SEQUENTIAL)
+            if (info.st_size > YELLA_LARGE_READ_SIZE)
+                posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+            ok = read_buffered(fd, offset, length, buf_size, drop_behind, func, udata);
+        }
+        if (ok)
+        {
+            yrc = YELLA_NO_ERROR;
         }
-        if (num_read < 0)
+        else
         {
             yrc = YELLA_FILE_SYSTEM_ERROR;
             CHUCHO_C_ERROR("common",
@@ -144,16 +305,37 @@ yella_rc yella_apply_function_to_file_contents(const UChar* const name,
                            utf8,
                            strerror(errno));
         }
-        else
-        {
-            yrc = YELLA_NO_ERROR;
-        }
         close(fd);
     }
     free(utf8);
     return yrc;
 }
 
+yella_rc yella_apply_function_to_file_contents(const UChar* const name,
+                                               void(*func)(const uint8_t* const, size_t, void*),
+                                               void* udata)
+{
+    return apply_function_to_file_range(name, 0, UINT64_MAX, YELLA_READ_STRATEGY_AUTOMATIC, func, udata);
+}
+
+yella_rc yella_apply_function_to_file_contents_with_strategy(const UChar* const name,
+                                                             yella_read_strategy strategy,
+                                                             void(*func)(const uint8_t* const, size_t, void*),
+                                                             void* udata)
+{
+    return apply_function_to_file_range(name, 0, UINT64_MAX, strategy, func, udata);
+}
+
+yella_rc yella_apply_function_to_file_range(const UChar* const name,
+                                            uint64_t offset,
+                                            uint64_t length,
+                                            yella_read_strategy strategy,
+                                            void(*func)(const uint8_t* const, size_t, void*),
+                                            void* udata)
+{
+    return apply_function_to_file_range(name, offset, length, strategy, func, udata);
+}
+
 uds yella_base_name(const UChar* const path)
 {
     size_t len;
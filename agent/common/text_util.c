@@ -91,9 +91,10 @@ char* yella_to_utf8(const UChar* const str)
     u_strToUTF8(buf, len + 1, &dest_len, str, len, &ec);
     if (ec != U_ZERO_ERROR)
     {
-        buf = realloc(buf, dest_len);
+        /* The length does not count the terminator */
+        buf = realloc(buf, dest_len + 1);
         ec = U_ZERO_ERROR;
-        u_strToUTF8(buf, dest_len, &dest_len, str, len, &ec);
+        u_strToUTF8(buf, dest_len + 1, &dest_len, str, len, &ec);
         if (ec != U_ZERO_ERROR)
         {
             free(buf);
@@ -1,6 +1,7 @@
 #include "attribute.h"
 #include "common/file.h"
 #include "common/text_util.h"
+#include <unicode/uiter.h>
 #include <string.h>
 
 static yella_file_type fb_to_file_type(yella_fb_file_file_type_enum_t fbt)
@@ -83,6 +84,53 @@ static void acl_entry_destructor(void* elem, void* udata)
     free(entry);
 }
 
+static UChar* copy_name(const UChar* const name)
+{
+    UChar* result;
+    size_t sz;
+
+    if (name == NULL)
+        return NULL;
+    sz = (u_strlen(name) + 1) * sizeof(UChar);
+    result = malloc(sz);
+    memcpy(result, name, sz);
+    return result;
+}
+
+static void read_posix_permission(const yella_fb_file_posix_permission_table_t tbl, struct posix_permission* perm)
+{
+    perm->read = yella_fb_file_posix_permission_read(tbl) ? true : false;
+    perm->write = yella_fb_file_posix_permission_write(tbl) ? true : false;
+    perm->execute = yella_fb_file_posix_permission_execute(tbl) ? true : false;
+}
+
+static void read_posix_permissions(const yella_fb_file_posix_permissions_table_t tbl, posix_permissions* perms)
+{
+    memset(perms, 0, sizeof(posix_permissions));
+    if (yella_fb_file_posix_permissions_owner_is_present(tbl))
+        read_posix_permission(yella_fb_file_posix_permissions_owner(tbl), &perms->owner);
+    if (yella_fb_file_posix_permissions_group_is_present(tbl))
+        read_posix_permission(yella_fb_file_posix_permissions_group(tbl), &perms->group);
+    if (yella_fb_file_posix_permissions_other_is_present(tbl))
+        read_posix_permission(yella_fb_file_posix_permissions_other(tbl), &perms->other);
+    perms->set_uid = yella_fb_file_posix_permissions_set_uid(tbl) ? true : false;
+    perms->set_gid = yella_fb_file_posix_permissions_set_gid(tbl) ? true : false;
+    perms->sticky = yella_fb_file_posix_permissions_sticky(tbl) ? true : false;
+}
+
+/* The packed name is UTF-8, so it is walked in place rather than converted */
+static int compare_name_to_utf8(const UChar* const name, const char* const utf8)
+{
+    UCharIterator itor1;
+    UCharIterator itor2;
+
+    if (name == NULL || utf8 == NULL)
+        return (name == NULL ? 0 : 1) - (utf8 == NULL ? 0 : 1);
+    uiter_setString(&itor1, name, -1);
+    uiter_setUTF8(&itor2, utf8, -1);
+    return u_strCompareIter(&itor1, &itor2, false);
+}
+
 uint16_t attribute_type_to_fb(attribute_type atp)
 {
     uint16_t result;
@@ -119,6 +167,12 @@ uint16_t attribute_type_to_fb(attribute_type atp)
     case ATTR_TYPE_POSIX_ACL:
         result = yella_fb_file_attr_type_POSIX_ACL;
         break;
+    case ATTR_TYPE_CHUNKED_SHA256:
+        result = yella_fb_file_attr_type_CHUNKED_SHA256;
+        break;
+    case ATTR_TYPE_XXH3_128:
+        result = yella_fb_file_attr_type_XXH3_128;
+        break;
     default:
         assert(false);
     }
@@ -141,6 +195,7 @@ int compare_attributes(const attribute* const lhs, const attribute* const rhs)
             rc = lhs->value.integer - rhs->value.integer;
             break;
         case ATTR_TYPE_SHA256:
+        case ATTR_TYPE_XXH3_128:
             rc = (int64_t)lhs->value.byte_array.sz - (int64_t)rhs->value.byte_array.sz;
             if (rc == 0)
                 rc = memcmp(lhs->value.byte_array.mem, rhs->value.byte_array.mem, lhs->value.byte_array.sz);
@@ -186,6 +241,10 @@ int compare_attributes(const attribute* const lhs, const attribute* const rhs)
                 }
             }
             break;
+        case ATTR_TYPE_CHUNKED_SHA256:
+            /* The root covers the chunk size and the chunks */
+            rc = memcmp(lhs->value.chunked.root, rhs->value.chunked.root, CHUNKED_SHA256_DIGEST_SIZE);
+            break;
         default:
             assert(false);
         }
@@ -193,88 +252,193 @@ int compare_attributes(const attribute* const lhs, const attribute* const rhs)
     return rc;
 }
 
-attribute* create_attribute_from_table(const yella_fb_file_attr_table_t tbl)
+int compare_attribute_to_table(const attribute* const attr, const yella_fb_file_attr_table_t tbl)
 {
-    attribute* result;
+    int rc;
     flatbuffers_uint8_vec_t bytes;
-    yella_fb_file_posix_permissions_table_t psx_perms;
+    posix_permissions perms;
     yella_fb_file_user_group_table_t usr_grp;
-    yella_fb_file_posix_permission_table_t psx_perm;
     yella_fb_file_posix_access_control_entry_vec_t acl_entries;
     yella_fb_file_posix_access_control_entry_table_t fb_entry;
+    size_t acl_count;
     size_t i;
     posix_acl_entry* entry;
+    struct posix_permission perm;
+
+    rc = (int)attr->type - (int)fb_to_attribute_type(yella_fb_file_attr_type(tbl));
+    if (rc == 0)
+    {
+        switch (attr->type)
+        {
+        case ATTR_TYPE_FILE_TYPE:
+            rc = attr->value.integer - fb_to_file_type(yella_fb_file_attr_ftype(tbl));
+            break;
+        case ATTR_TYPE_SHA256:
+        case ATTR_TYPE_XXH3_128:
+            bytes = yella_fb_file_attr_bytes(tbl);
+            rc = (int64_t)attr->value.byte_array.sz - (int64_t)flatbuffers_uint8_vec_len(bytes);
+            if (rc == 0)
+                rc = memcmp(attr->value.byte_array.mem, bytes, attr->value.byte_array.sz);
+            break;
+        case ATTR_TYPE_POSIX_PERMISSIONS:
+            read_posix_permissions(yella_fb_file_attr_psx_permissions(tbl), &perms);
+            rc = memcmp(&attr->value.psx_permissions, &perms, sizeof(posix_permissions));
+            break;
+        case ATTR_TYPE_USER:
+        case ATTR_TYPE_GROUP:
+            usr_grp = yella_fb_file_attr_usr_grp(tbl);
+            rc = (int64_t)attr->value.usr_grp.id - (int64_t)yella_fb_file_user_group_id(usr_grp);
+            if (rc == 0)
+                rc = compare_name_to_utf8(attr->value.usr_grp.name, yella_fb_file_user_group_name(usr_grp));
+            break;
+        case ATTR_TYPE_SIZE:
+            rc = (int64_t)attr->value.size - (int64_t)yella_fb_file_attr_unsigned_int(tbl);
+            break;
+        case ATTR_TYPE_ACCESS_TIME:
+        case ATTR_TYPE_METADATA_CHANGE_TIME:
+        case ATTR_TYPE_MODIFICATION_TIME:
+            rc = (int64_t)attr->value.millis_since_epoch - (int64_t)yella_fb_file_attr_milliseconds_since_epoch(tbl);
+            break;
+        case ATTR_TYPE_POSIX_ACL:
+            acl_entries = yella_fb_file_attr_psx_acl_is_present(tbl) ? yella_fb_file_attr_psx_acl(tbl) : NULL;
+            acl_count = (acl_entries == NULL) ? 0 : yella_fb_file_posix_access_control_entry_vec_len(acl_entries);
+            rc = (int64_t)yella_ptr_vector_size(attr->value.posix_acl_entries) - (int64_t)acl_count;
+            for (i = 0; rc == 0 && i < acl_count; i++)
+            {
+                entry = yella_ptr_vector_at(attr->value.posix_acl_entries, i);
+                fb_entry = yella_fb_file_posix_access_control_entry_vec_at(acl_entries, i);
+                rc = entry->type - (yella_fb_file_posix_access_control_entry_type(fb_entry) == yella_fb_file_posix_access_control_entry_type_USER ?
+                                    PACL_ENTRY_TYPE_USER : PACL_ENTRY_TYPE_GROUP);
+                if (rc == 0)
+                {
+                    usr_grp = yella_fb_file_posix_access_control_entry_usr_grp(fb_entry);
+                    rc = (int64_t)entry->usr_grp.id - (int64_t)yella_fb_file_user_group_id(usr_grp);
+                    if (rc == 0)
+                    {
+                        rc = compare_name_to_utf8(entry->usr_grp.name, yella_fb_file_user_group_name(usr_grp));
+                        if (rc == 0)
+                        {
+                            read_posix_permission(yella_fb_file_posix_access_control_entry_permission(fb_entry), &perm);
+                            rc = memcmp(&entry->perm, &perm, sizeof(struct posix_permission));
+                        }
+                    }
+                }
+            }
+            break;
+        case ATTR_TYPE_CHUNKED_SHA256:
+            bytes = yella_fb_file_attr_bytes(tbl);
+            rc = CHUNKED_SHA256_DIGEST_SIZE - (int)flatbuffers_uint8_vec_len(bytes);
+            if (rc == 0)
+                rc = memcmp(attr->value.chunked.root, bytes, CHUNKED_SHA256_DIGEST_SIZE);
+            break;
+        default:
+            assert(false);
+        }
+    }
+    return rc;
+}
+
+attribute* copy_attribute(const attribute* const attr)
+{
+    attribute* result;
+    size_t i;
+    posix_acl_entry* entry;
+    posix_acl_entry* copied;
 
     result = malloc(sizeof(attribute));
+    memcpy(result, attr, sizeof(attribute));
+    switch (attr->type)
+    {
+    case ATTR_TYPE_SHA256:
+    case ATTR_TYPE_XXH3_128:
+        result->value.byte_array.mem = malloc(attr->value.byte_array.sz);
+        memcpy(result->value.byte_array.mem, attr->value.byte_array.mem, attr->value.byte_array.sz);
+        break;
+    case ATTR_TYPE_USER:
+    case ATTR_TYPE_GROUP:
+        result->value.usr_grp.name = copy_name(attr->value.usr_grp.name);
+        break;
+    case ATTR_TYPE_POSIX_ACL:
+        result->value.posix_acl_entries = yella_create_ptr_vector();
+        yella_set_ptr_vector_destructor(result->value.posix_acl_entries, acl_entry_destructor, NULL);
+        for (i = 0; i < yella_ptr_vector_size(attr->value.posix_acl_entries); i++)
+        {
+            entry = yella_ptr_vector_at(attr->value.posix_acl_entries, i);
+            copied = malloc(sizeof(posix_acl_entry));
+            memcpy(copied, entry, sizeof(posix_acl_entry));
+            copied->usr_grp.name = copy_name(entry->usr_grp.name);
+            yella_push_back_ptr_vector(result->value.posix_acl_entries, copied);
+        }
+        break;
+    case ATTR_TYPE_CHUNKED_SHA256:
+        if (attr->value.chunked.chunks != NULL)
+        {
+            result->value.chunked.chunks = malloc(attr->value.chunked.chunk_count * CHUNKED_SHA256_DIGEST_SIZE);
+            memcpy(result->value.chunked.chunks,
+                   attr->value.chunked.chunks,
+                   attr->value.chunked.chunk_count * CHUNKED_SHA256_DIGEST_SIZE);
+        }
+        break;
+    default:
+        break;
+    }
+    return result;
+}
+
+void init_attribute_from_table(const yella_fb_file_attr_table_t tbl, attribute* attr)
+{
+    flatbuffers_uint8_vec_t bytes;
+    yella_fb_file_user_group_table_t usr_grp;
+    yella_fb_file_posix_access_control_entry_vec_t acl_entries;
+    yella_fb_file_posix_access_control_entry_table_t fb_entry;
+    size_t i;
+    posix_acl_entry* entry;
+
     switch (yella_fb_file_attr_type(tbl))
     {
     case yella_fb_file_attr_type_FILE_TYPE:
-        result->type = ATTR_TYPE_FILE_TYPE;
-        result->value.integer = fb_to_file_type(yella_fb_file_attr_ftype(tbl));
+        attr->type = ATTR_TYPE_FILE_TYPE;
+        attr->value.integer = fb_to_file_type(yella_fb_file_attr_ftype(tbl));
         break;
     case yella_fb_file_attr_type_SHA256:
-        result->type = ATTR_TYPE_SHA256;
+    case yella_fb_file_attr_type_XXH3_128:
+        attr->type = yella_fb_file_attr_type(tbl) == yella_fb_file_attr_type_SHA256 ? ATTR_TYPE_SHA256 : ATTR_TYPE_XXH3_128;
         bytes = yella_fb_file_attr_bytes(tbl);
-        result->value.byte_array.sz = flatbuffers_uint8_vec_len(bytes);
-        result->value.byte_array.mem = malloc(result->value.byte_array.sz);
-        memcpy(result->value.byte_array.mem, bytes, result->value.byte_array.sz);
+        attr->value.byte_array.sz = flatbuffers_uint8_vec_len(bytes);
+        attr->value.byte_array.mem = malloc(attr->value.byte_array.sz);
+        memcpy(attr->value.byte_array.mem, bytes, attr->value.byte_array.sz);
         break;
     case yella_fb_file_attr_type_POSIX_PERMISSIONS:
-        result->type = ATTR_TYPE_POSIX_PERMISSIONS;
-        memset(&result->value.psx_permissions, 0, sizeof(posix_permissions));
-        psx_perms = yella_fb_file_attr_psx_permissions(tbl);
-        if (yella_fb_file_posix_permissions_owner_is_present(psx_perms))
-        {
-            psx_perm = yella_fb_file_posix_permissions_owner(psx_perms);
-            result->value.psx_permissions.owner.read = yella_fb_file_posix_permission_read(psx_perm) ? true : false;
-            result->value.psx_permissions.owner.write = yella_fb_file_posix_permission_write(psx_perm) ? true : false;
-            result->value.psx_permissions.owner.execute = yella_fb_file_posix_permission_execute(psx_perm) ? true : false;
-        }
-        if (yella_fb_file_posix_permissions_group_is_present(psx_perms))
-        {
-            psx_perm = yella_fb_file_posix_permissions_group(psx_perms);
-            result->value.psx_permissions.group.read = yella_fb_file_posix_permission_read(psx_perm) ? true : false;
-            result->value.psx_permissions.group.write = yella_fb_file_posix_permission_write(psx_perm) ? true : false;
-            result->value.psx_permissions.group.execute = yella_fb_file_posix_permission_execute(psx_perm) ? true : false;
-        }
-        if (yella_fb_file_posix_permissions_other_is_present(psx_perms))
-        {
-            psx_perm = yella_fb_file_posix_permissions_other(psx_perms);
-            result->value.psx_permissions.other.read = yella_fb_file_posix_permission_read(psx_perm) ? true : false;
-            result->value.psx_permissions.other.write = yella_fb_file_posix_permission_write(psx_perm) ? true : false;
-            result->value.psx_permissions.other.execute = yella_fb_file_posix_permission_execute(psx_perm) ? true : false;
-        }
-        result->value.psx_permissions.set_uid = yella_fb_file_posix_permissions_set_uid(psx_perms) ? true : false;
-        result->value.psx_permissions.set_gid = yella_fb_file_posix_permissions_set_gid(psx_perms) ? true : false;
-        result->value.psx_permissions.sticky = yella_fb_file_posix_permissions_sticky(psx_perms) ? true : false;
+        attr->type = ATTR_TYPE_POSIX_PERMISSIONS;
+        read_posix_permissions(yella_fb_file_attr_psx_permissions(tbl), &attr->value.psx_permissions);
         break;
     case yella_fb_file_attr_type_USER:
     case yella_fb_file_attr_type_GROUP:
-        result->type = (yella_fb_file_attr_type(tbl) == yella_fb_file_attr_type_USER) ? ATTR_TYPE_USER : ATTR_TYPE_GROUP;
+        attr->type = (yella_fb_file_attr_type(tbl) == yella_fb_file_attr_type_USER) ? ATTR_TYPE_USER : ATTR_TYPE_GROUP;
         usr_grp = yella_fb_file_attr_usr_grp(tbl);
-        result->value.usr_grp.id = yella_fb_file_user_group_id(usr_grp);
-        result->value.usr_grp.name = yella_from_utf8(yella_fb_file_user_group_name(usr_grp));
+        attr->value.usr_grp.id = yella_fb_file_user_group_id(usr_grp);
+        attr->value.usr_grp.name = yella_from_utf8(yella_fb_file_user_group_name(usr_grp));
         break;
     case yella_fb_file_attr_type_SIZE:
-        result->type = ATTR_TYPE_SIZE;
-        result->value.size = yella_fb_file_attr_unsigned_int(tbl);
+        attr->type = ATTR_TYPE_SIZE;
+        attr->value.size = yella_fb_file_attr_unsigned_int(tbl);
         break;
     case yella_fb_file_attr_type_ACCESS_TIME:
-        result->type = ATTR_TYPE_ACCESS_TIME;
-        result->value.millis_since_epoch = yella_fb_file_attr_milliseconds_since_epoch(tbl);
+        attr->type = ATTR_TYPE_ACCESS_TIME;
+        attr->value.millis_since_epoch = yella_fb_file_attr_milliseconds_since_epoch(tbl);
         break;
     case yella_fb_file_attr_type_METADATA_CHANGE_TIME:
-        result->type = ATTR_TYPE_METADATA_CHANGE_TIME;
-        result->value.millis_since_epoch = yella_fb_file_attr_milliseconds_since_epoch(tbl);
+        attr->type = ATTR_TYPE_METADATA_CHANGE_TIME;
+        attr->value.millis_since_epoch = yella_fb_file_attr_milliseconds_since_epoch(tbl);
         break;
     case yella_fb_file_attr_type_MODIFICATION_TIME:
-        result->type = ATTR_TYPE_MODIFICATION_TIME;
-        result->value.millis_since_epoch = yella_fb_file_attr_milliseconds_since_epoch(tbl);
+        attr->type = ATTR_TYPE_MODIFICATION_TIME;
+        attr->value.millis_since_epoch = yella_fb_file_attr_milliseconds_since_epoch(tbl);
         break;
     case yella_fb_file_attr_type_POSIX_ACL:
-        result->type = ATTR_TYPE_POSIX_ACL;
-        result->value.posix_acl_entries = yella_create_ptr_vector();
-        yella_set_ptr_vector_destructor(result->value.posix_acl_entries, acl_entry_destructor, NULL);
+        attr->type = ATTR_TYPE_POSIX_ACL;
+        attr->value.posix_acl_entries = yella_create_ptr_vector();
+        yella_set_ptr_vector_destructor(attr->value.posix_acl_entries, acl_entry_destructor, NULL);
         if (yella_fb_file_attr_psx_acl_is_present(tbl))
         {
             acl_entries = yella_fb_file_attr_psx_acl(tbl);
@@ -287,25 +451,43 @@ attribute* create_attribute_from_table(const yella_fb_file_attr_table_t tbl)
                 usr_grp = yella_fb_file_posix_access_control_entry_usr_grp(fb_entry);
                 entry->usr_grp.id = yella_fb_file_user_group_id(usr_grp);
                 entry->usr_grp.name = yella_from_utf8(yella_fb_file_user_group_name(usr_grp));
-                psx_perm = yella_fb_file_posix_access_control_entry_permission(fb_entry);
-                entry->perm.read = yella_fb_file_posix_permission_read(psx_perm) ? true : false;
-                entry->perm.write = yella_fb_file_posix_permission_write(psx_perm) ? true : false;
-                entry->perm.execute = yella_fb_file_posix_permission_execute(psx_perm) ? true : false;
-                yella_push_back_ptr_vector(result->value.posix_acl_entries, entry);
+                read_posix_permission(yella_fb_file_posix_access_control_entry_permission(fb_entry), &entry->perm);
+                yella_push_back_ptr_vector(attr->value.posix_acl_entries, entry);
             }
         }
         break;
+    case yella_fb_file_attr_type_CHUNKED_SHA256:
+        attr->type = ATTR_TYPE_CHUNKED_SHA256;
+        memset(attr->value.chunked.root, 0, CHUNKED_SHA256_DIGEST_SIZE);
+        bytes = yella_fb_file_attr_bytes(tbl);
+        if (flatbuffers_uint8_vec_len(bytes) == CHUNKED_SHA256_DIGEST_SIZE)
+            memcpy(attr->value.chunked.root, bytes, CHUNKED_SHA256_DIGEST_SIZE);
+        attr->value.chunked.byte_count = yella_fb_file_attr_unsigned_int(tbl);
+        attr->value.chunked.chunk_size = yella_fb_file_attr_chunk_size(tbl);
+        /* The chunk digests are not part of the table */
+        attr->value.chunked.chunk_count = 0;
+        attr->value.chunked.chunks = NULL;
+        break;
     default:
         assert(false);
     }
+}
+
+attribute* create_attribute_from_table(const yella_fb_file_attr_table_t tbl)
+{
+    attribute* result;
+
+    result = malloc(sizeof(attribute));
+    init_attribute_from_table(tbl, result);
     return result;
 }
 
-void destroy_attribute(attribute* attr)
+void clear_attribute(attribute* attr)
 {
     switch (attr->type)
     {
     case ATTR_TYPE_SHA256:
+    case ATTR_TYPE_XXH3_128:
         free(attr->value.byte_array.mem);
         break;
     case ATTR_TYPE_USER:
@@ -315,9 +497,17 @@ void destroy_attribute(attribute* attr)
     case ATTR_TYPE_POSIX_ACL:
         yella_destroy_ptr_vector(attr->value.posix_acl_entries);
         break;
+    case ATTR_TYPE_CHUNKED_SHA256:
+        free(attr->value.chunked.chunks);
+        break;
     default:
         break;
     }
+}
+
+void destroy_attribute(attribute* attr)
+{
+    clear_attribute(attr);
     free(attr);
 }
 
@@ -357,6 +547,12 @@ attribute_type fb_to_attribute_type(uint16_t fb)
     case yella_fb_file_attr_type_POSIX_ACL:
         result = ATTR_TYPE_POSIX_ACL;
         break;
+    case yella_fb_file_attr_type_CHUNKED_SHA256:
+        result = ATTR_TYPE_CHUNKED_SHA256;
+        break;
+    case yella_fb_file_attr_type_XXH3_128:
+        result = ATTR_TYPE_XXH3_128;
+        break;
     default:
         assert(false);
     }
@@ -379,7 +575,8 @@ yella_fb_file_attr_ref_t pack_attribute(const attribute* const attr, flatcc_buil
         yella_fb_file_attr_ftype_add(bld, file_type_to_fb(attr->value.integer));
         break;
     case ATTR_TYPE_SHA256:
-        fb_type = yella_fb_file_attr_type_SHA256;
+    case ATTR_TYPE_XXH3_128:
+        fb_type = attr->type == ATTR_TYPE_SHA256 ? yella_fb_file_attr_type_SHA256 : yella_fb_file_attr_type_XXH3_128;
         yella_fb_file_attr_bytes_add(bld,
                                      flatbuffers_uint8_vec_create(bld,
                                                                   attr->value.byte_array.mem,
@@ -490,6 +687,15 @@ yella_fb_file_attr_ref_t pack_attribute(const attribute* const attr, flatcc_buil
             yella_fb_file_attr_psx_acl_add(bld, yella_fb_file_posix_access_control_entry_vec_end(bld));
         }
         break;
+    case ATTR_TYPE_CHUNKED_SHA256:
+        fb_type = yella_fb_file_attr_type_CHUNKED_SHA256;
+        yella_fb_file_attr_bytes_add(bld,
+                                     flatbuffers_uint8_vec_create(bld,
+                                                                  attr->value.chunked.root,
+                                                                  CHUNKED_SHA256_DIGEST_SIZE));
+        yella_fb_file_attr_unsigned_int_add(bld, attr->value.chunked.byte_count);
+        yella_fb_file_attr_chunk_size_add(bld, attr->value.chunked.chunk_size);
+        break;
     default:
         assert(false);
     }
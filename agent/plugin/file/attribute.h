@@ -20,9 +20,13 @@ typedef enum
     ATTR_TYPE_ACCESS_TIME,
     ATTR_TYPE_METADATA_CHANGE_TIME,
     ATTR_TYPE_MODIFICATION_TIME,
-    ATTR_TYPE_POSIX_ACL
+    ATTR_TYPE_POSIX_ACL,
+    ATTR_TYPE_CHUNKED_SHA256,
+    ATTR_TYPE_XXH3_128
 } attribute_type;
 
+#define ATTR_TYPE_COUNT (ATTR_TYPE_XXH3_128 + 1)
+
 typedef struct posix_permission
 {
     bool read;
@@ -63,6 +67,22 @@ typedef struct posix_acl_entry
     posix_permission perm;
 } posix_acl_entry;
 
+#define CHUNKED_SHA256_DIGEST_SIZE 32
+
+/* The root is the SHA-256 digest of the chunk digests */
+typedef struct chunked_digest
+{
+    uint8_t root[CHUNKED_SHA256_DIGEST_SIZE];
+    uint64_t chunk_size;
+    uint64_t byte_count;
+    /* Zero, with chunks NULL, when only the root is known. The chunk
+     * digests are stored in the state db, but not packed with the
+     * attribute, so that messages only carry the root. */
+    size_t chunk_count;
+    /* chunk_count digests, one after the other */
+    uint8_t* chunks;
+} chunked_digest;
+
 typedef struct attribute
 {
     attribute_type type;
@@ -79,14 +99,22 @@ typedef struct attribute
         size_t size;
         uint64_t millis_since_epoch;
         yella_ptr_vector* posix_acl_entries;
+        chunked_digest chunked;
     } value;
 } attribute;
 
 YELLA_PRIV_EXPORT uint16_t attribute_type_to_fb(attribute_type atp);
+/* Frees what the attribute holds, but not the attribute itself */
+YELLA_PRIV_EXPORT void clear_attribute(attribute* attr);
 YELLA_PRIV_EXPORT int compare_attributes(const attribute* const lhs, const attribute* const rhs);
+/* Compares against a packed attribute without unpacking it */
+YELLA_PRIV_EXPORT int compare_attribute_to_table(const attribute* const attr, const yella_fb_file_attr_table_t tbl);
+YELLA_PRIV_EXPORT attribute* copy_attribute(const attribute* const attr);
 YELLA_PRIV_EXPORT attribute* create_attribute_from_table(const yella_fb_file_attr_table_t tbl);
 YELLA_PRIV_EXPORT void destroy_attribute(attribute* attr);
 YELLA_PRIV_EXPORT attribute_type fb_to_attribute_type(uint16_t fb);
+/* Fills in an attribute that the caller owns */
+YELLA_PRIV_EXPORT void init_attribute_from_table(const yella_fb_file_attr_table_t tbl, attribute* attr);
 YELLA_PRIV_EXPORT yella_fb_file_attr_ref_t pack_attribute(const attribute* const attr, flatcc_builder_t* bld);
 
 #endif
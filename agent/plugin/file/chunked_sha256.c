@@ -0,0 +1,182 @@
+#include "plugin/file/chunked_sha256.h"
+#include "common/settings.h"
+#include "common/thread.h"
+#include "common/text_util.h"
+#include <openssl/evp.h>
+#include <chucho/log.h>
+#include <string.h>
+
+typedef struct chunk_work
+{
+    const UChar* name;
+    uint64_t file_size;
+    yella_read_strategy strategy;
+    attribute* attr;
+    size_t next_chunk;
+    bool failed;
+    yella_mutex* guard;
+} chunk_work;
+
+typedef struct chunk_digest_state
+{
+    EVP_MD_CTX* ctx;
+    uint64_t count;
+} chunk_digest_state;
+
+static void digest_callback(const uint8_t* const bytes, size_t sz, void* udata)
+{
+    chunk_digest_state* st = (chunk_digest_state*)udata;
+
+    EVP_DigestUpdate(st->ctx, bytes, sz);
+    st->count += sz;
+}
+
+static bool hash_chunk(chunk_work* work, size_t idx)
+{
+    chunk_digest_state st;
+    uint64_t offset;
+    uint64_t len;
+    unsigned md_len;
+    yella_rc yrc;
+
+    offset = (uint64_t)idx * CHUNKED_SHA256_CHUNK_SIZE;
+    len = work->file_size - offset;
+    if (len > CHUNKED_SHA256_CHUNK_SIZE)
+        len = CHUNKED_SHA256_CHUNK_SIZE;
+    st.ctx = EVP_MD_CTX_new();
+    st.count = 0;
+    EVP_DigestInit_ex(st.ctx, EVP_sha256(), NULL);
+    yrc = yella_apply_function_to_file_range(work->name, offset, len, work->strategy, digest_callback, &st);
+    EVP_DigestFinal_ex(st.ctx,
+                       work->attr->value.chunked.chunks + (idx * CHUNKED_SHA256_DIGEST_SIZE),
+                       &md_len);
+    EVP_MD_CTX_free(st.ctx);
+    /* A short read means the file was truncated underneath us */
+    return yrc == YELLA_NO_ERROR && st.count == len;
+}
+
+static void chunk_worker_main(void* udata)
+{
+    chunk_work* work = (chunk_work*)udata;
+    size_t idx;
+    bool ok;
+
+    while (true)
+    {
+        yella_lock_mutex(work->guard);
+        idx = work->next_chunk++;
+        ok = !work->failed;
+        yella_unlock_mutex(work->guard);
+        if (!ok || idx >= work->attr->value.chunked.chunk_count)
+            break;
+        if (!hash_chunk(work, idx))
+        {
+            yella_lock_mutex(work->guard);
+            work->failed = true;
+            yella_unlock_mutex(work->guard);
+        }
+    }
+}
+
+attribute* create_chunked_sha256_attribute(const UChar* const name,
+                                           uint64_t file_size,
+                                           yella_read_strategy strategy,
+                                           const attribute* const prev,
+                                           chucho_logger_t* lgr)
+{
+    attribute* result;
+    chunk_work work;
+    size_t reused;
+    size_t thread_count;
+    size_t i;
+    yella_thread** threads;
+    unsigned md_len;
+    char* utf8;
+
+    result = malloc(sizeof(attribute));
+    result->type = ATTR_TYPE_CHUNKED_SHA256;
+    result->value.chunked.chunk_size = CHUNKED_SHA256_CHUNK_SIZE;
+    result->value.chunked.byte_count = file_size;
+    result->value.chunked.chunk_count = (file_size + CHUNKED_SHA256_CHUNK_SIZE - 1) / CHUNKED_SHA256_CHUNK_SIZE;
+    result->value.chunked.chunks = malloc(result->value.chunked.chunk_count * CHUNKED_SHA256_DIGEST_SIZE);
+    reused = 0;
+    /* Only reading a chunk again would show that it was changed in place */
+    if (prev != NULL &&
+        *yella_settings_get_uint(u"file", u"chunk-hash-trust-appends") != 0 &&
+        prev->value.chunked.chunk_size == CHUNKED_SHA256_CHUNK_SIZE &&
+        prev->value.chunked.byte_count < file_size)
+    {
+        /* A partial last chunk has to be hashed again */
+        reused = prev->value.chunked.byte_count / CHUNKED_SHA256_CHUNK_SIZE;
+        /* The digests are only known when prev came from the state db */
+        if (reused > prev->value.chunked.chunk_count)
+            reused = 0;
+        memcpy(result->value.chunked.chunks, prev->value.chunked.chunks, reused * CHUNKED_SHA256_DIGEST_SIZE);
+    }
+    work.name = name;
+    work.file_size = file_size;
+    work.strategy = strategy;
+    work.attr = result;
+    work.failed = false;
+    /* A file rewritten in place keeps its inode, so the last reused chunk
+     * is checked. If it changed, then nothing from prev is trusted. */
+    if (reused > 0)
+    {
+        if (!hash_chunk(&work, reused - 1))
+            work.failed = true;
+        else if (memcmp(result->value.chunked.chunks + ((reused - 1) * CHUNKED_SHA256_DIGEST_SIZE),
+                        prev->value.chunked.chunks + ((reused - 1) * CHUNKED_SHA256_DIGEST_SIZE),
+                        CHUNKED_SHA256_DIGEST_SIZE) != 0)
+            reused = 0;
+    }
+    work.next_chunk = reused;
+    work.guard = yella_create_mutex();
+    thread_count = *yella_settings_get_uint(u"file", u"chunk-hash-threads");
+    if (thread_count > result->value.chunked.chunk_count - reused)
+        thread_count = result->value.chunked.chunk_count - reused;
+    if (thread_count <= 1)
+    {
+        chunk_worker_main(&work);
+    }
+    else
+    {
+        threads = malloc(thread_count * sizeof(yella_thread*));
+        for (i = 0; i < thread_count; i++)
+            threads[i] = yella_create_thread(chunk_worker_main, &work);
+        for (i = 0; i < thread_count; i++)
+        {
+            yella_join_thread(threads[i]);
+            yella_destroy_thread(threads[i]);
+        }
+        free(threads);
+    }
+    yella_destroy_mutex(work.guard);
+    if (work.failed)
+    {
+        if (chucho_logger_permits(lgr, CHUCHO_ERROR))
+        {
+            utf8 = yella_to_utf8(name);
+            CHUCHO_C_ERROR(lgr, "Unable to compute the chunked digest of '%s'", utf8);
+            free(utf8);
+        }
+        destroy_attribute(result);
+        return NULL;
+    }
+    EVP_Digest(result->value.chunked.chunks,
+               result->value.chunked.chunk_count * CHUNKED_SHA256_DIGEST_SIZE,
+               result->value.chunked.root,
+               &md_len,
+               EVP_sha256(),
+               NULL);
+    if (chucho_logger_permits(lgr, CHUCHO_TRACE))
+    {
+        utf8 = yella_to_utf8(name);
+        CHUCHO_C_TRACE(lgr,
+                       "Hashed %zu of %zu chunks of '%s'",
+                       result->value.chunked.chunk_count - reused,
+                       result->value.chunked.chunk_count,
+                       utf8);
+        free(utf8);
+    }
+    return result;
+}
@@ -0,0 +1,25 @@
+#ifndef YELLA_CHUNKED_SHA256_H__
+#define YELLA_CHUNKED_SHA256_H__
+
+#include "plugin/file/attribute.h"
+#include "common/file.h"
+#include <chucho/logger.h>
+
+/* A multiple of any page size, so chunks may be read with direct I/O */
+#define CHUNKED_SHA256_CHUNK_SIZE (4 * 1024 * 1024)
+
+/* The chunks are hashed on up to the number of threads in the file
+ * setting chunk-hash-threads. Every chunk is hashed, unless the file
+ * setting chunk-hash-trust-appends is non-zero, prev is not NULL and the
+ * file has grown. Then prev must describe an earlier version of the same
+ * file, and its whole chunks are assumed to be unchanged as long as the
+ * last of them still is. This is what makes appending cheap, but an edit
+ * to an earlier chunk goes unseen until the next full-hash scan. Returns
+ * NULL if the file cannot be read in its entirety. */
+YELLA_PRIV_EXPORT attribute* create_chunked_sha256_attribute(const UChar* const name,
+                                                             uint64_t file_size,
+                                                             yella_read_strategy strategy,
+                                                             const attribute* const prev,
+                                                             chucho_logger_t* lgr);
+
+#endif
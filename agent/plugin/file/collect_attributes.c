@@ -1,18 +1,32 @@
 #include "plugin/file/collect_attributes.h"
 #include "plugin/file/stat_collector.h"
 #include "plugin/file/posix_acl.h"
+#include "plugin/file/chunked_sha256.h"
 #include "common/file.h"
 #include "common/text_util.h"
+#include "common/time_util.h"
 #include "attribute.h"
 #include <openssl/evp.h>
+#include <xxhash.h>
 #include <chucho/log.h>
 #include <inttypes.h>
 
+/* A file modified this recently may be modified again without its
+ * modification time changing, so its stamp cannot be trusted. */
+#define RACY_STAMP_NANOS UINT64_C(1000000000)
+
+static const attribute_type CACHED_DIGEST_TYPES[] = { ATTR_TYPE_SHA256, ATTR_TYPE_XXH3_128 };
+
 static void digest_callback(const uint8_t* const buf, size_t sz, void* udata)
 {
     EVP_DigestUpdate((EVP_MD_CTX*)udata, buf, sz);
 }
 
+static void xxh3_callback(const uint8_t* const buf, size_t sz, void* udata)
+{
+    XXH3_128bits_update((XXH3_state_t*)udata, buf, sz);
+}
+
 static void handle_access_time(element* elem, void* stat_buf)
 {
     attribute* attr;
@@ -23,6 +37,36 @@ static void handle_access_time(element* elem, void* stat_buf)
     add_element_attribute(elem, attr);
 }
 
+static bool handle_chunked_sha256(element* elem,
+                                  yella_file_type ftype,
+                                  const file_stamp* const stmp,
+                                  yella_read_strategy strategy,
+                                  const uint8_t* const prev_packed,
+                                  chucho_logger_t* lgr)
+{
+    attribute* prev_attr;
+    file_stamp prev_stmp;
+    attribute* attr;
+
+    if (ftype != YELLA_FILE_TYPE_REGULAR)
+        return false;
+    prev_attr = NULL;
+    /* Only the same file can have grown */
+    if (packed_attributes_file_stamp(prev_packed, &prev_stmp) &&
+        prev_stmp.device == stmp->device &&
+        prev_stmp.inode == stmp->inode)
+    {
+        prev_attr = create_attribute_from_packed_attributes(prev_packed, ATTR_TYPE_CHUNKED_SHA256);
+    }
+    attr = create_chunked_sha256_attribute(element_name(elem), stmp->size, strategy, prev_attr, lgr);
+    if (prev_attr != NULL)
+        destroy_attribute(prev_attr);
+    if (attr == NULL)
+        return false;
+    add_element_attribute(elem, attr);
+    return true;
+}
+
 static void handle_file_type(element* elem, yella_file_type ftype)
 {
     attribute* attr;
@@ -88,7 +132,7 @@ static void handle_posix_permissions(element* elem, void* stat_buf)
     add_element_attribute(elem, attr);
 }
 
-static bool handle_sha256(element* elem, yella_file_type ftype)
+static bool handle_sha256(element* elem, yella_file_type ftype, yella_read_strategy strategy)
 {
     EVP_MD_CTX* ctx;
     unsigned char md[EVP_MAX_MD_SIZE];
@@ -101,7 +145,10 @@ static bool handle_sha256(element* elem, yella_file_type ftype)
     {
         ctx = EVP_MD_CTX_new();
         EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
-        yrc = yella_apply_function_to_file_contents(element_name(elem), digest_callback, ctx);
+        yrc = yella_apply_function_to_file_contents_with_strategy(element_name(elem),
+                                                                  strategy,
+                                                                  digest_callback,
+                                                                  ctx);
         if (yrc == YELLA_NO_ERROR)
         {
             EVP_DigestFinal_ex(ctx, md, &md_len);
@@ -118,6 +165,37 @@ static bool handle_sha256(element* elem, yella_file_type ftype)
     return rc;
 }
 
+static bool reuse_attribute(element* elem, const uint8_t* const prev_packed, attribute_type tp)
+{
+    attribute* found;
+
+    found = create_attribute_from_packed_attributes(prev_packed, tp);
+    if (found == NULL)
+        return false;
+    add_element_attribute(elem, found);
+    return true;
+}
+
+static bool reuse_cached_digest(element* elem, hash_cache* cache, const file_stamp* const stmp, attribute_type tp)
+{
+    uint8_t md[HASH_CACHE_MAX_DIGEST_SIZE];
+    size_t md_len;
+    attribute* attr;
+
+    if (cache == NULL)
+        return false;
+    md_len = get_hash_cache_digest(cache, tp, stmp, md);
+    if (md_len == 0)
+        return false;
+    attr = malloc(sizeof(attribute));
+    attr->type = tp;
+    attr->value.byte_array.mem = malloc(md_len);
+    attr->value.byte_array.sz = md_len;
+    memcpy(attr->value.byte_array.mem, md, md_len);
+    add_element_attribute(elem, attr);
+    return true;
+}
+
 static void handle_size(element* elem, void* stat_buf)
 {
     attribute* attr;
@@ -128,6 +206,73 @@ static void handle_size(element* elem, void* stat_buf)
     add_element_attribute(elem, attr);
 }
 
+static void handle_stamp(element* elem, const file_stamp* const before, bool was_hashed)
+{
+    file_stamp after;
+    yella_file_type ftype;
+    void* stat_buf;
+    uint64_t now_nanos;
+
+    if (was_hashed)
+    {
+        /* Resetting the access time changes the metadata change time, so
+         * the stamp has to be taken again after hashing. If the contents
+         * moved underneath the hash, then there is no trustworthy stamp. */
+        if (yella_get_file_type(element_name(elem), &ftype, &stat_buf) != YELLA_NO_ERROR)
+            return;
+        get_file_stamp(stat_buf, &after);
+        free(stat_buf);
+        if (after.device != before->device ||
+            after.inode != before->inode ||
+            after.size != before->size ||
+            after.modification_nanos != before->modification_nanos)
+        {
+            return;
+        }
+    }
+    else
+    {
+        after = *before;
+    }
+    now_nanos = yella_microseconds_since_epoch() * 1000;
+    if (after.modification_nanos + RACY_STAMP_NANOS <= now_nanos)
+        set_element_file_stamp(elem, &after);
+}
+
+/* xxHash picks the widest SIMD kernel the CPU supports, so this runs at
+ * about the speed the file can be read */
+static bool handle_xxh3_128(element* elem, yella_file_type ftype, yella_read_strategy strategy)
+{
+    XXH3_state_t* st;
+    XXH128_canonical_t canon;
+    yella_rc yrc;
+    attribute* attr;
+    bool rc = false;
+
+    if (ftype == YELLA_FILE_TYPE_REGULAR || ftype == YELLA_FILE_TYPE_SYMBOLIC_LINK)
+    {
+        st = XXH3_createState();
+        XXH3_128bits_reset(st);
+        yrc = yella_apply_function_to_file_contents_with_strategy(element_name(elem),
+                                                                  strategy,
+                                                                  xxh3_callback,
+                                                                  st);
+        if (yrc == YELLA_NO_ERROR)
+        {
+            XXH128_canonicalFromHash(&canon, XXH3_128bits_digest(st));
+            attr = malloc(sizeof(attribute));
+            attr->type = ATTR_TYPE_XXH3_128;
+            attr->value.byte_array.mem = malloc(sizeof(canon.digest));
+            attr->value.byte_array.sz = sizeof(canon.digest);
+            memcpy(attr->value.byte_array.mem, canon.digest, sizeof(canon.digest));
+            add_element_attribute(elem, attr);
+            rc = true;
+        }
+        XXH3_freeState(st);
+    }
+    return rc;
+}
+
 static void handle_user(element* elem, void* stat_buf, chucho_logger_t* lgr)
 {
     attribute* attr;
@@ -141,6 +286,11 @@ static void handle_user(element* elem, void* stat_buf, chucho_logger_t* lgr)
 element* collect_attributes(const UChar* const name,
                             const attribute_type* const attr_types,
                             size_t attr_type_count,
+                            yella_read_strategy strategy,
+                            const uint8_t* const prev_packed,
+                            hash_cache* cache,
+                            bool full_hash,
+                            yella_arena* arena,
                             chucho_logger_t* lgr)
 {
     element* result;
@@ -149,14 +299,24 @@ element* collect_attributes(const UChar* const name,
     void* stat_buf;
     bool should_reset_access_time;
     bool should_get_access_time;
+    file_stamp stmp;
+    file_stamp prev_stmp;
+    bool stamp_matches;
+    const attribute* digest;
+    const uint8_t* reusable;
+    hash_cache* lookup_cache;
 
     if (yella_file_exists(name))
     {
         if (yella_get_file_type(name, &ftype, &stat_buf) != YELLA_NO_ERROR)
             return NULL;
-        result = create_element(name);
+        result = (arena == NULL) ? create_element(name) : create_element_in_arena(name, arena);
         should_reset_access_time = false;
         should_get_access_time = false;
+        get_file_stamp(stat_buf, &stmp);
+        reusable = full_hash ? NULL : prev_packed;
+        lookup_cache = full_hash ? NULL : cache;
+        stamp_matches = packed_attributes_file_stamp(reusable, &prev_stmp) && file_stamps_equal(&stmp, &prev_stmp);
         for (i = 0; i < attr_type_count; i++)
         {
             switch (attr_types[i])
@@ -189,12 +349,48 @@ element* collect_attributes(const UChar* const name,
                 handle_posix_acl(result, lgr);
                 break;
             case ATTR_TYPE_SHA256:
-                should_reset_access_time = handle_sha256(result, ftype);
+                if ((!stamp_matches || !reuse_attribute(result, reusable, ATTR_TYPE_SHA256)) &&
+                    !reuse_cached_digest(result, lookup_cache, &stmp, ATTR_TYPE_SHA256))
+                {
+                    if (handle_sha256(result, ftype, strategy))
+                        should_reset_access_time = true;
+                }
+                break;
+            case ATTR_TYPE_XXH3_128:
+                if ((!stamp_matches || !reuse_attribute(result, reusable, ATTR_TYPE_XXH3_128)) &&
+                    !reuse_cached_digest(result, lookup_cache, &stmp, ATTR_TYPE_XXH3_128))
+                {
+                    if (handle_xxh3_128(result, ftype, strategy))
+                        should_reset_access_time = true;
+                }
+                break;
+            case ATTR_TYPE_CHUNKED_SHA256:
+                if (!stamp_matches || !reuse_attribute(result, reusable, ATTR_TYPE_CHUNKED_SHA256))
+                {
+                    if (handle_chunked_sha256(result, ftype, &stmp, strategy, reusable, lgr))
+                        should_reset_access_time = true;
+                }
                 break;
             }
         }
         if (should_reset_access_time)
             reset_access_time(name, stat_buf, lgr);
+        handle_stamp(result, &stmp, should_reset_access_time);
+        if (cache != NULL && element_file_stamp(result) != NULL)
+        {
+            for (i = 0; i < sizeof(CACHED_DIGEST_TYPES) / sizeof(CACHED_DIGEST_TYPES[0]); i++)
+            {
+                digest = find_element_attribute(result, CACHED_DIGEST_TYPES[i]);
+                if (digest != NULL)
+                {
+                    put_hash_cache_digest(cache,
+                                          CACHED_DIGEST_TYPES[i],
+                                          element_file_stamp(result),
+                                          digest->value.byte_array.mem,
+                                          digest->value.byte_array.sz);
+                }
+            }
+        }
         if (should_get_access_time)
             handle_access_time(result, stat_buf);
         free(stat_buf);
@@ -2,11 +2,24 @@
 #define YELLA_COLLECT_ATTRIBUTES_H__
 
 #include "plugin/file/element.h"
+#include "plugin/file/hash_cache.h"
+#include "common/file.h"
 #include <chucho/logger.h>
 
+/* If prev_packed is not NULL and its stamp matches the current state of the
+ * file, then content attributes are unpacked from it rather than being
+ * computed again from the file's contents. Failing that, the cache is
+ * consulted, if it is not NULL. A full hash uses neither and computes
+ * every digest, but still refreshes the cache with them. If arena is not
+ * NULL, then the element is created in it. */
 YELLA_PRIV_EXPORT element* collect_attributes(const UChar* const name,
                                               const attribute_type* const attr_types,
                                               size_t attr_type_count,
+                                              yella_read_strategy strategy,
+                                              const uint8_t* const prev_packed,
+                                              hash_cache* cache,
+                                              bool full_hash,
+                                              yella_arena* arena,
                                               chucho_logger_t* lgr);
 
 #endif
@@ -1,58 +1,122 @@
 #include "plugin/file/element.h"
-#include "common/sglib.h"
 #include "common/uds.h"
-#include "common/ptr_vector.h"
+#include "common/arena.h"
 #include "file_builder.h"
 #include "db_attrs_builder.h"
 #include <unicode/ustring.h>
+#include <string.h>
 
-typedef struct attr_node
-{
-    attribute* attr;
-    struct attr_node* next;
-} attr_node;
-
+/* Each type has its own slot, and present has the bit (1 << type) set
+ * for each slot in use. So there is at most one attribute of each type,
+ * and walking the slots in order visits them sorted by type. */
 struct element
 {
-    uds name;
-    attr_node* attrs;
+    /* A uds, unless the element lives in an arena */
+    UChar* name;
+    yella_arena* arena;
+    uint32_t present;
+    attribute attrs[ATTR_TYPE_COUNT];
+    bool has_stamp;
+    file_stamp stamp;
 };
 
-#define ATTR_COMPARATOR(lhs, rhs) (lhs->attr->type - rhs->attr->type)
-
-SGLIB_DEFINE_SORTED_LIST_PROTOTYPES(attr_node, ATTR_COMPARATOR, next);
-SGLIB_DEFINE_SORTED_LIST_FUNCTIONS(attr_node, ATTR_COMPARATOR, next);
+#define ATTR_TYPE_BIT(tp) ((uint32_t)1 << (tp))
 
 void add_element_attribute(element* elem, attribute* attr)
 {
-    attr_node* al;
-
-    al = malloc(sizeof(attr_node));
-    al->attr = attr;
-    sglib_attr_node_add(&elem->attrs, al);
+    if (elem->present & ATTR_TYPE_BIT(attr->type))
+        clear_attribute(&elem->attrs[attr->type]);
+    elem->attrs[attr->type] = *attr;
+    elem->present |= ATTR_TYPE_BIT(attr->type);
+    free(attr);
 }
 
 int compare_element_attributes(const element* const lhs, const element* const rhs)
 {
     int rc;
-    struct sglib_attr_node_iterator litor;
-    struct sglib_attr_node_iterator ritor;
-    attr_node* lal;
-    attr_node* ral;
+    int i;
+
+    rc = (int)lhs->present - (int)rhs->present;
+    for (i = 0; rc == 0 && i < ATTR_TYPE_COUNT; i++)
+    {
+        if (lhs->present & ATTR_TYPE_BIT(i))
+            rc = compare_attributes(&lhs->attrs[i], &rhs->attrs[i]);
+    }
+    return rc;
+}
+
+/* A missing vector and an empty one are the same */
+static yella_fb_file_attr_vec_t packed_attribute_vector(const uint8_t* const packed_attrs)
+{
+    yella_fb_file_attr_array_table_t tbl;
+
+    if (packed_attrs == NULL)
+        return NULL;
+    tbl = yella_fb_file_attr_array_as_root(packed_attrs);
+    return yella_fb_file_attr_array_attrs_is_present(tbl) ? yella_fb_file_attr_array_attrs(tbl) : NULL;
+}
+
+int compare_element_to_packed_attributes(const element* const elem, const uint8_t* const packed_attrs)
+{
+    int rc;
+    yella_fb_file_attr_vec_t attrs;
+    yella_fb_file_attr_table_t tbl;
+    attribute_type tp;
+    uint32_t packed_present;
+    size_t i;
 
-    rc = sglib_attr_node_len(lhs->attrs) - sglib_attr_node_len(rhs->attrs);
+    rc = 0;
+    packed_present = 0;
+    attrs = packed_attribute_vector(packed_attrs);
+    for (i = 0; rc == 0 && i < yella_fb_file_attr_vec_len(attrs); i++)
+    {
+        tbl = yella_fb_file_attr_vec_at(attrs, i);
+        tp = fb_to_attribute_type(yella_fb_file_attr_type(tbl));
+        packed_present |= ATTR_TYPE_BIT(tp);
+        if (elem->present & ATTR_TYPE_BIT(tp))
+            rc = compare_attribute_to_table(&elem->attrs[tp], tbl);
+    }
     if (rc == 0)
+        rc = (int)elem->present - (int)packed_present;
+    return rc;
+}
+
+/* The chunk digests are stored beside the attributes, rather than in them */
+static void read_packed_chunk_digests(const uint8_t* const packed_attrs, attribute* attr)
+{
+    flatbuffers_uint8_vec_t digests;
+
+    digests = yella_fb_file_attr_array_chunk_digests(yella_fb_file_attr_array_as_root(packed_attrs));
+    if (digests != NULL && flatbuffers_uint8_vec_len(digests) > 0)
+    {
+        attr->value.chunked.chunk_count = flatbuffers_uint8_vec_len(digests) / CHUNKED_SHA256_DIGEST_SIZE;
+        attr->value.chunked.chunks = malloc(attr->value.chunked.chunk_count * CHUNKED_SHA256_DIGEST_SIZE);
+        memcpy(attr->value.chunked.chunks, digests, attr->value.chunked.chunk_count * CHUNKED_SHA256_DIGEST_SIZE);
+    }
+}
+
+attribute* create_attribute_from_packed_attributes(const uint8_t* const packed_attrs, attribute_type tp)
+{
+    yella_fb_file_attr_vec_t attrs;
+    yella_fb_file_attr_table_t tbl;
+    uint16_t fb_type;
+    size_t i;
+    attribute* result;
+
+    attrs = packed_attribute_vector(packed_attrs);
+    fb_type = attribute_type_to_fb(tp);
+    for (i = 0; i < yella_fb_file_attr_vec_len(attrs); i++)
     {
-        for (lal = sglib_attr_node_it_init(&litor, lhs->attrs),
-             ral = sglib_attr_node_it_init(&ritor, rhs->attrs);
-             lal != NULL && rc == 0;
-             lal = sglib_attr_node_it_next(&litor),
-             ral = sglib_attr_node_it_next(&ritor))
+        tbl = yella_fb_file_attr_vec_at(attrs, i);
+        if (yella_fb_file_attr_type(tbl) == fb_type)
         {
-            rc = compare_attributes(lal->attr, ral->attr);
+            result = create_attribute_from_table(tbl);
+            if (tp == ATTR_TYPE_CHUNKED_SHA256)
+                read_packed_chunk_digests(packed_attrs, result);
+            return result;
         }
     }
-    return rc;
+    return NULL;
 }
 
 element* create_element(const UChar* const name)
@@ -64,89 +128,90 @@ element* create_element(const UChar* const name)
     return result;
 }
 
+element* create_element_in_arena(const UChar* const name, yella_arena* arena)
+{
+    element* result;
+
+    result = yella_arena_calloc(arena, sizeof(element));
+    result->name = yella_arena_copy_string(arena, name);
+    result->arena = arena;
+    return result;
+}
+
 element* create_element_with_attrs(const UChar* const name, const uint8_t* const packed_attrs)
 {
     element*  result;
-    yella_fb_file_attr_array_table_t tbl;
     yella_fb_file_attr_vec_t attrs;
-    int i;
+    yella_fb_file_attr_table_t tbl;
+    attribute_type tp;
+    size_t i;
 
     result = create_element(name);
     if (packed_attrs != NULL)
     {
-        tbl = yella_fb_file_attr_array_as_root(packed_attrs);
-        attrs = yella_fb_file_attr_array_attrs(tbl);
+        attrs = packed_attribute_vector(packed_attrs);
         for (i = 0; i < yella_fb_file_attr_vec_len(attrs); i++)
-            add_element_attribute(result, create_attribute_from_table(yella_fb_file_attr_vec_at(attrs, i)));
+        {
+            tbl = yella_fb_file_attr_vec_at(attrs, i);
+            tp = fb_to_attribute_type(yella_fb_file_attr_type(tbl));
+            if (result->present & ATTR_TYPE_BIT(tp))
+                clear_attribute(&result->attrs[tp]);
+            init_attribute_from_table(tbl, &result->attrs[tp]);
+            result->present |= ATTR_TYPE_BIT(tp);
+        }
+        if (result->present & ATTR_TYPE_BIT(ATTR_TYPE_CHUNKED_SHA256))
+            read_packed_chunk_digests(packed_attrs, &result->attrs[ATTR_TYPE_CHUNKED_SHA256]);
+        result->has_stamp = packed_attributes_file_stamp(packed_attrs, &result->stamp);
     }
     return result;
 }
 
 void destroy_element(element* elem)
 {
-    struct sglib_attr_node_iterator itor;
-    attr_node* al;
+    int i;
 
     if (elem != NULL)
     {
-        udsfree(elem->name);
-        for (al = sglib_attr_node_it_init(&itor, elem->attrs);
-             al != NULL;
-             al = sglib_attr_node_it_next(&itor))
+        for (i = 0; i < ATTR_TYPE_COUNT; i++)
         {
-            destroy_attribute(al->attr);
-            free(al);
+            if (elem->present & ATTR_TYPE_BIT(i))
+                clear_attribute(&elem->attrs[i]);
+        }
+        if (elem->arena == NULL)
+        {
+            udsfree(elem->name);
+            free(elem);
         }
-        free(elem);
     }
 }
 
 void diff_elements(element* elem1, element* elem2)
 {
-    struct sglib_attr_node_iterator itor;
-    attr_node* an;
-    attr_node* found;
-    yella_ptr_vector* to_delete1;
-    yella_ptr_vector* to_delete2;
+    uint32_t both;
+    uint32_t only2;
     int i;
 
     assert(u_strcmp(elem1->name, elem2->name) == 0);
-    to_delete1 = yella_create_ptr_vector();
-    yella_set_ptr_vector_destructor(to_delete1, NULL, NULL);
-    /* The first loop covers the case where an attribute is either just
-     * in elem1 or different from that in elem2.
-     */
-    for (an = sglib_attr_node_it_init(&itor, elem1->attrs);
-         an != NULL;
-         an = sglib_attr_node_it_next(&itor))
-    {
-        found = sglib_attr_node_find_member(elem2->attrs, an);
-        if (found != NULL && compare_attributes(an->attr, found->attr) == 0)
-            yella_push_back_ptr_vector(to_delete1, an);
-    }
-    to_delete2 = yella_create_ptr_vector();
-    yella_set_ptr_vector_destructor(to_delete2, NULL, NULL);
-    /* The second loop covers attribute that are only in elem2 and
-     * not in elem1.
-     */
-    for (an = sglib_attr_node_it_init(&itor, elem2->attrs);
-         an != NULL;
-         an = sglib_attr_node_it_next(&itor))
-    {
-        found = sglib_attr_node_find_member(elem1->attrs, an);
-        if (found == NULL)
-            yella_push_back_ptr_vector(to_delete2, an);
-    }
-    for (i = 0; i < yella_ptr_vector_size(to_delete1); i++)
+    both = elem1->present & elem2->present;
+    only2 = elem2->present & ~elem1->present;
+    for (i = 0; i < ATTR_TYPE_COUNT; i++)
     {
-        an = (attr_node*)yella_ptr_vector_at(to_delete1, i);
-        sglib_attr_node_delete(&elem1->attrs, an);
-        destroy_attribute(an->attr);
+        /* Attributes that are the same in both are not part of the difference */
+        if ((both & ATTR_TYPE_BIT(i)) && compare_attributes(&elem1->attrs[i], &elem2->attrs[i]) == 0)
+        {
+            clear_attribute(&elem1->attrs[i]);
+            elem1->present &= ~ATTR_TYPE_BIT(i);
+        }
+        else if (only2 & ATTR_TYPE_BIT(i))
+        {
+            add_element_attribute(elem1, copy_attribute(&elem2->attrs[i]));
+        }
     }
-    for (i = 0; i < yella_ptr_vector_size(to_delete2); i++)
-        sglib_attr_node_add(&elem1->attrs, yella_ptr_vector_at(to_delete2, i));
-    yella_destroy_ptr_vector(to_delete1);
-    yella_destroy_ptr_vector(to_delete2);
+}
+
+const file_stamp* element_file_stamp(const element* const elem)
+{
+    return elem->has_stamp ? &elem->stamp : NULL;
 }
 
 const UChar* element_name(const element* const elem)
@@ -154,12 +219,46 @@ const UChar* element_name(const element* const elem)
     return elem->name;
 }
 
+const attribute* find_element_attribute(const element* const elem, attribute_type tp)
+{
+    return (elem->present & ATTR_TYPE_BIT(tp)) ? &elem->attrs[tp] : NULL;
+}
+
+bool file_stamps_equal(const file_stamp* const lhs, const file_stamp* const rhs)
+{
+    if (lhs == NULL || rhs == NULL)
+        return lhs == rhs;
+    return lhs->device == rhs->device &&
+           lhs->inode == rhs->inode &&
+           lhs->size == rhs->size &&
+           lhs->modification_nanos == rhs->modification_nanos &&
+           lhs->metadata_change_nanos == rhs->metadata_change_nanos;
+}
+
+bool packed_attributes_file_stamp(const uint8_t* const packed_attrs, file_stamp* stmp)
+{
+    yella_fb_file_file_stamp_struct_t fb_stmp;
+
+    if (packed_attrs == NULL)
+        return false;
+    fb_stmp = yella_fb_file_attr_array_stamp(yella_fb_file_attr_array_as_root(packed_attrs));
+    if (fb_stmp == NULL)
+        return false;
+    stmp->device = yella_fb_file_file_stamp_device(fb_stmp);
+    stmp->inode = yella_fb_file_file_stamp_inode(fb_stmp);
+    stmp->size = yella_fb_file_file_stamp_size(fb_stmp);
+    stmp->modification_nanos = yella_fb_file_file_stamp_modification_nanos(fb_stmp);
+    stmp->metadata_change_nanos = yella_fb_file_file_stamp_metadata_change_nanos(fb_stmp);
+    return true;
+}
+
 uint8_t* pack_element_attributes(const element* const elem, size_t* sz)
 {
     flatcc_builder_t bld;
     uint8_t* result;
+    const chunked_digest* chunked;
 
-    if (elem->attrs == NULL)
+    if (elem->present == 0 && !elem->has_stamp)
     {
         result = NULL;
     }
@@ -167,7 +266,28 @@ uint8_t* pack_element_attributes(const element* const elem, size_t* sz)
     {
         flatcc_builder_init(&bld);
         yella_fb_file_attr_array_start_as_root(&bld);
-        yella_fb_file_attr_array_attrs_add(&bld, pack_element_attributes_to_vector(elem, &bld));
+        if (elem->present != 0)
+            yella_fb_file_attr_array_attrs_add(&bld, pack_element_attributes_to_vector(elem, &bld));
+        if (elem->has_stamp)
+        {
+            yella_fb_file_attr_array_stamp_create(&bld,
+                                                  elem->stamp.device,
+                                                  elem->stamp.inode,
+                                                  elem->stamp.size,
+                                                  elem->stamp.modification_nanos,
+                                                  elem->stamp.metadata_change_nanos);
+        }
+        if (elem->present & ATTR_TYPE_BIT(ATTR_TYPE_CHUNKED_SHA256))
+        {
+            chunked = &elem->attrs[ATTR_TYPE_CHUNKED_SHA256].value.chunked;
+            if (chunked->chunks != NULL)
+            {
+                yella_fb_file_attr_array_chunk_digests_add(&bld,
+                                                           flatbuffers_uint8_vec_create(&bld,
+                                                                                        chunked->chunks,
+                                                                                        chunked->chunk_count * CHUNKED_SHA256_DIGEST_SIZE));
+            }
+        }
         yella_fb_file_attr_array_end_as_root(&bld);
         result = flatcc_builder_finalize_buffer(&bld, sz);
         flatcc_builder_clear(&bld);
@@ -177,16 +297,26 @@ uint8_t* pack_element_attributes(const element* const elem, size_t* sz)
 
 yella_fb_file_attr_vec_ref_t pack_element_attributes_to_vector(const element* const elem, flatcc_builder_t* bld)
 {
-    attr_node* al;
-    struct sglib_attr_node_iterator itor;
+    int i;
 
     yella_fb_file_attr_vec_start(bld);
-    for (al = sglib_attr_node_it_init(&itor, elem->attrs);
-         al != NULL;
-         al = sglib_attr_node_it_next(&itor))
+    for (i = 0; i < ATTR_TYPE_COUNT; i++)
     {
-        yella_fb_file_attr_vec_push(bld, pack_attribute(al->attr, bld));
+        if (elem->present & ATTR_TYPE_BIT(i))
+            yella_fb_file_attr_vec_push(bld, pack_attribute(&elem->attrs[i], bld));
     }
     return yella_fb_file_attr_vec_end(bld);
+}
 
+void set_element_file_stamp(element* elem, const file_stamp* const stmp)
+{
+    if (stmp == NULL)
+    {
+        elem->has_stamp = false;
+    }
+    else
+    {
+        elem->has_stamp = true;
+        elem->stamp = *stmp;
+    }
 }
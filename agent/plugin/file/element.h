@@ -3,22 +3,51 @@
 
 #include "plugin/file/attribute.h"
 #include "file_builder.h"
+#include "common/arena.h"
 #include <unicode/utypes.h>
 #include <stdbool.h>
 
 typedef struct element element;
 
+/* The parts of the file's status that change whenever its contents change */
+typedef struct file_stamp
+{
+    uint64_t device;
+    uint64_t inode;
+    uint64_t size;
+    uint64_t modification_nanos;
+    uint64_t metadata_change_nanos;
+} file_stamp;
+
 YELLA_PRIV_EXPORT void add_element_attribute(element* elem, attribute* attr);
 YELLA_PRIV_EXPORT int compare_element_attributes(const element* const lhs, const element* const rhs);
+/* The packed attributes are those made by pack_element_attributes, and
+ * may be NULL. The comparison allocates nothing. */
+YELLA_PRIV_EXPORT int compare_element_to_packed_attributes(const element* const elem, const uint8_t* const packed_attrs);
+/* Returns NULL if the packed attributes have no attribute of the type */
+YELLA_PRIV_EXPORT attribute* create_attribute_from_packed_attributes(const uint8_t* const packed_attrs, attribute_type tp);
 YELLA_PRIV_EXPORT element* create_element(const UChar* const name);
+/* The element's memory comes from the arena, but what its attributes hold
+ * does not, so it must still be destroyed before the arena is reset */
+YELLA_PRIV_EXPORT element* create_element_in_arena(const UChar* const name, yella_arena* arena);
 YELLA_PRIV_EXPORT element* create_element_with_attrs(const UChar* const name, const uint8_t* const packed_attrs);
 YELLA_PRIV_EXPORT void destroy_element(element* elem);
 /* post: elem1 contains the symmetric difference of attributes between the two */
 YELLA_PRIV_EXPORT void diff_elements(element* elem1, element* elem2);
 YELLA_PRIV_EXPORT const UChar* element_name(const element* const elem);
+/* Returns NULL if the element has no stamp */
+YELLA_PRIV_EXPORT const file_stamp* element_file_stamp(const element* const elem);
+/* Returns NULL if the element has no attribute of the type */
+YELLA_PRIV_EXPORT const attribute* find_element_attribute(const element* const elem, attribute_type tp);
+/* Either may be NULL, and two NULLs are equal */
+YELLA_PRIV_EXPORT bool file_stamps_equal(const file_stamp* const lhs, const file_stamp* const rhs);
+/* Returns false if the packed attributes have no stamp */
+YELLA_PRIV_EXPORT bool packed_attributes_file_stamp(const uint8_t* const packed_attrs, file_stamp* stmp);
 /* This array of bytes will go into the database */
 YELLA_PRIV_EXPORT uint8_t* pack_element_attributes(const element* const elem, size_t* sz);
 /* This attr vector will go into the outgoing change message for this element */
 YELLA_PRIV_EXPORT yella_fb_file_attr_vec_ref_t pack_element_attributes_to_vector(const element* const elem, flatcc_builder_t* bld);
+/* A NULL stamp removes the element's stamp */
+YELLA_PRIV_EXPORT void set_element_file_stamp(element* elem, const file_stamp* const stmp);
 
 #endif
@@ -0,0 +1,144 @@
+#include "plugin/file/event_batch.h"
+#include "common/arena.h"
+#include <unicode/ustring.h>
+#include <xxhash.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A power of two. The slots double as they fill, and shrink back after a flush. */
+#define INITIAL_SLOT_COUNT 256
+#define NAME_ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct slot
+{
+    uint64_t hash;
+    const UChar* name;
+    size_t len;
+} slot;
+
+struct event_batch
+{
+    const event_source* esrc;
+    slot* slots;
+    size_t slot_count;
+    size_t used;
+    event_source_event* events;
+    size_t event_count;
+    size_t event_capacity;
+    yella_arena* names;
+};
+
+static void grow_slots(event_batch* batch)
+{
+    slot* old;
+    size_t old_count;
+    size_t mask;
+    size_t pos;
+    size_t i;
+
+    old = batch->slots;
+    old_count = batch->slot_count;
+    batch->slot_count *= 2;
+    batch->slots = calloc(batch->slot_count, sizeof(slot));
+    mask = batch->slot_count - 1;
+    for (i = 0; i < old_count; i++)
+    {
+        if (old[i].name != NULL)
+        {
+            for (pos = old[i].hash & mask; batch->slots[pos].name != NULL; pos = (pos + 1) & mask);
+            batch->slots[pos] = old[i];
+        }
+    }
+    free(old);
+}
+
+void add_to_event_batch(event_batch* batch, const UChar* const fname)
+{
+    size_t len;
+    uint64_t hash;
+    size_t mask;
+    size_t pos;
+    slot* cur;
+    UChar* copy;
+    const UChar* cfg;
+
+    len = u_strlen(fname);
+    hash = XXH3_64bits(fname, len * sizeof(UChar));
+    mask = batch->slot_count - 1;
+    for (pos = hash & mask; batch->slots[pos].name != NULL; pos = (pos + 1) & mask)
+    {
+        cur = &batch->slots[pos];
+        if (cur->hash == hash && cur->len == len && memcmp(cur->name, fname, len * sizeof(UChar)) == 0)
+            return;
+    }
+    copy = yella_arena_alloc(batch->names, (len + 1) * sizeof(UChar));
+    memcpy(copy, fname, (len + 1) * sizeof(UChar));
+    cur = &batch->slots[pos];
+    cur->hash = hash;
+    cur->name = copy;
+    cur->len = len;
+    /* Kept at most half full, so that probe runs stay short */
+    if (++batch->used * 2 > batch->slot_count)
+        grow_slots(batch);
+    cfg = event_source_file_name_matches_any(batch->esrc, copy);
+    if (cfg != NULL)
+    {
+        if (batch->event_count == batch->event_capacity)
+        {
+            batch->event_capacity *= 2;
+            batch->events = realloc(batch->events, batch->event_capacity * sizeof(event_source_event));
+        }
+        batch->events[batch->event_count].config_name = cfg;
+        batch->events[batch->event_count].fname = copy;
+        ++batch->event_count;
+    }
+}
+
+event_batch* create_event_batch(const event_source* const esrc)
+{
+    event_batch* result;
+
+    result = calloc(1, sizeof(event_batch));
+    result->esrc = esrc;
+    result->slot_count = INITIAL_SLOT_COUNT;
+    result->slots = calloc(result->slot_count, sizeof(slot));
+    result->event_capacity = INITIAL_SLOT_COUNT / 2;
+    result->events = malloc(result->event_capacity * sizeof(event_source_event));
+    result->names = yella_create_arena(NAME_ARENA_BLOCK_SIZE);
+    return result;
+}
+
+void destroy_event_batch(event_batch* batch)
+{
+    yella_destroy_arena(batch->names);
+    free(batch->events);
+    free(batch->slots);
+    free(batch);
+}
+
+size_t event_batch_size(const event_batch* const batch)
+{
+    return batch->event_count;
+}
+
+void flush_event_batch(event_batch* batch)
+{
+    if (batch->event_count > 0)
+        batch->esrc->callback(batch->events, batch->event_count, batch->esrc->callback_udata);
+    if (batch->used > 0)
+    {
+        if (batch->slot_count > INITIAL_SLOT_COUNT)
+        {
+            free(batch->slots);
+            batch->slot_count = INITIAL_SLOT_COUNT;
+            batch->slots = calloc(batch->slot_count, sizeof(slot));
+        }
+        else
+        {
+            memset(batch->slots, 0, batch->slot_count * sizeof(slot));
+        }
+        batch->used = 0;
+    }
+    batch->event_count = 0;
+    yella_reset_arena(batch->names);
+}
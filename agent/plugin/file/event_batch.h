@@ -0,0 +1,21 @@
+#ifndef YELLA_EVENT_BATCH_H__
+#define YELLA_EVENT_BATCH_H__
+
+#include "plugin/file/event_source.h"
+
+/* Collects the file names an event source receives in one burst, so that
+ * each name is matched and reported once however often it repeats. The
+ * names are kept in a hash set that is emptied at every flush, and their
+ * copies live in an arena that is reset along with it. */
+typedef struct event_batch event_batch;
+
+/* Names that are already in the batch, or that no spec matches, are dropped */
+YELLA_PRIV_EXPORT void add_to_event_batch(event_batch* batch, const UChar* const fname);
+YELLA_PRIV_EXPORT event_batch* create_event_batch(const event_source* const esrc);
+YELLA_PRIV_EXPORT void destroy_event_batch(event_batch* batch);
+/* The number of matched names waiting to be flushed */
+YELLA_PRIV_EXPORT size_t event_batch_size(const event_batch* const batch);
+/* Hands the matched names to the event source callback and empties the batch */
+YELLA_PRIV_EXPORT void flush_event_batch(event_batch* batch);
+
+#endif
@@ -0,0 +1,446 @@
+#include "plugin/file/event_coalescer.h"
+#include "common/arena.h"
+#include "common/file.h"
+#include "common/thread.h"
+#include <chucho/log.h>
+#include <unicode/ustring.h>
+#include <xxhash.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A power of two. The slots double as they fill, and shrink back after a flush. */
+#define INITIAL_SLOT_COUNT 256
+#define NAME_ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct name_slot
+{
+    uint64_t hash;
+    size_t config;
+    const UChar* name;
+    size_t len;
+} name_slot;
+
+typedef struct name_table
+{
+    name_slot* slots;
+    size_t slot_count;
+    size_t used;
+} name_table;
+
+typedef struct config_entry
+{
+    uds name;
+    /* The whole config is rescanned, so nothing else of it is kept */
+    bool dirty;
+} config_entry;
+
+/* Everything gathered in one window. There are two, so that one can be
+ * filled while the other is handed on. */
+typedef struct generation
+{
+    config_entry* configs;
+    size_t config_count;
+    size_t config_capacity;
+    name_table files;
+    name_table dirs;
+    yella_arena* names;
+} generation;
+
+struct event_coalescer
+{
+    size_t max_names;
+    size_t window_millis;
+    event_coalescer_callback cb;
+    void* udata;
+    /* Guards current, should_stop and stats */
+    yella_mutex* guard;
+    yella_condition_variable* cond;
+    bool should_stop;
+    generation* current;
+    event_coalescer_stats stats;
+    /* Guards spare and events, and keeps flushes in order */
+    yella_mutex* flush_guard;
+    generation* spare;
+    coalesced_event* events;
+    size_t event_capacity;
+    yella_thread* flusher;
+};
+
+static uint64_t name_hash(size_t config, const UChar* const name, size_t len)
+{
+    return XXH3_64bits(name, len * sizeof(UChar)) ^ (config * 0x9e3779b97f4a7c15ULL);
+}
+
+static void init_name_table(name_table* tbl)
+{
+    tbl->slot_count = INITIAL_SLOT_COUNT;
+    tbl->slots = calloc(tbl->slot_count, sizeof(name_slot));
+    tbl->used = 0;
+}
+
+static void reset_name_table(name_table* tbl)
+{
+    if (tbl->used > 0)
+    {
+        if (tbl->slot_count > INITIAL_SLOT_COUNT)
+        {
+            free(tbl->slots);
+            init_name_table(tbl);
+        }
+        else
+        {
+            memset(tbl->slots, 0, tbl->slot_count * sizeof(name_slot));
+            tbl->used = 0;
+        }
+    }
+}
+
+static void grow_name_table(name_table* tbl)
+{
+    name_slot* old;
+    size_t old_count;
+    size_t mask;
+    size_t pos;
+    size_t i;
+
+    old = tbl->slots;
+    old_count = tbl->slot_count;
+    tbl->slot_count *= 2;
+    tbl->slots = calloc(tbl->slot_count, sizeof(name_slot));
+    mask = tbl->slot_count - 1;
+    for (i = 0; i < old_count; i++)
+    {
+        if (old[i].name != NULL)
+        {
+            for (pos = old[i].hash & mask; tbl->slots[pos].name != NULL; pos = (pos + 1) & mask);
+            tbl->slots[pos] = old[i];
+        }
+    }
+    free(old);
+}
+
+/* Returns the slot holding the name, or the empty slot where it belongs */
+static name_slot* find_name(const name_table* const tbl, uint64_t hash, size_t config, const UChar* const name, size_t len)
+{
+    size_t mask;
+    size_t pos;
+    name_slot* cur;
+
+    mask = tbl->slot_count - 1;
+    for (pos = hash & mask; tbl->slots[pos].name != NULL; pos = (pos + 1) & mask)
+    {
+        cur = &tbl->slots[pos];
+        if (cur->hash == hash &&
+            cur->config == config &&
+            cur->len == len &&
+            memcmp(cur->name, name, len * sizeof(UChar)) == 0)
+        {
+            break;
+        }
+    }
+    return &tbl->slots[pos];
+}
+
+static bool contains_name(const name_table* const tbl, size_t config, const UChar* const name, size_t len)
+{
+    return find_name(tbl, name_hash(config, name, len), config, name, len)->name != NULL;
+}
+
+/* Returns false when the name was already there */
+static bool insert_name(name_table* tbl, yella_arena* names, size_t config, const UChar* const name, size_t len)
+{
+    uint64_t hash;
+    name_slot* slot;
+    UChar* copy;
+
+    hash = name_hash(config, name, len);
+    slot = find_name(tbl, hash, config, name, len);
+    if (slot->name != NULL)
+        return false;
+    copy = yella_arena_alloc(names, (len + 1) * sizeof(UChar));
+    memcpy(copy, name, len * sizeof(UChar));
+    copy[len] = 0;
+    slot->hash = hash;
+    slot->config = config;
+    slot->name = copy;
+    slot->len = len;
+    /* Kept at most half full, so that probe runs stay short */
+    if (++tbl->used * 2 > tbl->slot_count)
+        grow_name_table(tbl);
+    return true;
+}
+
+static generation* create_generation(void)
+{
+    generation* result;
+
+    result = calloc(1, sizeof(generation));
+    init_name_table(&result->files);
+    init_name_table(&result->dirs);
+    result->names = yella_create_arena(NAME_ARENA_BLOCK_SIZE);
+    return result;
+}
+
+static void reset_generation(generation* gen)
+{
+    size_t i;
+
+    for (i = 0; i < gen->config_count; i++)
+        udsfree(gen->configs[i].name);
+    gen->config_count = 0;
+    reset_name_table(&gen->files);
+    reset_name_table(&gen->dirs);
+    yella_reset_arena(gen->names);
+}
+
+static void destroy_generation(generation* gen)
+{
+    reset_generation(gen);
+    free(gen->configs);
+    free(gen->files.slots);
+    free(gen->dirs.slots);
+    yella_destroy_arena(gen->names);
+    free(gen);
+}
+
+/* There are only ever a few configs, so they are searched in order */
+static size_t config_index(generation* gen, const UChar* const config_name)
+{
+    size_t i;
+
+    for (i = 0; i < gen->config_count; i++)
+    {
+        if (u_strcmp(gen->configs[i].name, config_name) == 0)
+            return i;
+    }
+    if (gen->config_count == gen->config_capacity)
+    {
+        gen->config_capacity = (gen->config_capacity == 0) ? 4 : gen->config_capacity * 2;
+        gen->configs = realloc(gen->configs, gen->config_capacity * sizeof(config_entry));
+    }
+    gen->configs[gen->config_count].name = udsnew(config_name);
+    gen->configs[gen->config_count].dirty = false;
+    return gen->config_count++;
+}
+
+/* The length of the parent directory of the first len characters of
+ * name, or zero if there is none */
+static size_t parent_length(const UChar* const name, size_t len)
+{
+    while (len > 0 && name[len - 1] != YELLA_DIR_SEP[0])
+        --len;
+    if (len == 0)
+        return 0;
+    /* The root keeps its separator */
+    return (len == 1) ? 1 : len - 1;
+}
+
+static bool has_dirty_ancestor(const generation* const gen, size_t config, const UChar* const name, size_t len)
+{
+    size_t plen;
+
+    for (plen = parent_length(name, len);
+         plen > 0 && plen < len;
+         len = plen, plen = parent_length(name, len))
+    {
+        if (contains_name(&gen->dirs, config, name, plen))
+            return true;
+    }
+    return false;
+}
+
+static void add_one(event_coalescer* ec, const event_source_event* const evt)
+{
+    generation* gen;
+    size_t cfg;
+    size_t len;
+    size_t plen;
+
+    gen = ec->current;
+    cfg = config_index(gen, evt->config_name);
+    if (gen->configs[cfg].dirty)
+        return;
+    len = u_strlen(evt->fname);
+    if (contains_name(&gen->files, cfg, evt->fname, len))
+        return;
+    if (gen->files.used < ec->max_names)
+    {
+        insert_name(&gen->files, gen->names, cfg, evt->fname, len);
+        return;
+    }
+    plen = parent_length(evt->fname, len);
+    if (plen == 0 || contains_name(&gen->dirs, cfg, evt->fname, plen))
+        return;
+    if (gen->dirs.used < ec->max_names)
+        insert_name(&gen->dirs, gen->names, cfg, evt->fname, plen);
+    else
+        gen->configs[cfg].dirty = true;
+}
+
+static void push_event(event_coalescer* ec, size_t* count, const UChar* const config_name, const UChar* const name, coalesced_kind kind)
+{
+    if (*count == ec->event_capacity)
+    {
+        ec->event_capacity = (ec->event_capacity == 0) ? INITIAL_SLOT_COUNT : ec->event_capacity * 2;
+        ec->events = realloc(ec->events, ec->event_capacity * sizeof(coalesced_event));
+    }
+    ec->events[*count].config_name = config_name;
+    ec->events[*count].name = name;
+    ec->events[*count].kind = kind;
+    ++*count;
+}
+
+/* Rescans come first, and nothing already covered by one is handed on */
+static void emit_generation(event_coalescer* ec, const generation* const gen)
+{
+    size_t count;
+    size_t files;
+    size_t dirs;
+    size_t configs;
+    size_t i;
+    const name_slot* slot;
+
+    count = 0;
+    for (i = 0; i < gen->config_count; i++)
+    {
+        if (gen->configs[i].dirty)
+            push_event(ec, &count, gen->configs[i].name, NULL, COALESCED_CONFIG);
+    }
+    configs = count;
+    for (i = 0; i < gen->dirs.slot_count; i++)
+    {
+        slot = &gen->dirs.slots[i];
+        if (slot->name != NULL &&
+            !gen->configs[slot->config].dirty &&
+            !has_dirty_ancestor(gen, slot->config, slot->name, slot->len))
+        {
+            push_event(ec, &count, gen->configs[slot->config].name, slot->name, COALESCED_DIRECTORY);
+        }
+    }
+    dirs = count - configs;
+    for (i = 0; i < gen->files.slot_count; i++)
+    {
+        slot = &gen->files.slots[i];
+        if (slot->name != NULL &&
+            !gen->configs[slot->config].dirty &&
+            (gen->dirs.used == 0 || !has_dirty_ancestor(gen, slot->config, slot->name, slot->len)))
+        {
+            push_event(ec, &count, gen->configs[slot->config].name, slot->name, COALESCED_FILE);
+        }
+    }
+    files = count - configs - dirs;
+    if (count > 0)
+        ec->cb(ec->events, count, ec->udata);
+    yella_lock_mutex(ec->guard);
+    ec->stats.files += files;
+    ec->stats.directories += dirs;
+    ec->stats.configs += configs;
+    yella_unlock_mutex(ec->guard);
+}
+
+static void flusher_main(void* udata)
+{
+    event_coalescer* ec;
+
+    ec = udata;
+    yella_lock_mutex(ec->guard);
+    while (!ec->should_stop)
+    {
+        yella_wait_milliseconds_for_condition_variable(ec->cond, ec->guard, ec->window_millis);
+        if (!ec->should_stop)
+        {
+            yella_unlock_mutex(ec->guard);
+            flush_event_coalescer(ec);
+            yella_lock_mutex(ec->guard);
+        }
+    }
+    yella_unlock_mutex(ec->guard);
+}
+
+void add_to_event_coalescer(event_coalescer* ec, const event_source_event* const events, size_t count)
+{
+    size_t i;
+
+    yella_lock_mutex(ec->guard);
+    for (i = 0; i < count; i++)
+        add_one(ec, &events[i]);
+    ec->stats.events += count;
+    yella_unlock_mutex(ec->guard);
+    if (ec->window_millis == 0)
+        flush_event_coalescer(ec);
+}
+
+event_coalescer* create_event_coalescer(size_t max_names,
+                                        size_t window_millis,
+                                        event_coalescer_callback cb,
+                                        void* udata)
+{
+    event_coalescer* result;
+
+    result = calloc(1, sizeof(event_coalescer));
+    result->max_names = (max_names == 0) ? 1 : max_names;
+    result->window_millis = window_millis;
+    result->cb = cb;
+    result->udata = udata;
+    result->guard = yella_create_mutex();
+    result->cond = yella_create_condition_variable();
+    result->current = create_generation();
+    result->flush_guard = yella_create_mutex();
+    result->spare = create_generation();
+    if (window_millis > 0)
+        result->flusher = yella_create_thread(flusher_main, result);
+    return result;
+}
+
+void destroy_event_coalescer(event_coalescer* ec)
+{
+    if (ec->flusher != NULL)
+    {
+        yella_lock_mutex(ec->guard);
+        ec->should_stop = true;
+        yella_signal_condition_variable(ec->cond);
+        yella_unlock_mutex(ec->guard);
+        yella_join_thread(ec->flusher);
+        yella_destroy_thread(ec->flusher);
+    }
+    flush_event_coalescer(ec);
+    CHUCHO_C_INFO("file.event",
+                  "Event coalescer: %" PRIu64 " events, %" PRIu64 " files, %" PRIu64 " directory rescans, %" PRIu64 " config rescans",
+                  ec->stats.events,
+                  ec->stats.files,
+                  ec->stats.directories,
+                  ec->stats.configs);
+    destroy_generation(ec->spare);
+    yella_destroy_mutex(ec->flush_guard);
+    destroy_generation(ec->current);
+    yella_destroy_condition_variable(ec->cond);
+    yella_destroy_mutex(ec->guard);
+    free(ec->events);
+    free(ec);
+}
+
+void flush_event_coalescer(event_coalescer* ec)
+{
+    generation* full;
+
+    yella_lock_mutex(ec->flush_guard);
+    yella_lock_mutex(ec->guard);
+    full = ec->current;
+    ec->current = ec->spare;
+    ec->spare = full;
+    yella_unlock_mutex(ec->guard);
+    if (full->config_count > 0)
+    {
+        emit_generation(ec, full);
+        reset_generation(full);
+    }
+    yella_unlock_mutex(ec->flush_guard);
+}
+
+void get_event_coalescer_stats(event_coalescer* ec, event_coalescer_stats* stats)
+{
+    yella_lock_mutex(ec->guard);
+    *stats = ec->stats;
+    yella_unlock_mutex(ec->guard);
+}
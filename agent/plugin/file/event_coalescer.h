@@ -0,0 +1,58 @@
+#ifndef YELLA_EVENT_COALESCER_H__
+#define YELLA_EVENT_COALESCER_H__
+
+#include "plugin/file/event_source.h"
+#include <stdint.h>
+
+/* Sits between the event source and the job queue. Events are gathered
+ * over a short window, so that a file that changes many times in the
+ * window is examined once. The number of names held is bounded. When the
+ * names are full, further events only mark their directory dirty, and
+ * when the dirty directories are full as well, their config is marked
+ * dirty as a whole. Dirty directories and configs are handed on as
+ * rescans, which find whatever the dropped events would have. */
+typedef struct event_coalescer event_coalescer;
+
+typedef enum
+{
+    COALESCED_FILE,
+    COALESCED_DIRECTORY,
+    COALESCED_CONFIG
+} coalesced_kind;
+
+typedef struct coalesced_event
+{
+    const UChar* config_name;
+    /* The file or the dirty directory, and NULL for a dirty config */
+    const UChar* name;
+    coalesced_kind kind;
+} coalesced_event;
+
+typedef struct event_coalescer_stats
+{
+    /* Events added */
+    uint64_t events;
+    /* Files handed on */
+    uint64_t files;
+    /* Directories handed on for rescan */
+    uint64_t directories;
+    /* Configs handed on for rescan */
+    uint64_t configs;
+} event_coalescer_stats;
+
+/* The events are only valid for the duration of the call */
+typedef void (*event_coalescer_callback)(const coalesced_event* const events, size_t count, void* udata);
+
+YELLA_PRIV_EXPORT void add_to_event_coalescer(event_coalescer* ec, const event_source_event* const events, size_t count);
+/* The names and the dirty directories are each bounded by max_names. With
+ * a window of zero, every addition is flushed right away. */
+YELLA_PRIV_EXPORT event_coalescer* create_event_coalescer(size_t max_names,
+                                                          size_t window_millis,
+                                                          event_coalescer_callback cb,
+                                                          void* udata);
+/* Whatever is still held is flushed first */
+YELLA_PRIV_EXPORT void destroy_event_coalescer(event_coalescer* ec);
+YELLA_PRIV_EXPORT void flush_event_coalescer(event_coalescer* ec);
+YELLA_PRIV_EXPORT void get_event_coalescer_stats(event_coalescer* ec, event_coalescer_stats* stats);
+
+#endif
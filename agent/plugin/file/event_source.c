@@ -1,20 +1,71 @@
 #include "plugin/file/event_source.h"
 #include "plugin/file/file_name_matcher.h"
+#include "plugin/file/spec_index.h"
+#include "common/file.h"
 #include "common/text_util.h"
 #include "common/yaml_util.h"
 #include <chucho/log.h>
+#include <assert.h>
 #include <stdlib.h>
+#include <sys/param.h>
 
 SGLIB_DEFINE_RBTREE_FUNCTIONS(event_source_spec, left, right, color, EVENT_SOURCE_SPEC_COMPARATOR);
 
+static int qsort_strcmp(const void* p1, const void* p2)
+{
+    const UChar* u1;
+    const UChar* u2;
+
+    u1 = *(const UChar**)p1;
+    u2 = *(const UChar**)p2;
+    return u_strcmp(u1, u2);
+}
+
 static void destroy_event_source_spec(event_source_spec* spec)
 {
     udsfree(spec->name);
     yella_destroy_ptr_vector(spec->includes);
     yella_destroy_ptr_vector(spec->excludes);
+    yella_destroy_ptr_vector(spec->include_patterns);
     free(spec);
 }
 
+/* The directory above the first special character, or above the file if
+ * there is none */
+static uds top_directory(const UChar* const incl)
+{
+    const UChar* spesh;
+
+    spesh = first_unescaped_special_char(incl);
+    if (spesh == NULL)
+        spesh = u_strrchr(incl, YELLA_DIR_SEP[0]);
+    assert(spesh != NULL);
+    while (*spesh != YELLA_DIR_SEP[0] && spesh >= incl)
+        --spesh;
+    return (spesh >= incl) ? udsnewlen(incl, (spesh == incl) ? 1 : spesh - incl) : NULL;
+}
+
+/* The specs are write-locked on entry */
+static void rebuild_index(event_source* esrc)
+{
+    event_source_spec* cur;
+    struct sglib_event_source_spec_iterator itor;
+    event_source_spec** specs;
+    size_t count;
+
+    specs = malloc(MAX(sglib_event_source_spec_len(esrc->specs), 1) * sizeof(event_source_spec*));
+    count = 0;
+    for (cur = sglib_event_source_spec_it_init(&itor, esrc->specs);
+         cur != NULL;
+         cur = sglib_event_source_spec_it_next(&itor))
+    {
+        specs[count++] = cur;
+    }
+    destroy_spec_index(esrc->index);
+    esrc->index = create_spec_index(specs, count);
+    free(specs);
+}
+
 static char* specs_to_yaml(event_source_spec** specs, size_t count)
 {
     char* utf8;
@@ -72,10 +123,12 @@ void add_or_replace_event_source_specs(event_source* esrc, event_source_spec** s
     yella_write_lock_reader_writer_lock(esrc->guard);
     for (i = 0; i < count; i++)
     {
+        specs[i]->include_patterns = compile_file_name_patterns(specs[i]->includes);
         if (sglib_event_source_spec_delete_if_member(&esrc->specs, specs[i], &removed) != 0)
             destroy_event_source_spec(removed);
         sglib_event_source_spec_add(&esrc->specs, specs[i]);
     }
+    rebuild_index(esrc);
     yella_unlock_reader_writer_lock(esrc->guard);
     add_or_replace_event_source_impl_specs(esrc, specs, count);
     if (chucho_logger_permits(esrc->lgr, CHUCHO_INFO))
@@ -95,6 +148,7 @@ event_source* create_event_source(event_source_callback cb, void* cb_udata)
     result->callback = cb;
     result->callback_udata = cb_udata;
     result->lgr = chucho_get_logger("file.event");
+    result->index = create_spec_index(NULL, 0);
     init_event_source_impl(result);
     return result;
 }
@@ -112,6 +166,7 @@ void clear_event_source_specs(event_source* esrc)
         destroy_event_source_spec(cur);
     }
     esrc->specs = NULL;
+    rebuild_index(esrc);
     yella_unlock_reader_writer_lock(esrc->guard);
     clear_event_source_impl_specs(esrc);
     CHUCHO_C_INFO(esrc->lgr, "Cleared all configs");
@@ -121,6 +176,7 @@ void destroy_event_source(event_source* esrc)
 {
     destroy_event_source_impl(esrc);
     clear_event_source_specs(esrc);
+    destroy_spec_index(esrc->index);
     yella_destroy_reader_writer_lock(esrc->guard);
     chucho_release_logger(esrc->lgr);
     free(esrc);
@@ -128,34 +184,126 @@ void destroy_event_source(event_source* esrc)
 
 const UChar* event_source_file_name_matches_any(const event_source* const esrc, const UChar* const fname)
 {
-    int i;
+    const UChar* result;
+
+    yella_read_lock_reader_writer_lock(esrc->guard);
+    result = spec_index_match(esrc->index, fname);
+    yella_unlock_reader_writer_lock(esrc->guard);
+    return result;
+}
+
+void event_source_overflowed(const event_source* const esrc)
+{
+    struct sglib_event_source_spec_iterator itor;
+    event_source_spec* cur;
+    yella_ptr_vector* configs;
+    yella_ptr_vector* dirs;
+    uds top;
+    size_t i;
+    size_t j;
+
+    if (esrc->overflow_callback == NULL)
+        return;
+    /* Collected first, so that the callback runs without the lock */
+    configs = yella_create_uds_ptr_vector();
+    dirs = yella_create_uds_ptr_vector();
+    yella_read_lock_reader_writer_lock(esrc->guard);
+    for (cur = sglib_event_source_spec_it_init(&itor, esrc->specs);
+         cur != NULL;
+         cur = sglib_event_source_spec_it_next(&itor))
+    {
+        for (i = 0; i < yella_ptr_vector_size(cur->includes); i++)
+        {
+            top = top_directory(yella_ptr_vector_at(cur->includes, i));
+            if (top != NULL)
+            {
+                for (j = 0; j < yella_ptr_vector_size(dirs); j++)
+                {
+                    if (u_strcmp(yella_ptr_vector_at(configs, j), cur->name) == 0 &&
+                        u_strcmp(yella_ptr_vector_at(dirs, j), top) == 0)
+                    {
+                        break;
+                    }
+                }
+                if (j == yella_ptr_vector_size(dirs))
+                {
+                    yella_push_back_ptr_vector(configs, udsdup(cur->name));
+                    yella_push_back_ptr_vector(dirs, top);
+                }
+                else
+                {
+                    udsfree(top);
+                }
+            }
+        }
+    }
+    yella_unlock_reader_writer_lock(esrc->guard);
+    for (i = 0; i < yella_ptr_vector_size(dirs); i++)
+        esrc->overflow_callback(yella_ptr_vector_at(configs, i), yella_ptr_vector_at(dirs, i), esrc->callback_udata);
+    yella_destroy_ptr_vector(dirs);
+    yella_destroy_ptr_vector(configs);
+}
+
+yella_ptr_vector* event_source_top_directories(const event_source* const esrc)
+{
     struct sglib_event_source_spec_iterator spec_itor;
     event_source_spec* cur_spec;
-    const UChar* result;
+    size_t i;
+    uds top;
+    yella_ptr_vector* paths;
+    char* utf8;
+    yella_ptr_vector* uniq;
+    yaml_document_t doc;
+    int seq;
+    int value;
 
-    result = NULL;
+    paths = yella_create_uds_ptr_vector();
     yella_read_lock_reader_writer_lock(esrc->guard);
     for (cur_spec = sglib_event_source_spec_it_init(&spec_itor, esrc->specs);
          cur_spec != NULL;
          cur_spec = sglib_event_source_spec_it_next(&spec_itor))
     {
-        for (i = 0; i < yella_ptr_vector_size(cur_spec->excludes); i++)
+        for (i = 0; i < yella_ptr_vector_size(cur_spec->includes); i++)
         {
-            if (file_name_matches(fname, yella_ptr_vector_at(cur_spec->excludes, i)))
-                goto top_break;
+            top = top_directory(yella_ptr_vector_at(cur_spec->includes, i));
+            if (top != NULL)
+                yella_push_back_ptr_vector(paths, top);
         }
-        for (i = 0; i < yella_ptr_vector_size(cur_spec->includes); i++)
+    }
+    yella_unlock_reader_writer_lock(esrc->guard);
+    if (yella_ptr_vector_size(paths) > 0)
+    {
+        qsort(yella_ptr_vector_data(paths),
+              yella_ptr_vector_size(paths),
+              sizeof(UChar*),
+              qsort_strcmp);
+        uniq = yella_create_uds_ptr_vector();
+        yella_push_back_ptr_vector(uniq, udsdup(yella_ptr_vector_at(paths, 0)));
+        for (i = 1; i < yella_ptr_vector_size(paths); i++)
+        {
+            if (u_strcmp(yella_ptr_vector_at(paths, i), yella_ptr_vector_at(uniq, yella_ptr_vector_size(uniq) - 1)) != 0)
+                yella_push_back_ptr_vector(uniq, udsdup(yella_ptr_vector_at(paths, i)));
+        }
+        yella_destroy_ptr_vector(paths);
+        paths = uniq;
+        if (chucho_logger_permits(esrc->lgr, CHUCHO_INFO))
         {
-            if (file_name_matches(fname, yella_ptr_vector_at(cur_spec->includes, i)))
+            yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
+            seq = yaml_document_add_sequence(&doc, NULL, YAML_FLOW_SEQUENCE_STYLE);
+            for (i = 0; i < yella_ptr_vector_size(paths); i++)
             {
-                result = cur_spec->name;
-                goto top_break;
+                utf8 = yella_to_utf8(yella_ptr_vector_at(paths, i));
+                value = yaml_document_add_scalar(&doc, NULL, (yaml_char_t*)utf8, strlen(utf8), YAML_PLAIN_SCALAR_STYLE);
+                free(utf8);
+                yaml_document_append_sequence_item(&doc, seq, value);
             }
+            utf8 = yella_emit_yaml(&doc);
+            yaml_document_delete(&doc);
+            CHUCHO_C_INFO(esrc->lgr, "Watching paths: %s", utf8);
+            free(utf8);
         }
     }
-    top_break:
-    yella_unlock_reader_writer_lock(esrc->guard);
-    return result;
+    return paths;
 }
 
 void remove_event_source_spec(event_source* esrc, const UChar* const name)
@@ -167,7 +315,10 @@ void remove_event_source_spec(event_source* esrc, const UChar* const name)
     to_remove.name = (UChar*)name;
     yella_write_lock_reader_writer_lock(esrc->guard);
     if (sglib_event_source_spec_delete_if_member(&esrc->specs, &to_remove, &removed))
+    {
         destroy_event_source_spec(removed);
+        rebuild_index(esrc);
+    }
     yella_unlock_reader_writer_lock(esrc->guard);
     remove_event_source_impl_spec(esrc, name);
     if (chucho_logger_permits(esrc->lgr, CHUCHO_INFO))
@@ -177,3 +328,8 @@ void remove_event_source_spec(event_source* esrc, const UChar* const name)
         free(spec_text);
     }
 }
+
+void set_event_source_overflow_callback(event_source* esrc, event_source_overflow_callback cb)
+{
+    esrc->overflow_callback = cb;
+}
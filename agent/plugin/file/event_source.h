@@ -1,6 +1,7 @@
 #ifndef YELLA_EVENT_SOURCE_H__
 #define YELLA_EVENT_SOURCE_H__
 
+#include "plugin/file/file_name_matcher.h"
 #include "common/uds_util.h"
 #include "common/thread.h"
 #include "common/sglib.h"
@@ -15,18 +16,36 @@ typedef struct event_source_spec
     yella_ptr_vector* includes;
     yella_ptr_vector* excludes;
     /* These are private */
+    /* The includes compiled into a vector of file_name_pattern. The
+     * excludes of all specs are compiled together by the spec index. */
+    yella_ptr_vector* include_patterns;
     char color;
     struct event_source_spec* left;
     struct event_source_spec* right;
 } event_source_spec;
 
-typedef void (*event_source_callback)(const UChar* const config_name, const UChar* const fname, void* udata);
+typedef struct event_source_event
+{
+    const UChar* config_name;
+    const UChar* fname;
+} event_source_event;
+
+/* The events are only valid for the duration of the call */
+typedef void (*event_source_callback)(const event_source_event* const events, size_t count, void* udata);
+/* Events were lost, so anything below dir may have changed unreported. The
+ * dir is one of the top directories of the config's includes. */
+typedef void (*event_source_overflow_callback)(const UChar* const config_name, const UChar* const dir, void* udata);
+
+struct spec_index;
 
 typedef struct event_source
 {
     event_source_spec* specs;
+    /* Rebuilt from the specs whenever they change */
+    struct spec_index* index;
     yella_reader_writer_lock* guard;
     event_source_callback callback;
+    event_source_overflow_callback overflow_callback;
     void* callback_udata;
     void* impl;
     chucho_logger_t* lgr;
@@ -40,6 +59,11 @@ void add_or_replace_event_source_impl_specs(event_source* esrc, event_source_spe
 void clear_event_source_impl_specs(event_source* esrc);
 void destroy_event_source_impl(event_source* esrc);
 const UChar* event_source_file_name_matches_any(const event_source* const esrc, const UChar* const fname);
+/* Called by the impl when the platform drops events. The impl's own locks
+ * must not be held, since spec updates take them. */
+void event_source_overflowed(const event_source* const esrc);
+/* The unique directories above the includes of all specs, as a vector of uds */
+yella_ptr_vector* event_source_top_directories(const event_source* const esrc);
 void init_event_source_impl(event_source* esrc);
 void remove_event_source_impl_spec(event_source* esrc, const UChar* const config_name);
 /* End private */
@@ -52,6 +76,8 @@ YELLA_PRIV_EXPORT void destroy_event_source(event_source* esrc);
 YELLA_PRIV_EXPORT void pause_event_source(event_source* esrc);
 YELLA_PRIV_EXPORT void remove_event_source_spec(event_source* esrc, const UChar* const name);
 YELLA_PRIV_EXPORT void resume_event_source(event_source* esrc);
+/* The overflow callback receives the same udata as the event callback */
+YELLA_PRIV_EXPORT void set_event_source_overflow_callback(event_source* esrc, event_source_overflow_callback cb);
 YELLA_PRIV_EXPORT void wait_for_event_source_pause(event_source* esrc);
 
 #endif
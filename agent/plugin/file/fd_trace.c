@@ -0,0 +1,381 @@
+#include "plugin/file/fd_trace.h"
+#include "common/macro_util.h"
+#include "common/sglib.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Keeps the two indexes of the ring out of each other's cache line */
+#define CACHE_LINE_SIZE 64
+
+struct fd_trace_ring
+{
+    fd_trace_record* records;
+    size_t mask;
+    char pad0[CACHE_LINE_SIZE];
+    /* The next record to pop, only written by the consumer */
+    atomic_size_t head;
+    char pad1[CACHE_LINE_SIZE];
+    /* The next record to push, only written by the producer */
+    atomic_size_t tail;
+    char pad2[CACHE_LINE_SIZE];
+    /* These are only used to sleep when the ring is empty */
+    atomic_bool consumer_waiting;
+    yella_mutex* guard;
+    yella_condition_variable* cond;
+};
+
+typedef struct name_node
+{
+    int32_t pid;
+    int32_t fd;
+    /* Only kept when a spec matches */
+    UChar* name;
+    char color;
+    struct name_node* left;
+    struct name_node* right;
+} name_node;
+
+struct fd_name_cache
+{
+    const event_source* esrc;
+    fd_name_resolver resolver;
+    void* resolver_udata;
+    yella_mutex* guard;
+    name_node* names;
+    size_t count;
+    /* Bumped at every clear, so that a name resolved across one is not kept */
+    uint64_t generation;
+    fd_name_cache_stats stats;
+};
+
+static int pid_comparator(name_node* lhs, name_node* rhs)
+{
+    return (lhs->pid > rhs->pid) - (lhs->pid < rhs->pid);
+}
+
+static int name_node_comparator(name_node* lhs, name_node* rhs)
+{
+    int result;
+
+    result = pid_comparator(lhs, rhs);
+    if (result == 0)
+        result = (lhs->fd > rhs->fd) - (lhs->fd < rhs->fd);
+    return result;
+}
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(name_node, left, right, color, name_node_comparator);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(name_node, left, right, color, name_node_comparator);
+
+static void destroy_name_node(name_node* nn)
+{
+    free(nn->name);
+    free(nn);
+}
+
+static bool parse_int(const char** cur, int32_t* val)
+{
+    const char* p;
+    int64_t result;
+    bool neg;
+
+    p = *cur;
+    neg = (*p == '-');
+    if (neg)
+        ++p;
+    if (*p < '0' || *p > '9')
+        return false;
+    result = 0;
+    while (*p >= '0' && *p <= '9')
+    {
+        result = result * 10 + (*p++ - '0');
+        if (result > INT32_MAX)
+            return false;
+    }
+    *val = (int32_t)(neg ? -result : result);
+    *cur = p;
+    return true;
+}
+
+/* The fds of pid from fd up are removed. The cache is locked on entry. */
+static void remove_fds_from(fd_name_cache* cache, int32_t pid, int32_t fd)
+{
+    struct sglib_name_node_iterator itor;
+    name_node to_find;
+    name_node* cur;
+    name_node* to_remove[64];
+    size_t count;
+    size_t i;
+
+    to_find.pid = pid;
+    /* The tree cannot change while it is walked, so this goes in rounds */
+    do
+    {
+        count = 0;
+        for (cur = sglib_name_node_it_init_on_equal(&itor, cache->names, pid_comparator, &to_find);
+             cur != NULL && count < YELLA_ARRAY_SIZE(to_remove);
+             cur = sglib_name_node_it_next(&itor))
+        {
+            if (cur->fd >= fd)
+                to_remove[count++] = cur;
+        }
+        for (i = 0; i < count; i++)
+        {
+            sglib_name_node_delete(&cache->names, to_remove[i]);
+            destroy_name_node(to_remove[i]);
+        }
+        cache->count -= count;
+    } while (count == YELLA_ARRAY_SIZE(to_remove));
+}
+
+static void apply_write(fd_name_cache* cache, const fd_trace_record* const rec, event_batch* batch)
+{
+    name_node to_find;
+    name_node* found;
+    uint64_t generation;
+    UChar* name;
+
+    to_find.pid = rec->pid;
+    to_find.fd = rec->fd;
+    yella_lock_mutex(cache->guard);
+    found = sglib_name_node_find_member(cache->names, &to_find);
+    if (found != NULL)
+    {
+        ++cache->stats.hits;
+        if (found->name != NULL)
+            add_to_event_batch(batch, found->name);
+        yella_unlock_mutex(cache->guard);
+        return;
+    }
+    ++cache->stats.misses;
+    generation = cache->generation;
+    /* The resolver may be slow, so spec changes are not held up by it */
+    yella_unlock_mutex(cache->guard);
+    name = cache->resolver(rec->pid, rec->fd, cache->resolver_udata);
+    if (name != NULL && event_source_file_name_matches_any(cache->esrc, name) == NULL)
+    {
+        free(name);
+        name = NULL;
+    }
+    yella_lock_mutex(cache->guard);
+    if (name != NULL)
+        add_to_event_batch(batch, name);
+    if (generation == cache->generation)
+    {
+        found = malloc(sizeof(name_node));
+        found->pid = rec->pid;
+        found->fd = rec->fd;
+        found->name = name;
+        sglib_name_node_add(&cache->names, found);
+        ++cache->count;
+    }
+    else
+    {
+        free(name);
+    }
+    yella_unlock_mutex(cache->guard);
+}
+
+bool parse_fd_trace_record(const char* const line, fd_trace_record* rec)
+{
+    const char* cur;
+
+    if (strncmp(line, "write:", 6) == 0)
+    {
+        rec->kind = FD_TRACE_WRITE;
+        cur = line + 6;
+    }
+    else if (strncmp(line, "close:", 6) == 0)
+    {
+        rec->kind = FD_TRACE_CLOSE;
+        cur = line + 6;
+    }
+    else if (strncmp(line, "closefrom:", 10) == 0)
+    {
+        rec->kind = FD_TRACE_CLOSEFROM;
+        cur = line + 10;
+    }
+    else if (strncmp(line, "exit:", 5) == 0)
+    {
+        rec->kind = FD_TRACE_EXIT;
+        cur = line + 5;
+    }
+    else
+    {
+        return false;
+    }
+    if (!parse_int(&cur, &rec->pid))
+        return false;
+    if (rec->kind == FD_TRACE_EXIT)
+    {
+        rec->fd = 0;
+    }
+    else if (*cur++ != ',' || !parse_int(&cur, &rec->fd))
+    {
+        return false;
+    }
+    return *cur == 0 || *cur == '\n';
+}
+
+void apply_fd_trace_record(fd_name_cache* cache, const fd_trace_record* const rec, event_batch* batch)
+{
+    name_node to_remove;
+    name_node* removed;
+
+    switch (rec->kind)
+    {
+    case FD_TRACE_WRITE:
+        apply_write(cache, rec, batch);
+        break;
+    case FD_TRACE_CLOSE:
+        to_remove.pid = rec->pid;
+        to_remove.fd = rec->fd;
+        yella_lock_mutex(cache->guard);
+        if (sglib_name_node_delete_if_member(&cache->names, &to_remove, &removed))
+        {
+            destroy_name_node(removed);
+            --cache->count;
+        }
+        yella_unlock_mutex(cache->guard);
+        break;
+    case FD_TRACE_CLOSEFROM:
+        yella_lock_mutex(cache->guard);
+        remove_fds_from(cache, rec->pid, rec->fd);
+        yella_unlock_mutex(cache->guard);
+        break;
+    case FD_TRACE_EXIT:
+        yella_lock_mutex(cache->guard);
+        remove_fds_from(cache, rec->pid, INT32_MIN);
+        yella_unlock_mutex(cache->guard);
+        break;
+    }
+}
+
+void clear_fd_name_cache(fd_name_cache* cache)
+{
+    name_node* cur;
+
+    yella_lock_mutex(cache->guard);
+    /* The iterator reads nodes after returning them, so they are taken from the top */
+    while (cache->names != NULL)
+    {
+        cur = cache->names;
+        sglib_name_node_delete(&cache->names, cur);
+        destroy_name_node(cur);
+    }
+    cache->count = 0;
+    ++cache->generation;
+    yella_unlock_mutex(cache->guard);
+}
+
+fd_name_cache* create_fd_name_cache(const event_source* const esrc, fd_name_resolver res, void* udata)
+{
+    fd_name_cache* result;
+
+    result = calloc(1, sizeof(fd_name_cache));
+    result->esrc = esrc;
+    result->resolver = res;
+    result->resolver_udata = udata;
+    result->guard = yella_create_mutex();
+    return result;
+}
+
+fd_trace_ring* create_fd_trace_ring(size_t capacity)
+{
+    fd_trace_ring* result;
+    size_t actual;
+
+    for (actual = 2; actual < capacity; actual *= 2);
+    result = calloc(1, sizeof(fd_trace_ring));
+    result->records = malloc(actual * sizeof(fd_trace_record));
+    result->mask = actual - 1;
+    atomic_init(&result->head, 0);
+    atomic_init(&result->tail, 0);
+    atomic_init(&result->consumer_waiting, false);
+    result->guard = yella_create_mutex();
+    result->cond = yella_create_condition_variable();
+    return result;
+}
+
+void destroy_fd_name_cache(fd_name_cache* cache)
+{
+    clear_fd_name_cache(cache);
+    yella_destroy_mutex(cache->guard);
+    free(cache);
+}
+
+void destroy_fd_trace_ring(fd_trace_ring* ring)
+{
+    yella_destroy_condition_variable(ring->cond);
+    yella_destroy_mutex(ring->guard);
+    free(ring->records);
+    free(ring);
+}
+
+size_t fd_name_cache_size(fd_name_cache* cache)
+{
+    size_t result;
+
+    yella_lock_mutex(cache->guard);
+    result = cache->count;
+    yella_unlock_mutex(cache->guard);
+    return result;
+}
+
+size_t fd_trace_ring_size(const fd_trace_ring* const ring)
+{
+    return atomic_load_explicit(&((fd_trace_ring*)ring)->tail, memory_order_acquire) -
+        atomic_load_explicit(&((fd_trace_ring*)ring)->head, memory_order_acquire);
+}
+
+void get_fd_name_cache_stats(fd_name_cache* cache, fd_name_cache_stats* stats)
+{
+    yella_lock_mutex(cache->guard);
+    *stats = cache->stats;
+    yella_unlock_mutex(cache->guard);
+}
+
+bool pop_fd_trace_ring(fd_trace_ring* ring, fd_trace_record* rec)
+{
+    size_t head;
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire))
+        return false;
+    *rec = ring->records[head & ring->mask];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+bool push_fd_trace_ring(fd_trace_ring* ring, const fd_trace_record* const rec)
+{
+    size_t tail;
+
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) > ring->mask)
+        return false;
+    ring->records[tail & ring->mask] = *rec;
+    /* Sequentially consistent, so that either the consumer sees the new
+     * tail before sleeping, or the producer sees that it is waiting */
+    atomic_store(&ring->tail, tail + 1);
+    if (atomic_load(&ring->consumer_waiting))
+    {
+        yella_lock_mutex(ring->guard);
+        yella_signal_condition_variable(ring->cond);
+        yella_unlock_mutex(ring->guard);
+    }
+    return true;
+}
+
+bool wait_for_fd_trace_ring(fd_trace_ring* ring, size_t milliseconds)
+{
+    if (fd_trace_ring_size(ring) > 0)
+        return true;
+    yella_lock_mutex(ring->guard);
+    atomic_store(&ring->consumer_waiting, true);
+    if (atomic_load(&ring->tail) == atomic_load_explicit(&ring->head, memory_order_relaxed))
+        yella_wait_milliseconds_for_condition_variable(ring->cond, ring->guard, milliseconds);
+    atomic_store(&ring->consumer_waiting, false);
+    yella_unlock_mutex(ring->guard);
+    return fd_trace_ring_size(ring) > 0;
+}
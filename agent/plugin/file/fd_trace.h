@@ -0,0 +1,77 @@
+#ifndef YELLA_FD_TRACE_H__
+#define YELLA_FD_TRACE_H__
+
+#include "plugin/file/event_batch.h"
+#include <stdint.h>
+
+/* The bookkeeping behind an event source that traces file descriptors,
+ * as the FreeBSD one does with DTrace. It is kept apart from DTrace, so
+ * that a captured trace can be replayed through it anywhere. */
+
+typedef enum
+{
+    FD_TRACE_WRITE,
+    FD_TRACE_CLOSE,
+    FD_TRACE_CLOSEFROM,
+    FD_TRACE_EXIT
+} fd_trace_kind;
+
+/* One line of the trace, parsed. The fd of an exit is unused, and that
+ * of a closefrom is the lowest one closed. */
+typedef struct fd_trace_record
+{
+    int32_t pid;
+    int32_t fd;
+    fd_trace_kind kind;
+} fd_trace_record;
+
+/* Possibilities are:
+ * "write:<pid>,<fd>"
+ * "close:<pid>,<fd>"
+ * "closefrom:<pid>,<fd>"
+ * "exit:<pid>"
+ */
+YELLA_PRIV_EXPORT bool parse_fd_trace_record(const char* const line, fd_trace_record* rec);
+
+/* A queue of records between exactly one producer and one consumer.
+ * Pushing and popping take no locks. */
+typedef struct fd_trace_ring fd_trace_ring;
+
+/* The capacity is rounded up to a power of two */
+YELLA_PRIV_EXPORT fd_trace_ring* create_fd_trace_ring(size_t capacity);
+YELLA_PRIV_EXPORT void destroy_fd_trace_ring(fd_trace_ring* ring);
+YELLA_PRIV_EXPORT size_t fd_trace_ring_size(const fd_trace_ring* const ring);
+/* Only the consumer may pop. Returns false when the ring is empty. */
+YELLA_PRIV_EXPORT bool pop_fd_trace_ring(fd_trace_ring* ring, fd_trace_record* rec);
+/* Only the producer may push. Returns false when the ring is full. */
+YELLA_PRIV_EXPORT bool push_fd_trace_ring(fd_trace_ring* ring, const fd_trace_record* const rec);
+/* Only the consumer may wait. Returns false if the ring is still empty
+ * after the time has passed. */
+YELLA_PRIV_EXPORT bool wait_for_fd_trace_ring(fd_trace_ring* ring, size_t milliseconds);
+
+/* Finds the name of the file open as fd in pid, or returns NULL. The
+ * result is freed by the caller. */
+typedef UChar* (*fd_name_resolver)(int32_t pid, int32_t fd, void* udata);
+
+/* Remembers the name of each (pid, fd) written, until it is closed or
+ * its process exits, so that the resolver runs once per open file. */
+typedef struct fd_name_cache fd_name_cache;
+
+typedef struct fd_name_cache_stats
+{
+    /* Writes whose name was remembered */
+    uint64_t hits;
+    /* Writes that had to call the resolver */
+    uint64_t misses;
+} fd_name_cache_stats;
+
+/* Writes to names that match a spec are added to the batch */
+YELLA_PRIV_EXPORT void apply_fd_trace_record(fd_name_cache* cache, const fd_trace_record* const rec, event_batch* batch);
+/* Whether a name is of interest depends on the specs, so this is called when they change */
+YELLA_PRIV_EXPORT void clear_fd_name_cache(fd_name_cache* cache);
+YELLA_PRIV_EXPORT fd_name_cache* create_fd_name_cache(const event_source* const esrc, fd_name_resolver res, void* udata);
+YELLA_PRIV_EXPORT void destroy_fd_name_cache(fd_name_cache* cache);
+YELLA_PRIV_EXPORT size_t fd_name_cache_size(fd_name_cache* cache);
+YELLA_PRIV_EXPORT void get_fd_name_cache_stats(fd_name_cache* cache, fd_name_cache_stats* stats);
+
+#endif
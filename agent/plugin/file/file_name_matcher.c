@@ -1,104 +1,641 @@
 #include "plugin/file/file_name_matcher.h"
 #include "common/file.h"
 #include <unicode/ustring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
 
-static bool file_name_matches_impl(const UChar *name, const UChar *pattern)
+/* Words of state set kept on the stack while matching, which covers
+ * patterns of up to 255 pieces without allocating */
+#define STACK_STATE_WORDS 4
+#define STATE_WORD_BITS 64
+/* Characters below this have a mask of their own */
+#define MASKED_CHAR_COUNT 128
+
+/* Pieces of a pattern are matched as follows. A character matches itself.
+ * A ? matches any one character but a separator, a * any run of characters
+ * without a separator, and a ** any run of characters at all. A ** that is
+ * followed by a separator is preceded by a skip, which lets it match no
+ * directories at all by skipping both. */
+typedef enum
+{
+    MASK_ONE,
+    MASK_STAR,
+    MASK_STAR_STAR,
+    /* Both kinds of star, which may match nothing */
+    MASK_ANY_STAR,
+    MASK_SKIP,
+    MASK_CHAR
+} mask_type;
+
+typedef struct wide_char
+{
+    size_t state;
+    UChar ch;
+} wide_char;
+
+/* The pattern is compiled into a nondeterministic automaton with one
+ * state per piece, plus the accepting state. Each piece type has a mask
+ * of the states holding it, and so does each character below
+ * MASKED_CHAR_COUNT, so that all the live states advance over a character
+ * of the name together in a few word operations. Matching never
+ * backtracks and takes time linear in the length of the name. */
+struct file_name_pattern
+{
+    size_t count;
+    size_t words;
+    uint64_t* masks;
+    /* Characters of the pattern that have no mask */
+    wide_char* wide;
+    size_t wide_count;
+    /* The characters before the first wildcard are compared directly,
+     * and the automaton starts after them */
+    UChar* prefix;
+    size_t prefix_len;
+    /* Whether a skip may lead straight to another skip, which happens
+     * when one ** and its separator directly follow another */
+    bool chained_skips;
+};
+
+/* A set of patterns is first scanned for the longest literal of each
+ * pattern, all at once with an Aho-Corasick automaton, since no name can
+ * match a pattern without containing its literal. Only the patterns whose
+ * literal turns up, or that have none, are then matched in full. */
+struct file_name_pattern_set
+{
+    /* Of file_name_pattern */
+    yella_ptr_vector* patterns;
+    size_t words;
+    /* Patterns without a literal, which are always matched in full */
+    uint64_t* always;
+    /* The transitions of the automaton are indexed by node and column.
+     * Only characters found in the literals have columns. Column zero is
+     * for every other character and leads back to the root. */
+    uint32_t* transitions;
+    size_t columns;
+    uint8_t column_of[MASKED_CHAR_COUNT];
+    /* All characters at or above MASKED_CHAR_COUNT share this column,
+     * which can only add candidates. It is zero if no literal has one. */
+    uint8_t wide_column;
+    /* For each node, the patterns whose literal ends there */
+    uint64_t* outputs;
+};
+
+static uint64_t* pattern_mask(const file_name_pattern* const fnp, size_t mask)
+{
+    return fnp->masks + mask * fnp->words;
+}
+
+static void set_state(uint64_t* states, size_t st)
 {
-    UChar p_ch;
-    bool match_slash;
-    UChar n_ch;
-    const UChar* prev_p;
-    const UChar* slash;
+    states[st / STATE_WORD_BITS] |= (uint64_t)1 << (st % STATE_WORD_BITS);
+}
+
+static bool state_is_set(const uint64_t* states, size_t st)
+{
+    return (states[st / STATE_WORD_BITS] & ((uint64_t)1 << (st % STATE_WORD_BITS))) != 0;
+}
+
+/* Makes live the states shift past every live state in mask */
+static bool or_shifted_states(uint64_t* states, const uint64_t* mask, size_t words, unsigned shift)
+{
+    size_t w;
+    uint64_t bits;
+    uint64_t added;
+    uint64_t carry;
+    bool changed;
 
-    for ( ; (p_ch = *pattern) != 0; name++, pattern++)
+    carry = 0;
+    changed = false;
+    for (w = 0; w < words; w++)
     {
-        if ((n_ch = *name) == 0 && p_ch != u'*')
-            return false;
-        switch (p_ch)
+        bits = states[w] & mask[w];
+        added = (bits << shift) | carry;
+        carry = bits >> (STATE_WORD_BITS - shift);
+        if ((states[w] | added) != states[w])
         {
-        case u'\\':
-            p_ch = *++pattern;
-            /* fall through */
+            states[w] |= added;
+            changed = true;
+        }
+    }
+    return changed;
+}
 
-        default:
-            if (n_ch != p_ch)
-                return false;
-            continue;
+/* Stars may match nothing, so a live star makes the following state live,
+ * and a skip makes both the star and the state past its separator live.
+ * A star is never followed by a star or a skip, so one pass closes the
+ * set unless a skip can reach another skip. */
+static void close_states(const file_name_pattern* const fnp, uint64_t* states)
+{
+    bool changed;
 
-        case u'?':
-            if (n_ch == YELLA_DIR_SEP[0])
-                return false;
-            continue;
+    do
+    {
+        changed = or_shifted_states(states, pattern_mask(fnp, MASK_SKIP), fnp->words, 1);
+        changed |= or_shifted_states(states, pattern_mask(fnp, MASK_SKIP), fnp->words, 3);
+        or_shifted_states(states, pattern_mask(fnp, MASK_ANY_STAR), fnp->words, 1);
+    } while (fnp->chained_skips && changed);
+}
 
-        case u'*':
-            if (*++pattern == u'*')
+static bool advance_states(const file_name_pattern* const fnp,
+                           const uint64_t* cur,
+                           uint64_t* next,
+                           UChar ch)
+{
+    size_t w;
+    size_t i;
+    bool is_sep;
+    const uint64_t* chars;
+    uint64_t advancing;
+    uint64_t looping;
+    uint64_t moved;
+    uint64_t carry;
+    uint64_t any;
+
+    is_sep = ch == YELLA_DIR_SEP[0];
+    chars = (ch < MASKED_CHAR_COUNT) ? pattern_mask(fnp, MASK_CHAR + ch) : NULL;
+    carry = 0;
+    any = 0;
+    for (w = 0; w < fnp->words; w++)
+    {
+        advancing = (chars == NULL) ? 0 : chars[w];
+        looping = pattern_mask(fnp, MASK_STAR_STAR)[w];
+        if (!is_sep)
+        {
+            advancing |= pattern_mask(fnp, MASK_ONE)[w];
+            looping |= pattern_mask(fnp, MASK_STAR)[w];
+        }
+        moved = cur[w] & advancing;
+        next[w] = (moved << 1) | carry | (cur[w] & looping);
+        carry = moved >> (STATE_WORD_BITS - 1);
+        any |= next[w];
+    }
+    if (chars == NULL)
+    {
+        for (i = 0; i < fnp->wide_count; i++)
+        {
+            if (fnp->wide[i].ch == ch && state_is_set(cur, fnp->wide[i].state))
             {
-                prev_p = pattern - 2;
-                while (*++pattern == u'*') {}
-                if ((prev_p < pattern || *prev_p == YELLA_DIR_SEP[0]) &&
-                    (*pattern == 0 || *pattern == YELLA_DIR_SEP[0] || (*pattern == u'\\' && pattern[1] == YELLA_DIR_SEP[0])))
-                {
-                    if (*pattern == YELLA_DIR_SEP[0] && file_name_matches_impl(name, pattern + 1))
-                        return true;
-                    match_slash = true;
-                }
-                else
-                {
-                    match_slash = false;
-                }
+                set_state(next, fnp->wide[i].state + 1);
+                any = 1;
+            }
+        }
+    }
+    if (any == 0)
+        return false;
+    close_states(fnp, next);
+    return true;
+}
+
+/* The same as advancing and closing the states one character at a time,
+ * but for patterns short enough to keep all the states in one word */
+static bool single_word_matches(const file_name_pattern* const fnp, const UChar* name)
+{
+    uint64_t one;
+    uint64_t star;
+    uint64_t star_star;
+    uint64_t any_star;
+    uint64_t skip;
+    uint64_t states;
+    uint64_t next;
+    uint64_t prev;
+    size_t i;
+
+    one = *pattern_mask(fnp, MASK_ONE);
+    star = *pattern_mask(fnp, MASK_STAR);
+    star_star = *pattern_mask(fnp, MASK_STAR_STAR);
+    any_star = *pattern_mask(fnp, MASK_ANY_STAR);
+    skip = *pattern_mask(fnp, MASK_SKIP);
+    next = (uint64_t)1 << fnp->prefix_len;
+    for ( ; ; name++)
+    {
+        do
+        {
+            prev = next;
+            next |= ((next & skip) << 1) | ((next & skip) << 3);
+            next |= (next & any_star) << 1;
+        } while (fnp->chained_skips && next != prev);
+        states = next;
+        if (*name == 0)
+            break;
+        if (*name == YELLA_DIR_SEP[0])
+            next = ((states & *pattern_mask(fnp, MASK_CHAR + *name)) << 1) | (states & star_star);
+        else if (*name < MASKED_CHAR_COUNT)
+            next = ((states & (*pattern_mask(fnp, MASK_CHAR + *name) | one)) << 1) | (states & (star | star_star));
+        else
+            next = ((states & one) << 1) | (states & (star | star_star));
+        if (*name >= MASKED_CHAR_COUNT)
+        {
+            for (i = 0; i < fnp->wide_count; i++)
+            {
+                if (fnp->wide[i].ch == *name && state_is_set(&states, fnp->wide[i].state))
+                    set_state(&next, fnp->wide[i].state + 1);
+            }
+        }
+        if (next == 0)
+            return false;
+    }
+    return state_is_set(&states, fnp->count);
+}
+
+static size_t prefilter_column(const file_name_pattern_set* const set, UChar ch)
+{
+    return (ch < MASKED_CHAR_COUNT) ? set->column_of[ch] : set->wide_column;
+}
+
+/* Sets len to the length of the longest run of literal characters in the
+ * pattern and returns the run unescaped */
+static UChar* longest_literal(const UChar* const pattern, size_t* len)
+{
+    UChar* result;
+    UChar* run;
+    size_t run_len;
+    const UChar* cur;
+
+    result = malloc((u_strlen(pattern) + 1) * sizeof(UChar));
+    run = malloc((u_strlen(pattern) + 1) * sizeof(UChar));
+    *len = 0;
+    run_len = 0;
+    cur = pattern;
+    while (true)
+    {
+        if (*cur == u'\\' && cur[1] != 0)
+        {
+            run[run_len++] = cur[1];
+            cur += 2;
+        }
+        else if (*cur == 0 || *cur == u'*' || *cur == u'?' || *cur == u'\\')
+        {
+            if (run_len > *len)
+            {
+                memcpy(result, run, run_len * sizeof(UChar));
+                *len = run_len;
+            }
+            run_len = 0;
+            if (*cur == 0 || *cur == u'\\')
+                break;
+            /* The separator after a ** may be skipped, so it is not required */
+            if (cur[0] == u'*' && cur[1] == u'*')
+            {
+                while (*cur == u'*')
+                    ++cur;
+                if (*cur == YELLA_DIR_SEP[0])
+                    ++cur;
             }
             else
             {
-                match_slash = false;
+                ++cur;
             }
-            if (*pattern == 0)
+        }
+        else
+        {
+            run[run_len++] = *cur++;
+        }
+    }
+    free(run);
+    return result;
+}
+
+static void assign_prefilter_columns(file_name_pattern_set* set, UChar** literals, const size_t* lens, size_t count)
+{
+    size_t i;
+    size_t j;
+    UChar ch;
+
+    memset(set->column_of, 0, sizeof(set->column_of));
+    set->wide_column = 0;
+    set->columns = 1;
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < lens[i]; j++)
+        {
+            ch = literals[i][j];
+            if (ch < MASKED_CHAR_COUNT)
             {
-                if (!match_slash)
-                {
-                    if (u_strchr(name, YELLA_DIR_SEP[0]) != NULL)
-                        return false;
-                }
-                return true;
+                if (set->column_of[ch] == 0)
+                    set->column_of[ch] = set->columns++;
             }
-            else if (!match_slash && *pattern == YELLA_DIR_SEP[0])
+            else if (set->wide_column == 0)
             {
-                slash = u_strchr(name, YELLA_DIR_SEP[0]);
-                if (slash == NULL)
-                    return false;
-                name = slash;
-                break;
+                set->wide_column = set->columns++;
             }
-            while (true)
+        }
+    }
+}
+
+static void build_prefilter(file_name_pattern_set* set, UChar** literals, const size_t* lens, size_t count)
+{
+    size_t max_nodes;
+    size_t node_count;
+    size_t i;
+    size_t j;
+    size_t w;
+    size_t col;
+    uint32_t node;
+    uint32_t child;
+    uint32_t* fail;
+    uint32_t* queue;
+    size_t head;
+    size_t tail;
+
+    assign_prefilter_columns(set, literals, lens, count);
+    max_nodes = 1;
+    for (i = 0; i < count; i++)
+        max_nodes += lens[i];
+    /* While the trie is built, a transition of zero means there is no child,
+     * since nothing leads back to the root */
+    set->transitions = calloc(max_nodes * set->columns, sizeof(uint32_t));
+    set->outputs = calloc(max_nodes * set->words, sizeof(uint64_t));
+    node_count = 1;
+    for (i = 0; i < count; i++)
+    {
+        if (lens[i] == 0)
+            continue;
+        node = 0;
+        for (j = 0; j < lens[i]; j++)
+        {
+            col = prefilter_column(set, literals[i][j]);
+            if (set->transitions[node * set->columns + col] == 0)
+                set->transitions[node * set->columns + col] = node_count++;
+            node = set->transitions[node * set->columns + col];
+        }
+        set_state(set->outputs + node * set->words, i);
+    }
+    /* Breadth first, fill in the failure transitions and collect the
+     * outputs of the suffixes of each node */
+    fail = calloc(node_count, sizeof(uint32_t));
+    queue = malloc(node_count * sizeof(uint32_t));
+    head = 0;
+    tail = 0;
+    for (col = 0; col < set->columns; col++)
+    {
+        child = set->transitions[col];
+        if (child != 0)
+            queue[tail++] = child;
+    }
+    while (head < tail)
+    {
+        node = queue[head++];
+        for (w = 0; w < set->words; w++)
+            set->outputs[node * set->words + w] |= set->outputs[fail[node] * set->words + w];
+        for (col = 0; col < set->columns; col++)
+        {
+            child = set->transitions[node * set->columns + col];
+            if (child == 0)
+            {
+                set->transitions[node * set->columns + col] = set->transitions[fail[node] * set->columns + col];
+            }
+            else
             {
-                if (n_ch == 0)
-                    break;
-                if (u_strchr(u"*?\\", *pattern) == NULL)
+                fail[child] = set->transitions[fail[node] * set->columns + col];
+                queue[tail++] = child;
+            }
+        }
+    }
+    free(queue);
+    free(fail);
+}
+
+static void add_char_piece(file_name_pattern* fnp, size_t state, UChar ch)
+{
+    if (state == fnp->prefix_len)
+        fnp->prefix[fnp->prefix_len++] = ch;
+    if (ch < MASKED_CHAR_COUNT)
+    {
+        set_state(pattern_mask(fnp, MASK_CHAR + ch), state);
+    }
+    else
+    {
+        fnp->wide[fnp->wide_count].state = state;
+        fnp->wide[fnp->wide_count].ch = ch;
+        ++fnp->wide_count;
+    }
+}
+
+file_name_pattern* compile_file_name_pattern(const UChar* const pattern)
+{
+    file_name_pattern* result;
+    const UChar* cur;
+    const UChar* after;
+    size_t len;
+
+    result = malloc(sizeof(file_name_pattern));
+    len = u_strlen(pattern);
+    /* No pattern compiles to more pieces than it has characters */
+    result->words = len / STATE_WORD_BITS + 1;
+    result->masks = calloc((MASK_CHAR + MASKED_CHAR_COUNT) * result->words, sizeof(uint64_t));
+    result->wide = malloc(MAX(len, 1) * sizeof(wide_char));
+    result->wide_count = 0;
+    result->prefix = malloc((len + 1) * sizeof(UChar));
+    result->prefix_len = 0;
+    result->chained_skips = false;
+    result->count = 0;
+    cur = pattern;
+    while (*cur != 0)
+    {
+        switch (*cur)
+        {
+        case u'\\':
+            /* A trailing backslash is a piece in no mask, so nothing gets past it */
+            if (cur[1] != 0)
+                add_char_piece(result, result->count, cur[1]);
+            cur += (cur[1] == 0) ? 1 : 2;
+            break;
+        case u'?':
+            set_state(pattern_mask(result, MASK_ONE), result->count);
+            ++cur;
+            break;
+        case u'*':
+            for (after = cur; *after == u'*'; after++) {}
+            /* A run of stars only crosses directories when it
+             * ends the pattern or is followed by a separator */
+            if (after - cur > 1 &&
+                (*after == 0 || *after == YELLA_DIR_SEP[0] || (*after == u'\\' && after[1] == YELLA_DIR_SEP[0])))
+            {
+                if (*after == YELLA_DIR_SEP[0])
                 {
-                    p_ch = *pattern;
-                    while ((n_ch = *name) != 0 && (match_slash || n_ch != YELLA_DIR_SEP[0]))
-                    {
-                        if (n_ch == p_ch)
-                            break;
-                        name++;
-                    }
-                    if (n_ch != p_ch)
-                        return false;
+                    if (result->count >= 3 && state_is_set(pattern_mask(result, MASK_SKIP), result->count - 3))
+                        result->chained_skips = true;
+                    set_state(pattern_mask(result, MASK_SKIP), result->count++);
                 }
-                if (file_name_matches_impl(name, pattern))
-                    return true;
-                else if (!match_slash && n_ch == YELLA_DIR_SEP[0])
-                    return false;
-                n_ch = *++name;
+                set_state(pattern_mask(result, MASK_STAR_STAR), result->count);
             }
-            return false;
+            else
+            {
+                set_state(pattern_mask(result, MASK_STAR), result->count);
+            }
+            set_state(pattern_mask(result, MASK_ANY_STAR), result->count);
+            cur = after;
+            break;
+        default:
+            add_char_piece(result, result->count, *cur);
+            ++cur;
+            break;
         }
+        ++result->count;
+    }
+    result->prefix[result->prefix_len] = 0;
+    return result;
+}
+
+file_name_pattern_set* compile_file_name_pattern_set(const yella_ptr_vector* const patterns)
+{
+    file_name_pattern_set* result;
+    size_t count;
+    UChar** literals;
+    size_t* lens;
+    size_t i;
+    bool any_literal;
+
+    result = calloc(1, sizeof(file_name_pattern_set));
+    result->patterns = compile_file_name_patterns(patterns);
+    count = yella_ptr_vector_size(patterns);
+    result->words = count / STATE_WORD_BITS + 1;
+    result->always = calloc(result->words, sizeof(uint64_t));
+    literals = malloc(MAX(count, 1) * sizeof(UChar*));
+    lens = malloc(MAX(count, 1) * sizeof(size_t));
+    any_literal = false;
+    for (i = 0; i < count; i++)
+    {
+        literals[i] = longest_literal(yella_ptr_vector_at(patterns, i), &lens[i]);
+        if (lens[i] == 0)
+            set_state(result->always, i);
+        else
+            any_literal = true;
     }
-    return *name == 0;
+    if (any_literal)
+        build_prefilter(result, literals, lens, count);
+    for (i = 0; i < count; i++)
+        free(literals[i]);
+    free(lens);
+    free(literals);
+    return result;
+}
+
+yella_ptr_vector* compile_file_name_patterns(const yella_ptr_vector* const patterns)
+{
+    yella_ptr_vector* result;
+    size_t i;
+
+    result = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(result, file_name_pattern_destructor, NULL);
+    for (i = 0; i < yella_ptr_vector_size(patterns); i++)
+        yella_push_back_ptr_vector(result, compile_file_name_pattern(yella_ptr_vector_at(patterns, i)));
+    return result;
+}
+
+void destroy_file_name_pattern(file_name_pattern* fnp)
+{
+    free(fnp->prefix);
+    free(fnp->wide);
+    free(fnp->masks);
+    free(fnp);
+}
+
+void destroy_file_name_pattern_set(file_name_pattern_set* set)
+{
+    yella_destroy_ptr_vector(set->patterns);
+    free(set->always);
+    free(set->transitions);
+    free(set->outputs);
+    free(set);
 }
 
 bool file_name_matches(const UChar* name, const UChar* pattern)
 {
-    return file_name_matches_impl(name, pattern);
+    file_name_pattern* fnp;
+    bool result;
+
+    fnp = compile_file_name_pattern(pattern);
+    result = file_name_pattern_matches(fnp, name);
+    destroy_file_name_pattern(fnp);
+    return result;
+}
+
+void file_name_pattern_destructor(void* fnp, void* udata)
+{
+    destroy_file_name_pattern(fnp);
+}
+
+bool file_name_pattern_matches(const file_name_pattern* const fnp, const UChar* name)
+{
+    uint64_t stack_states[2 * STACK_STATE_WORDS];
+    uint64_t* heap_states;
+    uint64_t* cur;
+    uint64_t* next;
+    uint64_t* tmp;
+    bool result;
+
+    if (u_strncmp(name, fnp->prefix, fnp->prefix_len) != 0)
+        return false;
+    name += fnp->prefix_len;
+    if (fnp->prefix_len == fnp->count)
+        return *name == 0;
+    if (fnp->words == 1)
+        return single_word_matches(fnp, name);
+    heap_states = (fnp->words > STACK_STATE_WORDS) ? malloc(2 * fnp->words * sizeof(uint64_t)) : NULL;
+    cur = (heap_states == NULL) ? stack_states : heap_states;
+    next = cur + fnp->words;
+    memset(cur, 0, fnp->words * sizeof(uint64_t));
+    set_state(cur, fnp->prefix_len);
+    close_states(fnp, cur);
+    result = true;
+    for ( ; *name != 0; name++)
+    {
+        if (!advance_states(fnp, cur, next, *name))
+        {
+            result = false;
+            break;
+        }
+        tmp = cur;
+        cur = next;
+        next = tmp;
+    }
+    if (result)
+        result = state_is_set(cur, fnp->count);
+    free(heap_states);
+    return result;
+}
+
+size_t file_name_pattern_set_first_match(const file_name_pattern_set* const set, const UChar* const name)
+{
+    uint64_t stack_candidates[STACK_STATE_WORDS];
+    uint64_t* heap_candidates;
+    uint64_t* candidates;
+    const uint64_t* out;
+    const UChar* cur;
+    uint32_t node;
+    size_t w;
+    size_t i;
+
+    if (yella_ptr_vector_size(set->patterns) == 0)
+        return 0;
+    heap_candidates = (set->words > STACK_STATE_WORDS) ? malloc(set->words * sizeof(uint64_t)) : NULL;
+    candidates = (heap_candidates == NULL) ? stack_candidates : heap_candidates;
+    memcpy(candidates, set->always, set->words * sizeof(uint64_t));
+    if (set->transitions != NULL)
+    {
+        node = 0;
+        for (cur = name; *cur != 0; cur++)
+        {
+            node = set->transitions[node * set->columns + prefilter_column(set, *cur)];
+            out = set->outputs + node * set->words;
+            for (w = 0; w < set->words; w++)
+                candidates[w] |= out[w];
+        }
+    }
+    for (i = 0; i < yella_ptr_vector_size(set->patterns); i++)
+    {
+        if (state_is_set(candidates, i) && file_name_pattern_matches(yella_ptr_vector_at(set->patterns, i), name))
+            break;
+    }
+    free(heap_candidates);
+    return i;
+}
+
+bool file_name_pattern_set_matches(const file_name_pattern_set* const set, const UChar* const name)
+{
+    return file_name_pattern_set_first_match(set, name) < yella_ptr_vector_size(set->patterns);
 }
 
 const UChar* first_unescaped_special_char(const UChar* const pattern)
@@ -2,10 +2,34 @@
 #define YELLA_FILE_NAME_MATCHER_H__
 
 #include "common/uds.h"
+#include "common/ptr_vector.h"
 #include <unicode/utypes.h>
 #include <stdbool.h>
 
+/* A compiled pattern is immutable, so it may be shared between threads */
+typedef struct file_name_pattern file_name_pattern;
+/* Patterns compiled together, to be checked all at once. A name is scanned
+ * in one pass for the literal text of every pattern, and only the patterns
+ * whose literal text it holds are matched in full. Also immutable. */
+typedef struct file_name_pattern_set file_name_pattern_set;
+
+YELLA_PRIV_EXPORT file_name_pattern* compile_file_name_pattern(const UChar* const pattern);
+/* The patterns are a vector of uds */
+YELLA_PRIV_EXPORT file_name_pattern_set* compile_file_name_pattern_set(const yella_ptr_vector* const patterns);
+/* Returns a vector of file_name_pattern compiled from a vector of uds */
+YELLA_PRIV_EXPORT yella_ptr_vector* compile_file_name_patterns(const yella_ptr_vector* const patterns);
+YELLA_PRIV_EXPORT void destroy_file_name_pattern(file_name_pattern* fnp);
+YELLA_PRIV_EXPORT void destroy_file_name_pattern_set(file_name_pattern_set* set);
+/* This compiles the pattern on every call. Prefer a compiled pattern
+ * when matching more than once. */
 YELLA_PRIV_EXPORT bool file_name_matches(const UChar* name, const UChar* pattern);
+YELLA_PRIV_EXPORT void file_name_pattern_destructor(void* fnp, void* udata);
+YELLA_PRIV_EXPORT bool file_name_pattern_matches(const file_name_pattern* const fnp, const UChar* name);
+/* Returns the index of the first pattern in the set that matches, in the
+ * order they were compiled, or the number of patterns if none does */
+YELLA_PRIV_EXPORT size_t file_name_pattern_set_first_match(const file_name_pattern_set* const set, const UChar* const name);
+/* Returns whether any pattern in the set matches */
+YELLA_PRIV_EXPORT bool file_name_pattern_set_matches(const file_name_pattern_set* const set, const UChar* const name);
 YELLA_PRIV_EXPORT const UChar* first_unescaped_special_char(const UChar* const pattern);
 YELLA_PRIV_EXPORT uds unescape_pattern(const UChar* const pattern);
 
@@ -9,7 +9,9 @@
 #include "common/compression.h"
 #include "plugin/file/job_queue.h"
 #include "plugin/file/event_source.h"
+#include "plugin/file/event_coalescer.h"
 #include "plugin/file/state_db_pool.h"
+#include "plugin/file/hash_cache.h"
 #include "plugin/file/accumulator.h"
 #undef flatbuffers_identifier
 #include "file_reader.h"
@@ -28,11 +30,20 @@ typedef struct config_node
     yella_ptr_vector* excludes;
     attribute_type* attr_types;
     size_t attr_type_count;
+    bool cache_neutral_reads;
     char color;
     struct config_node* left;
     struct config_node* right;
 } config_node;
 
+/* A rescan queued after lost events that has not begun to run */
+typedef struct pending_rescan
+{
+    struct file_plugin* fplg;
+    uds config_name;
+    uds dir;
+} pending_rescan;
+
 typedef struct file_plugin
 {
     yella_plugin* desc;
@@ -42,8 +53,14 @@ typedef struct file_plugin
     job_queue* jq;
     config_node* configs;
     event_source* esrc;
+    event_coalescer* coalescer;
     state_db_pool* db_pool;
+    hash_cache* hcache;
     accumulator* acc;
+    /* These are guarded by guard */
+    yella_ptr_vector* pending_rescans;
+    uint64_t rescans_queued;
+    uint64_t rescans_coalesced;
 } file_plugin;
 
 #define CONFIG_MAP_COMPARATOR(lhs, rhs) (u_strcmp(lhs->name, rhs->name))
@@ -64,6 +81,16 @@ static void destroy_config_node(config_node* cn)
     }
 }
 
+static void pending_rescan_destructor(void* elem, void* udata)
+{
+    pending_rescan* pr;
+
+    pr = elem;
+    udsfree(pr->config_name);
+    udsfree(pr->dir);
+    free(pr);
+}
+
 static void job_queue_empty(void* udata)
 {
     file_plugin* fplg;
@@ -73,62 +100,194 @@ static void job_queue_empty(void* udata)
     CHUCHO_C_INFO(fplg->lgr, "The job queue has emptied, so the event source has been resumed.");
 }
 
-static void event_received(const UChar* const config_name, const UChar* const fname, void* udata)
+static job* create_config_job(file_plugin* fplg, const config_node* const cfg)
+{
+    job* result;
+
+    result = create_job(cfg->name, cfg->recipient, fplg->acc);
+    result->attr_type_count = cfg->attr_type_count;
+    result->attr_types = malloc(sizeof(attribute_type) * result->attr_type_count);
+    memcpy(result->attr_types, cfg->attr_types, sizeof(attribute_type) * result->attr_type_count);
+    if (cfg->cache_neutral_reads)
+        result->read_strategy = YELLA_READ_STRATEGY_CACHE_NEUTRAL;
+    return result;
+}
+
+/* Files become jobs of their own, while dirty directories and configs
+ * become scans of the config, scoped to the directory when there is one */
+static void events_coalesced(const coalesced_event* const events, size_t count, void* udata)
 {
     file_plugin* fplg;
     config_node to_find;
     config_node* found;
+    job** jobs;
     job* jb;
+    size_t job_count;
+    size_t i;
     char* cutf8;
     char* futf8;
     uint64_t max_jobs;
-    size_t job_count;
+    size_t queue_size;
 
     fplg = (file_plugin*)udata;
-    to_find.name = (uds)config_name;
+    jobs = malloc(count * sizeof(job*));
+    job_count = 0;
     yella_read_lock_reader_writer_lock(fplg->config_guard);
-    found = sglib_config_node_find_member(fplg->configs, &to_find);
-    if (found != NULL)
+    for (i = 0; i < count; i++)
+    {
+        to_find.name = (uds)events[i].config_name;
+        found = sglib_config_node_find_member(fplg->configs, &to_find);
+        if (found != NULL)
+        {
+            jb = create_config_job(fplg, found);
+            if (events[i].kind == COALESCED_FILE)
+            {
+                yella_push_back_ptr_vector(jb->includes, udsnew(events[i].name));
+            }
+            else
+            {
+                yella_assign_ptr_vector(jb->includes, found->includes);
+                yella_assign_ptr_vector(jb->excludes, found->excludes);
+                jb->is_scan = true;
+                if (events[i].kind == COALESCED_DIRECTORY)
+                    jb->scope = udsnew(events[i].name);
+            }
+            jobs[job_count++] = jb;
+            if (chucho_logger_permits(fplg->lgr, CHUCHO_TRACE))
+            {
+                cutf8 = yella_to_utf8(events[i].config_name);
+                futf8 = (events[i].name == NULL) ? NULL : yella_to_utf8(events[i].name);
+                if (events[i].kind == COALESCED_FILE)
+                    CHUCHO_C_TRACE(fplg->lgr, "Submitting job for config '%s': '%s'", cutf8, futf8);
+                else if (events[i].kind == COALESCED_DIRECTORY)
+                    CHUCHO_C_TRACE(fplg->lgr, "Submitting rescan for config '%s' of directory '%s'", cutf8, futf8);
+                else
+                    CHUCHO_C_TRACE(fplg->lgr, "Submitting rescan of config '%s'", cutf8);
+                free(futf8);
+                free(cutf8);
+            }
+        }
+        else if (chucho_logger_permits(fplg->lgr, CHUCHO_WARN))
+        {
+            cutf8 = yella_to_utf8(events[i].config_name);
+            CHUCHO_C_WARN(fplg->lgr, "Unable to find config named '%s'", cutf8);
+            free(cutf8);
+        }
+    }
+    yella_unlock_reader_writer_lock(fplg->config_guard);
+    if (job_count > 0)
     {
-        jb = create_job(config_name, found->recipient, fplg->acc);
-        yella_push_back_ptr_vector(jb->includes, udsnew(fname));
-        jb->attr_type_count = found->attr_type_count;
-        jb->attr_types = malloc(sizeof(attribute_type) * jb->attr_type_count);
-        memcpy(jb->attr_types, found->attr_types, sizeof(attribute_type) * jb->attr_type_count);
-        yella_unlock_reader_writer_lock(fplg->config_guard);
         max_jobs = *yella_settings_get_uint(u"file", u"max-queued-jobs");
-        job_count = push_job_queue(fplg->jq, jb);
-        if (job_count >= max_jobs)
+        queue_size = push_job_queue_batch(fplg->jq, jobs, job_count);
+        if (queue_size >= max_jobs)
         {
 //            pause_event_source(fplg->esrc);
             /* This callback is removed automatically once it is called */
             set_job_queue_empty_callback(fplg->jq, job_queue_empty, fplg);
             CHUCHO_C_WARN(fplg->lgr,
                           "The job queue is full (%zu >= %" PRIu64 "), so the event source is paused until the queue empties.",
-                          job_count,
+                          queue_size,
                           max_jobs);
         }
-        if (chucho_logger_permits(fplg->lgr, CHUCHO_TRACE))
+    }
+    free(jobs);
+}
+
+static void event_received(const event_source_event* const events, size_t count, void* udata)
+{
+    add_to_event_coalescer(((file_plugin*)udata)->coalescer, events, count);
+}
+
+static void rescan_started(const job* const j, void* udata)
+{
+    pending_rescan* pr;
+    file_plugin* fplg;
+    size_t i;
+
+    pr = udata;
+    fplg = pr->fplg;
+    yella_lock_mutex(fplg->guard);
+    for (i = 0; i < yella_ptr_vector_size(fplg->pending_rescans); i++)
+    {
+        if (yella_ptr_vector_at(fplg->pending_rescans, i) == pr)
         {
-            cutf8 = yella_to_utf8(config_name);
-            futf8 = yella_to_utf8(fname);
-            CHUCHO_C_TRACE(fplg->lgr, "Submitted job for config '%s': '%s'", cutf8, futf8);
-            free(futf8);
-            free(cutf8);
+            yella_erase_ptr_vector_at(fplg->pending_rescans, i);
+            break;
         }
     }
-    else
+    yella_unlock_mutex(fplg->guard);
+}
+
+/* Only the includes below the directory are rescanned, and a rescan that
+ * is still waiting in the queue covers any later overflow in the same place */
+static void overflow_received(const UChar* const config_name, const UChar* const dir, void* udata)
+{
+    file_plugin* fplg;
+    config_node to_find;
+    config_node* found;
+    pending_rescan* pr;
+    job* jb;
+    size_t i;
+    size_t dir_len;
+    const UChar* cur;
+    char* cutf8;
+    char* dutf8;
+
+    fplg = (file_plugin*)udata;
+    to_find.name = (uds)config_name;
+    yella_read_lock_reader_writer_lock(fplg->config_guard);
+    found = sglib_config_node_find_member(fplg->configs, &to_find);
+    if (found == NULL)
     {
         yella_unlock_reader_writer_lock(fplg->config_guard);
-        if (chucho_logger_permits(fplg->lgr, CHUCHO_WARN))
+        return;
+    }
+    yella_lock_mutex(fplg->guard);
+    for (i = 0; i < yella_ptr_vector_size(fplg->pending_rescans); i++)
+    {
+        pr = yella_ptr_vector_at(fplg->pending_rescans, i);
+        if (u_strcmp(pr->config_name, config_name) == 0 && u_strcmp(pr->dir, dir) == 0)
+            break;
+    }
+    if (i < yella_ptr_vector_size(fplg->pending_rescans))
+    {
+        ++fplg->rescans_coalesced;
+        yella_unlock_mutex(fplg->guard);
+        yella_unlock_reader_writer_lock(fplg->config_guard);
+        return;
+    }
+    pr = malloc(sizeof(pending_rescan));
+    pr->fplg = fplg;
+    pr->config_name = udsnew(config_name);
+    pr->dir = udsnew(dir);
+    yella_push_back_ptr_vector(fplg->pending_rescans, pr);
+    ++fplg->rescans_queued;
+    yella_unlock_mutex(fplg->guard);
+    jb = create_config_job(fplg, found);
+    dir_len = u_strlen(dir);
+    for (i = 0; i < yella_ptr_vector_size(found->includes); i++)
+    {
+        cur = yella_ptr_vector_at(found->includes, i);
+        if (u_strncmp(cur, dir, dir_len) == 0 &&
+            (cur[dir_len] == YELLA_DIR_SEP[0] || (dir_len > 0 && dir[dir_len - 1] == YELLA_DIR_SEP[0])))
         {
-            cutf8 = yella_to_utf8(config_name);
-            futf8 = yella_to_utf8(fname);
-            CHUCHO_C_WARN(fplg->lgr, "Unable to find config named '%s' for file '%s'", cutf8, futf8);
-            free(futf8);
-            free(cutf8);
+            yella_push_back_ptr_vector(jb->includes, udsnew(cur));
         }
     }
+    yella_assign_ptr_vector(jb->excludes, found->excludes);
+    jb->is_scan = true;
+    jb->started = rescan_started;
+    jb->started_udata = pr;
+    yella_unlock_reader_writer_lock(fplg->config_guard);
+    push_job_queue(fplg->jq, jb);
+    if (chucho_logger_permits(fplg->lgr, CHUCHO_WARN))
+    {
+        cutf8 = yella_to_utf8(config_name);
+        dutf8 = yella_to_utf8(dir);
+        CHUCHO_C_WARN(fplg->lgr, "Events were lost for config '%s', so '%s' will be rescanned", cutf8, dutf8);
+        free(dutf8);
+        free(cutf8);
+    }
 }
 
 static void load_configs(file_plugin* fplg)
@@ -194,6 +353,7 @@ static void load_configs(file_plugin* fplg)
                 cur->attr_types = malloc(cur->attr_type_count * sizeof(attribute_type));
                 for (j = 0; j < cur->attr_type_count; j++)
                     cur->attr_types[j] = fb_to_attribute_type(flatbuffers_uint16_vec_at(atps, j));
+                cur->cache_neutral_reads = yella_fb_file_config_cache_neutral_reads(cfg);
                 sglib_config_node_add(&fplg->configs, cur);
                 especs[i] = malloc(sizeof(event_source_spec));
                 especs[i]->name = udsdup(cur->name);
@@ -266,6 +426,7 @@ static void save_configs(const file_plugin* const fplg)
             yella_fb_file_config_attribute_types_push(&bld, &fb_attr_type);
         }
         yella_fb_file_config_attribute_types_add(&bld, yella_fb_file_config_attribute_types_end(&bld));
+        yella_fb_file_config_cache_neutral_reads_add(&bld, cur->cache_neutral_reads);
         yella_fb_file_configs_cfgs_push(&bld, yella_fb_file_config_end(&bld));
     }
     yella_fb_file_configs_cfgs_end(&bld);
@@ -479,6 +640,10 @@ static void install_config_node(file_plugin* fplg, config_node* cfg, bool is_emp
         jb->attr_type_count = cfg->attr_type_count;
         jb->attr_types = malloc(sizeof(attribute_type) * jb->attr_type_count);
         memcpy(jb->attr_types, cfg->attr_types, sizeof(attribute_type) * jb->attr_type_count);
+        jb->is_scan = true;
+        jb->counts_toward_full_hash = true;
+        if (cfg->cache_neutral_reads)
+            jb->read_strategy = YELLA_READ_STRATEGY_CACHE_NEUTRAL;
         push_job_queue(fplg->jq, jb);
         espec = malloc(sizeof(event_source_spec));
         espec->name = udsdup(cfg->name);
@@ -528,12 +693,34 @@ static yella_rc monitor_handler(const yella_parcel* const pcl, void* udata)
     cfg->recipient = udsdup(pcl->sender);
     process_includes_excludes(fplg, cfg, req, &is_empty);
     process_attributes(fplg, cfg, req);
+    cfg->cache_neutral_reads = yella_fb_file_monitor_request_cache_neutral_reads(req);
     if (actual_payload != pcl->payload)
         free(actual_payload);
     install_config_node(fplg, cfg, is_empty, act);
     return YELLA_NO_ERROR;
 }
 
+static hash_cache* create_file_hash_cache(void)
+{
+    uint64_t max_entries;
+    uds name;
+    hash_cache* result;
+
+    max_entries = *yella_settings_get_uint(u"file", u"hash-cache-max-entries");
+    if (max_entries == 0)
+        return NULL;
+    if (*yella_settings_get_uint(u"file", u"persist-hash-cache") == 0)
+        return create_hash_cache(max_entries, NULL);
+    name = udsnew(yella_settings_get_dir(u"file", u"data-dir"));
+    yella_ensure_dir_exists(name);
+    if (name[0] != 0 && name[u_strlen(name) - 1] != YELLA_DIR_SEP[0])
+        name = udscat(name, YELLA_DIR_SEP);
+    name = udscat(name, u"hash-cache.bin");
+    result = create_hash_cache(max_entries, name);
+    udsfree(name);
+    return result;
+}
+
 static void retrieve_file_settings(void)
 {
     uds data_dir;
@@ -545,7 +732,21 @@ static void retrieve_file_settings(void)
         /* This is only used in FreeBSD with DTrace { u"max-events-in-cache", YELLA_SETTING_VALUE_UINT }, */
         { u"fs-monitor-latency-seconds", YELLA_SETTING_VALUE_UINT },
         { u"send-latency-seconds", YELLA_SETTING_VALUE_UINT },
-        { u"max-queued-jobs", YELLA_SETTING_VALUE_UINT }
+        { u"max-queued-jobs", YELLA_SETTING_VALUE_UINT },
+        { u"full-hash-scan-interval", YELLA_SETTING_VALUE_UINT },
+        { u"hash-cache-max-entries", YELLA_SETTING_VALUE_UINT },
+        { u"persist-hash-cache", YELLA_SETTING_VALUE_UINT },
+        { u"chunk-hash-threads", YELLA_SETTING_VALUE_UINT },
+        { u"chunk-hash-trust-appends", YELLA_SETTING_VALUE_UINT },
+        { u"db-batch-max-rows", YELLA_SETTING_VALUE_UINT },
+        { u"db-batch-max-milliseconds", YELLA_SETTING_VALUE_UINT },
+        { u"db-tuning", YELLA_SETTING_VALUE_TEXT },
+        { u"db-cache-size", YELLA_SETTING_VALUE_BYTE_SIZE },
+        { u"db-mmap-size", YELLA_SETTING_VALUE_BYTE_SIZE },
+        { u"db-wal-size-limit", YELLA_SETTING_VALUE_BYTE_SIZE },
+        { u"db-checkpoint-seconds", YELLA_SETTING_VALUE_UINT },
+        { u"event-coalesce-milliseconds", YELLA_SETTING_VALUE_UINT },
+        { u"max-coalesced-names", YELLA_SETTING_VALUE_UINT }
     };
 
     data_dir = udscatprintf(udsempty(), u"%Sfile", yella_settings_get_dir(u"agent", u"data-dir"));
@@ -556,6 +757,28 @@ static void retrieve_file_settings(void)
     yella_settings_set_uint(u"file", u"fs-monitor-latency-seconds", 5);
     yella_settings_set_uint(u"file", u"send-latency-seconds", 15);
     yella_settings_set_uint(u"file", u"max-queued-jobs", 10000);
+    /* Every Nth scan ignores stored stamps and hashes everything. Zero means never. */
+    yella_settings_set_uint(u"file", u"full-hash-scan-interval", 10);
+    /* Zero entries turns off the hash cache, and zero persistence keeps it only in memory */
+    yella_settings_set_uint(u"file", u"hash-cache-max-entries", 100000);
+    yella_settings_set_uint(u"file", u"persist-hash-cache", 1);
+    yella_settings_set_uint(u"file", u"chunk-hash-threads", 4);
+    /* Non-zero rehashes only the new chunks of a grown file, which is only
+     * safe when the monitored files are never changed in place */
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 0);
+    /* State database writes are committed after this many rows or milliseconds, whichever comes first */
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 5000);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 2000);
+    /* "tuned" or "sqlite-default". The sizes and checkpoint interval only apply when tuned. */
+    yella_settings_set_text(u"file", u"db-tuning", u"tuned");
+    yella_settings_set_byte_size(u"file", u"db-cache-size", u"8MB");
+    yella_settings_set_byte_size(u"file", u"db-mmap-size", u"256MB");
+    yella_settings_set_byte_size(u"file", u"db-wal-size-limit", u"64MB");
+    yella_settings_set_uint(u"file", u"db-checkpoint-seconds", 300);
+    /* Events are gathered this long before becoming jobs. Past the maximum
+     * names, whole directories are rescanned instead. */
+    yella_settings_set_uint(u"file", u"event-coalesce-milliseconds", 250);
+    yella_settings_set_uint(u"file", u"max-coalesced-names", 100000);
 
     yella_retrieve_settings(u"file", descs, YELLA_ARRAY_SIZE(descs));
 }
@@ -575,10 +798,20 @@ YELLA_EXPORT yella_plugin* plugin_start(const yella_agent_api* api, void* agnt)
     yella_push_back_ptr_vector(fplg->desc->out_caps,
                                yella_create_plugin_out_cap(u"file.change", 1));
     fplg->db_pool = create_state_db_pool();
+    fplg->hcache = create_file_hash_cache();
     fplg->acc = create_accumulator(agnt, api);
-    fplg->jq = create_job_queue(fplg->db_pool);
+    fplg->jq = create_job_queue(fplg->db_pool, fplg->hcache);
     fplg->configs = NULL;
+    fplg->pending_rescans = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(fplg->pending_rescans, pending_rescan_destructor, NULL);
+    fplg->rescans_queued = 0;
+    fplg->rescans_coalesced = 0;
+    fplg->coalescer = create_event_coalescer(*yella_settings_get_uint(u"file", u"max-coalesced-names"),
+                                             *yella_settings_get_uint(u"file", u"event-coalesce-milliseconds"),
+                                             events_coalesced,
+                                             fplg);
     fplg->esrc = create_event_source(event_received, fplg);
+    set_event_source_overflow_callback(fplg->esrc, overflow_received);
     load_configs(fplg);
     return yella_copy_plugin(fplg->desc);
 }
@@ -603,6 +836,8 @@ YELLA_EXPORT yella_rc plugin_stop(void* udata)
 
     fplg = (file_plugin*)udata;
     destroy_event_source(fplg->esrc);
+    /* What is still held becomes jobs before the queue goes away */
+    destroy_event_coalescer(fplg->coalescer);
     for (cur = sglib_config_node_it_init(&itor, fplg->configs);
          cur != NULL;
          cur = sglib_config_node_it_next(&itor))
@@ -610,7 +845,14 @@ YELLA_EXPORT yella_rc plugin_stop(void* udata)
         destroy_config_node(cur);
     }
     destroy_job_queue(fplg->jq);
+    CHUCHO_C_INFO(fplg->lgr,
+                  "Overflow rescans: %" PRIu64 " queued, %" PRIu64 " coalesced",
+                  fplg->rescans_queued,
+                  fplg->rescans_coalesced);
+    yella_destroy_ptr_vector(fplg->pending_rescans);
     destroy_state_db_pool(fplg->db_pool);
+    if (fplg->hcache != NULL)
+        destroy_hash_cache(fplg->hcache);
     destroy_accumulator(fplg->acc);
     yella_destroy_plugin(fplg->desc);
     yella_destroy_mutex(fplg->guard);
@@ -0,0 +1,274 @@
+#include "plugin/file/hash_cache.h"
+#include "common/sglib.h"
+#include "common/thread.h"
+#include "common/text_util.h"
+#include "common/uds.h"
+#include <chucho/log.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+typedef struct hash_node
+{
+    uint32_t type;
+    file_stamp stmp;
+    uint8_t md_len;
+    uint8_t md[HASH_CACHE_MAX_DIGEST_SIZE];
+    char color;
+    struct hash_node* left;
+    struct hash_node* right;
+    /* Least recently used order */
+    struct hash_node* newer;
+    struct hash_node* older;
+} hash_node;
+
+struct hash_cache
+{
+    hash_node* nodes;
+    hash_node* newest;
+    hash_node* oldest;
+    size_t count;
+    size_t max_entries;
+    uds file_name;
+    yella_mutex* guard;
+    chucho_logger_t* lgr;
+};
+
+static const uint64_t HASH_CACHE_ID = UINT64_C(0x59454c4c41484331);
+
+static int compare_u64(uint64_t lhs, uint64_t rhs)
+{
+    return (lhs < rhs) ? -1 : ((lhs > rhs) ? 1 : 0);
+}
+
+static int compare_hash_nodes(const hash_node* const lhs, const hash_node* const rhs)
+{
+    int result;
+
+    result = compare_u64(lhs->type, rhs->type);
+    if (result == 0)
+        result = compare_u64(lhs->stmp.inode, rhs->stmp.inode);
+    if (result == 0)
+        result = compare_u64(lhs->stmp.device, rhs->stmp.device);
+    if (result == 0)
+        result = compare_u64(lhs->stmp.size, rhs->stmp.size);
+    if (result == 0)
+        result = compare_u64(lhs->stmp.modification_nanos, rhs->stmp.modification_nanos);
+    if (result == 0)
+        result = compare_u64(lhs->stmp.metadata_change_nanos, rhs->stmp.metadata_change_nanos);
+    return result;
+}
+
+#define HASH_NODE_COMPARATOR(lhs, rhs) (compare_hash_nodes(lhs, rhs))
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(hash_node, left, right, color, HASH_NODE_COMPARATOR);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(hash_node, left, right, color, HASH_NODE_COMPARATOR);
+
+static void unlink_lru(hash_cache* hc, hash_node* node)
+{
+    if (node->newer == NULL)
+        hc->newest = node->older;
+    else
+        node->newer->older = node->older;
+    if (node->older == NULL)
+        hc->oldest = node->newer;
+    else
+        node->older->newer = node->newer;
+    node->newer = NULL;
+    node->older = NULL;
+}
+
+static void link_lru_newest(hash_cache* hc, hash_node* node)
+{
+    node->older = hc->newest;
+    node->newer = NULL;
+    if (hc->newest != NULL)
+        hc->newest->newer = node;
+    hc->newest = node;
+    if (hc->oldest == NULL)
+        hc->oldest = node;
+}
+
+/* The guard must be held */
+static void put_locked(hash_cache* hc, uint32_t tp, const file_stamp* const stmp, const uint8_t* const md, size_t md_len)
+{
+    hash_node to_find;
+    hash_node* found;
+
+    to_find.type = tp;
+    to_find.stmp = *stmp;
+    found = sglib_hash_node_find_member(hc->nodes, &to_find);
+    if (found == NULL)
+    {
+        if (hc->count >= hc->max_entries)
+        {
+            found = hc->oldest;
+            unlink_lru(hc, found);
+            sglib_hash_node_delete(&hc->nodes, found);
+            --hc->count;
+        }
+        else
+        {
+            found = malloc(sizeof(hash_node));
+        }
+        found->type = tp;
+        found->stmp = *stmp;
+        sglib_hash_node_add(&hc->nodes, found);
+        ++hc->count;
+    }
+    else
+    {
+        unlink_lru(hc, found);
+    }
+    found->md_len = md_len;
+    memcpy(found->md, md, md_len);
+    link_lru_newest(hc, found);
+}
+
+static void load_hash_cache(hash_cache* hc)
+{
+    FILE* f;
+    char* utf8;
+    uint64_t id;
+    hash_node node;
+
+    utf8 = yella_to_utf8(hc->file_name);
+    f = fopen(utf8, "rb");
+    free(utf8);
+    if (f == NULL)
+        return;
+    if (fread(&id, 1, sizeof(id), f) == sizeof(id) && id == HASH_CACHE_ID)
+    {
+        /* Entries are stored from oldest to newest, so adding them in order restores the LRU order */
+        while (fread(&node.type, 1, sizeof(node.type), f) == sizeof(node.type) &&
+               fread(&node.stmp, 1, sizeof(node.stmp), f) == sizeof(node.stmp) &&
+               fread(&node.md_len, 1, sizeof(node.md_len), f) == sizeof(node.md_len) &&
+               node.md_len <= HASH_CACHE_MAX_DIGEST_SIZE &&
+               fread(node.md, 1, node.md_len, f) == node.md_len)
+        {
+            put_locked(hc, node.type, &node.stmp, node.md, node.md_len);
+        }
+    }
+    fclose(f);
+    CHUCHO_C_INFO(hc->lgr, "Loaded %zu entries into the hash cache", hc->count);
+}
+
+static void save_hash_cache(hash_cache* hc)
+{
+    FILE* f;
+    char* utf8;
+    hash_node* node;
+    bool ok;
+    int err;
+
+    utf8 = yella_to_utf8(hc->file_name);
+    f = fopen(utf8, "wb");
+    if (f == NULL)
+    {
+        err = errno;
+        CHUCHO_C_ERROR(hc->lgr, "Could not open %s for writing: %s", utf8, strerror(err));
+        free(utf8);
+        return;
+    }
+    ok = fwrite(&HASH_CACHE_ID, 1, sizeof(HASH_CACHE_ID), f) == sizeof(HASH_CACHE_ID);
+    for (node = hc->oldest; ok && node != NULL; node = node->newer)
+    {
+        ok = fwrite(&node->type, 1, sizeof(node->type), f) == sizeof(node->type) &&
+             fwrite(&node->stmp, 1, sizeof(node->stmp), f) == sizeof(node->stmp) &&
+             fwrite(&node->md_len, 1, sizeof(node->md_len), f) == sizeof(node->md_len) &&
+             fwrite(node->md, 1, node->md_len, f) == node->md_len;
+    }
+    fclose(f);
+    if (!ok)
+    {
+        CHUCHO_C_ERROR(hc->lgr, "There was a problem writing the hash cache to %s", utf8);
+        remove(utf8);
+    }
+    free(utf8);
+}
+
+hash_cache* create_hash_cache(size_t max_entries, const UChar* const file_name)
+{
+    hash_cache* result;
+
+    result = calloc(1, sizeof(hash_cache));
+    result->max_entries = max_entries;
+    result->guard = yella_create_mutex();
+    result->lgr = chucho_get_logger("file.hash-cache");
+    if (file_name != NULL)
+    {
+        result->file_name = udsnew(file_name);
+        if (max_entries > 0)
+            load_hash_cache(result);
+    }
+    return result;
+}
+
+void destroy_hash_cache(hash_cache* hc)
+{
+    hash_node* node;
+    hash_node* next;
+
+    if (hc->file_name != NULL)
+    {
+        save_hash_cache(hc);
+        udsfree(hc->file_name);
+    }
+    for (node = hc->oldest; node != NULL; node = next)
+    {
+        next = node->newer;
+        free(node);
+    }
+    chucho_release_logger(hc->lgr);
+    yella_destroy_mutex(hc->guard);
+    free(hc);
+}
+
+size_t get_hash_cache_digest(hash_cache* hc,
+                             attribute_type tp,
+                             const file_stamp* const stmp,
+                             uint8_t* md)
+{
+    hash_node to_find;
+    hash_node* found;
+    size_t result;
+
+    result = 0;
+    to_find.type = tp;
+    to_find.stmp = *stmp;
+    yella_lock_mutex(hc->guard);
+    found = sglib_hash_node_find_member(hc->nodes, &to_find);
+    if (found != NULL)
+    {
+        unlink_lru(hc, found);
+        link_lru_newest(hc, found);
+        memcpy(md, found->md, found->md_len);
+        result = found->md_len;
+    }
+    yella_unlock_mutex(hc->guard);
+    return result;
+}
+
+size_t hash_cache_size(hash_cache* hc)
+{
+    size_t result;
+
+    yella_lock_mutex(hc->guard);
+    result = hc->count;
+    yella_unlock_mutex(hc->guard);
+    return result;
+}
+
+void put_hash_cache_digest(hash_cache* hc,
+                           attribute_type tp,
+                           const file_stamp* const stmp,
+                           const uint8_t* const md,
+                           size_t md_len)
+{
+    if (hc->max_entries > 0 && md_len <= HASH_CACHE_MAX_DIGEST_SIZE)
+    {
+        yella_lock_mutex(hc->guard);
+        put_locked(hc, tp, stmp, md, md_len);
+        yella_unlock_mutex(hc->guard);
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef YELLA_HASH_CACHE_H__
+#define YELLA_HASH_CACHE_H__
+
+#include "plugin/file/element.h"
+
+/* Content digests keyed by file stamp, shared by all configs so that a
+ * file included by more than one config is only read once. The least
+ * recently used entry is evicted when the cache is full. */
+typedef struct hash_cache hash_cache;
+
+#define HASH_CACHE_MAX_DIGEST_SIZE 64
+
+/* If file_name is not NULL, then the cache is loaded from the file when
+ * created and saved to it when destroyed */
+YELLA_PRIV_EXPORT hash_cache* create_hash_cache(size_t max_entries, const UChar* const file_name);
+YELLA_PRIV_EXPORT void destroy_hash_cache(hash_cache* hc);
+/* Returns the number of bytes copied into md, which must be at least
+ * HASH_CACHE_MAX_DIGEST_SIZE long, or zero if there is no entry */
+YELLA_PRIV_EXPORT size_t get_hash_cache_digest(hash_cache* hc,
+                                               attribute_type tp,
+                                               const file_stamp* const stmp,
+                                               uint8_t* md);
+YELLA_PRIV_EXPORT size_t hash_cache_size(hash_cache* hc);
+YELLA_PRIV_EXPORT void put_hash_cache_digest(hash_cache* hc,
+                                             attribute_type tp,
+                                             const file_stamp* const stmp,
+                                             const uint8_t* const md,
+                                             size_t md_len);
+
+#endif
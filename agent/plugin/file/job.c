@@ -2,33 +2,90 @@
 #include "plugin/file/file_name_matcher.h"
 #include "plugin/file/collect_attributes.h"
 #include "plugin/file/state_db_pool.h"
+#include "common/arena.h"
 #include "common/file.h"
+#include "common/settings.h"
+#include "common/sglib.h"
 #include "common/uds_util.h"
 #include <chucho/logger.h>
 #include <unicode/ustring.h>
 #include <sys/param.h>
 
-static bool matches_excludes(const UChar* const name, const yella_ptr_vector* excludes)
+/* Enough for the element of any one file */
+#define JOB_ARENA_BLOCK_SIZE (16 * 1024)
+/* The names seen by a crawl pile up until it is over */
+#define SEEN_ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct seen_name
 {
-    int i;
+    const UChar* name;
+    char color;
+    struct seen_name* left;
+    struct seen_name* right;
+} seen_name;
 
-    for (i = 0; i < yella_ptr_vector_size(excludes); i++)
-    {
-        if (file_name_matches(name, yella_ptr_vector_at(excludes, i)))
-            return true;
-    }
-    return false;
+/* The names a crawl visited, which need not be checked for existence
+ * afterwards. The nodes and names all live in the arena. */
+typedef struct seen_set
+{
+    seen_name* names;
+    yella_arena* arena;
+} seen_set;
+
+#define SEEN_NAME_COMPARATOR(lhs, rhs) (u_strcmp(lhs->name, rhs->name))
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(seen_name, left, right, color, SEEN_NAME_COMPARATOR);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(seen_name, left, right, color, SEEN_NAME_COMPARATOR);
+
+static void add_seen_name(seen_set* seen, const UChar* const name)
+{
+    seen_name* node;
+
+    node = yella_arena_alloc(seen->arena, sizeof(seen_name));
+    node->name = yella_arena_copy_string(seen->arena, name);
+    sglib_seen_name_add(&seen->names, node);
 }
 
-static void process_element(const UChar* const name, element* elem, const job* const j, state_db* db)
+static bool was_seen(const seen_set* const seen, const UChar* const name)
 {
+    seen_name to_find;
+
+    if (seen == NULL)
+        return false;
+    to_find.name = name;
+    return sglib_seen_name_find_member(seen->names, &to_find) != NULL;
+}
+
+static void process_element(const UChar* const name,
+                            const job* const j,
+                            state_db* db,
+                            bool full_hash,
+                            hash_cache* cache,
+                            yella_arena* arena,
+                            chucho_logger_t* lgr)
+{
+    element* elem;
     element* db_elem;
+    const uint8_t* packed;
+    bool found;
+    file_stamp db_stmp;
     yella_fb_file_condition_enum_t cond;
     int cmp;
 
     cmp = 0;
-    db_elem = get_element_from_state_db(db, name);
-    if (db_elem == NULL)
+    /* The stored attributes are copied into the arena and compared there,
+     * and only unpacked when there is a change to report */
+    found = get_packed_attributes_from_state_db(db, name, arena, &packed);
+    elem = collect_attributes(name,
+                              j->attr_types,
+                              j->attr_type_count,
+                              j->read_strategy,
+                              packed,
+                              cache,
+                              full_hash,
+                              arena,
+                              lgr);
+    if (!found)
     {
         if (elem != NULL)
         {
@@ -45,66 +102,127 @@ static void process_element(const UChar* const name, element* elem, const job* c
     }
     else
     {
-        cmp = compare_element_attributes(elem, db_elem);
+        cmp = compare_element_to_packed_attributes(elem, packed);
         if (cmp != 0)
         {
+            db_elem = create_element_with_attrs(name, packed);
             update_into_state_db(db, elem);
             diff_elements(elem, db_elem);
+            destroy_element(db_elem);
             cond = yella_fb_file_condition_CHANGED;
         }
+        else if (!file_stamps_equal(element_file_stamp(elem),
+                                    packed_attributes_file_stamp(packed, &db_stmp) ? &db_stmp : NULL))
+        {
+            /* Nothing worth reporting, but keep the stamp fresh so the next scan can skip hashing */
+            update_into_state_db(db, elem);
+        }
     }
-    destroy_element(db_elem);
     if (cmp != 0)
         add_accumulator_message(j->acc, j->recipient, j->config_name, name, elem, cond);
+    if (elem != NULL)
+        destroy_element(elem);
+    /* Everything carved for this file is dead now */
+    yella_reset_arena(arena);
+}
+
+/* Stored elements below a directory that are gone were either removed
+ * between scans, or removed along with the directory without an event
+ * of their own. Either way, they are reported as removed. Those the crawl
+ * just visited are known to exist, so seen may be NULL if there was none. */
+static void remove_missing_under(const UChar* const dir,
+                                 const seen_set* const seen,
+                                 const job* const j,
+                                 state_db* db,
+                                 hash_cache* cache,
+                                 yella_arena* arena,
+                                 chucho_logger_t* lgr)
+{
+    yella_ptr_vector* names;
+    const UChar* cur;
+    int i;
+
+    names = get_state_db_names_under(db, dir);
+    for (i = 0; i < yella_ptr_vector_size(names); i++)
+    {
+        cur = yella_ptr_vector_at(names, i);
+        if (!was_seen(seen, cur) && !yella_file_exists(cur))
+            process_element(cur, j, db, false, cache, arena, lgr);
+    }
+    yella_destroy_ptr_vector(names);
 }
 
 static void crawl_dir(const UChar* const dir,
-                      const UChar* const cur_incl,
+                      const file_name_pattern* const incl_pattern,
+                      const file_name_pattern_set* const excl_patterns,
+                      seen_set* seen,
                       const job* const j,
                       state_db* db,
+                      bool full_hash,
+                      hash_cache* cache,
+                      yella_arena* arena,
                       chucho_logger_t* lgr)
 {
     yella_directory_iterator* itor;
     const UChar* cur;
-    element* existing_elem;
     yella_file_type ftype;
 
     itor = yella_create_directory_iterator(dir);
     cur = yella_directory_iterator_next(itor);
     while (cur != NULL)
     {
-        if (file_name_matches(cur, cur_incl) && !matches_excludes(cur, j->excludes))
-            existing_elem = collect_attributes(cur, j->attr_types, j->attr_type_count, lgr);
-        process_element(cur, existing_elem, j, db);
-        if (existing_elem != NULL)
-            destroy_element(existing_elem);
+        if (file_name_pattern_matches(incl_pattern, cur) && !file_name_pattern_set_matches(excl_patterns, cur))
+        {
+            process_element(cur, j, db, full_hash, cache, arena, lgr);
+            if (seen != NULL)
+                add_seen_name(seen, cur);
+        }
         if (yella_get_file_type(cur, &ftype, NULL) == YELLA_NO_ERROR &&
             ftype == YELLA_FILE_TYPE_DIRECTORY)
         {
-            crawl_dir(cur, cur_incl, j, db, lgr);
+            crawl_dir(cur, incl_pattern, excl_patterns, seen, j, db, full_hash, cache, arena, lgr);
         }
         cur = yella_directory_iterator_next(itor);
     }
     yella_destroy_directory_iterator(itor);
 }
 
-static void run_one_include(const UChar* const incl, const job* const j, state_db* db, chucho_logger_t* lgr)
+static bool is_at_or_under(const UChar* const name, const UChar* const dir)
+{
+    size_t len;
+
+    len = u_strlen(dir);
+    return u_strncmp(name, dir, len) == 0 &&
+        (name[len] == 0 || name[len] == YELLA_DIR_SEP[0] || (len > 0 && dir[len - 1] == YELLA_DIR_SEP[0]));
+}
+
+static void run_one_include(const UChar* const incl,
+                            const file_name_pattern* const incl_pattern,
+                            const file_name_pattern_set* const excl_patterns,
+                            const job* const j,
+                            state_db* db,
+                            bool full_hash,
+                            hash_cache* cache,
+                            yella_arena* arena,
+                            chucho_logger_t* lgr)
 {
     const UChar* special;
     uds unescaped;
-    element* existing_elem;
     uds top_dir;
     yella_file_type ftype;
+    seen_set seen;
 
     special = first_unescaped_special_char(incl);
     if (special == NULL)
     {
         unescaped = unescape_pattern(incl);
-        existing_elem = collect_attributes(unescaped, j->attr_types, j->attr_type_count, lgr);
-        process_element(unescaped, existing_elem, j, db);
+        if (j->scope == NULL || is_at_or_under(unescaped, j->scope))
+        {
+            process_element(unescaped, j, db, full_hash, cache, arena, lgr);
+            if (!yella_file_exists(unescaped))
+                remove_missing_under(unescaped, NULL, j, db, cache, arena, lgr);
+        }
         udsfree(unescaped);
-        if (existing_elem != NULL)
-            destroy_element(existing_elem);
     }
     else
     {
@@ -113,10 +231,45 @@ static void run_one_include(const UChar* const incl, const job* const j, state_d
         if (special >= incl)
         {
             top_dir = udsnewlen(incl, (special == incl) ? 1 : special - incl);
+            /* A scope inside the top directory narrows the crawl, and one
+             * outside of it leaves nothing to do */
+            if (j->scope != NULL && !is_at_or_under(top_dir, j->scope))
+            {
+                if (!is_at_or_under(j->scope, top_dir))
+                {
+                    udsfree(top_dir);
+                    return;
+                }
+                udsfree(top_dir);
+                top_dir = udsdup(j->scope);
+                /* The crawl only visits what is below, so the scope itself is checked here */
+                if (file_name_pattern_matches(incl_pattern, top_dir) && !file_name_pattern_set_matches(excl_patterns, top_dir))
+                    process_element(top_dir, j, db, full_hash, cache, arena, lgr);
+            }
             if (yella_get_file_type(top_dir, &ftype, NULL) == YELLA_NO_ERROR &&
                 ftype == YELLA_FILE_TYPE_DIRECTORY)
             {
-                crawl_dir(top_dir, incl, j, db, lgr);
+                seen.names = NULL;
+                seen.arena = j->is_scan ? yella_create_arena(SEEN_ARENA_BLOCK_SIZE) : NULL;
+                crawl_dir(top_dir,
+                          incl_pattern,
+                          excl_patterns,
+                          j->is_scan ? &seen : NULL,
+                          j,
+                          db,
+                          full_hash,
+                          cache,
+                          arena,
+                          lgr);
+                if (j->is_scan)
+                {
+                    remove_missing_under(top_dir, &seen, j, db, cache, arena, lgr);
+                    yella_destroy_arena(seen.arena);
+                }
+            }
+            else if (j->is_scan)
+            {
+                remove_missing_under(top_dir, NULL, j, db, cache, arena, lgr);
             }
             udsfree(top_dir);
         }
@@ -144,19 +297,53 @@ void destroy_job(job* j)
     yella_destroy_ptr_vector(j->includes);
     udsfree(j->recipient);
     udsfree(j->config_name);
+    if (j->scope != NULL)
+        udsfree(j->scope);
     free(j->attr_types);
     free(j);
 }
 
-void run_job(const job* const j, state_db_pool* db_pool, chucho_logger_t* lgr)
+void run_job(const job* const j, state_db_pool* db_pool, hash_cache* cache, chucho_logger_t* lgr)
 {
     int i;
     state_db* db;
+    bool full_hash;
+    uint64_t interval;
+    yella_arena* arena;
+    yella_ptr_vector* incl_patterns;
+    file_name_pattern_set* excl_patterns;
 
+    if (j->started != NULL)
+        j->started(j, j->started_udata);
     db = get_state_db_from_pool(db_pool, j->config_name);
     if (db != NULL)
     {
+        full_hash = false;
+        if (j->is_scan && j->counts_toward_full_hash)
+        {
+            interval = *yella_settings_get_uint(u"file", u"full-hash-scan-interval");
+            full_hash = interval > 0 && increment_state_db_scan_count(db) % interval == 0;
+        }
+        arena = yella_create_arena(JOB_ARENA_BLOCK_SIZE);
+        /* Compiled once, rather than for every file crawled */
+        incl_patterns = compile_file_name_patterns(j->includes);
+        excl_patterns = compile_file_name_pattern_set(j->excludes);
+        begin_state_db_transaction(db);
         for (i = 0; i < yella_ptr_vector_size(j->includes); i++)
-            run_one_include(yella_ptr_vector_at(j->includes, i), j, db, lgr);
+        {
+            run_one_include(yella_ptr_vector_at(j->includes, i),
+                            yella_ptr_vector_at(incl_patterns, i),
+                            excl_patterns,
+                            j,
+                            db,
+                            full_hash,
+                            cache,
+                            arena,
+                            lgr);
+        }
+        commit_state_db_transaction(db);
+        destroy_file_name_pattern_set(excl_patterns);
+        yella_destroy_ptr_vector(incl_patterns);
+        yella_destroy_arena(arena);
     }
 }
\ No newline at end of file
@@ -3,12 +3,18 @@
 
 #include "plugin/file/attribute.h"
 #include "plugin/file/state_db_pool.h"
+#include "plugin/file/hash_cache.h"
 #include "plugin/file/accumulator.h"
+#include "common/file.h"
 #include "common/ptr_vector.h"
 #include "common/uds.h"
 #include "plugin/plugin.h"
 #include <chucho/logger.h>
 
+struct job;
+
+typedef void (*job_started_callback)(const struct job* const j, void* udata);
+
 typedef struct job
 {
     uds config_name;
@@ -19,13 +25,25 @@ typedef struct job
     yella_ptr_vector* excludes;
     attribute_type* attr_types;
     size_t attr_type_count;
+    /* A scan is a full pass over the includes, rather than a response to events */
+    bool is_scan;
+    /* When set, only the parts of the includes at or below this directory are visited */
+    uds scope;
+    /* Only scans of a whole config made on schedule count toward
+     * full-hash-scan-interval, and never rescans after events or losses */
+    bool counts_toward_full_hash;
+    /* How file contents are read for content attributes */
+    yella_read_strategy read_strategy;
+    /* Called as the job begins to run, when set */
+    job_started_callback started;
+    void* started_udata;
 } job;
 
 YELLA_PRIV_EXPORT job* create_job(const UChar* const cfg_name,
                                   const UChar* const recipient,
                                   accumulator* acc);
 YELLA_PRIV_EXPORT void destroy_job(job* j);
-/* Ownership of db_pool is not transferred */
-YELLA_PRIV_EXPORT void run_job(const job* const j, state_db_pool* db_pool, chucho_logger_t* lgr);
+/* Ownership of db_pool and cache is not transferred, and cache may be NULL */
+YELLA_PRIV_EXPORT void run_job(const job* const j, state_db_pool* db_pool, hash_cache* cache, chucho_logger_t* lgr);
 
 #endif
@@ -1,11 +1,9 @@
 #include "plugin/file/job_queue.h"
 #include "plugin/file/job.h"
-#include "common/sglib.h"
 #include "common/thread.h"
 #include "common/time_util.h"
 #include "common/text_util.h"
 #include "common/yaml_util.h"
-#include <unicode/ustring.h>
 #include <chucho/log.h>
 #include <inttypes.h>
 
@@ -18,13 +16,16 @@ typedef struct queue
 
 struct job_queue
 {
+    /* The front and back of the queue, so that both ends are reached without a walk */
     queue* q;
+    queue* tail;
     size_t sz;
     yella_mutex* guard;
     yella_condition_variable* cond;
     yella_thread* runner;
     bool should_stop;
     state_db_pool* db_pool;
+    hash_cache* cache;
     chucho_logger_t* lgr;
     job_queue_empty_callback cb;
     void* cb_data;
@@ -33,10 +34,20 @@ struct job_queue
     chucho_logger_t* job_lgr;
 };
 
-#define JOB_COMPARATOR(lhs, rhs) (u_strcmp(lhs->jb->config_name, rhs->jb->config_name))
-
-SGLIB_DEFINE_DL_LIST_PROTOTYPES(queue, JOB_COMPARATOR, previous, next);
-SGLIB_DEFINE_DL_LIST_FUNCTIONS(queue, JOB_COMPARATOR, previous, next);
+/* The elements from first to last are already linked among themselves */
+static void append_to_queue(job_queue* jq, queue* first, queue* last)
+{
+    if (jq->tail == NULL)
+    {
+        jq->q = first;
+    }
+    else
+    {
+        jq->tail->next = first;
+        first->previous = jq->tail;
+    }
+    jq->tail = last;
+}
 
 static void job_queue_main(void* udata)
 {
@@ -70,8 +81,12 @@ static void job_queue_main(void* udata)
         }
         else
         {
-            front = sglib_queue_get_first(jq->q);
-            sglib_queue_delete(&jq->q, front);
+            front = jq->q;
+            jq->q = front->next;
+            if (jq->q == NULL)
+                jq->tail = NULL;
+            else
+                jq->q->previous = NULL;
             --jq->sz;
             yella_unlock_mutex(jq->guard);
             if (chucho_logger_permits(jq->lgr, CHUCHO_INFO))
@@ -81,7 +96,7 @@ static void job_queue_main(void* udata)
                 free(utf8);
             }
             start_micros = yella_microseconds_since_epoch();
-            run_job(front->jb, jq->db_pool, jq->job_lgr);
+            run_job(front->jb, jq->db_pool, jq->cache, jq->job_lgr);
             job_micros = yella_microseconds_since_epoch() - start_micros;
             if (chucho_logger_permits(jq->lgr, CHUCHO_INFO))
             {
@@ -111,7 +126,7 @@ static void job_queue_main(void* udata)
     CHUCHO_C_INFO(jq->lgr, "Job queue thread ending");
 }
 
-job_queue* create_job_queue(state_db_pool* pool)
+job_queue* create_job_queue(state_db_pool* pool, hash_cache* cache)
 {
     job_queue* result;
 
@@ -120,15 +135,16 @@ job_queue* create_job_queue(state_db_pool* pool)
     result->job_lgr = chucho_get_logger("file.job");
     result->guard = yella_create_mutex();
     result->cond = yella_create_condition_variable();
-    result->runner = yella_create_thread(job_queue_main, result);
     result->db_pool = pool;
+    result->cache = cache;
+    result->runner = yella_create_thread(job_queue_main, result);
     return result;
 }
 
 void destroy_job_queue(job_queue* jq)
 {
-    struct sglib_queue_iterator itor;
     queue* q;
+    queue* next;
 
     yella_lock_mutex(jq->guard);
     jq->should_stop = true;
@@ -138,10 +154,9 @@ void destroy_job_queue(job_queue* jq)
     yella_destroy_thread(jq->runner);
     yella_destroy_condition_variable(jq->cond);
     yella_destroy_mutex(jq->guard);
-    for (q = sglib_queue_it_init(&itor, jq->q);
-         q != NULL;
-         q = sglib_queue_it_next(&itor))
+    for (q = jq->q; q != NULL; q = next)
     {
+        next = q->next;
         destroy_job(q->jb);
         free(q);
     }
@@ -197,7 +212,7 @@ size_t push_job_queue(job_queue* jq, job* jb)
     q = calloc(1, sizeof(queue));
     q->jb = jb;
     yella_lock_mutex(jq->guard);
-    sglib_queue_concat(&jq->q, q);
+    append_to_queue(jq, q, q);
     cur_sz = ++jq->sz;
     if (cur_sz == 1)
         yella_signal_condition_variable(jq->cond);
@@ -208,6 +223,43 @@ size_t push_job_queue(job_queue* jq, job* jb)
     return cur_sz;
 }
 
+size_t push_job_queue_batch(job_queue* jq, job** jobs, size_t count)
+{
+    queue* first;
+    queue* last;
+    queue* q;
+    size_t cur_sz;
+    size_t i;
+
+    first = NULL;
+    last = NULL;
+    /* Linked among themselves first, so the lock is held only to attach them */
+    for (i = 0; i < count; i++)
+    {
+        q = calloc(1, sizeof(queue));
+        q->jb = jobs[i];
+        q->previous = last;
+        if (last == NULL)
+            first = q;
+        else
+            last->next = q;
+        last = q;
+    }
+    yella_lock_mutex(jq->guard);
+    if (first != NULL)
+        append_to_queue(jq, first, last);
+    cur_sz = jq->sz;
+    jq->sz += count;
+    if (cur_sz == 0 && count > 0)
+        yella_signal_condition_variable(jq->cond);
+    cur_sz = jq->sz;
+    jq->stats.jobs_pushed += count;
+    if (cur_sz > jq->stats.max_size)
+        jq->stats.max_size = cur_sz;
+    yella_unlock_mutex(jq->guard);
+    return cur_sz;
+}
+
 void set_job_queue_empty_callback(job_queue* jq, job_queue_empty_callback cb, void* udata)
 {
     yella_lock_mutex(jq->guard);
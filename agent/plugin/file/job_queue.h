@@ -19,13 +19,16 @@ typedef struct job_queue_stats
 
 typedef void (*job_queue_empty_callback)(void* udata);
 
-/* Ownership of the pool is not transferred */
-YELLA_PRIV_EXPORT job_queue* create_job_queue(state_db_pool* pool);
+/* Ownership of the pool and cache is not transferred, and cache may be NULL */
+YELLA_PRIV_EXPORT job_queue* create_job_queue(state_db_pool* pool, hash_cache* cache);
 YELLA_PRIV_EXPORT void destroy_job_queue(job_queue* jq);
 YELLA_PRIV_EXPORT job_queue_stats get_job_queue_stats(job_queue* jq);
 YELLA_PRIV_EXPORT void log_job_queue_stats(job_queue* jq, chucho_logger_t* lgr);
 /* Returns the size of the queue after the push */
 YELLA_PRIV_EXPORT size_t push_job_queue(job_queue* jq, job* jb);
+/* Pushes all the jobs under one acquisition of the lock, and returns the
+ * size of the queue after the push */
+YELLA_PRIV_EXPORT size_t push_job_queue_batch(job_queue* jq, job** jobs, size_t count);
 /* As soon as the callback is called, it is removed.
  * The pattern is that once the queue fills, the
  * event source is paused until the queue is empty.
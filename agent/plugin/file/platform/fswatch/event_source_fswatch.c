@@ -1,11 +1,11 @@
 #include "plugin/file/event_source.h"
+#include "plugin/file/event_batch.h"
 #include "plugin/file/file_name_matcher.h"
 #include "common/thread.h"
 #include "common/settings.h"
 #include "common/text_util.h"
 #include "common/uds_util.h"
 #include "common/file.h"
-#include "common/yaml_util.h"
 #include <chucho/log.h>
 #include <libfswatch/c/libfswatch.h>
 #include <unicode/ustring.h>
@@ -16,83 +16,35 @@ typedef struct event_source_fswatch
     FSW_HANDLE fsw;
     yella_thread* worker;
     yella_event* pause_event;
+    event_batch* batch;
+    /* The top directories of the running session, as uds */
+    yella_ptr_vector* paths;
 } event_source_fswatch;
 
-static int qsort_strcmp(const void* p1, const void* p2)
+static bool same_paths(const yella_ptr_vector* const lhs, const yella_ptr_vector* const rhs)
 {
-    const UChar* u1;
-    const UChar* u2;
+    size_t i;
 
-    u1 = *(const UChar**)p1;
-    u2 = *(const UChar**)p2;
-    return u_strcmp(u1, u2);
+    if (yella_ptr_vector_size(lhs) != yella_ptr_vector_size(rhs))
+        return false;
+    for (i = 0; i < yella_ptr_vector_size(lhs); i++)
+    {
+        if (u_strcmp(yella_ptr_vector_at(lhs, i), yella_ptr_vector_at(rhs, i)) != 0)
+            return false;
+    }
+    return true;
 }
 
-static yella_ptr_vector* get_paths(const event_source* const esrc)
+static bool has_overflow_flag(const fsw_cevent* const evt)
 {
-    struct sglib_event_source_spec_iterator spec_itor;
-    event_source_spec* cur_spec;
-    size_t i;
-    const UChar* cur_inc;
-    const UChar* spesh;
-    yella_ptr_vector* paths;
-    char* utf8;
-    yella_ptr_vector* uniq;
-    yaml_document_t doc;
-    int seq;
-    int value;
+    unsigned i;
 
-    paths = yella_create_uds_ptr_vector();
-    for (cur_spec = sglib_event_source_spec_it_init(&spec_itor, esrc->specs);
-         cur_spec != NULL;
-         cur_spec = sglib_event_source_spec_it_next(&spec_itor))
-    {
-        for (i = 0; i < yella_ptr_vector_size(cur_spec->includes); i++)
-        {
-            cur_inc = yella_ptr_vector_at(cur_spec->includes, i);
-            spesh = first_unescaped_special_char(cur_inc);
-            if (spesh == NULL)
-                spesh = u_strrchr(cur_inc, YELLA_DIR_SEP[0]);
-            assert(spesh != NULL);
-            while (*spesh != YELLA_DIR_SEP[0] && spesh >= cur_inc)
-                --spesh;
-            if (spesh >= cur_inc)
-                yella_push_back_ptr_vector(paths, udsnewlen(cur_inc, (spesh == cur_inc) ? 1 : spesh - cur_inc));
-        }
-    }
-    if (yella_ptr_vector_size(paths) > 0)
+    for (i = 0; i < evt->flags_num; i++)
     {
-        qsort(yella_ptr_vector_data(paths),
-              yella_ptr_vector_size(paths),
-              sizeof(UChar*),
-              qsort_strcmp);
-        uniq = yella_create_uds_ptr_vector();
-        yella_push_back_ptr_vector(uniq, udsdup(yella_ptr_vector_at(paths, 0)));
-        for (i = 1; i < yella_ptr_vector_size(paths); i++)
-        {
-            if (u_strcmp(yella_ptr_vector_at(paths, i), yella_ptr_vector_at(uniq, yella_ptr_vector_size(uniq) - 1)) != 0)
-                yella_push_back_ptr_vector(uniq, udsdup(yella_ptr_vector_at(paths, i)));
-        }
-        yella_destroy_ptr_vector(paths);
-        paths = uniq;
-        if (chucho_logger_permits(esrc->lgr, CHUCHO_INFO))
-        {
-            yaml_document_initialize(&doc, NULL, NULL, NULL, 1, 1);
-            seq = yaml_document_add_sequence(&doc, NULL, YAML_FLOW_SEQUENCE_STYLE);
-            for (i = 0; i < yella_ptr_vector_size(paths); i++)
-            {
-                utf8 = yella_to_utf8(yella_ptr_vector_at(paths, i));
-                value = yaml_document_add_scalar(&doc, NULL, (yaml_char_t*)utf8, strlen(utf8), YAML_PLAIN_SCALAR_STYLE);
-                free(utf8);
-                yaml_document_append_sequence_item(&doc, seq, value);
-            }
-            utf8 = yella_emit_yaml(&doc);
-            yaml_document_delete(&doc);
-            CHUCHO_C_INFO(esrc->lgr, "Watching paths: %s", utf8);
-            free(utf8);
-        }
+        if (evt->flags[i] == Overflow)
+            return true;
     }
-    return paths;
+    return false;
 }
 
 static bool has_useful_flags(const fsw_cevent* const evt)
@@ -110,35 +62,27 @@ static bool has_useful_flags(const fsw_cevent* const evt)
 static void worker_callback(fsw_cevent const* const evts, const unsigned count, void* udata)
 {
     event_source* esrc;
+    event_source_fswatch* esf;
     unsigned i;
     UChar* utf16;
-    const UChar* cfg;
-    yella_ptr_vector* called;
-    unsigned j;
 
     esrc = (event_source*)udata;
-    called = yella_create_uds_ptr_vector();
+    esf = esrc->impl;
     for (i = 0; i < count; i++)
     {
-        if (has_useful_flags(&evts[i]))
+        if (has_overflow_flag(&evts[i]))
+        {
+            CHUCHO_C_WARN(esrc->lgr, "The file system monitor overflowed and events were lost");
+            event_source_overflowed(esrc);
+        }
+        else if (has_useful_flags(&evts[i]))
         {
             utf16 = yella_from_utf8(evts[i].path);
-            for (j = 0; j < yella_ptr_vector_size(called); j++)
-            {
-                if (u_strcmp(utf16, yella_ptr_vector_at(called, j)) == 0)
-                    break;
-            }
-            if (j == yella_ptr_vector_size(called))
-            {
-                cfg = event_source_file_name_matches_any(esrc, utf16);
-                if (cfg != NULL)
-                    esrc->callback(cfg, utf16, esrc->callback_udata);
-                yella_push_back_ptr_vector(called, udsnew(utf16));
-            }
+            add_to_event_batch(esf->batch, utf16);
             free(utf16);
         }
     }
-    yella_destroy_ptr_vector(called);
+    flush_event_batch(esf->batch);
 }
 
 static void worker_main(void* udata)
@@ -153,17 +97,16 @@ static void worker_main(void* udata)
     CHUCHO_C_INFO(esrc->lgr, "Fswatch event source thread ending");
 }
 
-static void start_monitor(const event_source* const esrc)
+/* Takes ownership of the paths */
+static void start_monitor(const event_source* const esrc, yella_ptr_vector* paths)
 {
     event_source_fswatch* esf;
-    yella_ptr_vector* paths;
     char* utf8;
     size_t i;
 
     esf = (event_source_fswatch*)esrc->impl;
     if (esf != NULL)
     {
-        paths = get_paths(esrc);
         if (yella_ptr_vector_size(paths) > 0)
         {
             esf->fsw = fsw_init_session(system_default_monitor_type);
@@ -183,6 +126,12 @@ static void start_monitor(const event_source* const esrc)
              * join of the monitor thread. */
             yella_sleep_this_thread_milliseconds(100);
         }
+        if (esf->paths != NULL)
+            yella_destroy_ptr_vector(esf->paths);
+        esf->paths = paths;
+    }
+    else
+    {
         yella_destroy_ptr_vector(paths);
     }
 }
@@ -209,13 +158,24 @@ static void stop_monitor(event_source_fswatch* esf)
     }
 }
 
+/* A libfswatch session cannot take new paths once it runs, so the session
+ * is only restarted when the top directories actually change */
 static void update_specs(const event_source* const esrc)
 {
     event_source_fswatch* esf;
+    yella_ptr_vector* paths;
 
     esf = (event_source_fswatch*)esrc->impl;
-    stop_monitor(esf);
-    start_monitor(esrc);
+    paths = event_source_top_directories(esrc);
+    if (esf != NULL && esf->fsw != NULL && esf->paths != NULL && same_paths(esf->paths, paths))
+    {
+        yella_destroy_ptr_vector(paths);
+    }
+    else
+    {
+        stop_monitor(esf);
+        start_monitor(esrc, paths);
+    }
 }
 
 void add_or_replace_event_source_impl_specs(event_source* esrc, event_source_spec** specs, size_t count)
@@ -236,6 +196,9 @@ void destroy_event_source_impl(event_source* esrc)
     stop_monitor(esf);
     if (esf->pause_event != NULL)
         yella_destroy_event(esf->pause_event);
+    destroy_event_batch(esf->batch);
+    if (esf->paths != NULL)
+        yella_destroy_ptr_vector(esf->paths);
     free(esf);
     esrc->impl = NULL;
 }
@@ -245,7 +208,8 @@ void init_event_source_impl(event_source* esrc)
     if (fsw_init_library() == FSW_OK)
     {
         esrc->impl = calloc(1, sizeof(event_source_fswatch));
-        start_monitor(esrc);
+        ((event_source_fswatch*)esrc->impl)->batch = create_event_batch(esrc);
+        start_monitor(esrc, event_source_top_directories(esrc));
     }
 }
 
@@ -281,7 +245,7 @@ void resume_event_source(event_source* esrc)
     if (esf->fsw == NULL)
     {
         assert(esf->worker == NULL);
-        start_monitor(esrc);
+        start_monitor(esrc, event_source_top_directories(esrc));
         if (esf->pause_event != NULL)
         {
             yella_destroy_event(esf->pause_event);
@@ -0,0 +1,844 @@
+/* For open_by_handle_at and struct file_handle */
+#define _GNU_SOURCE
+
+#include "plugin/file/event_source.h"
+#include "plugin/file/event_batch.h"
+#include "common/text_util.h"
+#include "common/file.h"
+#include <chucho/log.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+
+/* Large enough that a busy file system is drained in few reads */
+#define EVENT_BUFFER_SIZE (64 * 1024)
+/* A storm that never lets the queue drain is still reported in pieces this big */
+#define MAX_BATCH_EVENTS 8192
+
+#define INOTIFY_MASK (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MODIFY | \
+                      IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF | IN_EXCL_UNLINK | IN_ONLYDIR)
+
+#if defined(FAN_REPORT_DFID_NAME)
+#define FANOTIFY_MASK (FAN_ATTRIB | FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | FAN_MODIFY | \
+                       FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+#endif
+
+typedef struct watch_node
+{
+    int wd;
+    uds dir;
+    char color;
+    struct watch_node* left;
+    struct watch_node* right;
+} watch_node;
+
+/* A file system marked with fanotify, and a descriptor from it to resolve handles */
+typedef struct marked_fs
+{
+    fsid_t fsid;
+    int fd;
+} marked_fs;
+
+typedef struct event_source_linux
+{
+    int notify_fd;
+    bool is_fanotify;
+    int wake_fd;
+    atomic_bool should_stop;
+    yella_thread* worker;
+    yella_event* pause_event;
+    event_batch* batch;
+    /* This guards the directories, watches and marks, which change
+     * under the worker when specs are updated */
+    yella_mutex* guard;
+    /* The top directories being watched, as UTF-8 */
+    yella_ptr_vector* top_dirs;
+    watch_node* watches;
+    yella_ptr_vector* marked;
+    uint64_t overflows;
+} event_source_linux;
+
+#define WATCH_NODE_COMPARATOR(lhs, rhs) ((lhs)->wd - (rhs)->wd)
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(watch_node, left, right, color, WATCH_NODE_COMPARATOR);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(watch_node, left, right, color, WATCH_NODE_COMPARATOR);
+
+static void marked_fs_destructor(void* elem, void* udata)
+{
+    marked_fs* mfs;
+
+    mfs = elem;
+    close(mfs->fd);
+    free(mfs);
+}
+
+static char* join_path(const char* const dir, const char* const name)
+{
+    size_t dir_len;
+    size_t name_len;
+    char* result;
+
+    dir_len = strlen(dir);
+    name_len = strlen(name);
+    result = malloc(dir_len + name_len + 2);
+    memcpy(result, dir, dir_len);
+    if (dir_len == 0 || result[dir_len - 1] != YELLA_DIR_SEP[0])
+        result[dir_len++] = YELLA_DIR_SEP[0];
+    memcpy(result + dir_len, name, name_len + 1);
+    return result;
+}
+
+static bool contains_dir(const yella_ptr_vector* const dirs, const char* const dir)
+{
+    size_t i;
+
+    for (i = 0; i < yella_ptr_vector_size(dirs); i++)
+    {
+        if (strcmp(yella_ptr_vector_at(dirs, i), dir) == 0)
+            return true;
+    }
+    return false;
+}
+
+static bool is_under(const char* const name, const char* const dir)
+{
+    size_t len;
+
+    len = strlen(dir);
+    return strncmp(name, dir, len) == 0 &&
+        (name[len] == 0 || name[len] == YELLA_DIR_SEP[0] || (len > 0 && dir[len - 1] == YELLA_DIR_SEP[0]));
+}
+
+static bool is_under_top_dir(const event_source_linux* const esl, const char* const name)
+{
+    size_t i;
+
+    for (i = 0; i < yella_ptr_vector_size(esl->top_dirs); i++)
+    {
+        if (is_under(name, yella_ptr_vector_at(esl->top_dirs, i)))
+            return true;
+    }
+    return false;
+}
+
+static void add_utf8(event_batch* batch, const char* const name)
+{
+    UChar* utf16;
+
+    utf16 = yella_from_utf8(name);
+    add_to_event_batch(batch, utf16);
+    free(utf16);
+}
+
+/* When entries_are_new, the directory has just appeared and everything
+ * in it is reported, since it may have been written before the watch
+ * was in place. */
+static void add_inotify_watches(const event_source* const esrc,
+                                event_source_linux* esl,
+                                const char* const dir,
+                                bool entries_are_new,
+                                event_batch* batch)
+{
+    int wd;
+    watch_node to_find;
+    watch_node* node;
+    UChar* utf16;
+    DIR* dp;
+    struct dirent* ent;
+    char* child;
+    struct stat st;
+    bool is_dir;
+
+    wd = inotify_add_watch(esl->notify_fd, dir, INOTIFY_MASK);
+    if (wd < 0)
+    {
+        if (errno == ENOSPC)
+            CHUCHO_C_ERROR(esrc->lgr, "Out of inotify watches at '%s'. Raise fs.inotify.max_user_watches.", dir);
+        else if (errno != ENOENT && errno != ENOTDIR)
+            CHUCHO_C_WARN(esrc->lgr, "Unable to watch '%s': %s", dir, strerror(errno));
+        return;
+    }
+    utf16 = yella_from_utf8(dir);
+    to_find.wd = wd;
+    node = sglib_watch_node_find_member(esl->watches, &to_find);
+    if (node == NULL)
+    {
+        node = malloc(sizeof(watch_node));
+        node->wd = wd;
+        node->dir = udsnew(utf16);
+        sglib_watch_node_add(&esl->watches, node);
+    }
+    else if (u_strcmp(node->dir, utf16) != 0)
+    {
+        /* The same directory watched again under a new name after a move */
+        udsfree(node->dir);
+        node->dir = udsnew(utf16);
+    }
+    free(utf16);
+    dp = opendir(dir);
+    if (dp != NULL)
+    {
+        while ((ent = readdir(dp)) != NULL)
+        {
+            if (strcmp(ent->d_name, ".") != 0 && strcmp(ent->d_name, "..") != 0)
+            {
+                child = join_path(dir, ent->d_name);
+                if (ent->d_type == DT_UNKNOWN)
+                    is_dir = lstat(child, &st) == 0 && S_ISDIR(st.st_mode);
+                else
+                    is_dir = ent->d_type == DT_DIR;
+                if (entries_are_new)
+                    add_utf8(batch, child);
+                if (is_dir)
+                    add_inotify_watches(esrc, esl, child, entries_are_new, batch);
+                free(child);
+            }
+        }
+        closedir(dp);
+    }
+}
+
+static void destroy_watches(event_source_linux* esl)
+{
+    watch_node* node;
+
+    /* The iterator reads nodes after returning them, so they are taken from the top */
+    while (esl->watches != NULL)
+    {
+        node = esl->watches;
+        sglib_watch_node_delete(&esl->watches, node);
+        udsfree(node->dir);
+        free(node);
+    }
+}
+
+/* Watches below the removed directory go, unless another directory still covers them */
+static void remove_inotify_watches(event_source_linux* esl, const char* const removed_dir)
+{
+    watch_node* node;
+    struct sglib_watch_node_iterator itor;
+    yella_ptr_vector* doomed;
+    char* utf8;
+    size_t i;
+
+    doomed = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(doomed, NULL, NULL);
+    for (node = sglib_watch_node_it_init(&itor, esl->watches);
+         node != NULL;
+         node = sglib_watch_node_it_next(&itor))
+    {
+        utf8 = yella_to_utf8(node->dir);
+        if (is_under(utf8, removed_dir) && !is_under_top_dir(esl, utf8))
+            yella_push_back_ptr_vector(doomed, node);
+        free(utf8);
+    }
+    for (i = 0; i < yella_ptr_vector_size(doomed); i++)
+    {
+        node = yella_ptr_vector_at(doomed, i);
+        inotify_rm_watch(esl->notify_fd, node->wd);
+        sglib_watch_node_delete(&esl->watches, node);
+        udsfree(node->dir);
+        free(node);
+    }
+    yella_destroy_ptr_vector(doomed);
+}
+
+static void handle_overflow(const event_source* const esrc, event_source_linux* esl, event_batch* batch)
+{
+    size_t i;
+
+    ++esl->overflows;
+    CHUCHO_C_WARN(esrc->lgr,
+                  "The kernel event queue overflowed and events were lost (%" PRIu64 " overflows so far)",
+                  esl->overflows);
+    /* Directories created while events were being dropped have no watches yet */
+    if (!esl->is_fanotify)
+    {
+        for (i = 0; i < yella_ptr_vector_size(esl->top_dirs); i++)
+            add_inotify_watches(esrc, esl, yella_ptr_vector_at(esl->top_dirs, i), false, batch);
+    }
+}
+
+/* Returns whether the kernel queue overflowed */
+static bool handle_inotify_events(const event_source* const esrc,
+                                  event_source_linux* esl,
+                                  const char* const buf,
+                                  ssize_t len,
+                                  event_batch* batch)
+{
+    const char* pos;
+    const struct inotify_event* evt;
+    watch_node to_find;
+    watch_node* node;
+    watch_node* removed;
+    uds name;
+    UChar* utf16;
+    char* utf8;
+    bool overflowed;
+
+    overflowed = false;
+    for (pos = buf; pos < buf + len; pos += sizeof(struct inotify_event) + evt->len)
+    {
+        evt = (const struct inotify_event*)pos;
+        if (evt->mask & IN_Q_OVERFLOW)
+        {
+            handle_overflow(esrc, esl, batch);
+            overflowed = true;
+            continue;
+        }
+        to_find.wd = evt->wd;
+        node = sglib_watch_node_find_member(esl->watches, &to_find);
+        if (node == NULL)
+            continue;
+        if (evt->mask & IN_IGNORED)
+        {
+            if (sglib_watch_node_delete_if_member(&esl->watches, &to_find, &removed))
+            {
+                udsfree(removed->dir);
+                free(removed);
+            }
+            continue;
+        }
+        name = udsdup(node->dir);
+        if (evt->len > 0 && evt->name[0] != 0)
+        {
+            if (udslen(name) == 0 || name[udslen(name) - 1] != YELLA_DIR_SEP[0])
+                name = udscat(name, YELLA_DIR_SEP);
+            utf16 = yella_from_utf8(evt->name);
+            name = udscat(name, utf16);
+            free(utf16);
+            if ((evt->mask & IN_ISDIR) && (evt->mask & (IN_CREATE | IN_MOVED_TO)))
+            {
+                utf8 = yella_to_utf8(name);
+                add_inotify_watches(esrc, esl, utf8, true, batch);
+                free(utf8);
+            }
+        }
+        add_to_event_batch(batch, name);
+        udsfree(name);
+    }
+    return overflowed;
+}
+
+#if defined(FAN_REPORT_DFID_NAME)
+
+static marked_fs* find_marked_fs(const event_source_linux* const esl, const void* const fsid)
+{
+    size_t i;
+    marked_fs* cur;
+
+    for (i = 0; i < yella_ptr_vector_size(esl->marked); i++)
+    {
+        cur = yella_ptr_vector_at(esl->marked, i);
+        if (memcmp(&cur->fsid, fsid, sizeof(cur->fsid)) == 0)
+            return cur;
+    }
+    return NULL;
+}
+
+/* Returns whether the kernel queue overflowed */
+static bool handle_fanotify_events(const event_source* const esrc,
+                                   event_source_linux* esl,
+                                   char* buf,
+                                   ssize_t len,
+                                   event_batch* batch)
+{
+    struct fanotify_event_metadata* md;
+    struct fanotify_event_info_fid* fid;
+    struct file_handle* handle;
+    const char* name;
+    marked_fs* mfs;
+    int dfd;
+    char proc[32];
+    char dir[PATH_MAX];
+    ssize_t dir_len;
+    char* full;
+    bool overflowed;
+
+    overflowed = false;
+    for (md = (struct fanotify_event_metadata*)buf; FAN_EVENT_OK(md, len); md = FAN_EVENT_NEXT(md, len))
+    {
+        if (md->mask & FAN_Q_OVERFLOW)
+        {
+            handle_overflow(esrc, esl, batch);
+            overflowed = true;
+            continue;
+        }
+        if (md->event_len < sizeof(*md) + sizeof(*fid))
+            continue;
+        fid = (struct fanotify_event_info_fid*)(md + 1);
+        if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME && fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID)
+            continue;
+        mfs = find_marked_fs(esl, &fid->fsid);
+        if (mfs == NULL)
+            continue;
+        handle = (struct file_handle*)fid->handle;
+        /* Gone already if this fails, and the removal was the event */
+        dfd = open_by_handle_at(mfs->fd, handle, O_PATH | O_CLOEXEC);
+        if (dfd < 0)
+            continue;
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dfd);
+        dir_len = readlink(proc, dir, sizeof(dir) - 1);
+        close(dfd);
+        if (dir_len <= 0)
+            continue;
+        dir[dir_len] = 0;
+        name = (fid->hdr.info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) ?
+            (const char*)(handle->f_handle + handle->handle_bytes) : ".";
+        /* The mark covers the whole file system, so everything outside
+         * the top directories is dropped before any conversion */
+        if (strcmp(name, ".") == 0)
+        {
+            if (is_under_top_dir(esl, dir))
+                add_utf8(batch, dir);
+        }
+        else
+        {
+            full = join_path(dir, name);
+            if (is_under_top_dir(esl, full))
+                add_utf8(batch, full);
+            free(full);
+        }
+    }
+    return overflowed;
+}
+
+#endif
+
+#if defined(FAN_REPORT_DFID_NAME)
+
+/* A directory that cannot be found is skipped, and only a refused mark fails */
+static bool mark_file_system(const event_source* const esrc, event_source_linux* esl, int fd, const char* const dir)
+{
+    struct statfs sfs;
+    marked_fs* mfs;
+
+    if (statfs(dir, &sfs) != 0)
+    {
+        CHUCHO_C_WARN(esrc->lgr, "Unable to watch '%s': %s", dir, strerror(errno));
+        return true;
+    }
+    if (find_marked_fs(esl, &sfs.f_fsid) == NULL)
+    {
+        if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, dir) != 0)
+        {
+            CHUCHO_C_INFO(esrc->lgr,
+                          "Unable to mark the file system of '%s' with fanotify (%s), so inotify will be used",
+                          dir,
+                          strerror(errno));
+            return false;
+        }
+        mfs = malloc(sizeof(marked_fs));
+        mfs->fsid = sfs.f_fsid;
+        mfs->fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mfs->fd < 0)
+        {
+            CHUCHO_C_WARN(esrc->lgr, "Unable to open '%s': %s", dir, strerror(errno));
+            fanotify_mark(fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, dir);
+            free(mfs);
+            return false;
+        }
+        yella_push_back_ptr_vector(esl->marked, mfs);
+    }
+    return true;
+}
+
+/* File systems that none of the top directories are on any longer are unmarked */
+static void unmark_unused_file_systems(event_source_linux* esl)
+{
+    struct statfs sfs;
+    marked_fs* mfs;
+    size_t i;
+    size_t j;
+
+    i = 0;
+    while (i < yella_ptr_vector_size(esl->marked))
+    {
+        mfs = yella_ptr_vector_at(esl->marked, i);
+        for (j = 0; j < yella_ptr_vector_size(esl->top_dirs); j++)
+        {
+            if (statfs(yella_ptr_vector_at(esl->top_dirs, j), &sfs) == 0 &&
+                memcmp(&sfs.f_fsid, &mfs->fsid, sizeof(mfs->fsid)) == 0)
+            {
+                break;
+            }
+        }
+        if (j == yella_ptr_vector_size(esl->top_dirs))
+        {
+            fanotify_mark(esl->notify_fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, mfs->fd, NULL);
+            yella_erase_ptr_vector_at(esl->marked, i);
+        }
+        else
+        {
+            ++i;
+        }
+    }
+}
+
+#endif
+
+static bool start_fanotify(const event_source* const esrc, event_source_linux* esl)
+{
+#if defined(FAN_REPORT_DFID_NAME)
+    int fd;
+    size_t i;
+
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME, O_RDONLY | O_LARGEFILE);
+    if (fd < 0)
+    {
+        CHUCHO_C_INFO(esrc->lgr, "Fanotify is not available (%s), so inotify will be used", strerror(errno));
+        return false;
+    }
+    esl->marked = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(esl->marked, marked_fs_destructor, NULL);
+    for (i = 0; i < yella_ptr_vector_size(esl->top_dirs); i++)
+    {
+        if (!mark_file_system(esrc, esl, fd, yella_ptr_vector_at(esl->top_dirs, i)))
+        {
+            yella_destroy_ptr_vector(esl->marked);
+            esl->marked = NULL;
+            close(fd);
+            return false;
+        }
+    }
+    esl->notify_fd = fd;
+    esl->is_fanotify = true;
+    return true;
+#else
+    return false;
+#endif
+}
+
+static bool start_inotify(const event_source* const esrc, event_source_linux* esl)
+{
+    size_t i;
+
+    esl->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (esl->notify_fd < 0)
+    {
+        CHUCHO_C_ERROR(esrc->lgr, "Unable to initialize inotify: %s", strerror(errno));
+        return false;
+    }
+    esl->is_fanotify = false;
+    for (i = 0; i < yella_ptr_vector_size(esl->top_dirs); i++)
+        add_inotify_watches(esrc, esl, yella_ptr_vector_at(esl->top_dirs, i), false, NULL);
+    return true;
+}
+
+static void worker_main(void* udata)
+{
+    event_source* esrc;
+    event_source_linux* esl;
+    struct pollfd fds[2];
+    char* buf;
+    ssize_t len;
+    bool overflowed;
+
+    esrc = udata;
+    esl = esrc->impl;
+    CHUCHO_C_INFO(esrc->lgr, "%s event source thread starting", esl->is_fanotify ? "Fanotify" : "Inotify");
+    buf = malloc(EVENT_BUFFER_SIZE);
+    fds[0].fd = esl->notify_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = esl->wake_fd;
+    fds[1].events = POLLIN;
+    while (!atomic_load(&esl->should_stop))
+    {
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            CHUCHO_C_ERROR(esrc->lgr, "Error waiting for file system events: %s", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0)
+            break;
+        /* Drain everything queued, so that repeats across reads still collapse */
+        len = 0;
+        while (!atomic_load(&esl->should_stop) && (len = read(esl->notify_fd, buf, EVENT_BUFFER_SIZE)) > 0)
+        {
+            yella_lock_mutex(esl->guard);
+#if defined(FAN_REPORT_DFID_NAME)
+            if (esl->is_fanotify)
+                overflowed = handle_fanotify_events(esrc, esl, buf, len, esl->batch);
+            else
+#endif
+                overflowed = handle_inotify_events(esrc, esl, buf, len, esl->batch);
+            yella_unlock_mutex(esl->guard);
+            /* Reported without the guard, since the callback takes locks that
+             * are held around spec updates, which take the guard */
+            if (overflowed)
+                event_source_overflowed(esrc);
+            if (event_batch_size(esl->batch) >= MAX_BATCH_EVENTS)
+                flush_event_batch(esl->batch);
+        }
+        if (len < 0 && errno != EAGAIN && errno != EINTR)
+            CHUCHO_C_ERROR(esrc->lgr, "Error reading file system events: %s", strerror(errno));
+        flush_event_batch(esl->batch);
+    }
+    free(buf);
+    CHUCHO_C_INFO(esrc->lgr, "%s event source thread ending", esl->is_fanotify ? "Fanotify" : "Inotify");
+    if (esl->pause_event != NULL)
+        yella_signal_event(esl->pause_event);
+}
+
+static void wake_worker(event_source_linux* esl)
+{
+    uint64_t one;
+
+    one = 1;
+    while (write(esl->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static yella_ptr_vector* utf8_top_directories(const event_source* const esrc)
+{
+    yella_ptr_vector* paths;
+    yella_ptr_vector* result;
+    size_t i;
+
+    paths = event_source_top_directories(esrc);
+    result = yella_create_ptr_vector();
+    for (i = 0; i < yella_ptr_vector_size(paths); i++)
+        yella_push_back_ptr_vector(result, yella_to_utf8(yella_ptr_vector_at(paths, i)));
+    yella_destroy_ptr_vector(paths);
+    return result;
+}
+
+/* Takes ownership of the directories */
+static void start_monitor(event_source* esrc, yella_ptr_vector* dirs)
+{
+    event_source_linux* esl;
+    uint64_t ignored;
+
+    esl = esrc->impl;
+    esl->top_dirs = dirs;
+    if (yella_ptr_vector_size(dirs) > 0)
+    {
+        /* The marks and watches are all in place before the thread
+         * starts, so there is nothing to wait for */
+        if (start_fanotify(esrc, esl) || start_inotify(esrc, esl))
+        {
+            while (read(esl->wake_fd, &ignored, sizeof(ignored)) > 0);
+            atomic_store(&esl->should_stop, false);
+            esl->worker = yella_create_thread(worker_main, esrc);
+        }
+    }
+}
+
+static void stop_monitor(event_source_linux* esl)
+{
+    if (esl != NULL)
+    {
+        if (esl->worker != NULL)
+        {
+            atomic_store(&esl->should_stop, true);
+            wake_worker(esl);
+            yella_join_thread(esl->worker);
+            yella_destroy_thread(esl->worker);
+            esl->worker = NULL;
+        }
+        if (esl->notify_fd >= 0)
+        {
+            close(esl->notify_fd);
+            esl->notify_fd = -1;
+        }
+        destroy_watches(esl);
+        if (esl->marked != NULL)
+        {
+            yella_destroy_ptr_vector(esl->marked);
+            esl->marked = NULL;
+        }
+        if (esl->top_dirs != NULL)
+        {
+            yella_destroy_ptr_vector(esl->top_dirs);
+            esl->top_dirs = NULL;
+        }
+    }
+}
+
+static void restart_monitor(event_source* esrc)
+{
+    stop_monitor(esrc->impl);
+    start_monitor(esrc, utf8_top_directories(esrc));
+}
+
+/* Only the top directories that come or go are marked, watched or
+ * dropped, while the worker keeps running */
+static void update_specs(event_source* esrc)
+{
+    event_source_linux* esl;
+    yella_ptr_vector* dirs;
+    yella_ptr_vector* old_dirs;
+    const char* dir;
+    bool ok;
+    size_t i;
+
+    esl = esrc->impl;
+    if (esl == NULL)
+        return;
+    if (esl->worker == NULL)
+    {
+        restart_monitor(esrc);
+        return;
+    }
+    /* Paused, and resuming will pick up the new specs */
+    if (atomic_load(&esl->should_stop))
+        return;
+    dirs = utf8_top_directories(esrc);
+    ok = true;
+    yella_lock_mutex(esl->guard);
+    old_dirs = esl->top_dirs;
+    esl->top_dirs = dirs;
+#if defined(FAN_REPORT_DFID_NAME)
+    if (esl->is_fanotify)
+    {
+        for (i = 0; ok && i < yella_ptr_vector_size(dirs); i++)
+        {
+            dir = yella_ptr_vector_at(dirs, i);
+            if (!contains_dir(old_dirs, dir))
+                ok = mark_file_system(esrc, esl, esl->notify_fd, dir);
+        }
+        if (ok)
+            unmark_unused_file_systems(esl);
+    }
+    else
+#endif
+    {
+        for (i = 0; i < yella_ptr_vector_size(dirs); i++)
+        {
+            dir = yella_ptr_vector_at(dirs, i);
+            if (!contains_dir(old_dirs, dir))
+                add_inotify_watches(esrc, esl, dir, false, NULL);
+        }
+        for (i = 0; i < yella_ptr_vector_size(old_dirs); i++)
+        {
+            dir = yella_ptr_vector_at(old_dirs, i);
+            if (!contains_dir(dirs, dir))
+                remove_inotify_watches(esl, dir);
+        }
+    }
+    yella_unlock_mutex(esl->guard);
+    yella_destroy_ptr_vector(old_dirs);
+    /* A file system that fanotify refuses needs inotify for everything */
+    if (!ok)
+        restart_monitor(esrc);
+}
+
+void add_or_replace_event_source_impl_specs(event_source* esrc, event_source_spec** specs, size_t count)
+{
+    update_specs(esrc);
+}
+
+void clear_event_source_impl_specs(event_source* esrc)
+{
+    update_specs(esrc);
+}
+
+void destroy_event_source_impl(event_source* esrc)
+{
+    event_source_linux* esl;
+
+    esl = esrc->impl;
+    if (esl != NULL)
+    {
+        stop_monitor(esl);
+        close(esl->wake_fd);
+        if (esl->pause_event != NULL)
+            yella_destroy_event(esl->pause_event);
+        destroy_event_batch(esl->batch);
+        yella_destroy_mutex(esl->guard);
+        free(esl);
+        esrc->impl = NULL;
+    }
+}
+
+void init_event_source_impl(event_source* esrc)
+{
+    event_source_linux* esl;
+
+    esl = calloc(1, sizeof(event_source_linux));
+    esl->notify_fd = -1;
+    esl->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (esl->wake_fd < 0)
+    {
+        CHUCHO_C_ERROR(esrc->lgr, "Unable to create the event source wake descriptor: %s", strerror(errno));
+        free(esl);
+        return;
+    }
+    atomic_init(&esl->should_stop, false);
+    esl->batch = create_event_batch(esrc);
+    esl->guard = yella_create_mutex();
+    esrc->impl = esl;
+    start_monitor(esrc, utf8_top_directories(esrc));
+}
+
+void pause_event_source(event_source* esrc)
+{
+    event_source_linux* esl;
+
+    esl = esrc->impl;
+    if (esl != NULL)
+    {
+        /* This may be called from the worker, so the worker is only
+         * told to stop here and is joined on resume */
+        if (esl->pause_event != NULL)
+            yella_destroy_event(esl->pause_event);
+        esl->pause_event = yella_create_event();
+        if (esl->worker != NULL)
+        {
+            atomic_store(&esl->should_stop, true);
+            wake_worker(esl);
+        }
+        else
+        {
+            yella_signal_event(esl->pause_event);
+        }
+    }
+}
+
+void remove_event_source_impl_spec(event_source* esrc, const UChar* const config_name)
+{
+    update_specs(esrc);
+}
+
+void resume_event_source(event_source* esrc)
+{
+    event_source_linux* esl;
+
+    esl = esrc->impl;
+    if (esl != NULL)
+    {
+        restart_monitor(esrc);
+        if (esl->pause_event != NULL)
+        {
+            yella_destroy_event(esl->pause_event);
+            esl->pause_event = NULL;
+        }
+    }
+}
+
+void wait_for_event_source_pause(event_source* esrc)
+{
+    event_source_linux* esl;
+
+    esl = esrc->impl;
+    if (esl != NULL && esl->pause_event != NULL)
+    {
+        yella_wait_for_event(esl->pause_event);
+        yella_destroy_event(esl->pause_event);
+        esl->pause_event = NULL;
+    }
+}
@@ -17,6 +17,18 @@ uint64_t get_access_time(void* stat_buf)
     return (sb->st_atim.tv_sec * 1000) + (sb->st_atim.tv_nsec / 1000000);
 }
 
+void get_file_stamp(void* stat_buf, file_stamp* stmp)
+{
+    struct stat* sb = (struct stat*)stat_buf;
+
+    assert(stat_buf != NULL);
+    stmp->device = sb->st_dev;
+    stmp->inode = sb->st_ino;
+    stmp->size = sb->st_size;
+    stmp->modification_nanos = (sb->st_mtim.tv_sec * UINT64_C(1000000000)) + sb->st_mtim.tv_nsec;
+    stmp->metadata_change_nanos = (sb->st_ctim.tv_sec * UINT64_C(1000000000)) + sb->st_ctim.tv_nsec;
+}
+
 void get_group(void* stat_buf, uint64_t* id, UChar** name, chucho_logger_t* lgr)
 {
     struct stat* sb = (struct stat*)stat_buf;
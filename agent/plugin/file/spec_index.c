@@ -0,0 +1,250 @@
+#include "plugin/file/spec_index.h"
+#include "plugin/file/file_name_matcher.h"
+#include "common/file.h"
+#include "common/sglib.h"
+#include <unicode/ustring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+typedef struct index_entry
+{
+    const event_source_spec* spec;
+    /* The position of the spec in name order */
+    size_t rank;
+    const file_name_pattern* include;
+} index_entry;
+
+typedef struct index_node
+{
+    /* This points into the node's own copy, except in nodes used as search keys */
+    const UChar* component;
+    size_t len;
+    uds owned;
+    yella_ptr_vector* entries;
+    struct index_node* children;
+    char color;
+    struct index_node* left;
+    struct index_node* right;
+} index_node;
+
+struct spec_index
+{
+    index_node* root;
+    /* The excludes of all the specs, which are not indexed, compiled
+     * together in the name order of their specs */
+    file_name_pattern_set* excludes;
+    size_t exclude_count;
+    /* The rank of the spec of each exclude */
+    size_t* exclude_ranks;
+};
+
+static int compare_components(const index_node* const lhs, const index_node* const rhs)
+{
+    int result;
+
+    result = u_memcmp(lhs->component, rhs->component, MIN(lhs->len, rhs->len));
+    if (result == 0)
+        result = (lhs->len < rhs->len) ? -1 : ((lhs->len > rhs->len) ? 1 : 0);
+    return result;
+}
+
+#define INDEX_NODE_COMPARATOR(lhs, rhs) (compare_components(lhs, rhs))
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(index_node, left, right, color, INDEX_NODE_COMPARATOR);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(index_node, left, right, color, INDEX_NODE_COMPARATOR);
+
+static index_node* create_index_node(const UChar* const component, size_t len)
+{
+    index_node* result;
+
+    result = calloc(1, sizeof(index_node));
+    result->owned = udsnewlen(component, len);
+    result->component = result->owned;
+    result->len = len;
+    result->entries = yella_create_ptr_vector();
+    return result;
+}
+
+static void destroy_index_node(index_node* node)
+{
+    index_node* cur;
+
+    /* The iterator reads nodes after returning them, so they are taken from the top */
+    while (node->children != NULL)
+    {
+        cur = node->children;
+        sglib_index_node_delete(&node->children, cur);
+        destroy_index_node(cur);
+    }
+    yella_destroy_ptr_vector(node->entries);
+    udsfree(node->owned);
+    free(node);
+}
+
+/* Sets len to the length of the component starting at *name, after
+ * skipping separators, and returns false when there are no more */
+static bool next_component(const UChar** name, size_t* len)
+{
+    const UChar* end;
+
+    while (**name == YELLA_DIR_SEP[0])
+        ++*name;
+    for (end = *name; *end != 0 && *end != YELLA_DIR_SEP[0]; end++) {}
+    *len = end - *name;
+    return *len > 0;
+}
+
+/* Every name an include can match starts with this directory, which is
+ * empty when the include begins with a wildcard */
+static uds literal_prefix(const UChar* const include)
+{
+    const UChar* special;
+    uds prefix;
+    uds result;
+
+    special = first_unescaped_special_char(include);
+    if (special == NULL)
+        return unescape_pattern(include);
+    while (special > include && *special != YELLA_DIR_SEP[0])
+        --special;
+    /* The separator is kept, so that one escaped before it stays escaped */
+    prefix = udsnewlen(include, (*special == YELLA_DIR_SEP[0]) ? special - include + 1 : 0);
+    result = unescape_pattern(prefix);
+    udsfree(prefix);
+    return result;
+}
+
+static void add_entry(spec_index* idx, const event_source_spec* const spec, size_t rank, size_t include_num)
+{
+    uds prefix;
+    const UChar* cur;
+    size_t len;
+    index_node* node;
+    index_node* child;
+    index_node key;
+    index_entry* entry;
+
+    prefix = literal_prefix(yella_ptr_vector_at(spec->includes, include_num));
+    node = idx->root;
+    cur = prefix;
+    while (next_component(&cur, &len))
+    {
+        key.component = cur;
+        key.len = len;
+        child = sglib_index_node_find_member(node->children, &key);
+        if (child == NULL)
+        {
+            child = create_index_node(cur, len);
+            sglib_index_node_add(&node->children, child);
+        }
+        node = child;
+        cur += len;
+    }
+    udsfree(prefix);
+    entry = malloc(sizeof(index_entry));
+    entry->spec = spec;
+    entry->rank = rank;
+    entry->include = yella_ptr_vector_at(spec->include_patterns, include_num);
+    yella_push_back_ptr_vector(node->entries, entry);
+}
+
+static const index_entry* match_entries(const index_node* const node,
+                                        const UChar* const fname,
+                                        const index_entry* best)
+{
+    size_t i;
+    const index_entry* entry;
+
+    for (i = 0; i < yella_ptr_vector_size(node->entries); i++)
+    {
+        entry = yella_ptr_vector_at(node->entries, i);
+        if ((best == NULL || entry->rank < best->rank) && file_name_pattern_matches(entry->include, fname))
+            best = entry;
+    }
+    return best;
+}
+
+static int compare_spec_names(const void* lhs, const void* rhs)
+{
+    return u_strcmp((*(const event_source_spec* const*)lhs)->name, (*(const event_source_spec* const*)rhs)->name);
+}
+
+spec_index* create_spec_index(event_source_spec* const* specs, size_t count)
+{
+    spec_index* result;
+    const event_source_spec** sorted;
+    yella_ptr_vector* excludes;
+    size_t i;
+    size_t j;
+    size_t k;
+
+    result = malloc(sizeof(spec_index));
+    result->root = create_index_node(u"", 0);
+    sorted = malloc(MAX(count, 1) * sizeof(event_source_spec*));
+    memcpy(sorted, specs, count * sizeof(event_source_spec*));
+    qsort(sorted, count, sizeof(event_source_spec*), compare_spec_names);
+    /* The patterns are not owned */
+    excludes = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(excludes, NULL, NULL);
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < yella_ptr_vector_size(sorted[i]->includes); j++)
+            add_entry(result, sorted[i], i, j);
+        for (j = 0; j < yella_ptr_vector_size(sorted[i]->excludes); j++)
+            yella_push_back_ptr_vector(excludes, yella_ptr_vector_at(sorted[i]->excludes, j));
+    }
+    result->exclude_count = yella_ptr_vector_size(excludes);
+    result->exclude_ranks = malloc(MAX(result->exclude_count, 1) * sizeof(size_t));
+    k = 0;
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < yella_ptr_vector_size(sorted[i]->excludes); j++)
+            result->exclude_ranks[k++] = i;
+    }
+    result->excludes = compile_file_name_pattern_set(excludes);
+    yella_destroy_ptr_vector(excludes);
+    free(sorted);
+    return result;
+}
+
+void destroy_spec_index(spec_index* idx)
+{
+    destroy_index_node(idx->root);
+    destroy_file_name_pattern_set(idx->excludes);
+    free(idx->exclude_ranks);
+    free(idx);
+}
+
+const UChar* spec_index_match(const spec_index* const idx, const UChar* const fname)
+{
+    const index_node* node;
+    const index_entry* best;
+    index_node key;
+    const UChar* cur;
+    size_t len;
+    size_t first;
+
+    node = idx->root;
+    best = match_entries(node, fname, NULL);
+    cur = fname;
+    while (next_component(&cur, &len))
+    {
+        key.component = cur;
+        key.len = len;
+        node = sglib_index_node_find_member(node->children, &key);
+        if (node == NULL)
+            break;
+        best = match_entries(node, fname, best);
+        cur += len;
+    }
+    if (best == NULL)
+        return NULL;
+    /* Specs are consulted in name order, and an exclude stops the search,
+     * so any spec up to the winner can veto it. The excludes are in rank
+     * order, so the first that matches has the lowest rank. */
+    first = file_name_pattern_set_first_match(idx->excludes, fname);
+    if (first < idx->exclude_count && idx->exclude_ranks[first] <= best->rank)
+        return NULL;
+    return best->spec->name;
+}
@@ -0,0 +1,23 @@
+#ifndef YELLA_SPEC_INDEX_H__
+#define YELLA_SPEC_INDEX_H__
+
+#include "plugin/file/event_source.h"
+
+/* A trie of path components built from the literal directory prefix of
+ * each include of a set of event source specs. Looking up a file name only
+ * evaluates the includes whose prefix covers it, rather than every pattern
+ * of every spec. The index refers to the specs and their compiled patterns
+ * without owning them, so it must be rebuilt whenever the specs change. */
+typedef struct spec_index spec_index;
+
+/* The specs' include patterns must already be compiled, and the specs may
+ * be in any order. The excludes of all of them are compiled into one set. */
+YELLA_PRIV_EXPORT spec_index* create_spec_index(event_source_spec* const* specs, size_t count);
+YELLA_PRIV_EXPORT void destroy_spec_index(spec_index* idx);
+/* Specs are consulted in name order, and the first one that excludes or
+ * includes fname decides. Returns the name of that spec if it includes
+ * fname, or NULL if it excludes it or there is none. An exclude is checked
+ * before the includes of the same spec. */
+YELLA_PRIV_EXPORT const UChar* spec_index_match(const spec_index* const idx, const UChar* const fname);
+
+#endif
@@ -2,9 +2,11 @@
 #define YELLA_POSIX_PERMISSIONS_H
 
 #include "attribute.h"
+#include "element.h"
 #include <chucho/logger.h>
 
 uint64_t get_access_time(void* stat_buf);
+void get_file_stamp(void* stat_buf, file_stamp* stmp);
 void get_group(void* stat_buf, uint64_t* id, UChar** name, chucho_logger_t* lgr);
 uint64_t get_metadata_change_time(void* stat_buf);
 uint64_t get_modification_time(void* stat_buf);
@@ -2,27 +2,106 @@
 #include "common/settings.h"
 #include "common/file.h"
 #include "common/macro_util.h"
+#include "common/ptr_vector.h"
 #include "common/text_util.h"
+#include "common/thread.h"
+#include "common/time_util.h"
+#include "common/uds_util.h"
 #include <sqlite3.h>
 #include <openssl/evp.h>
 #include <unicode/ustring.h>
 #include <chucho/logger.h>
 #include <chucho/log.h>
+#include <inttypes.h>
+#include <stdio.h>
 
 enum
 {
     STMT_INSERT,
     STMT_DELETE,
     STMT_UPDATE,
-    STMT_SELECT_ATTRS
+    STMT_SELECT_ATTRS,
+    STMT_SELECT_META,
+    STMT_REPLACE_META,
+    STMT_SELECT_SUBTREE,
+    STMT_INSERT_DIR,
+    STMT_SELECT_DIR,
+    STMT_DELETE_EMPTY_DIR
 };
 
+/* These must remain in sync with the anonymous enum values at the top of this file */
+static const char* const STMT_SQLS[] =
+{
+   "INSERT INTO 'entry' (directory_id, basename, attributes) VALUES (?1, ?2, ?3);",
+   "DELETE FROM 'entry' WHERE directory_id = ?1 AND basename = ?2;",
+   "UPDATE 'entry' SET attributes = ?1 WHERE directory_id = ?2 AND basename = ?3;",
+   "SELECT attributes FROM 'entry' WHERE directory_id = ?1 AND basename = ?2;",
+   "SELECT value FROM 'meta' WHERE name = ?1;",
+   "INSERT OR REPLACE INTO 'meta' (name, value) VALUES (?1, ?2);",
+   "SELECT d.path, e.basename FROM 'directory' d JOIN 'entry' e ON e.directory_id = d.id "
+       "WHERE d.path = ?1 OR (d.path >= ?2 AND d.path < ?3);",
+   "INSERT OR IGNORE INTO 'directory' (path) VALUES (?1);",
+   "SELECT id FROM 'directory' WHERE path = ?1;",
+   "DELETE FROM 'directory' WHERE id = ?1 AND NOT EXISTS (SELECT 1 FROM 'entry' WHERE directory_id = ?1);"
+};
+
+/* The only statements a reader prepares */
+static const int READER_STMTS[] = { STMT_SELECT_ATTRS, STMT_SELECT_SUBTREE, STMT_SELECT_DIR };
+
+/* How long a reader waits on a lock, which in WAL mode only happens
+ * while the writer is recovering or checkpointing */
+#define READER_BUSY_MILLISECONDS 5000
+
+typedef struct connection
+{
+    sqlite3* db;
+    sqlite3_stmt* stmts[10];
+    char* last_dir;
+    sqlite3_int64 last_dir_id;
+    /* The state db's directory generation when last_dir was looked up */
+    uint64_t last_dir_generation;
+    /* The thread that owns a reader */
+    void* thread;
+} connection;
+
+/*
+ * There is one writer connection, which a thread holds only for the length
+ * of a single write or commit. Writes made while any thread is between
+ * begin and commit go into one open transaction, which is opened by the
+ * first of them. In WAL mode, every thread that reads gets its own
+ * read-only connection with its own statements, so lookups do not wait on
+ * the writer or on each other. A reader only sees committed rows, which is
+ * why a thread that has written to the open transaction reads through the
+ * writer instead until it is committed. Without WAL there are no readers,
+ * and every read goes through the writer.
+ */
 struct state_db
 {
     chucho_logger_t* lgr;
-    sqlite3* db;
-    sqlite3_stmt* stmts[4];
+    connection writer;
     uds name;
+    /* These four are guarded by the writer lock */
+    bool in_transaction;
+    unsigned batch_users;
+    uint64_t batch_rows;
+    uint64_t batch_start_micros;
+    uint64_t max_batch_rows;
+    uint64_t max_batch_micros;
+    uint64_t checkpoint_micros;
+    uint64_t last_checkpoint_micros;
+    bool is_wal;
+    yella_mutex* writer_lock;
+    /* This guards writer_thread, writer_depth, readers, dirty_threads and dir_generation */
+    yella_mutex* guard;
+    void* writer_thread;
+    unsigned writer_depth;
+    yella_ptr_vector* readers;
+    /* The threads with writes in the open transaction, which they must
+     * read through the writer to see */
+    yella_ptr_vector* dirty_threads;
+    /* Bumped whenever a directory row is deleted, because a directory that
+     * comes back gets a new id, and remembered ids would be wrong */
+    uint64_t dir_generation;
 };
 
 static uds create_db_name(const UChar* const config_name)
@@ -43,6 +122,626 @@ static uds create_db_name(const UChar* const config_name)
     return result;
 }
 
+static void forget_directory_id(connection* conn)
+{
+    free(conn->last_dir);
+    conn->last_dir = NULL;
+}
+
+static void close_connection(connection* conn)
+{
+    int i;
+
+    for (i = 0; i < YELLA_ARRAY_SIZE(conn->stmts); i++)
+        sqlite3_finalize(conn->stmts[i]);
+    sqlite3_close(conn->db);
+    forget_directory_id(conn);
+}
+
+static void reader_destructor(void* elem, void* udata)
+{
+    close_connection((connection*)elem);
+    free(elem);
+}
+
+/* The writer lock is recursive, since a thread in a transaction also
+ * takes it for each write */
+static void lock_writer(state_db* st)
+{
+    void* self;
+
+    self = yella_this_thread();
+    yella_lock_mutex(st->guard);
+    if (st->writer_depth > 0 && st->writer_thread == self)
+    {
+        ++st->writer_depth;
+        yella_unlock_mutex(st->guard);
+        return;
+    }
+    yella_unlock_mutex(st->guard);
+    yella_lock_mutex(st->writer_lock);
+    yella_lock_mutex(st->guard);
+    st->writer_thread = self;
+    st->writer_depth = 1;
+    yella_unlock_mutex(st->guard);
+}
+
+static void unlock_writer(state_db* st)
+{
+    bool should_release;
+
+    yella_lock_mutex(st->guard);
+    should_release = --st->writer_depth == 0;
+    if (should_release)
+        st->writer_thread = NULL;
+    yella_unlock_mutex(st->guard);
+    if (should_release)
+        yella_unlock_mutex(st->writer_lock);
+}
+
+static connection* find_reader(state_db* st, void* thread)
+{
+    connection* conn;
+    int i;
+
+    for (i = 0; i < yella_ptr_vector_size(st->readers); i++)
+    {
+        conn = yella_ptr_vector_at(st->readers, i);
+        if (conn->thread == thread)
+            return conn;
+    }
+    return NULL;
+}
+
+static connection* open_reader(state_db* st)
+{
+    connection* result;
+    uds name;
+    char* utf8;
+    char sql[128];
+    int rc;
+    int i;
+
+    result = calloc(1, sizeof(connection));
+    result->thread = yella_this_thread();
+    name = create_db_name(st->name);
+    utf8 = yella_to_utf8(name);
+    udsfree(name);
+    rc = sqlite3_open_v2(utf8, &result->db, SQLITE_OPEN_READONLY, NULL);
+    free(utf8);
+    if (rc == SQLITE_OK)
+    {
+        sqlite3_busy_timeout(result->db, READER_BUSY_MILLISECONDS);
+        snprintf(sql,
+                 sizeof(sql),
+                 "PRAGMA cache_size=-%" PRIu64 "; PRAGMA mmap_size=%" PRIu64 ";",
+                 *yella_settings_get_byte_size(u"file", u"db-cache-size") / 1024,
+                 *yella_settings_get_byte_size(u"file", u"db-mmap-size"));
+        sqlite3_exec(result->db, sql, NULL, NULL, NULL);
+        for (i = 0; rc == SQLITE_OK && i < YELLA_ARRAY_SIZE(READER_STMTS); i++)
+        {
+            rc = sqlite3_prepare_v3(result->db,
+                                    STMT_SQLS[READER_STMTS[i]],
+                                    -1,
+                                    SQLITE_PREPARE_PERSISTENT,
+                                    &result->stmts[READER_STMTS[i]],
+                                    NULL);
+        }
+    }
+    if (rc != SQLITE_OK)
+    {
+        CHUCHO_C_ERROR(st->lgr,
+                       "Unable to open a reader connection: %s",
+                       result->db == NULL ? sqlite3_errstr(rc) : sqlite3_errmsg(result->db));
+        reader_destructor(result, NULL);
+        return NULL;
+    }
+    return result;
+}
+
+static bool is_dirty_thread(state_db* st, void* thread)
+{
+    int i;
+
+    for (i = 0; i < yella_ptr_vector_size(st->dirty_threads); i++)
+    {
+        if (yella_ptr_vector_at(st->dirty_threads, i) == thread)
+            return true;
+    }
+    return false;
+}
+
+/* The connection a read by this thread goes through. If it is the writer,
+ * then the writer is locked until unlock_reading_connection. */
+static connection* lock_reading_connection(state_db* st)
+{
+    void* self;
+    connection* result;
+    bool dirty;
+
+    result = NULL;
+    if (st->is_wal)
+    {
+        self = yella_this_thread();
+        yella_lock_mutex(st->guard);
+        dirty = is_dirty_thread(st, self);
+        if (!dirty)
+            result = find_reader(st, self);
+        yella_unlock_mutex(st->guard);
+        if (result == NULL && !dirty)
+        {
+            result = open_reader(st);
+            if (result != NULL)
+            {
+                yella_lock_mutex(st->guard);
+                yella_push_back_ptr_vector(st->readers, result);
+                yella_unlock_mutex(st->guard);
+            }
+        }
+    }
+    if (result == NULL)
+    {
+        lock_writer(st);
+        result = &st->writer;
+    }
+    return result;
+}
+
+static void unlock_reading_connection(state_db* st, connection* conn)
+{
+    if (conn == &st->writer)
+        unlock_writer(st);
+}
+
+static void mark_dirty_thread(state_db* st)
+{
+    void* self;
+
+    self = yella_this_thread();
+    yella_lock_mutex(st->guard);
+    if (!is_dirty_thread(st, self))
+        yella_push_back_ptr_vector(st->dirty_threads, self);
+    yella_unlock_mutex(st->guard);
+}
+
+static bool exec_transaction_sql(state_db* st, const char* const sql)
+{
+    int rc;
+    char* sqlerr;
+
+    rc = sqlite3_exec(st->writer.db, sql, NULL, NULL, &sqlerr);
+    if (rc != SQLITE_OK)
+    {
+        CHUCHO_C_ERROR(st->lgr, "Error executing '%s': %s", sql, sqlerr);
+        sqlite3_free(sqlerr);
+        return false;
+    }
+    return true;
+}
+
+/* Everything written is now either committed or gone, so every thread
+ * can go back to its reader. The writer must be locked. */
+static void end_transaction(state_db* st)
+{
+    st->in_transaction = false;
+    st->batch_rows = 0;
+    yella_lock_mutex(st->guard);
+    yella_clear_ptr_vector(st->dirty_threads);
+    yella_unlock_mutex(st->guard);
+}
+
+/* The writer must be locked */
+static bool commit_open_transaction(state_db* st)
+{
+    bool result;
+
+    if (!st->in_transaction)
+        return true;
+    result = exec_transaction_sql(st, "COMMIT;");
+    if (!result)
+    {
+        forget_directory_id(&st->writer);
+        if (!sqlite3_get_autocommit(st->writer.db))
+            exec_transaction_sql(st, "ROLLBACK;");
+    }
+    end_transaction(st);
+    return result;
+}
+
+/* Called with the writer locked before each write. A write made while
+ * nobody is batching commits by itself. */
+static void open_batch(state_db* st)
+{
+    if (st->batch_users > 0 && !st->in_transaction && exec_transaction_sql(st, "BEGIN;"))
+    {
+        st->in_transaction = true;
+        st->batch_rows = 0;
+        st->batch_start_micros = yella_microseconds_since_epoch();
+    }
+}
+
+/* SQLite rolls back the whole transaction by itself on some errors, like
+ * a full disk, so the transaction state has to be checked after any failure */
+static void check_transaction_after_error(state_db* st)
+{
+    if (st->in_transaction && sqlite3_get_autocommit(st->writer.db))
+    {
+        forget_directory_id(&st->writer);
+        CHUCHO_C_ERROR(st->lgr,
+                       "The transaction was rolled back, losing %" PRIu64 " writes. They will be redetected on the next scan.",
+                       st->batch_rows);
+        end_transaction(st);
+    }
+}
+
+/* Called after each successful write. Long batches are committed and
+ * restarted so that a big crawl is neither one huge transaction nor one
+ * transaction per file. */
+static void count_batched_write(state_db* st)
+{
+    if (st->in_transaction)
+    {
+        mark_dirty_thread(st);
+        ++st->batch_rows;
+        /* The next write opens the next batch */
+        if (st->batch_rows >= st->max_batch_rows ||
+            yella_microseconds_since_epoch() - st->batch_start_micros >= st->max_batch_micros)
+        {
+            commit_open_transaction(st);
+        }
+    }
+}
+
+static void checkpoint(state_db* st)
+{
+    int rc;
+
+    /* Truncating keeps the WAL file from holding on to its high water mark */
+    rc = sqlite3_wal_checkpoint_v2(st->writer.db, NULL, SQLITE_CHECKPOINT_TRUNCATE, NULL, NULL);
+    if (rc != SQLITE_OK && rc != SQLITE_BUSY)
+        CHUCHO_C_WARN(st->lgr, "Unable to checkpoint: %s", sqlite3_errmsg(st->writer.db));
+    st->last_checkpoint_micros = yella_microseconds_since_epoch();
+}
+
+/* The "tuned" profile trades durability of the last few commits on power
+ * loss for much faster writes. The database is only a cache of what was
+ * last seen, so losing a few commits just causes some changes to be
+ * reported again. */
+static void apply_tuning(state_db* st)
+{
+    const UChar* profile;
+    char* utf8;
+    char sql[256];
+    int rc;
+    char* sqlerr;
+    sqlite3_stmt* stmt;
+
+    profile = yella_settings_get_text(u"file", u"db-tuning");
+    if (profile == NULL || u_strcmp(profile, u"tuned") != 0)
+    {
+        if (profile != NULL && u_strcmp(profile, u"sqlite-default") != 0)
+        {
+            utf8 = yella_to_utf8(profile);
+            CHUCHO_C_WARN(st->lgr, "Unknown db-tuning profile '%s'. Using SQLite's defaults.", utf8);
+            free(utf8);
+        }
+        return;
+    }
+    /* journal_mode returns the mode actually in use, which is not WAL on file systems that cannot share memory */
+    if (sqlite3_prepare_v2(st->writer.db, "PRAGMA journal_mode=WAL;", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        if (sqlite3_step(stmt) == SQLITE_ROW &&
+            sqlite3_strnicmp((const char*)sqlite3_column_text(stmt, 0), "wal", 3) == 0)
+        {
+            st->is_wal = true;
+        }
+        else
+        {
+            CHUCHO_C_WARN(st->lgr, "Unable to use write-ahead logging, so reads cannot run alongside writes");
+        }
+        sqlite3_finalize(stmt);
+    }
+    snprintf(sql,
+             sizeof(sql),
+             "PRAGMA synchronous=NORMAL; PRAGMA temp_store=MEMORY; PRAGMA cache_size=-%" PRIu64 "; PRAGMA mmap_size=%" PRIu64 "; PRAGMA journal_size_limit=%" PRIu64 ";",
+             *yella_settings_get_byte_size(u"file", u"db-cache-size") / 1024,
+             *yella_settings_get_byte_size(u"file", u"db-mmap-size"),
+             *yella_settings_get_byte_size(u"file", u"db-wal-size-limit"));
+    rc = sqlite3_exec(st->writer.db, sql, NULL, NULL, &sqlerr);
+    if (rc != SQLITE_OK)
+    {
+        CHUCHO_C_WARN(st->lgr, "Unable to tune the database: %s", sqlerr);
+        sqlite3_free(sqlerr);
+    }
+    st->checkpoint_micros = *yella_settings_get_uint(u"file", u"db-checkpoint-seconds") * 1000000;
+    st->last_checkpoint_micros = yella_microseconds_since_epoch();
+}
+
+/* Paths are split into their directory and base name, and each directory
+ * is stored once in the directory table. Both are stored as UTF-8, because
+ * UTF-8 byte order is also code point order. That makes every directory
+ * below another one fall in one range of the path index. */
+static void split_name(const UChar* const elem_name, char** dir, char** base)
+{
+    const UChar* sep;
+    uds d;
+
+    sep = u_strrchr(elem_name, YELLA_DIR_SEP[0]);
+    if (sep == NULL)
+    {
+        d = udsempty();
+        *base = yella_to_utf8(elem_name);
+    }
+    else
+    {
+        d = (sep == elem_name) ? udsnew(YELLA_DIR_SEP) : udsnewlen(elem_name, sep - elem_name);
+        *base = yella_to_utf8(sep + 1);
+    }
+    *dir = yella_to_utf8(d);
+    udsfree(d);
+}
+
+static uds join_name(const char* const dir, size_t dir_len, const char* const base, size_t base_len)
+{
+    char* utf8;
+    UChar* utf16;
+    uds result;
+    size_t len;
+
+    utf8 = malloc(dir_len + base_len + 2);
+    memcpy(utf8, dir, dir_len);
+    len = dir_len;
+    if (dir_len > 0 && dir[dir_len - 1] != YELLA_DIR_SEP[0])
+        utf8[len++] = (char)YELLA_DIR_SEP[0];
+    memcpy(utf8 + len, base, base_len);
+    utf8[len + base_len] = 0;
+    utf16 = yella_from_utf8(utf8);
+    result = udsnew(utf16);
+    free(utf16);
+    free(utf8);
+    return result;
+}
+
+static uint64_t directory_generation(state_db* st)
+{
+    uint64_t result;
+
+    yella_lock_mutex(st->guard);
+    result = st->dir_generation;
+    yella_unlock_mutex(st->guard);
+    return result;
+}
+
+/* Files tend to arrive a directory at a time, so the last directory's id
+ * is remembered. Returns SQLITE_ROW and sets id if the directory is there,
+ * SQLITE_DONE if it is not, or an error code. */
+static int get_directory_id(state_db* st, connection* conn, const char* const dir, bool should_create, sqlite3_int64* id)
+{
+    int rc;
+    uint64_t generation;
+
+    generation = directory_generation(st);
+    if (conn->last_dir != NULL && conn->last_dir_generation == generation && strcmp(conn->last_dir, dir) == 0)
+    {
+        *id = conn->last_dir_id;
+        return SQLITE_ROW;
+    }
+    if (should_create)
+    {
+        sqlite3_bind_blob(conn->stmts[STMT_INSERT_DIR], 1, dir, strlen(dir), SQLITE_STATIC);
+        rc = sqlite3_step(conn->stmts[STMT_INSERT_DIR]);
+        sqlite3_clear_bindings(conn->stmts[STMT_INSERT_DIR]);
+        sqlite3_reset(conn->stmts[STMT_INSERT_DIR]);
+        if (rc != SQLITE_DONE)
+        {
+            CHUCHO_C_ERROR(st->lgr, "Error inserting directory '%s': %s", dir, sqlite3_errmsg(conn->db));
+            return rc;
+        }
+    }
+    sqlite3_bind_blob(conn->stmts[STMT_SELECT_DIR], 1, dir, strlen(dir), SQLITE_STATIC);
+    rc = sqlite3_step(conn->stmts[STMT_SELECT_DIR]);
+    if (rc == SQLITE_ROW)
+    {
+        *id = sqlite3_column_int64(conn->stmts[STMT_SELECT_DIR], 0);
+        free(conn->last_dir);
+        conn->last_dir = strdup(dir);
+        conn->last_dir_id = *id;
+        conn->last_dir_generation = generation;
+    }
+    else if (rc != SQLITE_DONE)
+    {
+        CHUCHO_C_ERROR(st->lgr, "Error getting directory '%s': %s", dir, sqlite3_errmsg(conn->db));
+    }
+    sqlite3_clear_bindings(conn->stmts[STMT_SELECT_DIR]);
+    sqlite3_reset(conn->stmts[STMT_SELECT_DIR]);
+    return rc;
+}
+
+/* Directories are only there to hold entries, so the last entry to leave
+ * one takes it along */
+static int delete_directory_if_empty(state_db* st, sqlite3_int64 dir_id)
+{
+    int rc;
+
+    sqlite3_bind_int64(st->writer.stmts[STMT_DELETE_EMPTY_DIR], 1, dir_id);
+    rc = sqlite3_step(st->writer.stmts[STMT_DELETE_EMPTY_DIR]);
+    if (rc == SQLITE_DONE && sqlite3_changes(st->writer.db) > 0)
+    {
+        forget_directory_id(&st->writer);
+        yella_lock_mutex(st->guard);
+        ++st->dir_generation;
+        yella_unlock_mutex(st->guard);
+    }
+    sqlite3_clear_bindings(st->writer.stmts[STMT_DELETE_EMPTY_DIR]);
+    sqlite3_reset(st->writer.stmts[STMT_DELETE_EMPTY_DIR]);
+    return rc;
+}
+
+static int insert_row(state_db* st, const UChar* const elem_name, const void* const attrs, size_t sz)
+{
+    char* dir;
+    char* base;
+    sqlite3_int64 dir_id;
+    int rc;
+
+    split_name(elem_name, &dir, &base);
+    rc = get_directory_id(st, &st->writer, dir, true, &dir_id);
+    if (rc == SQLITE_ROW)
+    {
+        sqlite3_bind_int64(st->writer.stmts[STMT_INSERT], 1, dir_id);
+        sqlite3_bind_blob(st->writer.stmts[STMT_INSERT], 2, base, strlen(base), SQLITE_STATIC);
+        sqlite3_bind_blob(st->writer.stmts[STMT_INSERT], 3, attrs, sz, SQLITE_STATIC);
+        rc = sqlite3_step(st->writer.stmts[STMT_INSERT]);
+        sqlite3_clear_bindings(st->writer.stmts[STMT_INSERT]);
+        sqlite3_reset(st->writer.stmts[STMT_INSERT]);
+    }
+    else if (rc == SQLITE_DONE)
+    {
+        rc = SQLITE_ERROR;
+    }
+    free(base);
+    free(dir);
+    return rc;
+}
+
+typedef struct packed_copy
+{
+    yella_arena* arena;
+    const uint8_t* packed;
+} packed_copy;
+
+typedef struct stored_element
+{
+    const UChar* name;
+    element* elem;
+} stored_element;
+
+static void copy_packed_attributes(const uint8_t* const packed, size_t sz, void* udata)
+{
+    packed_copy* pc = (packed_copy*)udata;
+    uint8_t* copy;
+
+    if (sz > 0)
+    {
+        copy = yella_arena_alloc(pc->arena, sz);
+        memcpy(copy, packed, sz);
+        pc->packed = copy;
+    }
+}
+
+static void create_stored_element(const uint8_t* const packed, size_t sz, void* udata)
+{
+    stored_element* se = (stored_element*)udata;
+
+    se->elem = create_element_with_attrs(se->name, packed);
+}
+
+/* The row's bytes are handed to func while the statement is stepped, and
+ * the statement is reset before returning. Returns false if there is no
+ * such element. */
+static bool select_attributes(state_db* st,
+                              const UChar* const elem_name,
+                              void (*func)(const uint8_t* const, size_t, void*),
+                              void* udata)
+{
+    int rc;
+    char* utf8;
+    char* dir;
+    char* base;
+    sqlite3_int64 dir_id;
+    connection* conn;
+
+    conn = lock_reading_connection(st);
+    split_name(elem_name, &dir, &base);
+    rc = get_directory_id(st, conn, dir, false, &dir_id);
+    if (rc == SQLITE_ROW)
+    {
+        sqlite3_bind_int64(conn->stmts[STMT_SELECT_ATTRS], 1, dir_id);
+        sqlite3_bind_blob(conn->stmts[STMT_SELECT_ATTRS], 2, base, strlen(base), SQLITE_STATIC);
+        rc = sqlite3_step(conn->stmts[STMT_SELECT_ATTRS]);
+        if (rc == SQLITE_ROW)
+        {
+            func(sqlite3_column_blob(conn->stmts[STMT_SELECT_ATTRS], 0),
+                 sqlite3_column_bytes(conn->stmts[STMT_SELECT_ATTRS], 0),
+                 udata);
+        }
+        sqlite3_clear_bindings(conn->stmts[STMT_SELECT_ATTRS]);
+        sqlite3_reset(conn->stmts[STMT_SELECT_ATTRS]);
+    }
+    free(base);
+    free(dir);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+    {
+        utf8 = yella_to_utf8(elem_name);
+        CHUCHO_C_DEBUG(st->lgr, "Error getting attributes for '%s': %s", utf8, sqlite3_errmsg(conn->db));
+        free(utf8);
+    }
+    unlock_reading_connection(st, conn);
+    return rc == SQLITE_ROW;
+}
+
+static bool table_exists(state_db* st, const char* const table)
+{
+    sqlite3_stmt* stmt;
+    bool result;
+
+    result = false;
+    if (sqlite3_prepare_v2(st->writer.db, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?1;", -1, &stmt, NULL) == SQLITE_OK)
+    {
+        sqlite3_bind_text(stmt, 1, table, -1, SQLITE_STATIC);
+        result = sqlite3_step(stmt) == SQLITE_ROW;
+        sqlite3_finalize(stmt);
+    }
+    return result;
+}
+
+/* Older databases kept the full UTF-16 path of each element in the
+ * 'state' table. Its rows are moved to the new tables, and the file is
+ * vacuumed so that it actually shrinks. */
+static bool migrate_state_table(state_db* st)
+{
+    sqlite3_stmt* stmt;
+    bool result;
+    int rc;
+    uint64_t count;
+
+    CHUCHO_C_INFO(st->lgr, "Converting a state database to directory and base name storage");
+    if (!exec_transaction_sql(st, "BEGIN;"))
+        return false;
+    count = 0;
+    result = sqlite3_prepare_v2(st->writer.db, "SELECT name, attributes FROM 'state';", -1, &stmt, NULL) == SQLITE_OK;
+    if (result)
+    {
+        while (result && (rc = sqlite3_step(stmt)) == SQLITE_ROW)
+        {
+            result = insert_row(st,
+                                sqlite3_column_text16(stmt, 0),
+                                sqlite3_column_blob(stmt, 1),
+                                sqlite3_column_bytes(stmt, 1)) == SQLITE_DONE;
+            ++count;
+        }
+        if (result && rc != SQLITE_DONE)
+            result = false;
+        sqlite3_finalize(stmt);
+    }
+    if (result)
+        result = exec_transaction_sql(st, "DROP TABLE 'state';") && exec_transaction_sql(st, "COMMIT;");
+    if (result)
+    {
+        CHUCHO_C_INFO(st->lgr, "Converted %" PRIu64 " state database rows", count);
+        exec_transaction_sql(st, "VACUUM;");
+    }
+    else
+    {
+        CHUCHO_C_ERROR(st->lgr, "Unable to convert the state database: %s", sqlite3_errmsg(st->writer.db));
+        if (!sqlite3_get_autocommit(st->writer.db))
+            exec_transaction_sql(st, "ROLLBACK;");
+    }
+    forget_directory_id(&st->writer);
+    return result;
+}
+
+
 state_db* create_state_db(const UChar* const config_name)
 {
     uds name;
@@ -50,19 +749,24 @@ state_db* create_state_db(const UChar* const config_name)
     int rc;
     state_db* st;
     char* sqlerr;
-    /* These must remain in sync with the anonymous enum values at the top of this file */
-    char* sqls[] =
-    {
-       "INSERT INTO 'state' (name, attributes) VALUES (?1, ?2);",
-       "DELETE FROM 'state' WHERE name = ?1;",
-       "UPDATE 'state' SET attributes = ?1 WHERE name = ?2;",
-       "SELECT attributes FROM 'state' WHERE name = ?1;"
-    };
+    /* Only new databases take the encoding, and nothing is stored as text anyway except meta names */
+    const char* tables =
+        "PRAGMA encoding='UTF-8';"
+        "CREATE TABLE IF NOT EXISTS 'directory' (id INTEGER PRIMARY KEY, path BLOB UNIQUE);"
+        "CREATE TABLE IF NOT EXISTS 'entry' (directory_id INTEGER, basename BLOB, attributes BLOB, UNIQUE (directory_id, basename));";
 
     st = calloc(1, sizeof(state_db));
     st->lgr = chucho_get_logger("file.db");
+    st->name = udsnew(config_name);
+    st->writer_lock = yella_create_mutex();
+    st->guard = yella_create_mutex();
+    st->readers = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(st->readers, reader_destructor, NULL);
+    /* Thread handles are not owned */
+    st->dirty_threads = yella_create_ptr_vector();
+    yella_set_ptr_vector_destructor(st->dirty_threads, NULL, NULL);
     name = create_db_name(config_name);
-    rc = sqlite3_open16(name, &st->db);
+    rc = sqlite3_open16(name, &st->writer.db);
     udsfree(name);
     if (rc != SQLITE_OK)
     {
@@ -70,46 +774,104 @@ state_db* create_state_db(const UChar* const config_name)
         destroy_state_db(st, STATE_DB_ACTION_REMOVE);
         return NULL;
     }
-    sqlite3_extended_result_codes(st->db, 1);
-    rc = sqlite3_exec(st->db,
-                      "CREATE TABLE IF NOT EXISTS 'state' (name TEXT UNIQUE, attributes BLOB);",
+    sqlite3_extended_result_codes(st->writer.db, 1);
+    apply_tuning(st);
+    rc = sqlite3_exec(st->writer.db, tables, NULL, NULL, &sqlerr);
+    if (rc != SQLITE_OK)
+    {
+        CHUCHO_C_FATAL(st->lgr, "Unable to create 'directory' and 'entry' tables: %s", sqlerr);
+        sqlite3_free(sqlerr);
+        destroy_state_db(st, STATE_DB_ACTION_REMOVE);
+        return NULL;
+    }
+    rc = sqlite3_exec(st->writer.db,
+                      "CREATE TABLE IF NOT EXISTS 'meta' (name TEXT UNIQUE, value INTEGER);",
                       NULL,
                       NULL,
                       &sqlerr);
     if (rc != SQLITE_OK)
     {
-        CHUCHO_C_FATAL(st->lgr, "Unable to create 'state' table: %s", sqlerr);
+        CHUCHO_C_FATAL(st->lgr, "Unable to create 'meta' table: %s", sqlerr);
         sqlite3_free(sqlerr);
         destroy_state_db(st, STATE_DB_ACTION_REMOVE);
         return NULL;
     }
-    for (i = 0; i < YELLA_ARRAY_SIZE(sqls); i++)
+    for (i = 0; i < YELLA_ARRAY_SIZE(STMT_SQLS); i++)
     {
-        rc = sqlite3_prepare_v3(st->db,
-                                sqls[i],
+        rc = sqlite3_prepare_v3(st->writer.db,
+                                STMT_SQLS[i],
                                 -1,
                                 SQLITE_PREPARE_PERSISTENT,
-                                &st->stmts[i],
+                                &st->writer.stmts[i],
                                 NULL);
         if (rc != SQLITE_OK)
         {
-            CHUCHO_C_FATAL(st->lgr, "Unable to prepare statement '%s': %s", st->stmts[i], sqlite3_errmsg(st->db));
+            CHUCHO_C_FATAL(st->lgr, "Unable to prepare statement '%s': %s", STMT_SQLS[i], sqlite3_errmsg(st->writer.db));
             destroy_state_db(st, STATE_DB_ACTION_REMOVE);
             return NULL;
         }
     }
-    st->name = udsnew(config_name);
+    st->max_batch_rows = *yella_settings_get_uint(u"file", u"db-batch-max-rows");
+    st->max_batch_micros = *yella_settings_get_uint(u"file", u"db-batch-max-milliseconds") * 1000;
+    if (table_exists(st, "state") && !migrate_state_table(st))
+    {
+        /* What was last seen is lost, so everything is reported as added on the next scan */
+        CHUCHO_C_ERROR(st->lgr, "Discarding the old state");
+        exec_transaction_sql(st, "DROP TABLE IF EXISTS 'state';");
+    }
     return st;
 }
 
+bool begin_state_db_transaction(state_db* st)
+{
+    /* The transaction itself waits for the first write */
+    lock_writer(st);
+    ++st->batch_users;
+    unlock_writer(st);
+    return true;
+}
+
+bool commit_state_db_transaction(state_db* st)
+{
+    bool result;
+
+    lock_writer(st);
+    if (st->batch_users > 0)
+        --st->batch_users;
+    result = commit_open_transaction(st);
+    if (st->checkpoint_micros > 0 &&
+        yella_microseconds_since_epoch() - st->last_checkpoint_micros >= st->checkpoint_micros)
+    {
+        checkpoint(st);
+    }
+    unlock_writer(st);
+    return result;
+}
+
 bool delete_from_state_db(state_db* st, const UChar* const elem_name)
 {
     int rc;
     bool result;
     char* utf8;
+    char* dir;
+    char* base;
+    sqlite3_int64 dir_id;
 
-    sqlite3_bind_text16(st->stmts[STMT_DELETE], 1, elem_name, -1, SQLITE_STATIC);
-    rc = sqlite3_step(st->stmts[STMT_DELETE]);
+    lock_writer(st);
+    open_batch(st);
+    split_name(elem_name, &dir, &base);
+    /* If the directory is not there, then there is nothing to delete */
+    rc = get_directory_id(st, &st->writer, dir, false, &dir_id);
+    if (rc == SQLITE_ROW)
+    {
+        sqlite3_bind_int64(st->writer.stmts[STMT_DELETE], 1, dir_id);
+        sqlite3_bind_blob(st->writer.stmts[STMT_DELETE], 2, base, strlen(base), SQLITE_STATIC);
+        rc = sqlite3_step(st->writer.stmts[STMT_DELETE]);
+        if (rc == SQLITE_DONE && sqlite3_changes(st->writer.db) > 0)
+            rc = delete_directory_if_empty(st, dir_id);
+    }
+    free(base);
+    free(dir);
     if (rc == SQLITE_DONE)
     {
         result = true;
@@ -117,57 +879,148 @@ bool delete_from_state_db(state_db* st, const UChar* const elem_name)
     else
     {
         utf8 = yella_to_utf8(elem_name);
-        CHUCHO_C_ERROR(st->lgr, "Error deleting '%s': %s", utf8, sqlite3_errmsg(st->db));
+        CHUCHO_C_ERROR(st->lgr, "Error deleting '%s': %s", utf8, sqlite3_errmsg(st->writer.db));
         free(utf8);
         result = false;
     }
-    sqlite3_clear_bindings(st->stmts[STMT_DELETE]);
-    sqlite3_reset(st->stmts[STMT_DELETE]);
+    sqlite3_clear_bindings(st->writer.stmts[STMT_DELETE]);
+    sqlite3_reset(st->writer.stmts[STMT_DELETE]);
+    if (result)
+        count_batched_write(st);
+    else
+        check_transaction_after_error(st);
+    unlock_writer(st);
     return result;
-
 }
 
 void destroy_state_db(state_db* st, state_db_removal_action ra)
 {
-    int i;
     uds name;
     char* utf8;
 
-    for (i = 0; i < YELLA_ARRAY_SIZE(st->stmts); i++)
-        sqlite3_finalize(st->stmts[i]);
-    sqlite3_close(st->db);
+    lock_writer(st);
+    commit_open_transaction(st);
+    unlock_writer(st);
+    /* Readers go first, so that the last connection to close cleans up the WAL */
+    yella_destroy_ptr_vector(st->readers);
+    yella_destroy_ptr_vector(st->dirty_threads);
+    close_connection(&st->writer);
     if (ra == STATE_DB_ACTION_REMOVE)
     {
         name = create_db_name(st->name);
         yella_remove_file(name);
+        /* These are normally removed on close, but not if something went wrong */
+        name = udscat(name, u"-wal");
+        yella_remove_file(name);
+        udsrange(name, 0, -5);
+        name = udscat(name, u"-shm");
+        yella_remove_file(name);
         udsfree(name);
     }
     chucho_release_logger(st->lgr);
     udsfree(st->name);
+    yella_destroy_mutex(st->guard);
+    yella_destroy_mutex(st->writer_lock);
     free(st);
 }
 
 element* get_element_from_state_db(state_db* st, const UChar* const elem_name)
 {
-    int rc;
+    stored_element se;
+
+    se.name = elem_name;
+    se.elem = NULL;
+    select_attributes(st, elem_name, create_stored_element, &se);
+    return se.elem;
+}
+
+bool get_packed_attributes_from_state_db(state_db* st,
+                                         const UChar* const elem_name,
+                                         yella_arena* arena,
+                                         const uint8_t** packed_attrs)
+{
+    packed_copy pc;
+
+    pc.arena = arena;
+    pc.packed = NULL;
+    if (!select_attributes(st, elem_name, copy_packed_attributes, &pc))
+        return false;
+    *packed_attrs = pc.packed;
+    return true;
+}
+
+yella_ptr_vector* get_state_db_names_under(state_db* st, const UChar* const dir)
+{
+    yella_ptr_vector* result;
     char* utf8;
-    element* result;
+    size_t len;
+    char* lower;
+    char* upper;
+    int rc;
+    connection* conn;
 
-    result = NULL;
-    sqlite3_bind_text16(st->stmts[STMT_SELECT_ATTRS], 1, elem_name, -1, SQLITE_STATIC);
-    rc = sqlite3_step(st->stmts[STMT_SELECT_ATTRS]);
-    if (rc == SQLITE_ROW)
+    result = yella_create_uds_ptr_vector();
+    conn = lock_reading_connection(st);
+    utf8 = yella_to_utf8(dir);
+    len = strlen(utf8);
+    if (len > 0 && utf8[len - 1] == YELLA_DIR_SEP[0])
+        utf8[--len] = 0;
+    /* Everything below dir is in [dir + sep, dir + (sep + 1)) */
+    lower = malloc(len + 2);
+    memcpy(lower, utf8, len);
+    lower[len] = (char)YELLA_DIR_SEP[0];
+    lower[len + 1] = 0;
+    upper = strdup(lower);
+    ++upper[len];
+    sqlite3_bind_blob(conn->stmts[STMT_SELECT_SUBTREE], 1, utf8, len, SQLITE_STATIC);
+    sqlite3_bind_blob(conn->stmts[STMT_SELECT_SUBTREE], 2, lower, len + 1, SQLITE_STATIC);
+    sqlite3_bind_blob(conn->stmts[STMT_SELECT_SUBTREE], 3, upper, len + 1, SQLITE_STATIC);
+    while ((rc = sqlite3_step(conn->stmts[STMT_SELECT_SUBTREE])) == SQLITE_ROW)
     {
-        result = create_element_with_attrs(elem_name, sqlite3_column_blob(st->stmts[STMT_SELECT_ATTRS], 0));
+        /* The root directory itself has an empty base name */
+        if (sqlite3_column_bytes(conn->stmts[STMT_SELECT_SUBTREE], 1) > 0)
+        {
+            yella_push_back_ptr_vector(result,
+                                       join_name(sqlite3_column_blob(conn->stmts[STMT_SELECT_SUBTREE], 0),
+                                                 sqlite3_column_bytes(conn->stmts[STMT_SELECT_SUBTREE], 0),
+                                                 sqlite3_column_blob(conn->stmts[STMT_SELECT_SUBTREE], 1),
+                                                 sqlite3_column_bytes(conn->stmts[STMT_SELECT_SUBTREE], 1)));
+        }
     }
+    if (rc != SQLITE_DONE)
+        CHUCHO_C_ERROR(st->lgr, "Error getting the names under '%s': %s", utf8, sqlite3_errmsg(conn->db));
+    sqlite3_clear_bindings(conn->stmts[STMT_SELECT_SUBTREE]);
+    sqlite3_reset(conn->stmts[STMT_SELECT_SUBTREE]);
+    unlock_reading_connection(st, conn);
+    free(upper);
+    free(lower);
+    free(utf8);
+    return result;
+}
+
+uint64_t increment_state_db_scan_count(state_db* st)
+{
+    int rc;
+    uint64_t result;
+
+    lock_writer(st);
+    result = 0;
+    sqlite3_bind_text(st->writer.stmts[STMT_SELECT_META], 1, "scan-count", -1, SQLITE_STATIC);
+    rc = sqlite3_step(st->writer.stmts[STMT_SELECT_META]);
+    if (rc == SQLITE_ROW)
+        result = sqlite3_column_int64(st->writer.stmts[STMT_SELECT_META], 0);
     else if (rc != SQLITE_DONE)
-    {
-        utf8 = yella_to_utf8(elem_name);
-        CHUCHO_C_DEBUG(st->lgr, "Error getting attributes for '%s': %s", utf8, sqlite3_errmsg(st->db));
-        free(utf8);
-    }
-    sqlite3_clear_bindings(st->stmts[STMT_SELECT_ATTRS]);
-    sqlite3_reset(st->stmts[STMT_SELECT_ATTRS]);
+        CHUCHO_C_ERROR(st->lgr, "Error getting the scan count: %s", sqlite3_errmsg(st->writer.db));
+    sqlite3_clear_bindings(st->writer.stmts[STMT_SELECT_META]);
+    sqlite3_reset(st->writer.stmts[STMT_SELECT_META]);
+    ++result;
+    sqlite3_bind_text(st->writer.stmts[STMT_REPLACE_META], 1, "scan-count", -1, SQLITE_STATIC);
+    sqlite3_bind_int64(st->writer.stmts[STMT_REPLACE_META], 2, result);
+    if (sqlite3_step(st->writer.stmts[STMT_REPLACE_META]) != SQLITE_DONE)
+        CHUCHO_C_ERROR(st->lgr, "Error setting the scan count: %s", sqlite3_errmsg(st->writer.db));
+    sqlite3_clear_bindings(st->writer.stmts[STMT_REPLACE_META]);
+    sqlite3_reset(st->writer.stmts[STMT_REPLACE_META]);
+    unlock_writer(st);
     return result;
 }
 
@@ -179,10 +1032,10 @@ bool insert_into_state_db(state_db* st, const element* const elem)
     bool result;
     char* utf8;
 
+    lock_writer(st);
+    open_batch(st);
     attrs = pack_element_attributes(elem, &sz);
-    sqlite3_bind_text16(st->stmts[STMT_INSERT], 1, element_name(elem), -1, SQLITE_STATIC);
-    sqlite3_bind_blob(st->stmts[STMT_INSERT], 2, attrs, sz, SQLITE_STATIC);
-    rc = sqlite3_step(st->stmts[STMT_INSERT]);
+    rc = insert_row(st, element_name(elem), attrs, sz);
     free(attrs);
     if (rc == SQLITE_DONE)
     {
@@ -191,27 +1044,44 @@ bool insert_into_state_db(state_db* st, const element* const elem)
     else
     {
         utf8 = yella_to_utf8(element_name(elem));
-        CHUCHO_C_ERROR(st->lgr, "Error inserting '%s': %s", utf8, sqlite3_errmsg(st->db));
+        CHUCHO_C_ERROR(st->lgr, "Error inserting '%s': %s", utf8, sqlite3_errmsg(st->writer.db));
         free(utf8);
         result = false;
     }
-    sqlite3_clear_bindings(st->stmts[STMT_INSERT]);
-    sqlite3_reset(st->stmts[STMT_INSERT]);
+    if (result)
+        count_batched_write(st);
+    else
+        check_transaction_after_error(st);
+    unlock_writer(st);
     return result;
 }
 
 bool update_into_state_db(state_db* st, const element* const elem)
 {
     uint8_t* attrs;
+    char* dir;
+    char* base;
+    sqlite3_int64 dir_id;
     size_t sz;
     int rc;
     bool result;
     char* utf8;
 
+    lock_writer(st);
+    open_batch(st);
     attrs = pack_element_attributes(elem, &sz);
-    sqlite3_bind_blob(st->stmts[STMT_UPDATE], 1, attrs, sz, SQLITE_STATIC);
-    sqlite3_bind_text16(st->stmts[STMT_UPDATE], 2, element_name(elem), -1, SQLITE_STATIC);
-    rc = sqlite3_step(st->stmts[STMT_UPDATE]);
+    split_name(element_name(elem), &dir, &base);
+    /* If the directory is not there, then there is nothing to update */
+    rc = get_directory_id(st, &st->writer, dir, false, &dir_id);
+    if (rc == SQLITE_ROW)
+    {
+        sqlite3_bind_blob(st->writer.stmts[STMT_UPDATE], 1, attrs, sz, SQLITE_STATIC);
+        sqlite3_bind_int64(st->writer.stmts[STMT_UPDATE], 2, dir_id);
+        sqlite3_bind_blob(st->writer.stmts[STMT_UPDATE], 3, base, strlen(base), SQLITE_STATIC);
+        rc = sqlite3_step(st->writer.stmts[STMT_UPDATE]);
+    }
+    free(base);
+    free(dir);
     free(attrs);
     if (rc == SQLITE_DONE)
     {
@@ -220,15 +1090,54 @@ bool update_into_state_db(state_db* st, const element* const elem)
     else
     {
         utf8 = yella_to_utf8(element_name(elem));
-        CHUCHO_C_ERROR(st->lgr, "Error updating '%s': %s", utf8, sqlite3_errmsg(st->db));
+        CHUCHO_C_ERROR(st->lgr, "Error updating '%s': %s", utf8, sqlite3_errmsg(st->writer.db));
         free(utf8);
         result = false;
     }
-    sqlite3_clear_bindings(st->stmts[STMT_UPDATE]);
-    sqlite3_reset(st->stmts[STMT_UPDATE]);
+    sqlite3_clear_bindings(st->writer.stmts[STMT_UPDATE]);
+    sqlite3_reset(st->writer.stmts[STMT_UPDATE]);
+    if (result)
+        count_batched_write(st);
+    else
+        check_transaction_after_error(st);
+    unlock_writer(st);
     return result;
 }
 
+void release_state_db_reader(state_db* st)
+{
+    void* self;
+    connection* conn;
+    int i;
+
+    self = yella_this_thread();
+    yella_lock_mutex(st->guard);
+    for (i = 0; i < yella_ptr_vector_size(st->readers); i++)
+    {
+        conn = yella_ptr_vector_at(st->readers, i);
+        if (conn->thread == self)
+        {
+            yella_erase_ptr_vector_at(st->readers, i);
+            break;
+        }
+    }
+    yella_unlock_mutex(st->guard);
+}
+
+void rollback_state_db_transaction(state_db* st)
+{
+    lock_writer(st);
+    /* The remembered directory may have been inserted in the discarded transaction */
+    forget_directory_id(&st->writer);
+    if (!sqlite3_get_autocommit(st->writer.db))
+        exec_transaction_sql(st, "ROLLBACK;");
+    if (st->in_transaction)
+        end_transaction(st);
+    if (st->batch_users > 0)
+        --st->batch_users;
+    unlock_writer(st);
+}
+
 const UChar* state_db_name(const state_db* const sdb)
 {
     return sdb->name;
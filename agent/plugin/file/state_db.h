@@ -3,6 +3,7 @@
 
 #include "export.h"
 #include "plugin/file/element.h"
+#include "common/ptr_vector.h"
 #include <stdbool.h>
 
 typedef struct state_db state_db;
@@ -13,12 +14,44 @@ typedef enum
     STATE_DB_ACTION_REMOVE
 } state_db_removal_action;
 
+/* A state db may be shared by threads. Writes go one at a time through a
+ * single connection. In WAL mode every thread reads through a connection of
+ * its own, so reads see only committed data and do not wait on the writer,
+ * except that a thread with uncommitted writes reads through the writer to
+ * see them. */
+
+/* Writes made while any thread is between begin and commit are grouped
+ * into transactions of at most the file settings db-batch-max-rows rows
+ * and db-batch-max-milliseconds milliseconds. A commit commits whatever is
+ * open, including the writes of other threads. Without a begin anywhere,
+ * each write commits by itself. */
+YELLA_PRIV_EXPORT bool begin_state_db_transaction(state_db* st);
+YELLA_PRIV_EXPORT bool commit_state_db_transaction(state_db* st);
 YELLA_PRIV_EXPORT state_db* create_state_db(const UChar* const config_name);
 YELLA_PRIV_EXPORT bool delete_from_state_db(state_db* st, const UChar* const elem_name);
+/* Destroying the database commits any open transaction */
 YELLA_PRIV_EXPORT void destroy_state_db(state_db* st, state_db_removal_action ra);
 YELLA_PRIV_EXPORT element* get_element_from_state_db(state_db* st, const UChar* const elem_name);
+/* Returns false if there is no such element. Otherwise packed_attrs points
+ * at a copy of the stored bytes in arena, which may be NULL if the element
+ * has neither attributes nor a stamp. The bytes are good until the arena
+ * is reset. */
+YELLA_PRIV_EXPORT bool get_packed_attributes_from_state_db(state_db* st,
+                                                           const UChar* const elem_name,
+                                                           yella_arena* arena,
+                                                           const uint8_t** packed_attrs);
+/* Returns a vector of uds holding the names of all stored elements below dir,
+ * at any depth, but not dir itself. This uses an index, so it is cheap. */
+YELLA_PRIV_EXPORT yella_ptr_vector* get_state_db_names_under(state_db* st, const UChar* const dir);
+/* Returns the number of scans, including this one, run against the database */
+YELLA_PRIV_EXPORT uint64_t increment_state_db_scan_count(state_db* st);
 YELLA_PRIV_EXPORT bool insert_into_state_db(state_db* st, const element* const elem);
 YELLA_PRIV_EXPORT bool update_into_state_db(state_db* st, const element* const elem);
+/* Closes the calling thread's reader connection, if it has one. A thread
+ * that has read from st should call this before it exits. */
+YELLA_PRIV_EXPORT void release_state_db_reader(state_db* st);
+/* Discards the writes since the last commit, including those of other threads */
+YELLA_PRIV_EXPORT void rollback_state_db_transaction(state_db* st);
 YELLA_PRIV_EXPORT const UChar* state_db_name(const state_db* const sdb);
 
 #endif
@@ -3,23 +3,29 @@
 #include "common/settings.h"
 #include "common/text_util.h"
 #include <unicode/ustring.h>
-#include <unicode/udat.h>
 #include <chucho/log.h>
+#include <inttypes.h>
 
 typedef struct state_db_node
 {
     const UChar* name;
     state_db* db;
-    UDate time_last_used;
     char color;
     struct state_db_node* left;
     struct state_db_node* right;
+    /* The LRU list runs from most to least recently used */
+    struct state_db_node* newer;
+    struct state_db_node* older;
 } state_db_node;
 
 struct state_db_pool
 {
     state_db_node* nodes;
     size_t count;
+    state_db_node* newest;
+    state_db_node* oldest;
+    size_t max_dbs;
+    state_db_pool_stats stats;
 };
 
 #define STATE_DB_COMPARATOR(lhs, rhs) (u_strcmp(lhs->name, rhs->name))
@@ -27,11 +33,37 @@ struct state_db_pool
 SGLIB_DEFINE_RBTREE_PROTOTYPES(state_db_node, left, right, color, STATE_DB_COMPARATOR);
 SGLIB_DEFINE_RBTREE_FUNCTIONS(state_db_node, left, right, color, STATE_DB_COMPARATOR);
 
+static void unlink_lru(state_db_pool* pool, state_db_node* node)
+{
+    if (node->newer == NULL)
+        pool->newest = node->older;
+    else
+        node->newer->older = node->older;
+    if (node->older == NULL)
+        pool->oldest = node->newer;
+    else
+        node->older->newer = node->newer;
+    node->newer = NULL;
+    node->older = NULL;
+}
+
+static void push_newest(state_db_pool* pool, state_db_node* node)
+{
+    node->newer = NULL;
+    node->older = pool->newest;
+    if (pool->newest == NULL)
+        pool->oldest = node;
+    else
+        pool->newest->newer = node;
+    pool->newest = node;
+}
+
 state_db_pool* create_state_db_pool(void)
 {
     state_db_pool* result;
 
     result = calloc(1, sizeof(state_db_pool));
+    result->max_dbs = *yella_settings_get_uint(u"file", u"max-spool-dbs");
     return result;
 }
 
@@ -40,6 +72,11 @@ void destroy_state_db_pool(state_db_pool* pool)
     state_db_node* node;
     struct sglib_state_db_node_iterator itor;
 
+    CHUCHO_C_INFO("file.db",
+                  "State database pool: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64 " evictions",
+                  pool->stats.hits,
+                  pool->stats.misses,
+                  pool->stats.evictions);
     for (node = sglib_state_db_node_it_init(&itor, pool->nodes);
          node != NULL;
          node = sglib_state_db_node_it_next(&itor))
@@ -50,41 +87,35 @@ void destroy_state_db_pool(state_db_pool* pool)
     free(pool);
 }
 
+void get_state_db_pool_stats(const state_db_pool* const pool, state_db_pool_stats* stats)
+{
+    *stats = pool->stats;
+}
+
 state_db* get_state_db_from_pool(state_db_pool* pool, const UChar* const config_name)
 {
-    state_db_node* node;
-    struct sglib_state_db_node_iterator itor;
     state_db_node* oldest;
     state_db_node* found;
     state_db_node to_find;
-    size_t max_dbs;
     char* utf8;
 
     to_find.name = config_name;
     found = sglib_state_db_node_find_member(pool->nodes, &to_find);
     if (found == NULL)
     {
-        max_dbs = *yella_settings_get_uint(u"file", u"max-spool-dbs");
-        if (pool->count >= max_dbs)
+        ++pool->stats.misses;
+        if (pool->count >= pool->max_dbs && pool->oldest != NULL)
         {
-            oldest = NULL;
-            for (node = sglib_state_db_node_it_init(&itor, pool->nodes);
-                 node != NULL;
-                 node = sglib_state_db_node_it_next(&itor))
-            {
-                if (oldest == NULL || node->time_last_used < oldest->time_last_used)
-                    oldest = node;
-            }
-            if (oldest != NULL)
-            {
-                utf8 = yella_to_utf8(oldest->name);
-                CHUCHO_C_INFO("file.db", "Too many open state databases (%zu open, %zu maximum). Closing '%s'.", pool->count, max_dbs, utf8);
-                free(utf8);
-                sglib_state_db_node_delete(&pool->nodes, oldest);
-                destroy_state_db(oldest->db, STATE_DB_ACTION_KEEP);
-                free(oldest);
-                --pool->count;
-            }
+            oldest = pool->oldest;
+            utf8 = yella_to_utf8(oldest->name);
+            CHUCHO_C_INFO("file.db", "Too many open state databases (%zu open, %zu maximum). Closing '%s'.", pool->count, pool->max_dbs, utf8);
+            free(utf8);
+            unlink_lru(pool, oldest);
+            sglib_state_db_node_delete(&pool->nodes, oldest);
+            destroy_state_db(oldest->db, STATE_DB_ACTION_KEEP);
+            free(oldest);
+            --pool->count;
+            ++pool->stats.evictions;
         }
         found = malloc(sizeof(state_db_node));
         found->db = create_state_db(config_name);
@@ -98,9 +129,18 @@ state_db* get_state_db_from_pool(state_db_pool* pool, const UChar* const config_
         }
         found->name = state_db_name(found->db);
         sglib_state_db_node_add(&pool->nodes, found);
+        push_newest(pool, found);
         ++pool->count;
     }
-    found->time_last_used = ucal_getNow();
+    else
+    {
+        ++pool->stats.hits;
+        if (found != pool->newest)
+        {
+            unlink_lru(pool, found);
+            push_newest(pool, found);
+        }
+    }
     return found->db;
 }
 
@@ -112,6 +152,7 @@ void remove_state_db_from_pool(state_db_pool* pool, const UChar* const config_na
     to_find.name = config_name;
     if (sglib_state_db_node_delete_if_member(&pool->nodes, &to_find, &removed))
     {
+        unlink_lru(pool, removed);
         destroy_state_db(removed->db, STATE_DB_ACTION_REMOVE);
         free(removed);
         --pool->count;
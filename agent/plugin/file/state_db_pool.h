@@ -5,8 +5,20 @@
 
 typedef struct state_db_pool state_db_pool;
 
+typedef struct state_db_pool_stats
+{
+    /* Gets that found the database open */
+    uint64_t hits;
+    /* Gets that had to open the database */
+    uint64_t misses;
+    /* Databases closed to stay within max-spool-dbs */
+    uint64_t evictions;
+} state_db_pool_stats;
+
 YELLA_PRIV_EXPORT state_db_pool* create_state_db_pool(void);
 YELLA_PRIV_EXPORT void destroy_state_db_pool(state_db_pool* pool);
+YELLA_PRIV_EXPORT void get_state_db_pool_stats(const state_db_pool* const pool, state_db_pool_stats* stats);
+/* When the pool is full, the least recently used database is closed */
 YELLA_PRIV_EXPORT state_db* get_state_db_from_pool(state_db_pool* pool, const UChar* const config_name);
 YELLA_PRIV_EXPORT void remove_state_db_from_pool(state_db_pool* pool, const UChar* const config_name);
 YELLA_PRIV_EXPORT size_t state_db_pool_size(const state_db_pool* const pool);
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2016 Will Mason
+ * 
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ * 
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ * 
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "common/arena.h"
+#include <unicode/ustring.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+
+static void simple(void** arg)
+{
+    yella_arena* ar;
+    void* p1;
+    void* p2;
+    UChar* str;
+    int i;
+
+    ar = yella_create_arena(1024);
+    assert_int_equal(yella_arena_capacity(ar), 1024);
+    p1 = yella_arena_alloc(ar, 3);
+    assert_non_null(p1);
+    assert_int_equal((uintptr_t)p1 % alignof(max_align_t), 0);
+    p2 = yella_arena_alloc(ar, 5);
+    assert_ptr_not_equal(p1, p2);
+    assert_int_equal((uintptr_t)p2 % alignof(max_align_t), 0);
+    str = yella_arena_copy_string(ar, u"my dog has fleas");
+    assert_true(u_strcmp(str, u"my dog has fleas") == 0);
+    p1 = yella_arena_calloc(ar, 100);
+    for (i = 0; i < 100; i++)
+        assert_int_equal(((unsigned char*)p1)[i], 0);
+    assert_int_equal(yella_arena_capacity(ar), 1024);
+    yella_destroy_arena(ar);
+}
+
+static void grow_and_reset(void** arg)
+{
+    yella_arena* ar;
+    void* first;
+    void* p;
+    int i;
+
+    ar = yella_create_arena(1024);
+    first = yella_arena_alloc(ar, 16);
+    for (i = 0; i < 200; i++)
+    {
+        p = yella_arena_alloc(ar, 16);
+        memset(p, 0xff, 16);
+    }
+    assert_true(yella_arena_capacity(ar) > 1024);
+    /* Too big for a block */
+    p = yella_arena_alloc(ar, 5000);
+    memset(p, 0xff, 5000);
+    assert_true(yella_arena_capacity(ar) >= 5000 + 4 * 1024);
+    yella_reset_arena(ar);
+    /* The big one is gone, but the blocks are kept */
+    assert_int_equal(yella_arena_capacity(ar), 4 * 1024);
+    assert_ptr_equal(yella_arena_alloc(ar, 16), first);
+    for (i = 0; i < 200; i++)
+        yella_arena_alloc(ar, 16);
+    assert_int_equal(yella_arena_capacity(ar), 4 * 1024);
+    yella_destroy_arena(ar);
+}
+
+int main()
+{
+    const struct CMUnitTest tests[] =
+    {
+        cmocka_unit_test(simple),
+        cmocka_unit_test(grow_and_reset)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
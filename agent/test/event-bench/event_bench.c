@@ -0,0 +1,902 @@
+/*
+ * Copyright 2016 Will Mason
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ * Drives file system activity past an event source and reports how long
+ * changes take to reach a parcel, and how many never do. The modes are:
+ *
+ *   storm   Creates, modifies, renames and deletes files in a temporary
+ *           tree at a fixed rate, with the file plugin monitoring it.
+ *   record  Writes what an event source reports to a file. The events
+ *           come from a directory that is watched for a while, or from a
+ *           storm when no directory is given.
+ *   replay  Performs the operations of a recording again in a temporary
+ *           tree, with the file plugin monitoring it, at a multiple of
+ *           the recorded speed.
+ *
+ * A recording has a header of lines starting with '#', and then one line
+ * per event of "<microseconds from start>\t<kind>\t<relative name>". The
+ * kind is what was found when the event arrived: 'F' for a file, 'D' for
+ * a directory, 'X' for nothing, and 'O' for lost events below a
+ * directory.
+ */
+
+#include "plugin/plugin.h"
+#include "plugin/file/event_source.h"
+#include "agent/argparse.h"
+#include "common/compression.h"
+#include "common/file.h"
+#include "common/macro_util.h"
+#include "common/settings.h"
+#include "common/sglib.h"
+#include "common/text_util.h"
+#include "common/thread.h"
+#include "common/time_util.h"
+#include "file_builder.h"
+#include "file_reader.h"
+#include <chucho/finalize.h>
+#include <unicode/ucal.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CONFIG_NAME "event-bench"
+#define RECIPIENT u"event-bench"
+/* Of the operations on a slot that already holds a file. The rest are deletions. */
+#define STORM_MODIFY_PERCENT 50
+#define STORM_RENAME_PERCENT 20
+/* Time for the event source to start watching before any operation, and
+ * for the last events to arrive when recording */
+#define SETTLE_MILLISECONDS 1000
+
+/* The file plugin is linked directly, rather than loaded */
+YELLA_EXPORT yella_plugin* plugin_start(const yella_agent_api* api, void* agnt);
+YELLA_EXPORT yella_rc plugin_stop(void* udata);
+
+typedef struct options
+{
+    const char* dir;
+    const char* file;
+    const char* work_dir;
+    int rate;
+    int seconds;
+    int files;
+    int dirs;
+    float speed;
+    int send_latency;
+    int coalesce;
+    int drain;
+    int seed;
+    int keep;
+} options;
+
+typedef struct name_node
+{
+    char* name;
+    /* The oldest operation not yet covered by a report, or zero */
+    UDate pending_since;
+    UDate last_op;
+    bool exists;
+    bool reported_present;
+    char color;
+    struct name_node* left;
+    struct name_node* right;
+} name_node;
+
+typedef struct bench
+{
+    yella_mutex* guard;
+    /* Absolute, with no trailing separator */
+    char* root;
+    name_node* names;
+    size_t name_count;
+    /* In milliseconds */
+    double* latencies;
+    size_t latency_count;
+    size_t latency_capacity;
+    uint64_t ops;
+    uint64_t op_errors;
+    uint64_t parcels;
+    uint64_t states;
+    uint64_t unsolicited;
+    FILE* recording;
+    uint64_t recording_start;
+    uint64_t events;
+    uint64_t overflows;
+    uint64_t skipped;
+} bench;
+
+#define NAME_NODE_COMPARATOR(lhs, rhs) (strcmp(lhs->name, rhs->name))
+
+SGLIB_DEFINE_RBTREE_PROTOTYPES(name_node, left, right, color, NAME_NODE_COMPARATOR);
+SGLIB_DEFINE_RBTREE_FUNCTIONS(name_node, left, right, color, NAME_NODE_COMPARATOR);
+
+/* The prefix is in lhs, so that all names under a directory compare equal */
+static int prefix_comparator(name_node* lhs, name_node* rhs)
+{
+    return strncmp(lhs->name, rhs->name, strlen(lhs->name));
+}
+
+static int latency_comparator(const void* lhs, const void* rhs)
+{
+    double l;
+    double r;
+
+    l = *(const double*)lhs;
+    r = *(const double*)rhs;
+    return (l > r) - (l < r);
+}
+
+/* The bench is locked on entry */
+static name_node* find_or_add_name(bench* bch, const char* const name)
+{
+    name_node to_find;
+    name_node* result;
+
+    to_find.name = (char*)name;
+    result = sglib_name_node_find_member(bch->names, &to_find);
+    if (result == NULL)
+    {
+        result = calloc(1, sizeof(name_node));
+        result->name = strdup(name);
+        sglib_name_node_add(&bch->names, result);
+        ++bch->name_count;
+    }
+    return result;
+}
+
+static void touch_name(bench* bch, const char* const name, bool exists)
+{
+    name_node* nn;
+    UDate now;
+
+    now = ucal_getNow();
+    yella_lock_mutex(bch->guard);
+    nn = find_or_add_name(bch, name);
+    if (nn->pending_since == 0)
+        nn->pending_since = now;
+    nn->last_op = now;
+    nn->exists = exists;
+    ++bch->ops;
+    yella_unlock_mutex(bch->guard);
+}
+
+/* Everything known below a removed directory is gone with it */
+static void touch_names_under(bench* bch, const char* const dir)
+{
+    struct sglib_name_node_iterator itor;
+    name_node to_find;
+    name_node* cur;
+    UDate now;
+
+    to_find.name = malloc(strlen(dir) + 2);
+    strcpy(to_find.name, dir);
+    strcat(to_find.name, "/");
+    now = ucal_getNow();
+    yella_lock_mutex(bch->guard);
+    for (cur = sglib_name_node_it_init_on_equal(&itor, bch->names, prefix_comparator, &to_find);
+         cur != NULL;
+         cur = sglib_name_node_it_next(&itor))
+    {
+        if (cur->exists)
+        {
+            if (cur->pending_since == 0)
+                cur->pending_since = now;
+            cur->last_op = now;
+            cur->exists = false;
+        }
+    }
+    yella_unlock_mutex(bch->guard);
+    free(to_find.name);
+}
+
+static void count_op_error(bench* bch, const char* const what, const char* const name)
+{
+    fprintf(stderr, "Could not %s '%s': %s\n", what, name, strerror(errno));
+    yella_lock_mutex(bch->guard);
+    ++bch->op_errors;
+    yella_unlock_mutex(bch->guard);
+}
+
+/* Directories made along the way are operations, too */
+static void make_parents(bench* bch, const char* const name)
+{
+    char* dir;
+    char* sep;
+
+    if (strlen(name) <= strlen(bch->root))
+        return;
+    dir = strdup(name);
+    for (sep = strchr(dir + strlen(bch->root) + 1, '/'); sep != NULL; sep = strchr(sep + 1, '/'))
+    {
+        *sep = 0;
+        if (mkdir(dir, 0755) == 0)
+            touch_name(bch, dir, true);
+        else if (errno != EEXIST)
+            count_op_error(bch, "create directory", dir);
+        *sep = '/';
+    }
+    free(dir);
+}
+
+/* Files only ever grow, so that every write is a change that must be reported */
+static void write_file(bench* bch, const char* const name)
+{
+    int fd;
+
+    make_parents(bch, name);
+    fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd == -1 || write(fd, "event-bench\n", 12) != 12)
+    {
+        count_op_error(bch, "write", name);
+    }
+    else
+    {
+        touch_name(bch, name, true);
+    }
+    if (fd != -1)
+        close(fd);
+}
+
+static void make_directory(bench* bch, const char* const name)
+{
+    make_parents(bch, name);
+    if (mkdir(name, 0755) == 0)
+        touch_name(bch, name, true);
+    else if (errno != EEXIST)
+        count_op_error(bch, "create directory", name);
+}
+
+static void remove_name(bench* bch, const char* const name)
+{
+    yella_file_type ftype;
+    UChar* utf16;
+    yella_rc rc;
+
+    utf16 = yella_from_utf8(name);
+    if (yella_get_file_type(utf16, &ftype, NULL) == YELLA_NO_ERROR)
+    {
+        rc = (ftype == YELLA_FILE_TYPE_DIRECTORY) ? yella_remove_all(utf16) : yella_remove_file(utf16);
+        if (rc == YELLA_NO_ERROR)
+        {
+            if (ftype == YELLA_FILE_TYPE_DIRECTORY)
+                touch_names_under(bch, name);
+            touch_name(bch, name, false);
+        }
+        else
+        {
+            count_op_error(bch, "remove", name);
+        }
+    }
+    free(utf16);
+}
+
+static void rename_file(bench* bch, const char* const from, const char* const to)
+{
+    make_parents(bch, to);
+    if (rename(from, to) == 0)
+    {
+        touch_name(bch, from, false);
+        touch_name(bch, to, true);
+    }
+    else
+    {
+        count_op_error(bch, "rename", from);
+    }
+}
+
+static void sleep_until(uint64_t due_micros)
+{
+    uint64_t now;
+
+    now = yella_microseconds_since_epoch();
+    if (due_micros > now + 1000)
+        yella_sleep_this_thread_milliseconds((due_micros - now) / 1000);
+}
+
+static void run_storm(bench* bch, const options* const opts)
+{
+    uint64_t total;
+    uint64_t i;
+    uint64_t start;
+    bool* present;
+    int slot;
+    int other;
+    int pct;
+    char name[PATH_MAX];
+    char other_name[PATH_MAX];
+
+    total = (uint64_t)opts->rate * opts->seconds;
+    present = calloc(opts->files, sizeof(bool));
+    srand(opts->seed);
+    start = yella_microseconds_since_epoch();
+    for (i = 0; i < total; i++)
+    {
+        sleep_until(start + i * 1000000 / opts->rate);
+        slot = rand() % opts->files;
+        snprintf(name, sizeof(name), "%s/d%d/f%d", bch->root, slot % opts->dirs, slot);
+        pct = rand() % 100;
+        if (!present[slot] || pct < STORM_MODIFY_PERCENT)
+        {
+            write_file(bch, name);
+            present[slot] = true;
+        }
+        else if (pct < STORM_MODIFY_PERCENT + STORM_RENAME_PERCENT)
+        {
+            other = rand() % opts->files;
+            if (present[other])
+            {
+                write_file(bch, name);
+            }
+            else
+            {
+                snprintf(other_name, sizeof(other_name), "%s/d%d/f%d", bch->root, other % opts->dirs, other);
+                rename_file(bch, name, other_name);
+                present[slot] = false;
+                present[other] = true;
+            }
+        }
+        else
+        {
+            remove_name(bch, name);
+            present[slot] = false;
+        }
+    }
+    free(present);
+}
+
+static bool run_replay(bench* bch, const options* const opts)
+{
+    FILE* f;
+    char line[PATH_MAX + 64];
+    char name[PATH_MAX];
+    char* kind;
+    char* rel;
+    char* end;
+    uint64_t offset;
+    uint64_t start;
+
+    f = fopen(opts->file, "r");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", opts->file, strerror(errno));
+        return false;
+    }
+    start = yella_microseconds_since_epoch();
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (line[0] == '#')
+            continue;
+        offset = strtoull(line, &kind, 10);
+        end = strchr(line, '\n');
+        if (*kind != '\t' || kind[1] == 0 || kind[2] != '\t' || end == NULL)
+        {
+            ++bch->skipped;
+            continue;
+        }
+        ++kind;
+        rel = kind + 2;
+        *end = 0;
+        sleep_until(start + (uint64_t)(offset / opts->speed));
+        if (rel[0] == 0)
+            snprintf(name, sizeof(name), "%s", bch->root);
+        else
+            snprintf(name, sizeof(name), "%s/%s", bch->root, rel);
+        switch (*kind)
+        {
+        case 'F':
+            write_file(bch, name);
+            break;
+        case 'D':
+            make_directory(bch, name);
+            break;
+        case 'X':
+            remove_name(bch, name);
+            break;
+        case 'O':
+            /* Loss cannot be forced, so it is only counted */
+            ++bch->overflows;
+            break;
+        default:
+            ++bch->skipped;
+            break;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void record_line(bench* bch, const UChar* const name, char kind)
+{
+    char* utf8;
+    const char* rel;
+    size_t root_len;
+
+    utf8 = yella_to_utf8(name);
+    root_len = strlen(bch->root);
+    yella_lock_mutex(bch->guard);
+    if (strncmp(utf8, bch->root, root_len) != 0 || (utf8[root_len] != 0 && utf8[root_len] != '/') ||
+        strpbrk(utf8, "\t\n") != NULL)
+    {
+        ++bch->skipped;
+    }
+    else
+    {
+        rel = utf8 + root_len;
+        if (*rel == '/')
+            ++rel;
+        fprintf(bch->recording,
+                "%" PRIu64 "\t%c\t%s\n",
+                yella_microseconds_since_epoch() - bch->recording_start,
+                kind,
+                rel);
+    }
+    yella_unlock_mutex(bch->guard);
+    free(utf8);
+}
+
+static void events_recorded(const event_source_event* const events, size_t count, void* udata)
+{
+    bench* bch;
+    size_t i;
+    yella_file_type ftype;
+    char kind;
+
+    bch = udata;
+    for (i = 0; i < count; i++)
+    {
+        if (yella_get_file_type(events[i].fname, &ftype, NULL) != YELLA_NO_ERROR)
+            kind = 'X';
+        else if (ftype == YELLA_FILE_TYPE_DIRECTORY)
+            kind = 'D';
+        else
+            kind = 'F';
+        record_line(bch, events[i].fname, kind);
+    }
+    yella_lock_mutex(bch->guard);
+    bch->events += count;
+    yella_unlock_mutex(bch->guard);
+}
+
+static void overflow_recorded(const UChar* const config_name, const UChar* const dir, void* udata)
+{
+    bench* bch;
+
+    bch = udata;
+    record_line(bch, dir, 'O');
+    yella_lock_mutex(bch->guard);
+    ++bch->overflows;
+    yella_unlock_mutex(bch->guard);
+}
+
+static bool run_record(bench* bch, const options* const opts)
+{
+    event_source* esrc;
+    event_source_spec* spec;
+    UChar* utf16;
+
+    bch->recording = fopen(opts->file, "w");
+    if (bch->recording == NULL)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", opts->file, strerror(errno));
+        return false;
+    }
+    fprintf(bch->recording,
+            "# event-bench recording\n# backend\t%s\n# root\t%s\n",
+            YELLA_VALUE_STR(YELLA_EVENT_BENCH_BACKEND),
+            bch->root);
+    yella_settings_set_uint(u"file", u"fs-monitor-latency-seconds", 1);
+    esrc = create_event_source(events_recorded, bch);
+    set_event_source_overflow_callback(esrc, overflow_recorded);
+    spec = malloc(sizeof(event_source_spec));
+    spec->name = udsnew(u"event-bench");
+    spec->includes = yella_create_uds_ptr_vector();
+    spec->excludes = yella_create_uds_ptr_vector();
+    utf16 = yella_from_utf8(bch->root);
+    yella_push_back_ptr_vector(spec->includes, udscat(udsnew(utf16), u"/**"));
+    free(utf16);
+    add_or_replace_event_source_specs(esrc, &spec, 1);
+    yella_sleep_this_thread_milliseconds(SETTLE_MILLISECONDS);
+    bch->recording_start = yella_microseconds_since_epoch();
+    if (opts->dir == NULL)
+        run_storm(bch, opts);
+    else
+        yella_sleep_this_thread_milliseconds((size_t)opts->seconds * 1000);
+    /* The last events may still be on their way */
+    yella_sleep_this_thread_milliseconds(SETTLE_MILLISECONDS);
+    destroy_event_source(esrc);
+    fclose(bch->recording);
+    return true;
+}
+
+static void send_message(void* agnt, yella_parcel* pcl)
+{
+    bench* bch;
+    UDate now;
+    uint8_t* payload;
+    size_t payload_size;
+    yella_fb_file_file_state_vec_t stv;
+    yella_fb_file_file_state_table_t st;
+    name_node to_find;
+    name_node* found;
+    UDate reported;
+    size_t i;
+
+    bch = agnt;
+    now = ucal_getNow();
+    if (u_strcmp(pcl->type, u"yella.fb.file.file_states") != 0)
+        return;
+    if (pcl->cmp == YELLA_COMPRESSION_LZ4)
+    {
+        payload_size = pcl->payload_size;
+        payload = yella_lz4_decompress(pcl->payload, &payload_size);
+    }
+    else
+    {
+        payload = pcl->payload;
+    }
+    stv = yella_fb_file_file_states_states(yella_fb_file_file_states_as_root(payload));
+    yella_lock_mutex(bch->guard);
+    ++bch->parcels;
+    for (i = 0; i < yella_fb_file_file_state_vec_len(stv); i++)
+    {
+        st = yella_fb_file_file_state_vec_at(stv, i);
+        ++bch->states;
+        to_find.name = (char*)yella_fb_file_file_state_file_name(st);
+        found = sglib_name_node_find_member(bch->names, &to_find);
+        /* The report's time is when the file was looked at, so it covers
+         * the operations before it */
+        reported = yella_fb_file_file_state_milliseconds_since_epoch(st);
+        if (found == NULL || found->pending_since == 0 || found->pending_since > reported)
+        {
+            ++bch->unsolicited;
+        }
+        else
+        {
+            if (bch->latency_count == bch->latency_capacity)
+            {
+                bch->latency_capacity = (bch->latency_capacity == 0) ? 1024 : bch->latency_capacity * 2;
+                bch->latencies = realloc(bch->latencies, bch->latency_capacity * sizeof(double));
+            }
+            bch->latencies[bch->latency_count++] = now - found->pending_since;
+            /* Later operations wait for a later report, and only the last
+             * of them is known */
+            found->pending_since = (found->last_op > reported) ? found->last_op : 0;
+        }
+        if (found != NULL)
+            found->reported_present = yella_fb_file_file_state_cond(st) != yella_fb_file_condition_REMOVED;
+    }
+    yella_unlock_mutex(bch->guard);
+    if (payload != pcl->payload)
+        free(payload);
+}
+
+/* A name whose last operations were never reported is lost, unless it
+ * came and went without ever being seen, which needs no report */
+static bool is_lost(const name_node* const nn)
+{
+    return nn->pending_since != 0 && (nn->exists || nn->reported_present);
+}
+
+static size_t count_lost(bench* bch)
+{
+    struct sglib_name_node_iterator itor;
+    name_node* cur;
+    size_t result;
+
+    result = 0;
+    yella_lock_mutex(bch->guard);
+    for (cur = sglib_name_node_it_init(&itor, bch->names);
+         cur != NULL;
+         cur = sglib_name_node_it_next(&itor))
+    {
+        if (is_lost(cur))
+            ++result;
+    }
+    yella_unlock_mutex(bch->guard);
+    return result;
+}
+
+static void send_monitor_request(bench* bch, const yella_plugin* const plug)
+{
+    flatcc_builder_t bld;
+    yella_parcel* pcl;
+    yella_plugin_in_cap* in_cap;
+    char* include;
+    uint16_t fb_attr_type;
+
+    flatcc_builder_init(&bld);
+    yella_fb_file_monitor_request_start_as_root(&bld);
+    yella_fb_file_monitor_request_config_start(&bld);
+    yella_fb_plugin_config_action_add(&bld, yella_fb_plugin_config_action_REPLACE_ALL);
+    yella_fb_plugin_config_name_create_str(&bld, CONFIG_NAME);
+    yella_fb_file_monitor_request_config_add(&bld, yella_fb_file_monitor_request_config_end(&bld));
+    yella_fb_file_monitor_request_includes_start(&bld);
+    include = malloc(strlen(bch->root) + 4);
+    strcpy(include, bch->root);
+    strcat(include, "/**");
+    yella_fb_file_monitor_request_includes_push_create_str(&bld, include);
+    free(include);
+    yella_fb_file_monitor_request_includes_add(&bld, yella_fb_file_monitor_request_includes_end(&bld));
+    /* Only what the events make necessary, so that hashing is not measured */
+    yella_fb_file_monitor_request_attr_types_start(&bld);
+    fb_attr_type = yella_fb_file_attr_type_FILE_TYPE;
+    yella_fb_file_monitor_request_attr_types_push(&bld, &fb_attr_type);
+    fb_attr_type = yella_fb_file_attr_type_SIZE;
+    yella_fb_file_monitor_request_attr_types_push(&bld, &fb_attr_type);
+    yella_fb_file_monitor_request_attr_types_add(&bld, yella_fb_file_monitor_request_attr_types_end(&bld));
+    yella_fb_file_monitor_request_end_as_root(&bld);
+    pcl = yella_create_parcel(u"file", u"file.monitor_request");
+    pcl->sender = udsnew(RECIPIENT);
+    pcl->payload = flatcc_builder_finalize_buffer(&bld, &pcl->payload_size);
+    flatcc_builder_clear(&bld);
+    in_cap = yella_ptr_vector_at(plug->in_caps, 0);
+    in_cap->handler(pcl, in_cap->udata);
+    yella_destroy_parcel(pcl);
+}
+
+/* The plugin takes its settings when it starts, so they are given as a document */
+static bool load_plugin_settings(const char* const work_dir, const options* const opts)
+{
+    char name[PATH_MAX];
+    FILE* f;
+    UChar* utf16;
+    yella_rc rc;
+
+    snprintf(name, sizeof(name), "%s/data/", work_dir);
+    if (mkdir(name, 0755) != 0)
+    {
+        fprintf(stderr, "Could not create '%s': %s\n", name, strerror(errno));
+        return false;
+    }
+    utf16 = yella_from_utf8(name);
+    yella_settings_set_dir(u"agent", u"data-dir", utf16);
+    free(utf16);
+    yella_settings_set_byte_size(u"agent", u"max-message-size", u"1MB");
+    snprintf(name, sizeof(name), "%s/event-bench.yaml", work_dir);
+    f = fopen(name, "w");
+    if (f == NULL)
+    {
+        fprintf(stderr, "Could not open '%s': %s\n", name, strerror(errno));
+        return false;
+    }
+    fprintf(f,
+            "file:\n"
+            "    send-latency-seconds: %d\n"
+            "    event-coalesce-milliseconds: %d\n"
+            "    fs-monitor-latency-seconds: 1\n"
+            "    persist-hash-cache: 0\n",
+            opts->send_latency,
+            opts->coalesce);
+    fclose(f);
+    utf16 = yella_from_utf8(name);
+    yella_settings_set_text(u"agent", u"config-file", utf16);
+    free(utf16);
+    rc = yella_load_settings_doc();
+    return rc == YELLA_NO_ERROR;
+}
+
+static bool run_monitored(bench* bch, const char* const mode, const options* const opts)
+{
+    yella_agent_api api;
+    yella_plugin* plug;
+    UDate drain_limit;
+    size_t lost;
+
+    api.send_message = send_message;
+    plug = plugin_start(&api, bch);
+    yella_destroy_settings_doc();
+    send_monitor_request(bch, plug);
+    yella_sleep_this_thread_milliseconds(SETTLE_MILLISECONDS);
+    if (strcmp(mode, "storm") == 0)
+    {
+        run_storm(bch, opts);
+    }
+    else if (!run_replay(bch, opts))
+    {
+        plugin_stop(plug->udata);
+        yella_destroy_plugin(plug);
+        return false;
+    }
+    drain_limit = ucal_getNow() + opts->drain * 1000.0;
+    do
+    {
+        yella_sleep_this_thread_milliseconds(100);
+        lost = count_lost(bch);
+    } while (lost > 0 && ucal_getNow() < drain_limit);
+    plugin_stop(plug->udata);
+    yella_destroy_plugin(plug);
+    return true;
+}
+
+static void print_results(bench* bch, const char* const mode, const options* const opts)
+{
+    struct sglib_name_node_iterator itor;
+    name_node* cur;
+    size_t lost;
+    size_t collapsed;
+
+    printf("backend:      %s\n", YELLA_VALUE_STR(YELLA_EVENT_BENCH_BACKEND));
+    printf("mode:         %s\n", mode);
+    if (strcmp(mode, "record") == 0)
+    {
+        printf("events:       %" PRIu64 "\n", bch->events);
+        printf("overflows:    %" PRIu64 "\n", bch->overflows);
+        printf("skipped:      %" PRIu64 "\n", bch->skipped);
+        printf("operations:   %" PRIu64 " (%" PRIu64 " failed)\n", bch->ops, bch->op_errors);
+        return;
+    }
+    lost = 0;
+    collapsed = 0;
+    for (cur = sglib_name_node_it_init(&itor, bch->names);
+         cur != NULL;
+         cur = sglib_name_node_it_next(&itor))
+    {
+        if (is_lost(cur))
+            ++lost;
+        else if (cur->pending_since != 0)
+            ++collapsed;
+    }
+    printf("operations:   %" PRIu64 " (%" PRIu64 " failed)\n", bch->ops, bch->op_errors);
+    if (strcmp(mode, "storm") == 0)
+        printf("rate:         %d/s for %d s\n", opts->rate, opts->seconds);
+    else
+        printf("speed:        %.2fx (%" PRIu64 " overflows and %" PRIu64 " lines skipped in the recording)\n",
+               opts->speed, bch->overflows, bch->skipped);
+    printf("names:        %zu\n", bch->name_count);
+    printf("parcels:      %" PRIu64 " (%" PRIu64 " states, %" PRIu64 " unsolicited)\n",
+           bch->parcels, bch->states, bch->unsolicited);
+    if (bch->latency_count > 0)
+    {
+        qsort(bch->latencies, bch->latency_count, sizeof(double), latency_comparator);
+        printf("latency ms:   min %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               bch->latencies[0],
+               bch->latencies[bch->latency_count / 2],
+               bch->latencies[bch->latency_count * 9 / 10],
+               bch->latencies[bch->latency_count * 99 / 100],
+               bch->latencies[bch->latency_count * 999 / 1000],
+               bch->latencies[bch->latency_count - 1]);
+    }
+    printf("lost:         %zu (%.3f%%)\n", lost, bch->name_count == 0 ? 0.0 : lost * 100.0 / bch->name_count);
+    printf("collapsed:    %zu\n", collapsed);
+}
+
+static void destroy_bench(bench* bch)
+{
+    name_node* cur;
+
+    /* The iterator reads nodes after returning them, so they are taken from the top */
+    while (bch->names != NULL)
+    {
+        cur = bch->names;
+        sglib_name_node_delete(&bch->names, cur);
+        free(cur->name);
+        free(cur);
+    }
+    free(bch->latencies);
+    free(bch->root);
+    yella_destroy_mutex(bch->guard);
+}
+
+int main(int argc, char* argv[])
+{
+    options opts = { NULL, "event-bench.rec", NULL, 1000, 10, 1000, 16, 1.0f, 1, 250, 30, 1, 0 };
+    struct argparse parser;
+    struct argparse_option arg_opts[] =
+    {
+        OPT_HELP(),
+        OPT_STRING('d', "dir", &opts.dir, "directory to record instead of a storm"),
+        OPT_STRING('f', "file", &opts.file, "recording to write or replay (event-bench.rec)"),
+        OPT_STRING('w', "work-dir", &opts.work_dir, "where the temporary tree goes (a new one in .)"),
+        OPT_INTEGER('r', "rate", &opts.rate, "storm operations per second (1000)"),
+        OPT_INTEGER('s', "seconds", &opts.seconds, "how long to storm or record (10)"),
+        OPT_INTEGER(0, "files", &opts.files, "distinct file names in a storm (1000)"),
+        OPT_INTEGER(0, "dirs", &opts.dirs, "directories the files are spread over (16)"),
+        OPT_FLOAT('x', "speed", &opts.speed, "replay speed relative to the recording (1.0)"),
+        OPT_INTEGER(0, "send-latency", &opts.send_latency, "plugin send-latency-seconds (1)"),
+        OPT_INTEGER(0, "coalesce", &opts.coalesce, "plugin event-coalesce-milliseconds (250)"),
+        OPT_INTEGER(0, "drain", &opts.drain, "most seconds to wait for the last parcels (30)"),
+        OPT_INTEGER(0, "seed", &opts.seed, "random seed of a storm (1)"),
+        OPT_BOOLEAN('k', "keep", &opts.keep, "keep the temporary tree"),
+        OPT_END()
+    };
+    const char* const usage[] =
+    {
+        "event-bench [options] storm|record|replay",
+        NULL
+    };
+    const char* mode;
+    char work_dir[PATH_MAX];
+    char* real_work_dir;
+    bench bch;
+    bool ok;
+    UChar* utf16;
+
+    argparse_init(&parser, arg_opts, usage, 0);
+    argparse_describe(&parser,
+                      "\nMeasures how long file system changes take to reach a parcel, and how many are lost",
+                      "");
+    argc = argparse_parse(&parser, argc, (const char**)argv);
+    if (argc != 1 ||
+        (strcmp(argv[0], "storm") != 0 && strcmp(argv[0], "record") != 0 && strcmp(argv[0], "replay") != 0) ||
+        opts.rate <= 0 || opts.seconds < 0 || opts.files <= 0 || opts.dirs <= 0 || opts.speed <= 0)
+    {
+        argparse_usage(&parser);
+        return EXIT_FAILURE;
+    }
+    mode = argv[0];
+    yella_initialize_settings();
+    if (opts.work_dir == NULL)
+    {
+        strcpy(work_dir, "event-bench-XXXXXX");
+        ok = mkdtemp(work_dir) != NULL;
+    }
+    else
+    {
+        snprintf(work_dir, sizeof(work_dir), "%s", opts.work_dir);
+        ok = mkdir(work_dir, 0755) == 0;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "Could not create '%s': %s\n", work_dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    real_work_dir = realpath(work_dir, NULL);
+    memset(&bch, 0, sizeof(bch));
+    bch.guard = yella_create_mutex();
+    if (strcmp(mode, "record") == 0 && opts.dir != NULL)
+    {
+        bch.root = realpath(opts.dir, NULL);
+        ok = bch.root != NULL;
+        if (!ok)
+            fprintf(stderr, "Could not find '%s': %s\n", opts.dir, strerror(errno));
+    }
+    else
+    {
+        bch.root = malloc(strlen(real_work_dir) + 6);
+        strcpy(bch.root, real_work_dir);
+        strcat(bch.root, "/tree");
+        ok = mkdir(bch.root, 0755) == 0;
+        if (!ok)
+            fprintf(stderr, "Could not create '%s': %s\n", bch.root, strerror(errno));
+    }
+    if (ok)
+    {
+        if (strcmp(mode, "record") == 0)
+            ok = run_record(&bch, &opts);
+        else
+            ok = load_plugin_settings(real_work_dir, &opts) && run_monitored(&bch, mode, &opts);
+    }
+    if (ok)
+        print_results(&bch, mode, &opts);
+    if (!opts.keep)
+    {
+        utf16 = yella_from_utf8(real_work_dir);
+        yella_remove_all(utf16);
+        free(utf16);
+    }
+    free(real_work_dir);
+    destroy_bench(&bch);
+    yella_destroy_settings();
+    chucho_finalize();
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
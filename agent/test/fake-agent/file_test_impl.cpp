@@ -4,10 +4,12 @@
 #include "common/compression.h"
 #include <chucho/log.hpp>
 #include <openssl/evp.h>
+#include <xxhash.h>
 #include <flatbuffers/flatbuffers.h>
 #include <fstream>
 #include <thread>
 #include <iomanip>
+#include <algorithm>
 
 namespace
 {
@@ -17,6 +19,46 @@ static void digest_callback(const uint8_t* const buf, size_t sz, void* udata)
     EVP_DigestUpdate(reinterpret_cast<EVP_MD_CTX*>(udata), buf, sz);
 }
 
+static void xxh3_callback(const uint8_t* const buf, size_t sz, void* udata)
+{
+    XXH3_128bits_update(reinterpret_cast<XXH3_state_t*>(udata), buf, sz);
+}
+
+// Must agree with CHUNKED_SHA256_CHUNK_SIZE in the agent
+constexpr std::size_t CHUNK_SIZE = 4 * 1024 * 1024;
+
+struct chunk_state
+{
+    EVP_MD_CTX* ctx = nullptr;
+    std::size_t in_chunk = 0;
+    std::vector<std::uint8_t> digests;
+};
+
+static void finish_chunk(chunk_state& st)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned md_len;
+    EVP_DigestFinal_ex(st.ctx, md, &md_len);
+    st.digests.insert(st.digests.end(), md, md + md_len);
+    EVP_DigestInit_ex(st.ctx, EVP_sha256(), nullptr);
+    st.in_chunk = 0;
+}
+
+static void chunk_callback(const uint8_t* const buf, size_t sz, void* udata)
+{
+    auto st = reinterpret_cast<chunk_state*>(udata);
+    std::size_t done = 0;
+    while (done < sz)
+    {
+        auto len = std::min(sz - done, CHUNK_SIZE - st->in_chunk);
+        EVP_DigestUpdate(st->ctx, buf + done, len);
+        st->in_chunk += len;
+        done += len;
+        if (st->in_chunk == CHUNK_SIZE)
+            finish_chunk(*st);
+    }
+}
+
 }
 
 namespace yella
@@ -203,6 +245,8 @@ void file_test_impl::process_monitor_request(const YAML::Node& body)
         bld.add_excludes(fexc);
     if (!fattrs.IsNull())
         bld.add_attr_types(fattrs);
+    if (body["cache-neutral-reads"])
+        bld.add_cache_neutral_reads(body["cache-neutral-reads"].as<bool>());
     fbld.Finish(bld.Finish());
     send_message(fbld.GetBufferPointer(), fbld.GetSize());
 }
@@ -334,6 +378,12 @@ void file_test_impl::attribute::emit(YAML::Emitter& e) const
     case type::POSIX_ACL:
         e << "POSIX_ACL";
         break;
+    case type::CHUNKED_SHA256:
+        e << "CHUNKED_SHA256";
+        break;
+    case type::XXH3_128:
+        e << "XXH3_128";
+        break;
     }
     e << YAML::Value;
 }
@@ -430,7 +480,7 @@ file_test_impl::bytes_attribute::bytes_attribute(type tp, const fb::file::attr&
     : attribute(tp),
       bytes_(fba.bytes()->begin(), fba.bytes()->end())
 {
-    assert(tp == type::SHA256);
+    assert(tp == type::SHA256 || tp == type::CHUNKED_SHA256 || tp == type::XXH3_128);
 }
 
 void file_test_impl::bytes_attribute::emit(YAML::Emitter& e) const
@@ -755,6 +805,12 @@ file_test_impl::file_state::file_state(const fb::file::file_state& fb)
         case fb::file::attr_type_SHA256:
             attrs_.emplace(std::make_unique<bytes_attribute>(attribute::type::SHA256, *cur));
             break;
+        case fb::file::attr_type_CHUNKED_SHA256:
+            attrs_.emplace(std::make_unique<bytes_attribute>(attribute::type::CHUNKED_SHA256, *cur));
+            break;
+        case fb::file::attr_type_XXH3_128:
+            attrs_.emplace(std::make_unique<bytes_attribute>(attribute::type::XXH3_128, *cur));
+            break;
         case fb::file::attr_type_POSIX_PERMISSIONS:
             attrs_.emplace(std::make_unique<posix_permissions_attribute>(*cur));
             break;
@@ -835,6 +891,10 @@ file_test_impl::file_state::file_state(const std::filesystem::path& working_dir,
                     should_get_sha256 = true;
                 else if (cur.Scalar() == "POSIX_ACL")
                     attrs_.emplace(std::make_unique<posix_acl_attribute>(file_name_));
+                else if (cur.Scalar() == "CHUNKED_SHA256")
+                    maybe_add_chunked_sha256_attr();
+                else if (cur.Scalar() == "XXH3_128")
+                    maybe_add_xxh3_128_attr();
             }
             if (should_get_sha256)
                 maybe_add_sha256_attr();
@@ -907,6 +967,44 @@ void file_test_impl::file_state::maybe_add_sha256_attr()
     }
 }
 
+void file_test_impl::file_state::maybe_add_chunked_sha256_attr()
+{
+    if (std::filesystem::is_regular_file(file_name_) && !std::filesystem::is_symlink(file_name_))
+    {
+        chunk_state st;
+        st.ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(st.ctx, EVP_sha256(), nullptr);
+        yella_apply_function_to_file_contents(file_name_.u16string().c_str(), chunk_callback, &st);
+        if (st.in_chunk > 0)
+            finish_chunk(st);
+        EVP_MD_CTX_free(st.ctx);
+        auto ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+        EVP_DigestUpdate(ctx, st.digests.data(), st.digests.size());
+        unsigned char md[EVP_MAX_MD_SIZE];
+        unsigned md_len;
+        EVP_DigestFinal_ex(ctx, md, &md_len);
+        EVP_MD_CTX_free(ctx);
+        std::vector<std::uint8_t> md_bytes(md, md + md_len);
+        attrs_.emplace(std::make_unique<bytes_attribute>(attribute::type::CHUNKED_SHA256, md_bytes));
+    }
 }
 
-}
\ No newline at end of file
+void file_test_impl::file_state::maybe_add_xxh3_128_attr()
+{
+    if (std::filesystem::is_regular_file(file_name_) || std::filesystem::is_symlink(file_name_))
+    {
+        auto st = XXH3_createState();
+        XXH3_128bits_reset(st);
+        yella_apply_function_to_file_contents(file_name_.u16string().c_str(), xxh3_callback, st);
+        XXH128_canonical_t canon;
+        XXH128_canonicalFromHash(&canon, XXH3_128bits_digest(st));
+        XXH3_freeState(st);
+        std::vector<std::uint8_t> md_bytes(canon.digest, canon.digest + sizeof(canon.digest));
+        attrs_.emplace(std::make_unique<bytes_attribute>(attribute::type::XXH3_128, md_bytes));
+    }
+}
+
+}
+
+}
@@ -41,7 +41,9 @@ private:
             ACCESS_TIME,
             METADATA_CHANGE_TIME,
             MODIFICATION_TIME,
-            POSIX_ACL
+            POSIX_ACL,
+            CHUNKED_SHA256,
+            XXH3_128
         };
 
         virtual ~attribute() = default;
@@ -265,6 +267,8 @@ private:
 
     private:
         void maybe_add_sha256_attr();
+        void maybe_add_chunked_sha256_attr();
+        void maybe_add_xxh3_128_attr();
 
         UDate time_;
         std::filesystem::path file_name_;
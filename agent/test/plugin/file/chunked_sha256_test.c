@@ -0,0 +1,235 @@
+#include "plugin/file/chunked_sha256.h"
+#include "common/settings.h"
+#include "common/file.h"
+#include "common/text_util.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cmocka.h>
+#include <openssl/evp.h>
+
+static const UChar* FILE_NAME = u"chunked-sha256-test-file.bin";
+/* Two and a half chunks */
+static const size_t INITIAL_SIZE = CHUNKED_SHA256_CHUNK_SIZE * 2 + CHUNKED_SHA256_CHUNK_SIZE / 2;
+
+static void write_to_file(const char* const mode, size_t count, uint8_t seed)
+{
+    FILE* f;
+    char* utf8;
+    uint8_t* buf;
+    size_t i;
+
+    buf = malloc(count);
+    for (i = 0; i < count; i++)
+        buf[i] = (uint8_t)(i * 31 + seed);
+    utf8 = yella_to_utf8(FILE_NAME);
+    f = fopen(utf8, mode);
+    free(utf8);
+    assert_non_null(f);
+    assert_int_equal(fwrite(buf, 1, count, f), count);
+    fclose(f);
+    free(buf);
+}
+
+static void append_to_file(size_t count, uint8_t seed)
+{
+    write_to_file("ab", count, seed);
+}
+
+static void change_byte(size_t offset)
+{
+    FILE* f;
+    char* utf8;
+    int c;
+
+    utf8 = yella_to_utf8(FILE_NAME);
+    f = fopen(utf8, "r+b");
+    free(utf8);
+    assert_non_null(f);
+    assert_int_equal(fseek(f, (long)offset, SEEK_SET), 0);
+    c = fgetc(f);
+    assert_int_not_equal(c, EOF);
+    assert_int_equal(fseek(f, (long)offset, SEEK_SET), 0);
+    fputc(c ^ 0xff, f);
+    fclose(f);
+}
+
+static void expected_root(uint8_t* root)
+{
+    uint8_t* contents;
+    size_t sz;
+    size_t offset;
+    size_t len;
+    uint8_t* digests;
+    size_t count;
+    unsigned md_len;
+
+    assert_int_equal(yella_file_size(FILE_NAME, &sz), YELLA_NO_ERROR);
+    assert_int_equal(yella_file_contents(FILE_NAME, &contents), YELLA_NO_ERROR);
+    count = (sz + CHUNKED_SHA256_CHUNK_SIZE - 1) / CHUNKED_SHA256_CHUNK_SIZE;
+    digests = malloc(count * CHUNKED_SHA256_DIGEST_SIZE);
+    for (offset = 0; offset < sz; offset += len)
+    {
+        len = sz - offset;
+        if (len > CHUNKED_SHA256_CHUNK_SIZE)
+            len = CHUNKED_SHA256_CHUNK_SIZE;
+        EVP_Digest(contents + offset,
+                   len,
+                   digests + (offset / CHUNKED_SHA256_CHUNK_SIZE) * CHUNKED_SHA256_DIGEST_SIZE,
+                   &md_len,
+                   EVP_sha256(),
+                   NULL);
+    }
+    EVP_Digest(digests, count * CHUNKED_SHA256_DIGEST_SIZE, root, &md_len, EVP_sha256(), NULL);
+    free(digests);
+    free(contents);
+}
+
+static void parallel(void** arg)
+{
+    attribute* attr;
+    uint8_t root[CHUNKED_SHA256_DIGEST_SIZE];
+    chucho_logger_t* lgr;
+
+    lgr = chucho_get_logger("chunked_sha256_test");
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, NULL, lgr);
+    assert_non_null(attr);
+    assert_int_equal(attr->value.chunked.chunk_count, 3);
+    assert_int_equal(attr->value.chunked.byte_count, INITIAL_SIZE);
+    expected_root(root);
+    assert_memory_equal(attr->value.chunked.root, root, CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    chucho_release_logger(lgr);
+}
+
+static void append(void** arg)
+{
+    attribute* prev;
+    attribute* attr;
+    uint8_t root[CHUNKED_SHA256_DIGEST_SIZE];
+    chucho_logger_t* lgr;
+
+    lgr = chucho_get_logger("chunked_sha256_test");
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 1);
+    prev = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, NULL, lgr);
+    assert_non_null(prev);
+    append_to_file(CHUNKED_SHA256_CHUNK_SIZE, 7);
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE + CHUNKED_SHA256_CHUNK_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, prev, lgr);
+    assert_non_null(attr);
+    assert_int_equal(attr->value.chunked.chunk_count, 4);
+    expected_root(root);
+    assert_memory_equal(attr->value.chunked.root, root, CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    /* Whole chunks of prev are trusted, so a bogus one shows up in the result */
+    memset(prev->value.chunked.chunks, 0, CHUNKED_SHA256_DIGEST_SIZE);
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE + CHUNKED_SHA256_CHUNK_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, prev, lgr);
+    assert_non_null(attr);
+    assert_memory_equal(attr->value.chunked.chunks, prev->value.chunked.chunks, CHUNKED_SHA256_DIGEST_SIZE);
+    assert_memory_not_equal(attr->value.chunked.root, root, CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    destroy_attribute(prev);
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 0);
+    chucho_release_logger(lgr);
+}
+
+static void edited(void** arg)
+{
+    attribute* prev;
+    attribute* attr;
+    uint8_t root[CHUNKED_SHA256_DIGEST_SIZE];
+    chucho_logger_t* lgr;
+
+    lgr = chucho_get_logger("chunked_sha256_test");
+    prev = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, NULL, lgr);
+    assert_non_null(prev);
+    /* Even when appends are trusted, a file of the same size is hashed again */
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 1);
+    change_byte(100);
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, prev, lgr);
+    assert_non_null(attr);
+    assert_memory_not_equal(attr->value.chunked.root, prev->value.chunked.root, CHUNKED_SHA256_DIGEST_SIZE);
+    expected_root(root);
+    assert_memory_equal(attr->value.chunked.root, root, CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    /* And by default, so is a file that grew */
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 0);
+    change_byte(200);
+    append_to_file(CHUNKED_SHA256_CHUNK_SIZE, 7);
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE + CHUNKED_SHA256_CHUNK_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, prev, lgr);
+    assert_non_null(attr);
+    expected_root(root);
+    assert_memory_equal(attr->value.chunked.root, root, CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    destroy_attribute(prev);
+    chucho_release_logger(lgr);
+}
+
+static void rewritten(void** arg)
+{
+    attribute* prev;
+    attribute* attr;
+    uint8_t root[CHUNKED_SHA256_DIGEST_SIZE];
+    chucho_logger_t* lgr;
+
+    lgr = chucho_get_logger("chunked_sha256_test");
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 1);
+    prev = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, NULL, lgr);
+    assert_non_null(prev);
+    /* The same inode with new contents, and then grown */
+    write_to_file("r+b", INITIAL_SIZE, 9);
+    append_to_file(CHUNKED_SHA256_CHUNK_SIZE, 7);
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE + CHUNKED_SHA256_CHUNK_SIZE, YELLA_READ_STRATEGY_AUTOMATIC, prev, lgr);
+    assert_non_null(attr);
+    assert_memory_not_equal(attr->value.chunked.chunks, prev->value.chunked.chunks, CHUNKED_SHA256_DIGEST_SIZE);
+    expected_root(root);
+    assert_memory_equal(attr->value.chunked.root, root, CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    destroy_attribute(prev);
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 0);
+    chucho_release_logger(lgr);
+}
+
+static void truncated(void** arg)
+{
+    attribute* attr;
+    chucho_logger_t* lgr;
+
+    lgr = chucho_get_logger("chunked_sha256_test");
+    attr = create_chunked_sha256_attribute(FILE_NAME, INITIAL_SIZE * 2, YELLA_READ_STRATEGY_AUTOMATIC, NULL, lgr);
+    assert_null(attr);
+    chucho_release_logger(lgr);
+}
+
+static int set_up(void** arg)
+{
+    yella_remove_file(FILE_NAME);
+    append_to_file(INITIAL_SIZE, 0);
+    return 0;
+}
+
+static int tear_down(void** arg)
+{
+    yella_remove_file(FILE_NAME);
+    return 0;
+}
+
+int main()
+{
+    const struct CMUnitTest tests[] =
+    {
+        cmocka_unit_test_setup_teardown(parallel, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(append, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(edited, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(rewritten, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(truncated, set_up, tear_down)
+    };
+
+    yella_load_settings_doc();
+    yella_destroy_settings_doc();
+    yella_settings_set_uint(u"file", u"chunk-hash-threads", 3);
+    yella_settings_set_uint(u"file", u"chunk-hash-trust-appends", 0);
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
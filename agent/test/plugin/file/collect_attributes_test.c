@@ -1,6 +1,7 @@
 #include "plugin/file/collect_attributes.h"
 #include "common/file.h"
 #include "common/text_util.h"
+#include "common/time_util.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -8,7 +9,10 @@
 #include <stdlib.h>
 #include <cmocka.h>
 #include <openssl/evp.h>
+#include <xxhash.h>
 #include <plugin/file/attribute.h>
+#include <sys/time.h>
+#include <inttypes.h>
 
 static const UChar* FILE_NAME = u"collect-attr-test-file.txt";
 
@@ -19,12 +23,15 @@ static void file_type(void** arg)
     element* elem2;
     attribute* attr;
     chucho_logger_t* lgr;
+    yella_arena* arena;
 
     tp = ATTR_TYPE_FILE_TYPE;
     lgr = chucho_get_logger("collect_attributes_test");
-    elem1 = collect_attributes(FILE_NAME, &tp, 1, lgr);
+    arena = yella_create_arena(1024);
+    elem1 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, NULL, false, arena, lgr);
     chucho_release_logger(lgr);
     assert_non_null(elem1);
+    assert_true(u_strcmp(element_name(elem1), FILE_NAME) == 0);
     elem2 = create_element(FILE_NAME);
     attr = malloc(sizeof(attribute));
     attr->type = ATTR_TYPE_FILE_TYPE;
@@ -33,6 +40,7 @@ static void file_type(void** arg)
     assert_int_equal(compare_element_attributes(elem1, elem2), 0);
     destroy_element(elem2);
     destroy_element(elem1);
+    yella_destroy_arena(arena);
 }
 
 static void non_existent(void** arg)
@@ -43,7 +51,7 @@ static void non_existent(void** arg)
 
     tp = ATTR_TYPE_FILE_TYPE;
     lgr = chucho_get_logger("collect_attributes_test");
-    elem = collect_attributes(u"doggies-and-monkies.xxx", &tp, 1, lgr);
+    elem = collect_attributes(u"doggies-and-monkies.xxx", &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, NULL, false, NULL, lgr);
     chucho_release_logger(lgr);
     assert_null(elem);
 }
@@ -64,7 +72,7 @@ static void sha256(void** arg)
 
     tp = ATTR_TYPE_SHA256;
     lgr = chucho_get_logger("collect_attributes_test");
-    elem1 = collect_attributes(FILE_NAME, &tp, 1, lgr);
+    elem1 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, NULL, false, NULL, lgr);
     chucho_release_logger(lgr);
     assert_non_null(elem1);
     elem2 = create_element(FILE_NAME);
@@ -89,20 +97,254 @@ static void sha256(void** arg)
     destroy_element(elem1);
 }
 
+static void xxh3_128(void** arg)
+{
+    attribute_type tp;
+    element* elem1;
+    element* elem2;
+    attribute* attr;
+    XXH128_canonical_t canon;
+    uint8_t* bytes;
+    size_t fsize;
+    chucho_logger_t* lgr;
+
+    tp = ATTR_TYPE_XXH3_128;
+    lgr = chucho_get_logger("collect_attributes_test");
+    elem1 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, NULL, false, NULL, lgr);
+    chucho_release_logger(lgr);
+    assert_non_null(elem1);
+    elem2 = create_element(FILE_NAME);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_XXH3_128;
+    yella_file_size(FILE_NAME, &fsize);
+    assert_int_equal(yella_file_contents(FILE_NAME, &bytes), YELLA_NO_ERROR);
+    XXH128_canonicalFromHash(&canon, XXH3_128bits(bytes, fsize));
+    free(bytes);
+    attr->value.byte_array.mem = malloc(sizeof(canon.digest));
+    attr->value.byte_array.sz = sizeof(canon.digest);
+    memcpy(attr->value.byte_array.mem, canon.digest, sizeof(canon.digest));
+    add_element_attribute(elem2, attr);
+    assert_int_equal(compare_element_attributes(elem1, elem2), 0);
+    destroy_element(elem2);
+    destroy_element(elem1);
+}
+
+static void content_digests(void** arg)
+{
+    const attribute_type types[] = { ATTR_TYPE_SHA256, ATTR_TYPE_XXH3_128 };
+    const char* names[] = { "SHA256", "XXH3_128" };
+    element* elem;
+    int i;
+    int j;
+    uint64_t start;
+    chucho_logger_t* lgr;
+
+    lgr = chucho_get_logger("collect_attributes_test");
+    for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+        start = yella_microseconds_since_epoch();
+        for (j = 0; j < 20; j++)
+        {
+            elem = collect_attributes(FILE_NAME, &types[i], 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, NULL, false, NULL, lgr);
+            assert_non_null(find_element_attribute(elem, types[i]));
+            destroy_element(elem);
+        }
+        print_message("%s: %" PRIu64 " microseconds for 20 digests\n", names[i], yella_microseconds_since_epoch() - start);
+    }
+    chucho_release_logger(lgr);
+}
+
+static void stamp_reuse(void** arg)
+{
+    attribute_type tp;
+    element* elem1;
+    element* elem2;
+    element* prev;
+    attribute* attr;
+    file_stamp stmp;
+    uint8_t* packed;
+    size_t sz;
+    chucho_logger_t* lgr;
+
+    tp = ATTR_TYPE_SHA256;
+    lgr = chucho_get_logger("collect_attributes_test");
+    elem1 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, NULL, false, NULL, lgr);
+    assert_non_null(elem1);
+    assert_non_null(element_file_stamp(elem1));
+    stmp = *element_file_stamp(elem1);
+    prev = create_element(FILE_NAME);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_SHA256;
+    attr->value.byte_array.mem = calloc(1, 32);
+    attr->value.byte_array.sz = 32;
+    add_element_attribute(prev, attr);
+    set_element_file_stamp(prev, &stmp);
+    packed = pack_element_attributes(prev, &sz);
+    /* The stamp matches, so the bogus digest is carried forward */
+    elem2 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, packed, NULL, false, NULL, lgr);
+    assert_non_null(elem2);
+    assert_int_equal(compare_element_attributes(elem2, prev), 0);
+    destroy_element(elem2);
+    free(packed);
+    /* The stamp does not match, so the file is hashed */
+    ++stmp.size;
+    set_element_file_stamp(prev, &stmp);
+    packed = pack_element_attributes(prev, &sz);
+    elem2 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, packed, NULL, false, NULL, lgr);
+    assert_non_null(elem2);
+    assert_int_not_equal(compare_element_attributes(elem2, prev), 0);
+    assert_int_equal(compare_element_attributes(elem2, elem1), 0);
+    destroy_element(elem2);
+    free(packed);
+    destroy_element(prev);
+    destroy_element(elem1);
+    chucho_release_logger(lgr);
+}
+
+static void cached_digest(void** arg)
+{
+    attribute_type tp;
+    element* elem1;
+    element* elem2;
+    const attribute* attr;
+    hash_cache* cache;
+    chucho_logger_t* lgr;
+    uint8_t md[HASH_CACHE_MAX_DIGEST_SIZE];
+
+    tp = ATTR_TYPE_SHA256;
+    lgr = chucho_get_logger("collect_attributes_test");
+    cache = create_hash_cache(10, NULL);
+    elem1 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, cache, false, NULL, lgr);
+    assert_non_null(elem1);
+    assert_non_null(element_file_stamp(elem1));
+    assert_int_equal(hash_cache_size(cache), 1);
+    /* A bogus digest in the cache proves that the file is not read again */
+    put_hash_cache_digest(cache, ATTR_TYPE_SHA256, element_file_stamp(elem1), (const uint8_t*)"bogus", 5);
+    elem2 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, cache, false, NULL, lgr);
+    assert_non_null(elem2);
+    attr = find_element_attribute(elem2, ATTR_TYPE_SHA256);
+    assert_non_null(attr);
+    assert_int_equal(attr->value.byte_array.sz, 5);
+    assert_memory_equal(attr->value.byte_array.mem, "bogus", 5);
+    destroy_element(elem2);
+    /* A full hash ignores the cache, but puts what it computes there */
+    elem2 = collect_attributes(FILE_NAME, &tp, 1, YELLA_READ_STRATEGY_AUTOMATIC, NULL, cache, true, NULL, lgr);
+    assert_non_null(elem2);
+    attr = find_element_attribute(elem2, ATTR_TYPE_SHA256);
+    assert_non_null(attr);
+    assert_int_equal(attr->value.byte_array.sz, 32);
+    assert_int_equal(get_hash_cache_digest(cache, ATTR_TYPE_SHA256, element_file_stamp(elem2), md), 32);
+    assert_memory_equal(md, attr->value.byte_array.mem, 32);
+    destroy_element(elem2);
+    destroy_element(elem1);
+    destroy_hash_cache(cache);
+    chucho_release_logger(lgr);
+}
+
+static void digest_callback(const uint8_t* const bytes, size_t sz, void* udata)
+{
+    EVP_DigestUpdate((EVP_MD_CTX*)udata, bytes, sz);
+}
+
+static void read_strategies(void** arg)
+{
+    const yella_read_strategy strategies[] =
+    {
+        YELLA_READ_STRATEGY_SMALL_BUFFER,
+        YELLA_READ_STRATEGY_LARGE_BUFFER,
+        YELLA_READ_STRATEGY_MAPPED,
+        YELLA_READ_STRATEGY_CACHE_NEUTRAL,
+        YELLA_READ_STRATEGY_AUTOMATIC
+    };
+    const char* names[] =
+    {
+        "small buffer",
+        "large buffer",
+        "mapped",
+        "cache neutral",
+        "automatic"
+    };
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned md_len;
+    EVP_MD_CTX* ctx;
+    int i;
+    int j;
+    uint64_t start;
+
+    for (i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++)
+    {
+        start = yella_microseconds_since_epoch();
+        for (j = 0; j < 20; j++)
+        {
+            ctx = EVP_MD_CTX_new();
+            EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+            assert_int_equal(yella_apply_function_to_file_contents_with_strategy(FILE_NAME, strategies[i], digest_callback, ctx),
+                             YELLA_NO_ERROR);
+            EVP_DigestFinal_ex(ctx, md, &md_len);
+            EVP_MD_CTX_free(ctx);
+            if (i == 0 && j == 0)
+                memcpy(expected, md, md_len);
+            else
+                assert_memory_equal(md, expected, md_len);
+        }
+        print_message("%s: %" PRIu64 " microseconds for 20 hashes\n", names[i], yella_microseconds_since_epoch() - start);
+    }
+}
+
+static void unaligned_range(void** arg)
+{
+    const yella_read_strategy strategies[] =
+    {
+        YELLA_READ_STRATEGY_SMALL_BUFFER,
+        YELLA_READ_STRATEGY_CACHE_NEUTRAL
+    };
+    unsigned char expected[EVP_MAX_MD_SIZE];
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned md_len;
+    EVP_MD_CTX* ctx;
+    int i;
+
+    /* Direct I/O refuses an offset and length like these, so the read must
+     * fall back to ordinary I/O rather than fail */
+    for (i = 0; i < sizeof(strategies) / sizeof(strategies[0]); i++)
+    {
+        ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, EVP_sha256(), NULL);
+        assert_int_equal(yella_apply_function_to_file_range(FILE_NAME, 3, 100001, strategies[i], digest_callback, ctx),
+                         YELLA_NO_ERROR);
+        EVP_DigestFinal_ex(ctx, md, &md_len);
+        EVP_MD_CTX_free(ctx);
+        if (i == 0)
+            memcpy(expected, md, md_len);
+        else
+            assert_memory_equal(md, expected, md_len);
+    }
+}
+
 static int set_up(void** arg)
 {
     FILE* f;
     char* utf8;
     int i;
+    struct timeval tms[2];
 
     utf8 = yella_to_utf8(FILE_NAME);
     f = fopen(utf8, "wb");
-    free(utf8);
     if (f == NULL)
+    {
+        free(utf8);
         return -1;
+    }
     for (i = 0; i < 1000000; i++)
         fwrite(&i, 1, sizeof(i), f);
     fclose(f);
+    /* A freshly written file has a racy stamp, which would not be recorded */
+    gettimeofday(&tms[0], NULL);
+    tms[0].tv_sec -= 60;
+    tms[1] = tms[0];
+    utimes(utf8, tms);
+    free(utf8);
     return 0;
 }
 
@@ -118,7 +360,13 @@ int main()
     {
         cmocka_unit_test(file_type),
         cmocka_unit_test(non_existent),
-        cmocka_unit_test(sha256)
+        cmocka_unit_test(sha256),
+        cmocka_unit_test(xxh3_128),
+        cmocka_unit_test(stamp_reuse),
+        cmocka_unit_test(cached_digest),
+        cmocka_unit_test(read_strategies),
+        cmocka_unit_test(unaligned_range),
+        cmocka_unit_test(content_digests)
     };
 
     return cmocka_run_group_tests(tests, set_up, tear_down);
@@ -1,12 +1,23 @@
 #include "plugin/file/element.h"
 #include "common/file.h"
+#include "db_attrs_builder.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cmocka.h>
 
+static UChar* copy_name(const UChar* const name)
+{
+    UChar* result;
+
+    result = malloc((u_strlen(name) + 1) * sizeof(UChar));
+    u_strcpy(result, name);
+    return result;
+}
+
 static void compare(void** arg)
 {
     element* elem1;
@@ -117,13 +128,160 @@ void diff(void** arg)
     destroy_element(elem3);
     destroy_element(elem2);
     destroy_element(elem1);
+    /* Attributes only in the second are copied into the first */
+    elem1 = create_element(u"funky");
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_SIZE;
+    attr->value.size = 12;
+    add_element_attribute(elem1, attr);
+    elem2 = create_element(u"funky");
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_SIZE;
+    attr->value.size = 12;
+    add_element_attribute(elem2, attr);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_USER;
+    attr->value.usr_grp.id = 501;
+    attr->value.usr_grp.name = copy_name(u"wellie");
+    add_element_attribute(elem2, attr);
+    diff_elements(elem1, elem2);
+    assert_null(find_element_attribute(elem1, ATTR_TYPE_SIZE));
+    assert_non_null(find_element_attribute(elem1, ATTR_TYPE_USER));
+    assert_int_equal(compare_attributes(find_element_attribute(elem1, ATTR_TYPE_USER),
+                                        find_element_attribute(elem2, ATTR_TYPE_USER)), 0);
+    destroy_element(elem2);
+    destroy_element(elem1);
+}
+
+static void compare_packed(void** arg)
+{
+    element* elem1;
+    element* elem2;
+    attribute* attr;
+    const attribute* found;
+    uint8_t* packed;
+    size_t sz;
+    file_stamp stmp;
+    file_stamp packed_stmp;
+
+    elem1 = create_element(u"funky");
+    assert_int_equal(compare_element_to_packed_attributes(elem1, NULL), 0);
+    assert_false(packed_attributes_file_stamp(NULL, &packed_stmp));
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_FILE_TYPE;
+    attr->value.integer = YELLA_FILE_TYPE_REGULAR;
+    add_element_attribute(elem1, attr);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_USER;
+    attr->value.usr_grp.id = 501;
+    attr->value.usr_grp.name = copy_name(u"wéllé");
+    add_element_attribute(elem1, attr);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_SIZE;
+    attr->value.size = 7000;
+    add_element_attribute(elem1, attr);
+    stmp.device = 1;
+    stmp.inode = 2;
+    stmp.size = 7000;
+    stmp.modification_nanos = 4;
+    stmp.metadata_change_nanos = 5;
+    set_element_file_stamp(elem1, &stmp);
+    packed = pack_element_attributes(elem1, &sz);
+    assert_non_null(packed);
+    assert_int_equal(compare_element_to_packed_attributes(elem1, packed), 0);
+    assert_true(packed_attributes_file_stamp(packed, &packed_stmp));
+    assert_true(file_stamps_equal(&stmp, &packed_stmp));
+    attr = create_attribute_from_packed_attributes(packed, ATTR_TYPE_USER);
+    assert_non_null(attr);
+    found = find_element_attribute(elem1, ATTR_TYPE_USER);
+    assert_int_equal(compare_attributes(attr, found), 0);
+    destroy_attribute(attr);
+    assert_null(create_attribute_from_packed_attributes(packed, ATTR_TYPE_SHA256));
+    /* Same id, different name */
+    elem2 = create_element(u"funky");
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_FILE_TYPE;
+    attr->value.integer = YELLA_FILE_TYPE_REGULAR;
+    add_element_attribute(elem2, attr);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_USER;
+    attr->value.usr_grp.id = 501;
+    attr->value.usr_grp.name = copy_name(u"wélly");
+    add_element_attribute(elem2, attr);
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_SIZE;
+    attr->value.size = 7000;
+    add_element_attribute(elem2, attr);
+    assert_int_not_equal(compare_element_to_packed_attributes(elem2, packed), 0);
+    assert_int_equal(compare_element_to_packed_attributes(elem2, packed) < 0, compare_element_attributes(elem2, elem1) < 0);
+    destroy_element(elem2);
+    /* Missing an attribute */
+    elem2 = create_element(u"funky");
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_FILE_TYPE;
+    attr->value.integer = YELLA_FILE_TYPE_REGULAR;
+    add_element_attribute(elem2, attr);
+    assert_int_not_equal(compare_element_to_packed_attributes(elem2, packed), 0);
+    assert_int_not_equal(compare_element_to_packed_attributes(elem1, NULL), 0);
+    destroy_element(elem2);
+    free(packed);
+    destroy_element(elem1);
+}
+
+static void chunk_digests(void** arg)
+{
+    element* elem;
+    attribute* attr;
+    uint8_t* packed;
+    size_t sz;
+    flatcc_builder_t bld;
+
+    elem = create_element(u"chunky");
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_CHUNKED_SHA256;
+    memset(attr->value.chunked.root, 1, CHUNKED_SHA256_DIGEST_SIZE);
+    attr->value.chunked.chunk_size = 4;
+    attr->value.chunked.byte_count = 7;
+    attr->value.chunked.chunk_count = 2;
+    attr->value.chunked.chunks = malloc(2 * CHUNKED_SHA256_DIGEST_SIZE);
+    memset(attr->value.chunked.chunks, 2, 2 * CHUNKED_SHA256_DIGEST_SIZE);
+    add_element_attribute(elem, attr);
+    /* The state db keeps the chunk digests */
+    packed = pack_element_attributes(elem, &sz);
+    assert_non_null(packed);
+    attr = create_attribute_from_packed_attributes(packed, ATTR_TYPE_CHUNKED_SHA256);
+    assert_non_null(attr);
+    assert_int_equal(attr->value.chunked.chunk_count, 2);
+    assert_memory_equal(attr->value.chunked.chunks,
+                        find_element_attribute(elem, ATTR_TYPE_CHUNKED_SHA256)->value.chunked.chunks,
+                        2 * CHUNKED_SHA256_DIGEST_SIZE);
+    destroy_attribute(attr);
+    free(packed);
+    /* But the vector that goes into messages only has the root */
+    flatcc_builder_init(&bld);
+    yella_fb_file_attr_array_start_as_root(&bld);
+    yella_fb_file_attr_array_attrs_add(&bld, pack_element_attributes_to_vector(elem, &bld));
+    yella_fb_file_attr_array_end_as_root(&bld);
+    packed = flatcc_builder_finalize_buffer(&bld, &sz);
+    flatcc_builder_clear(&bld);
+    attr = create_attribute_from_packed_attributes(packed, ATTR_TYPE_CHUNKED_SHA256);
+    assert_non_null(attr);
+    assert_int_equal(attr->value.chunked.chunk_count, 0);
+    assert_null(attr->value.chunked.chunks);
+    assert_int_equal(attr->value.chunked.byte_count, 7);
+    assert_int_equal(compare_attributes(attr, find_element_attribute(elem, ATTR_TYPE_CHUNKED_SHA256)), 0);
+    destroy_attribute(attr);
+    free(packed);
+    destroy_element(elem);
 }
 
 int main()
 {
     const struct CMUnitTest tests[] =
     {
+        cmocka_unit_test(chunk_digests),
         cmocka_unit_test(compare),
+        cmocka_unit_test(compare_packed),
         cmocka_unit_test(diff)
     };
 
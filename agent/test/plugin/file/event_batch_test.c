@@ -0,0 +1,133 @@
+#include "plugin/file/event_batch.h"
+#include "common/settings.h"
+#include "common/uds_util.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <cmocka.h>
+#include <unicode/ustdio.h>
+#include <unicode/ustring.h>
+
+typedef struct test_data
+{
+    event_source* esrc;
+    /* The names received by the callback, as uds */
+    yella_ptr_vector* received;
+    size_t calls;
+} test_data;
+
+static void events_received(const event_source_event* const events, size_t count, void* udata)
+{
+    test_data* td;
+    size_t i;
+
+    td = udata;
+    ++td->calls;
+    for (i = 0; i < count; i++)
+    {
+        assert_int_equal(u_strcmp(events[i].config_name, u"batch"), 0);
+        yella_push_back_ptr_vector(td->received, udsnew(events[i].fname));
+    }
+}
+
+static void duplicates(void** arg)
+{
+    test_data* td;
+    event_batch* batch;
+
+    td = *arg;
+    batch = create_event_batch(td->esrc);
+    add_to_event_batch(batch, u"/event-batch-test/a.c");
+    add_to_event_batch(batch, u"/event-batch-test/b.c");
+    add_to_event_batch(batch, u"/event-batch-test/a.c");
+    add_to_event_batch(batch, u"/event-batch-test/b.txt");
+    add_to_event_batch(batch, u"/event-batch-test/b.c");
+    assert_int_equal(event_batch_size(batch), 2);
+    flush_event_batch(batch);
+    assert_int_equal(td->calls, 1);
+    assert_int_equal(yella_ptr_vector_size(td->received), 2);
+    assert_int_equal(u_strcmp(yella_ptr_vector_at(td->received, 0), u"/event-batch-test/a.c"), 0);
+    assert_int_equal(u_strcmp(yella_ptr_vector_at(td->received, 1), u"/event-batch-test/b.c"), 0);
+    /* A flush forgets what it has seen */
+    assert_int_equal(event_batch_size(batch), 0);
+    add_to_event_batch(batch, u"/event-batch-test/a.c");
+    assert_int_equal(event_batch_size(batch), 1);
+    flush_event_batch(batch);
+    assert_int_equal(td->calls, 2);
+    assert_int_equal(yella_ptr_vector_size(td->received), 3);
+    /* Nothing matched means no call */
+    add_to_event_batch(batch, u"/event-batch-test/c.txt");
+    flush_event_batch(batch);
+    assert_int_equal(td->calls, 2);
+    destroy_event_batch(batch);
+}
+
+static void many(void** arg)
+{
+    test_data* td;
+    event_batch* batch;
+    uds name;
+    int i;
+    int round;
+
+    td = *arg;
+    batch = create_event_batch(td->esrc);
+    for (round = 0; round < 2; round++)
+    {
+        for (i = 0; i < 50000; i++)
+        {
+            name = udscatprintf(udsempty(), u"/event-batch-test/%d.c", i % 10000);
+            add_to_event_batch(batch, name);
+            udsfree(name);
+        }
+        assert_int_equal(event_batch_size(batch), 10000);
+        flush_event_batch(batch);
+        assert_int_equal(yella_ptr_vector_size(td->received), 10000 * (round + 1));
+    }
+    destroy_event_batch(batch);
+}
+
+static int set_up(void** arg)
+{
+    test_data* td;
+    event_source_spec* spec;
+
+    td = calloc(1, sizeof(test_data));
+    td->received = yella_create_uds_ptr_vector();
+    td->esrc = create_event_source(events_received, td);
+    spec = calloc(1, sizeof(event_source_spec));
+    spec->name = udsnew(u"batch");
+    spec->includes = yella_create_uds_ptr_vector();
+    yella_push_back_ptr_vector(spec->includes, udsnew(u"/event-batch-test/*.c"));
+    spec->excludes = yella_create_uds_ptr_vector();
+    add_or_replace_event_source_specs(td->esrc, &spec, 1);
+    *arg = td;
+    return 0;
+}
+
+static int tear_down(void** arg)
+{
+    test_data* td;
+
+    td = *arg;
+    destroy_event_source(td->esrc);
+    yella_destroy_ptr_vector(td->received);
+    free(td);
+    return 0;
+}
+
+int main()
+{
+    const struct CMUnitTest tests[] =
+    {
+        cmocka_unit_test_setup_teardown(duplicates, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(many, set_up, tear_down)
+    };
+
+    yella_load_settings_doc();
+    yella_destroy_settings_doc();
+    yella_settings_set_uint(u"file", u"fs-monitor-latency-seconds", 1);
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
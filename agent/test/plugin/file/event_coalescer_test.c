@@ -0,0 +1,235 @@
+#include "plugin/file/event_coalescer.h"
+#include "common/settings.h"
+#include "common/thread.h"
+#include "common/uds_util.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <cmocka.h>
+#include <unicode/ustdio.h>
+#include <unicode/ustring.h>
+
+typedef struct test_data
+{
+    /* What the callback received, rendered as "kind:config:name" */
+    yella_ptr_vector* received;
+    size_t calls;
+    yella_mutex* guard;
+} test_data;
+
+static void events_coalesced(const coalesced_event* const events, size_t count, void* udata)
+{
+    test_data* td;
+    size_t i;
+    static const UChar* kinds[] = { u"file", u"dir", u"config" };
+
+    td = udata;
+    yella_lock_mutex(td->guard);
+    ++td->calls;
+    for (i = 0; i < count; i++)
+    {
+        yella_push_back_ptr_vector(td->received,
+                                   udscatprintf(udsempty(),
+                                                u"%S:%S:%S",
+                                                kinds[events[i].kind],
+                                                events[i].config_name,
+                                                (events[i].name == NULL) ? u"" : events[i].name));
+    }
+    yella_unlock_mutex(td->guard);
+}
+
+static bool was_received(const test_data* const td, const UChar* const expected)
+{
+    size_t i;
+
+    for (i = 0; i < yella_ptr_vector_size(td->received); i++)
+    {
+        if (u_strcmp(yella_ptr_vector_at(td->received, i), expected) == 0)
+            return true;
+    }
+    return false;
+}
+
+static void add_one(event_coalescer* ec, const UChar* const config_name, const UChar* const fname)
+{
+    event_source_event evt;
+
+    evt.config_name = config_name;
+    evt.fname = fname;
+    add_to_event_coalescer(ec, &evt, 1);
+}
+
+static void ancestors(void** arg)
+{
+    test_data* td;
+    event_coalescer* ec;
+
+    td = *arg;
+    ec = create_event_coalescer(2, 60000, events_coalesced, td);
+    add_one(ec, u"one", u"/x/1");
+    add_one(ec, u"one", u"/x/2");
+    /* The names are full, so these dirty two nested directories */
+    add_one(ec, u"one", u"/a/f");
+    add_one(ec, u"one", u"/a/b/g");
+    flush_event_coalescer(ec);
+    assert_int_equal(yella_ptr_vector_size(td->received), 3);
+    assert_true(was_received(td, u"file:one:/x/1"));
+    assert_true(was_received(td, u"file:one:/x/2"));
+    assert_true(was_received(td, u"dir:one:/a"));
+    destroy_event_coalescer(ec);
+}
+
+static void configs(void** arg)
+{
+    test_data* td;
+    event_coalescer* ec;
+    event_coalescer_stats stats;
+
+    td = *arg;
+    ec = create_event_coalescer(2, 60000, events_coalesced, td);
+    add_one(ec, u"two", u"/a/x");
+    add_one(ec, u"one", u"/a/x");
+    /* Past here only directories are kept, and then only the config */
+    add_one(ec, u"one", u"/b/x");
+    add_one(ec, u"one", u"/c/x");
+    add_one(ec, u"one", u"/d/x");
+    add_one(ec, u"one", u"/e/x");
+    flush_event_coalescer(ec);
+    assert_int_equal(yella_ptr_vector_size(td->received), 2);
+    assert_true(was_received(td, u"config:one:"));
+    assert_true(was_received(td, u"file:two:/a/x"));
+    get_event_coalescer_stats(ec, &stats);
+    assert_int_equal(stats.events, 6);
+    assert_int_equal(stats.files, 1);
+    assert_int_equal(stats.directories, 0);
+    assert_int_equal(stats.configs, 1);
+    destroy_event_coalescer(ec);
+}
+
+static void directories(void** arg)
+{
+    test_data* td;
+    event_coalescer* ec;
+    uds name;
+    int i;
+
+    td = *arg;
+    ec = create_event_coalescer(4, 60000, events_coalesced, td);
+    for (i = 0; i < 10; i++)
+    {
+        name = udscatprintf(udsempty(), u"/one/%d", i);
+        add_one(ec, u"one", name);
+        udsfree(name);
+    }
+    add_one(ec, u"one", u"/two/0");
+    flush_event_coalescer(ec);
+    /* The files already held in /one are covered by its rescan */
+    assert_int_equal(yella_ptr_vector_size(td->received), 2);
+    assert_true(was_received(td, u"dir:one:/one"));
+    assert_true(was_received(td, u"dir:one:/two"));
+    destroy_event_coalescer(ec);
+}
+
+static void duplicates(void** arg)
+{
+    test_data* td;
+    event_coalescer* ec;
+    event_source_event evts[4];
+
+    td = *arg;
+    ec = create_event_coalescer(100, 60000, events_coalesced, td);
+    evts[0].config_name = u"one";
+    evts[0].fname = u"/dup/a";
+    evts[1].config_name = u"one";
+    evts[1].fname = u"/dup/b";
+    evts[2].config_name = u"one";
+    evts[2].fname = u"/dup/a";
+    evts[3].config_name = u"two";
+    evts[3].fname = u"/dup/a";
+    add_to_event_coalescer(ec, evts, 4);
+    add_to_event_coalescer(ec, evts, 4);
+    flush_event_coalescer(ec);
+    assert_int_equal(td->calls, 1);
+    assert_int_equal(yella_ptr_vector_size(td->received), 3);
+    assert_true(was_received(td, u"file:one:/dup/a"));
+    assert_true(was_received(td, u"file:one:/dup/b"));
+    assert_true(was_received(td, u"file:two:/dup/a"));
+    /* Nothing held means no call */
+    flush_event_coalescer(ec);
+    assert_int_equal(td->calls, 1);
+    /* Destruction flushes what is left */
+    add_to_event_coalescer(ec, evts, 1);
+    destroy_event_coalescer(ec);
+    assert_int_equal(td->calls, 2);
+    assert_int_equal(yella_ptr_vector_size(td->received), 4);
+}
+
+static void window(void** arg)
+{
+    test_data* td;
+    event_coalescer* ec;
+    size_t received;
+    int i;
+
+    td = *arg;
+    /* No window at all hands each addition on right away */
+    ec = create_event_coalescer(100, 0, events_coalesced, td);
+    add_one(ec, u"one", u"/window/a");
+    assert_int_equal(yella_ptr_vector_size(td->received), 1);
+    add_one(ec, u"one", u"/window/a");
+    assert_int_equal(yella_ptr_vector_size(td->received), 2);
+    destroy_event_coalescer(ec);
+    yella_clear_ptr_vector(td->received);
+    ec = create_event_coalescer(100, 50, events_coalesced, td);
+    add_one(ec, u"one", u"/window/a");
+    add_one(ec, u"one", u"/window/a");
+    received = 0;
+    for (i = 0; i < 100 && received == 0; i++)
+    {
+        yella_sleep_this_thread_milliseconds(50);
+        yella_lock_mutex(td->guard);
+        received = yella_ptr_vector_size(td->received);
+        yella_unlock_mutex(td->guard);
+    }
+    assert_int_equal(received, 1);
+    destroy_event_coalescer(ec);
+    assert_int_equal(yella_ptr_vector_size(td->received), 1);
+}
+
+static int set_up(void** arg)
+{
+    test_data* td;
+
+    td = calloc(1, sizeof(test_data));
+    td->received = yella_create_uds_ptr_vector();
+    td->guard = yella_create_mutex();
+    *arg = td;
+    return 0;
+}
+
+static int tear_down(void** arg)
+{
+    test_data* td;
+
+    td = *arg;
+    yella_destroy_mutex(td->guard);
+    yella_destroy_ptr_vector(td->received);
+    free(td);
+    return 0;
+}
+
+int main()
+{
+    const struct CMUnitTest tests[] =
+    {
+        cmocka_unit_test_setup_teardown(ancestors, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(configs, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(directories, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(duplicates, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(window, set_up, tear_down)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -1,7 +1,9 @@
 #include "plugin/file/event_source.h"
+#include "plugin/file/fd_trace.h"
 #include "common/settings.h"
 #include "common/file.h"
 #include "common/text_util.h"
+#include "common/time_util.h"
 #include <unicode/ustdio.h>
 #include <stdio.h>
 #include <stdarg.h>
@@ -24,8 +26,31 @@ typedef struct test_data
     yella_mutex* guard;
     yella_condition_variable* cond;
     yella_ptr_vector* exp;
+    /* What has been received from exp, as "config:file" uds */
+    yella_ptr_vector* seen;
+    /* Replayed events are only counted */
+    bool replaying;
+    size_t replayed;
+    /* While flooding, events are ignored, and the first batch holds the
+     * worker until released, so that the kernel queue fills */
+    bool flooding;
+    yella_event* worker_held;
+    yella_event* release_worker;
+    /* Stands in for the lock on the plugin's configs, which is held
+     * around spec updates and taken by the overflow callback */
+    yella_mutex* config_guard;
+    bool overflowed;
 } test_data;
 
+typedef struct replay_data
+{
+    /* The lines of the trace, as char* */
+    yella_ptr_vector* lines;
+    fd_trace_ring* ring;
+    char* dir_name;
+    size_t invalid;
+} replay_data;
+
 static void check_exp(yella_ptr_vector* exp)
 {
     unsigned i;
@@ -54,16 +79,15 @@ static void expected_destructor(void* elem, void* udata)
     udsfree(exp->file_name);
 }
 
-static void file_changed(const UChar* const config_name, const UChar* const fname, void* udata)
+static void one_file_changed(test_data* td, const UChar* const config_name, const UChar* const fname)
 {
-    test_data* td;
     char* c;
     char* f;
     size_t i;
     expected* cur;
     bool got_one;
+    uds seen;
 
-    td = udata;
     c = yella_to_utf8(config_name);
     f = yella_to_utf8(fname);
     print_message("Received '%s': '%s'\n", c, f);
@@ -78,6 +102,7 @@ static void file_changed(const UChar* const config_name, const UChar* const fnam
         {
             if (cur->pause_evt != NULL)
                 pause_event_source(td->esrc);
+            yella_push_back_ptr_vector(td->seen, udscatprintf(udsempty(), u"%S:%S", config_name, fname));
             yella_erase_ptr_vector_at(td->exp, i);
             if (yella_ptr_vector_size(td->exp) == 0)
                 yella_signal_condition_variable(td->cond);
@@ -85,10 +110,63 @@ static void file_changed(const UChar* const config_name, const UChar* const fnam
             break;
         }
     }
+    /* A file may be reported again by a later batch */
+    if (!got_one)
+    {
+        seen = udscatprintf(udsempty(), u"%S:%S", config_name, fname);
+        for (i = 0; !got_one && i < yella_ptr_vector_size(td->seen); i++)
+            got_one = u_strcmp(yella_ptr_vector_at(td->seen, i), seen) == 0;
+        udsfree(seen);
+    }
     yella_unlock_mutex(td->guard);
     assert_true(got_one);
 }
 
+static void file_changed(const event_source_event* const events, size_t count, void* udata)
+{
+    size_t i;
+    test_data* td;
+
+    td = udata;
+    if (td->flooding)
+    {
+        if (td->release_worker != NULL)
+        {
+            yella_signal_event(td->worker_held);
+            yella_wait_for_event(td->release_worker);
+            td->release_worker = NULL;
+        }
+        return;
+    }
+    if (td->replaying)
+    {
+        for (i = 0; i < count; i++)
+            assert_int_equal(u_strcmp(events[i].config_name, u"replay"), 0);
+        td->replayed += count;
+        return;
+    }
+    for (i = 0; i < count; i++)
+        one_file_changed(udata, events[i].config_name, events[i].fname);
+}
+
+/* Only the Linux event source can be made to overflow on demand */
+#if defined(__linux__)
+
+static void overflowed(const UChar* const config_name, const UChar* const dir, void* udata)
+{
+    test_data* td;
+
+    td = udata;
+    yella_lock_mutex(td->config_guard);
+    yella_lock_mutex(td->guard);
+    td->overflowed = true;
+    yella_signal_condition_variable(td->cond);
+    yella_unlock_mutex(td->guard);
+    yella_unlock_mutex(td->config_guard);
+}
+
+#endif
+
 static void touch_file(const UChar* const fname)
 {
     UFILE* f;
@@ -101,6 +179,32 @@ static void touch_file(const UChar* const fname)
     u_fclose(f);
 }
 
+/* The names are copied first, since each event removes its own */
+static void touch_expected(test_data* td)
+{
+    yella_ptr_vector* names;
+    size_t i;
+
+    names = yella_create_uds_ptr_vector();
+    yella_lock_mutex(td->guard);
+    for (i = 0; i < yella_ptr_vector_size(td->exp); i++)
+        yella_push_back_ptr_vector(names, udsdup(((expected*)yella_ptr_vector_at(td->exp, i))->file_name));
+    yella_unlock_mutex(td->guard);
+    for (i = 0; i < yella_ptr_vector_size(names); i++)
+        touch_file(yella_ptr_vector_at(names, i));
+    yella_destroy_ptr_vector(names);
+}
+
+/* The events may all arrive before the wait begins */
+static void wait_for_exp(test_data* td)
+{
+    yella_lock_mutex(td->guard);
+    while (yella_ptr_vector_size(td->exp) > 0)
+        assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
+    check_exp(td->exp);
+    yella_unlock_mutex(td->guard);
+}
+
 static void clear(void** arg)
 {
     test_data* td;
@@ -134,12 +238,8 @@ static void clear(void** arg)
     yella_push_back_ptr_vector(td->exp, exp);
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 0))->file_name);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 1))->file_name);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    touch_expected(td);
+    wait_for_exp(td);
     clear_event_source_specs(td->esrc);
     fname = udsdup(td->dir_name);
     fname = udscat(fname, u"one");
@@ -180,12 +280,8 @@ static void dir(void** arg)
     yella_push_back_ptr_vector(td->exp, exp);
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 0))->file_name);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 1))->file_name);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    touch_expected(td);
+    wait_for_exp(td);
 }
 
 static void duplicates(void** arg)
@@ -217,12 +313,8 @@ static void duplicates(void** arg)
     yella_push_back_ptr_vector(td->exp, exp);
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 0))->file_name);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 1))->file_name);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    touch_expected(td);
+    wait_for_exp(td);
 
 }
 
@@ -253,12 +345,9 @@ static void exclude(void** arg)
     yella_push_back_ptr_vector(spec->excludes, ex);
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 0))->file_name);
+    touch_expected(td);
     touch_file(ex);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    wait_for_exp(td);
 }
 
 static void multiple_configs(void** arg)
@@ -294,12 +383,8 @@ static void multiple_configs(void** arg)
     yella_push_back_ptr_vector(td->exp, exp);
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 0))->file_name);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 1))->file_name);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    touch_expected(td);
+    wait_for_exp(td);
 
 }
 
@@ -325,12 +410,75 @@ static void one_file(void** arg)
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
     touch_file(yella_ptr_vector_at(spec->includes, 0));
+    wait_for_exp(td);
+}
+
+#if defined(__linux__)
+
+static event_source_spec* create_dir_spec(test_data* td, const UChar* const name)
+{
+    event_source_spec* spec;
+
+    spec = malloc(sizeof(event_source_spec));
+    spec->name = udsnew(name);
+    spec->includes = yella_create_uds_ptr_vector();
+    spec->excludes = yella_create_uds_ptr_vector();
+    yella_push_back_ptr_vector(spec->includes, udscat(udsdup(td->dir_name), u"*"));
+    return spec;
+}
+
+/* The worker reports an overflow while the specs are being replaced */
+static void overflow_during_update(void** arg)
+{
+    test_data* td;
+    event_source_spec* spec;
+    yella_event* release;
+    uds fname;
+    UFILE* f;
+    int i;
+
+    td = *arg;
+    td->config_guard = yella_create_mutex();
+    td->worker_held = yella_create_event();
+    release = yella_create_event();
+    td->release_worker = release;
+    td->flooding = true;
+    set_event_source_overflow_callback(td->esrc, overflowed);
+    spec = create_dir_spec(td, u"floods");
+    add_or_replace_event_source_specs(td->esrc, &spec, 1);
+    yella_sleep_this_thread_milliseconds(250);
+    fname = udscat(udsdup(td->dir_name), u"one");
+    touch_file(fname);
+    udsfree(fname);
+    yella_wait_for_event(td->worker_held);
+    /* More distinct events than the kernel queues by default */
+    for (i = 0; i < 20000; i++)
+    {
+        fname = udscatprintf(udsdup(td->dir_name), u"flood-%d", i);
+        f = u_fopen_u(fname, "w", NULL, NULL);
+        u_fclose(f);
+        udsfree(fname);
+    }
+    yella_lock_mutex(td->config_guard);
+    yella_signal_event(release);
+    /* Long enough for the worker to read the overflow and call back */
+    yella_sleep_this_thread_milliseconds(500);
+    spec = create_dir_spec(td, u"floods");
+    add_or_replace_event_source_specs(td->esrc, &spec, 1);
+    yella_unlock_mutex(td->config_guard);
     yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
+    while (!td->overflowed)
+        assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 5000));
     yella_unlock_mutex(td->guard);
+    destroy_event_source(td->esrc);
+    td->esrc = NULL;
+    yella_destroy_event(release);
+    yella_destroy_event(td->worker_held);
+    yella_destroy_mutex(td->config_guard);
 }
 
+#endif
+
 static void pause_resume(void** arg)
 {
     test_data* td;
@@ -354,10 +502,7 @@ static void pause_resume(void** arg)
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
     touch_file(yella_ptr_vector_at(spec->includes, 0));
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    wait_for_exp(td);
     wait_for_event_source_pause(td->esrc);
     fname = udsdup(td->dir_name);
     fname = udscat(fname, u"one");
@@ -368,10 +513,7 @@ static void pause_resume(void** arg)
     exp->file_name = udsdup(yella_ptr_vector_at(spec->includes, 0));
     yella_push_back_ptr_vector(td->exp, exp);
     touch_file(yella_ptr_vector_at(spec->includes, 0));
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    wait_for_exp(td);
 }
 
 static void remove_one(void** arg)
@@ -407,12 +549,8 @@ static void remove_one(void** arg)
     yella_push_back_ptr_vector(td->exp, exp);
     add_or_replace_event_source_specs(td->esrc, &spec, 1);
     yella_sleep_this_thread_milliseconds(250);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 0))->file_name);
-    touch_file(((expected*)yella_ptr_vector_at(td->exp, 1))->file_name);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    touch_expected(td);
+    wait_for_exp(td);
     remove_event_source_spec(td->esrc, u"config 1");
     exp = calloc(1, sizeof(expected));
     exp->config_name = udsnew(u"config 2");
@@ -426,10 +564,182 @@ static void remove_one(void** arg)
     fname = udscat(fname, u"two");
     yella_remove_file(fname);
     udsfree(fname);
-    yella_lock_mutex(td->guard);
-    assert_true(yella_wait_milliseconds_for_condition_variable(td->cond, td->guard, 2000));
-    check_exp(td->exp);
-    yella_unlock_mutex(td->guard);
+    wait_for_exp(td);
+}
+
+/* Even fds are files below the test directory, and odd ones are elsewhere */
+static UChar* replay_resolver(int32_t pid, int32_t fd, void* udata)
+{
+    replay_data* rd;
+    char buf[1024];
+
+    rd = udata;
+    if (fd % 2 == 0)
+        snprintf(buf, sizeof(buf), "%sp%d/f%d", rd->dir_name, (int)pid, (int)fd);
+    else
+        snprintf(buf, sizeof(buf), "/elsewhere/p%d/f%d", (int)pid, (int)fd);
+    return yella_from_utf8(buf);
+}
+
+static void replay_producer(void* udata)
+{
+    replay_data* rd;
+    fd_trace_record rec;
+    size_t i;
+
+    rd = udata;
+    for (i = 0; i < yella_ptr_vector_size(rd->lines); i++)
+    {
+        if (parse_fd_trace_record(yella_ptr_vector_at(rd->lines, i), &rec))
+        {
+            while (!push_fd_trace_ring(rd->ring, &rec))
+                yella_sleep_this_thread_milliseconds(1);
+        }
+        else
+        {
+            ++rd->invalid;
+        }
+    }
+}
+
+static void push_line(yella_ptr_vector* lines, const char* const fmt, int pid, int fd)
+{
+    char buf[64];
+
+    snprintf(buf, sizeof(buf), fmt, pid, fd);
+    yella_push_back_ptr_vector(lines, strdup(buf));
+}
+
+/* Writes, closes and exits among 64 processes with 16 fds each, in the
+ * form DTrace prints them. Returns the number of writes to an fd that
+ * was not open before, which is how often the names must be resolved. */
+static size_t make_trace(yella_ptr_vector* lines, size_t count)
+{
+    bool open[64][16];
+    size_t misses;
+    size_t i;
+    int p;
+    int f;
+
+    memset(open, 0, sizeof(open));
+    misses = 0;
+    for (i = 0; i < count; i++)
+    {
+        p = (i * 7) % 64;
+        f = (i * 13) % 16;
+        if (i % 1000 == 999)
+        {
+            push_line(lines, "close:%d,%d\n", 1000 + p, 3 + f);
+            open[p][f] = false;
+        }
+        else if (i % 5000 == 4999)
+        {
+            push_line(lines, "closefrom:%d,%d\n", 1000 + p, 3 + 8);
+            memset(&open[p][8], 0, 8 * sizeof(bool));
+        }
+        else
+        {
+            push_line(lines, "write:%d,%d\n", 1000 + p, 3 + f);
+            if (!open[p][f])
+            {
+                open[p][f] = true;
+                ++misses;
+            }
+        }
+    }
+    for (p = 0; p < 64; p++)
+        push_line(lines, "exit:%d\n", 1000 + p, 0);
+    return misses;
+}
+
+/* Set YELLA_FD_TRACE to the name of a file of captured DTrace output to
+ * replay it instead of the made up trace */
+static void replay(void** arg)
+{
+    test_data* td;
+    event_source_spec* spec;
+    replay_data rd;
+    fd_name_cache* cache;
+    event_batch* batch;
+    yella_thread* producer;
+    fd_trace_record rec;
+    fd_name_cache_stats stats;
+    size_t expected_misses;
+    size_t records;
+    const char* captured;
+    FILE* f;
+    char line[1024];
+    uint64_t start;
+    uint64_t micros;
+
+    td = *arg;
+    spec = malloc(sizeof(event_source_spec));
+    spec->name = udsnew(u"replay");
+    spec->includes = yella_create_uds_ptr_vector();
+    spec->excludes = yella_create_uds_ptr_vector();
+    yella_push_back_ptr_vector(spec->includes, udscatprintf(udsempty(), u"%S**", td->dir_name));
+    add_or_replace_event_source_specs(td->esrc, &spec, 1);
+    rd.lines = yella_create_ptr_vector();
+    rd.invalid = 0;
+    rd.dir_name = yella_to_utf8(td->dir_name);
+    captured = getenv("YELLA_FD_TRACE");
+    if (captured == NULL)
+    {
+        expected_misses = make_trace(rd.lines, 500000);
+    }
+    else
+    {
+        f = fopen(captured, "r");
+        assert_non_null(f);
+        while (fgets(line, sizeof(line), f) != NULL)
+            yella_push_back_ptr_vector(rd.lines, strdup(line));
+        fclose(f);
+        expected_misses = 0;
+    }
+    rd.ring = create_fd_trace_ring(1024);
+    cache = create_fd_name_cache(td->esrc, replay_resolver, &rd);
+    batch = create_event_batch(td->esrc);
+    td->replaying = true;
+    records = 0;
+    start = yella_microseconds_since_epoch();
+    producer = yella_create_thread(replay_producer, &rd);
+    while (records + rd.invalid < yella_ptr_vector_size(rd.lines))
+    {
+        if (wait_for_fd_trace_ring(rd.ring, 250))
+        {
+            while (pop_fd_trace_ring(rd.ring, &rec))
+            {
+                apply_fd_trace_record(cache, &rec, batch);
+                ++records;
+            }
+            flush_event_batch(batch);
+        }
+    }
+    micros = yella_microseconds_since_epoch() - start;
+    yella_join_thread(producer);
+    yella_destroy_thread(producer);
+    td->replaying = false;
+    get_fd_name_cache_stats(cache, &stats);
+    print_message("Replayed %zu records in %llu microseconds (%.0f records/s): %zu events, %llu hits, %llu misses\n",
+                  records,
+                  (unsigned long long)micros,
+                  (micros == 0) ? 0.0 : records * 1000000.0 / micros,
+                  td->replayed,
+                  (unsigned long long)stats.hits,
+                  (unsigned long long)stats.misses);
+    if (captured == NULL)
+    {
+        assert_int_equal(rd.invalid, 0);
+        assert_int_equal(stats.misses, expected_misses);
+        assert_true(td->replayed > 0);
+        /* Every process has exited */
+        assert_int_equal(fd_name_cache_size(cache), 0);
+    }
+    destroy_event_batch(batch);
+    destroy_fd_name_cache(cache);
+    destroy_fd_trace_ring(rd.ring);
+    free(rd.dir_name);
+    yella_destroy_ptr_vector(rd.lines);
 }
 
 static int set_up(void** arg)
@@ -438,9 +748,7 @@ static int set_up(void** arg)
     UChar* cur_dir;
     const UChar* sep;
 
-    td = malloc(sizeof(test_data));
-    td->esrc = create_event_source(file_changed, td);
-    assert_non_null(td->esrc);
+    td = calloc(1, sizeof(test_data));
     cur_dir = yella_getcwd();
     if (u_strlen(cur_dir) > 0 && cur_dir[u_strlen(cur_dir) - 1] != YELLA_DIR_SEP[0])
         sep = YELLA_DIR_SEP;
@@ -454,6 +762,10 @@ static int set_up(void** arg)
     td->cond = yella_create_condition_variable();
     td->exp = yella_create_ptr_vector();
     yella_set_ptr_vector_destructor(td->exp, expected_destructor, NULL);
+    td->seen = yella_create_uds_ptr_vector();
+    /* Created after the old files are gone, so their removal is not reported */
+    td->esrc = create_event_source(file_changed, td);
+    assert_non_null(td->esrc);
     *arg = td;
     return 0;
 }
@@ -463,10 +775,12 @@ static int tear_down(void** arg)
     test_data* td;
 
     td = *arg;
-    destroy_event_source(td->esrc);
+    if (td->esrc != NULL)
+        destroy_event_source(td->esrc);
     yella_destroy_condition_variable(td->cond);
     yella_destroy_mutex(td->guard);
     yella_destroy_ptr_vector(td->exp);
+    yella_destroy_ptr_vector(td->seen);
     free(td);
     return 0;
 }
@@ -482,7 +796,11 @@ int main()
         cmocka_unit_test_setup_teardown(multiple_configs, set_up, tear_down),
         cmocka_unit_test_setup_teardown(remove_one, set_up, tear_down),
         cmocka_unit_test_setup_teardown(clear, set_up, tear_down),
-        cmocka_unit_test_setup_teardown(pause_resume, set_up, tear_down)
+#if defined(__linux__)
+        cmocka_unit_test_setup_teardown(overflow_during_update, set_up, tear_down),
+#endif
+        cmocka_unit_test_setup_teardown(pause_resume, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(replay, set_up, tear_down)
     };
 
     yella_load_settings_doc();
@@ -1,12 +1,16 @@
 #include "plugin/file/file_name_matcher.h"
 #include "common/macro_util.h"
 #include "common/text_util.h"
+#include "common/time_util.h"
+#include "common/uds_util.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdlib.h>
 #include <cmocka.h>
+#include <unicode/ustdio.h>
+#include <inttypes.h>
 
 typedef struct expected
 {
@@ -36,6 +40,122 @@ static void check_it(const expected* ex, size_t sz)
     }
 }
 
+static void benchmark(void** arg)
+{
+    const UChar* patterns[] =
+    {
+        u"/usr/local/etc/**/*.conf",
+        u"/**/a*b*c*d*e*f*g*h*",
+        u"/var/log/*/messages*",
+        /* A backtracking matcher tries millions of ways to split these names */
+        u"/**/a*a*a*a*a*a*a*a*b"
+    };
+    const int count = 20000;
+    UChar names[100][128];
+    file_name_pattern* fnp;
+    int i;
+    int j;
+    uint64_t start;
+    uint64_t elapsed[2];
+
+    for (j = 0; j < YELLA_ARRAY_SIZE(names); j++)
+        u_sprintf(names[j], "/usr/local/etc/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa/%d/file.conf", j);
+    for (i = 0; i < YELLA_ARRAY_SIZE(patterns); i++)
+    {
+        fnp = compile_file_name_pattern(patterns[i]);
+        start = yella_microseconds_since_epoch();
+        for (j = 0; j < count; j++)
+            file_name_matches(names[j % YELLA_ARRAY_SIZE(names)], patterns[i]);
+        elapsed[0] = yella_microseconds_since_epoch() - start;
+        start = yella_microseconds_since_epoch();
+        for (j = 0; j < count; j++)
+            file_name_pattern_matches(fnp, names[j % YELLA_ARRAY_SIZE(names)]);
+        elapsed[1] = yella_microseconds_since_epoch() - start;
+        destroy_file_name_pattern(fnp);
+        print_message("pattern %d: %d matches compiling each time in %" PRIu64 " us, precompiled in %" PRIu64 " us\n",
+                      i,
+                      count,
+                      elapsed[0],
+                      elapsed[1]);
+    }
+}
+
+static void set_benchmark(void** arg)
+{
+    const UChar* texts[] =
+    {
+        u"**/*.tmp",
+        u"**/*.swp",
+        u"**/*~",
+        u"**/.git/**",
+        u"**/.svn/**",
+        u"**/node_modules/**",
+        u"**/*.o",
+        u"**/*.pyc",
+        u"**/__pycache__/**",
+        u"**/.DS_Store"
+    };
+    const int count = 20000;
+    yella_ptr_vector* patterns;
+    yella_ptr_vector* compiled;
+    file_name_pattern_set* fps;
+    UChar names[100][128];
+    int i;
+    int j;
+    uint64_t start;
+    uint64_t elapsed[2];
+
+    patterns = yella_create_uds_ptr_vector();
+    for (i = 0; i < YELLA_ARRAY_SIZE(texts); i++)
+        yella_push_back_ptr_vector(patterns, udsnew(texts[i]));
+    compiled = compile_file_name_patterns(patterns);
+    fps = compile_file_name_pattern_set(patterns);
+    for (j = 0; j < YELLA_ARRAY_SIZE(names); j++)
+        u_sprintf(names[j], "/home/will/projects/yella/agent/plugin/file/source-%d.c", j);
+    start = yella_microseconds_since_epoch();
+    for (j = 0; j < count; j++)
+    {
+        for (i = 0; i < yella_ptr_vector_size(compiled); i++)
+        {
+            if (file_name_pattern_matches(yella_ptr_vector_at(compiled, i), names[j % YELLA_ARRAY_SIZE(names)]))
+                break;
+        }
+    }
+    elapsed[0] = yella_microseconds_since_epoch() - start;
+    start = yella_microseconds_since_epoch();
+    for (j = 0; j < count; j++)
+        file_name_pattern_set_matches(fps, names[j % YELLA_ARRAY_SIZE(names)]);
+    elapsed[1] = yella_microseconds_since_epoch() - start;
+    print_message("%d excludes: %d names one pattern at a time in %" PRIu64 " us, as a set in %" PRIu64 " us\n",
+                  (int)YELLA_ARRAY_SIZE(texts),
+                  count,
+                  elapsed[0],
+                  elapsed[1]);
+    destroy_file_name_pattern_set(fps);
+    yella_destroy_ptr_vector(compiled);
+    yella_destroy_ptr_vector(patterns);
+}
+
+static void compiled(void** arg)
+{
+    yella_ptr_vector* patterns;
+    yella_ptr_vector* compiled;
+
+    patterns = yella_create_uds_ptr_vector();
+    yella_push_back_ptr_vector(patterns, udsnew(u"/my/*/fleas"));
+    yella_push_back_ptr_vector(patterns, udsnew(u"**/*.txt"));
+    compiled = compile_file_name_patterns(patterns);
+    assert_int_equal(2, yella_ptr_vector_size(compiled));
+    assert_true(file_name_pattern_matches(yella_ptr_vector_at(compiled, 0), u"/my/dog/fleas"));
+    assert_false(file_name_pattern_matches(yella_ptr_vector_at(compiled, 0), u"/my/dog/has/fleas"));
+    assert_true(file_name_pattern_matches(yella_ptr_vector_at(compiled, 1), u"/my/dog/has/fleas.txt"));
+    assert_true(file_name_pattern_matches(yella_ptr_vector_at(compiled, 1), u"fleas.txt"));
+    /* A ** that has matched something may not also skip its separator */
+    assert_false(file_name_pattern_matches(yella_ptr_vector_at(compiled, 1), u"fleastxt"));
+    yella_destroy_ptr_vector(compiled);
+    yella_destroy_ptr_vector(patterns);
+}
+
 static void escaped(void** arg)
 {
     int i;
@@ -100,6 +220,75 @@ static void question(void** arg)
     check_it(tests, YELLA_ARRAY_SIZE(tests));
 }
 
+static void set(void** arg)
+{
+    const UChar* texts[] =
+    {
+        u"**/*.tmp",
+        u"**/.git/**",
+        u"**/*.swp",
+        u"/var/*/été/*",
+        u"/data/???",
+        u"/my\\*dog",
+        u"bad\\"
+    };
+    yella_ptr_vector* patterns;
+    file_name_pattern_set* fps;
+    UChar text[32];
+    int i;
+
+    patterns = yella_create_uds_ptr_vector();
+    for (i = 0; i < YELLA_ARRAY_SIZE(texts); i++)
+        yella_push_back_ptr_vector(patterns, udsnew(texts[i]));
+    fps = compile_file_name_pattern_set(patterns);
+    assert_true(file_name_pattern_set_matches(fps, u"/home/will/letter.tmp"));
+    assert_true(file_name_pattern_set_matches(fps, u"/home/will/src/.git/config"));
+    assert_true(file_name_pattern_set_matches(fps, u"/home/will/.letter.swp"));
+    assert_true(file_name_pattern_set_matches(fps, u"/var/log/été/messages"));
+    assert_true(file_name_pattern_set_matches(fps, u"/data/abc"));
+    assert_true(file_name_pattern_set_matches(fps, u"/my*dog"));
+    /* The literals are there, but the patterns do not match */
+    assert_false(file_name_pattern_set_matches(fps, u"/home/will/.tmp/letter"));
+    assert_false(file_name_pattern_set_matches(fps, u"/home/will/.gitignore"));
+    assert_false(file_name_pattern_set_matches(fps, u"/var/log/étéx/messages"));
+    assert_false(file_name_pattern_set_matches(fps, u"/data/abcd"));
+    assert_false(file_name_pattern_set_matches(fps, u"bad"));
+    assert_false(file_name_pattern_set_matches(fps, u"/home/will/letter.txt"));
+    /* The first to match is the first in order, not the first found */
+    assert_int_equal(file_name_pattern_set_first_match(fps, u"/home/will/.git/letter.tmp"), 0);
+    assert_int_equal(file_name_pattern_set_first_match(fps, u"/home/will/.git/letter.swp"), 1);
+    assert_int_equal(file_name_pattern_set_first_match(fps, u"/home/will/letter.txt"), YELLA_ARRAY_SIZE(texts));
+    destroy_file_name_pattern_set(fps);
+    yella_clear_ptr_vector(patterns);
+    fps = compile_file_name_pattern_set(patterns);
+    assert_false(file_name_pattern_set_matches(fps, u"/home/will/letter.tmp"));
+    assert_int_equal(file_name_pattern_set_first_match(fps, u"/home/will/letter.tmp"), 0);
+    destroy_file_name_pattern_set(fps);
+    /* The separator after the ** is not required, since it may be skipped */
+    yella_push_back_ptr_vector(patterns, udsnew(u"**/*"));
+    fps = compile_file_name_pattern_set(patterns);
+    assert_true(file_name_pattern_set_matches(fps, u"letter"));
+    destroy_file_name_pattern_set(fps);
+    yella_clear_ptr_vector(patterns);
+    /* More patterns than fit in one word of candidates, sharing prefixes */
+    for (i = 0; i < 200; i++)
+    {
+        u_sprintf(text, "**/file-%d.log", i);
+        yella_push_back_ptr_vector(patterns, udsnew(text));
+    }
+    yella_push_back_ptr_vector(patterns, udsnew(u"*"));
+    fps = compile_file_name_pattern_set(patterns);
+    assert_true(file_name_pattern_set_matches(fps, u"/logs/file-0.log"));
+    assert_true(file_name_pattern_set_matches(fps, u"/logs/file-199.log"));
+    assert_true(file_name_pattern_set_matches(fps, u"/logs/more/file-99.log"));
+    assert_false(file_name_pattern_set_matches(fps, u"/logs/file-200.log"));
+    /* Only the last pattern has no literal */
+    assert_true(file_name_pattern_set_matches(fps, u"anything"));
+    assert_false(file_name_pattern_set_matches(fps, u"/any/thing"));
+    destroy_file_name_pattern_set(fps);
+    yella_destroy_ptr_vector(patterns);
+}
+
 static void simple(void** arg)
 {
     int i;
@@ -158,7 +347,9 @@ static void star_star(void** arg)
         { u"/my/dog/has/fleas", u"/**fleas", false },
         { u"/my/dog/has/fleas", u"/**/f?ea*", true },
         { u"/my/dog/has/fleas", u"/m?/**/f?ea*", true },
-        { u"fleas", u"**/fleas", true }
+        { u"fleas", u"**/fleas", true },
+        { u"dogfleas", u"**/fleas", false },
+        { u"/my/dog/has/fleas", u"/**/a*b*c*d*e*f*", false }
     };
 
     check_it(tests, YELLA_ARRAY_SIZE(tests));
@@ -193,9 +384,13 @@ int main()
 {
     const struct CMUnitTest tests[] =
     {
+        cmocka_unit_test(benchmark),
+        cmocka_unit_test(compiled),
         cmocka_unit_test(escaped),
         cmocka_unit_test(first_unescaped_special),
         cmocka_unit_test(question),
+        cmocka_unit_test(set),
+        cmocka_unit_test(set_benchmark),
         cmocka_unit_test(simple),
         cmocka_unit_test(star),
         cmocka_unit_test(star_star),
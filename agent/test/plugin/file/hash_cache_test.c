@@ -0,0 +1,84 @@
+#include "plugin/file/hash_cache.h"
+#include "common/file.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <cmocka.h>
+
+static const UChar* FILE_NAME = u"hash-cache-test.bin";
+
+static void make_stamp(file_stamp* stmp, uint64_t inode)
+{
+    stmp->device = 1;
+    stmp->inode = inode;
+    stmp->size = 100;
+    stmp->modification_nanos = 1000;
+    stmp->metadata_change_nanos = 2000;
+}
+
+static void eviction(void** arg)
+{
+    hash_cache* hc;
+    file_stamp stmp;
+    uint8_t md[HASH_CACHE_MAX_DIGEST_SIZE];
+
+    hc = create_hash_cache(2, NULL);
+    make_stamp(&stmp, 1);
+    put_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, (const uint8_t*)"one", 3);
+    make_stamp(&stmp, 2);
+    put_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, (const uint8_t*)"two", 3);
+    /* Touching the first makes the second the least recently used */
+    make_stamp(&stmp, 1);
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, md), 3);
+    assert_memory_equal(md, "one", 3);
+    make_stamp(&stmp, 3);
+    put_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, (const uint8_t*)"three", 5);
+    assert_int_equal(hash_cache_size(hc), 2);
+    make_stamp(&stmp, 2);
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, md), 0);
+    make_stamp(&stmp, 1);
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, md), 3);
+    make_stamp(&stmp, 3);
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, md), 5);
+    assert_memory_equal(md, "three", 5);
+    /* The type is part of the key */
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SIZE, &stmp, md), 0);
+    destroy_hash_cache(hc);
+}
+
+static void persistence(void** arg)
+{
+    hash_cache* hc;
+    file_stamp stmp;
+    uint8_t md[HASH_CACHE_MAX_DIGEST_SIZE];
+
+    yella_remove_file(FILE_NAME);
+    hc = create_hash_cache(10, FILE_NAME);
+    make_stamp(&stmp, 1);
+    put_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, (const uint8_t*)"one", 3);
+    make_stamp(&stmp, 2);
+    put_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, (const uint8_t*)"two", 3);
+    destroy_hash_cache(hc);
+    hc = create_hash_cache(10, FILE_NAME);
+    assert_int_equal(hash_cache_size(hc), 2);
+    make_stamp(&stmp, 2);
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, md), 3);
+    assert_memory_equal(md, "two", 3);
+    ++stmp.metadata_change_nanos;
+    assert_int_equal(get_hash_cache_digest(hc, ATTR_TYPE_SHA256, &stmp, md), 0);
+    destroy_hash_cache(hc);
+    yella_remove_file(FILE_NAME);
+}
+
+int main()
+{
+    const struct CMUnitTest tests[] =
+    {
+        cmocka_unit_test(eviction),
+        cmocka_unit_test(persistence)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -57,6 +57,50 @@ static void a_lot(void** arg)
     assert_int_equal(stats.jobs_run, stats.jobs_pushed);
 }
 
+static size_t jobs_started;
+
+static void record_start(const job* const j, void* udata)
+{
+    *(size_t*)udata = jobs_started++;
+}
+
+static job* get_ordered_job(test_data* td, size_t* position)
+{
+    job* j;
+
+    j = get_job(td);
+    j->started = record_start;
+    j->started_udata = position;
+    return j;
+}
+
+static void batch(void** arg)
+{
+    test_data* td;
+    job* jobs[3];
+    size_t positions[7];
+    size_t i;
+    job_queue_stats stats;
+
+    td = *arg;
+    jobs_started = 0;
+    /* Batches and single jobs all run in the order pushed */
+    for (i = 0; i < 3; i++)
+        jobs[i] = get_ordered_job(td, &positions[i]);
+    assert_int_equal(push_job_queue_batch(td->jq, jobs, 0), 0);
+    push_job_queue_batch(td->jq, jobs, 3);
+    push_job_queue(td->jq, get_ordered_job(td, &positions[3]));
+    for (i = 0; i < 3; i++)
+        jobs[i] = get_ordered_job(td, &positions[i + 4]);
+    push_job_queue_batch(td->jq, jobs, 3);
+    yella_sleep_this_thread_milliseconds(2000);
+    stats = get_job_queue_stats(td->jq);
+    assert_int_equal(stats.jobs_pushed, 7);
+    assert_int_equal(stats.jobs_run, 7);
+    for (i = 0; i < 7; i++)
+        assert_int_equal(positions[i], i);
+}
+
 static void cb(void* udata)
 {
     yella_signal_event((yella_event*)udata);
@@ -118,7 +162,7 @@ static int set_up(void** arg)
     yella_remove_all(yella_settings_get_dir(u"file", u"data-dir"));
     td = calloc(1, sizeof(test_data));
     td->pool = create_state_db_pool();
-    td->jq = create_job_queue(td->pool);
+    td->jq = create_job_queue(td->pool, NULL);
     td->api.send_message = send_message;
     td->acc = create_accumulator(td, &td->api);
     td->lgr = chucho_get_logger("job-queue-test");
@@ -148,6 +192,7 @@ int main()
     {
         cmocka_unit_test_setup_teardown(one, set_up, tear_down),
         cmocka_unit_test_setup_teardown(a_lot, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(batch, set_up, tear_down),
         cmocka_unit_test_setup_teardown(empty_callback, set_up, tear_down)
     };
 
@@ -156,6 +201,8 @@ int main()
     yella_destroy_settings_doc();
     yella_settings_set_dir(u"file", u"data-dir", u"job-queue-test-data");
     yella_settings_set_uint(u"file", u"max-spool-dbs", 10);
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 5000);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 2000);
     yella_settings_set_byte_size(u"agent", u"max-message-size", u"1MB");
     yella_settings_set_uint(u"file", u"send-latency-seconds", 1);
     rc = cmocka_run_group_tests(tests, NULL, NULL);
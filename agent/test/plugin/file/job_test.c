@@ -275,7 +275,7 @@ static void single(void** arg)
         }
         sglib_test_node_add(&td->files, tn);
         lgr = chucho_get_logger("job_test");
-        run_job(j, td->db_pool, lgr);
+        run_job(j, td->db_pool, NULL, lgr);
         chucho_release_logger(lgr);
         yella_sleep_this_thread_milliseconds(1250);
         destroy_job(j);
@@ -332,18 +332,176 @@ void wild(void** arg)
     uf = u_fopen_u(tn->file_name, "w", NULL, NULL);
     u_fclose(uf);
     lgr = chucho_get_logger("job_test");
-    run_job(j, td->db_pool, lgr);
+    run_job(j, td->db_pool, NULL, lgr);
     chucho_release_logger(lgr);
     yella_sleep_this_thread_milliseconds(1250);
     destroy_job(j);
     assert_int_equal(sglib_test_node_len(td->files), 0);
 }
 
+static void removed_dir(void** arg)
+{
+    test_data* td;
+    test_node* tn;
+    job* j;
+    attr_node* expect;
+    UFILE* uf;
+    uds dir_name;
+    chucho_logger_t* lgr;
+
+    td = *arg;
+    lgr = chucho_get_logger("job_test");
+    dir_name = udscatprintf(udsempty(), u"%Sremoved-dir", td->data_dir);
+    yella_ensure_dir_exists(dir_name);
+    j = create_job(u"removed-dir-cfg", td->recipient, td->acc);
+    yella_push_back_ptr_vector(j->includes, udscatprintf(udsempty(), u"%S/**", dir_name));
+    j->attr_type_count = 1;
+    j->attr_types = malloc(sizeof(attribute_type));
+    j->attr_types[0] = ATTR_TYPE_FILE_TYPE;
+    tn = calloc(1, sizeof(test_node));
+    tn->file_name = udscatprintf(udsempty(), u"%S/inner", dir_name);
+    tn->cond = yella_fb_file_condition_ADDED;
+    tn->config_name = udsdup(j->config_name);
+    expect = malloc(sizeof(attr_node));
+    expect->attr.type = ATTR_TYPE_FILE_TYPE;
+    expect->attr.value.integer = YELLA_FILE_TYPE_REGULAR;
+    sglib_attr_node_add(&tn->attrs, expect);
+    sglib_test_node_add(&td->files, tn);
+    uf = u_fopen_u(tn->file_name, "w", NULL, NULL);
+    u_fclose(uf);
+    run_job(j, td->db_pool, NULL, lgr);
+    yella_sleep_this_thread_milliseconds(1250);
+    destroy_job(j);
+    assert_int_equal(sglib_test_node_len(td->files), 0);
+    /* An event for just the directory reports the stored file below it */
+    yella_remove_all(dir_name);
+    j = create_job(u"removed-dir-cfg", td->recipient, td->acc);
+    yella_push_back_ptr_vector(j->includes, udsdup(dir_name));
+    j->attr_type_count = 1;
+    j->attr_types = malloc(sizeof(attribute_type));
+    j->attr_types[0] = ATTR_TYPE_FILE_TYPE;
+    tn = calloc(1, sizeof(test_node));
+    tn->file_name = udscatprintf(udsempty(), u"%S/inner", dir_name);
+    tn->cond = yella_fb_file_condition_REMOVED;
+    tn->config_name = udsdup(j->config_name);
+    sglib_test_node_add(&td->files, tn);
+    run_job(j, td->db_pool, NULL, lgr);
+    yella_sleep_this_thread_milliseconds(1250);
+    destroy_job(j);
+    assert_int_equal(sglib_test_node_len(td->files), 0);
+    udsfree(dir_name);
+    chucho_release_logger(lgr);
+}
+
+static void count_start(const job* const j, void* udata)
+{
+    ++*(int*)udata;
+}
+
+static void started(void** arg)
+{
+    test_data* td;
+    job* j;
+    int starts;
+    chucho_logger_t* lgr;
+
+    td = *arg;
+    lgr = chucho_get_logger("job_test");
+    starts = 0;
+    j = create_job(u"started-cfg", td->recipient, td->acc);
+    j->started = count_start;
+    j->started_udata = &starts;
+    run_job(j, td->db_pool, NULL, lgr);
+    destroy_job(j);
+    assert_int_equal(starts, 1);
+    chucho_release_logger(lgr);
+}
+
+static void scan_count(void** arg)
+{
+    test_data* td;
+    job* j;
+    state_db* db;
+    chucho_logger_t* lgr;
+
+    td = *arg;
+    lgr = chucho_get_logger("job_test");
+    /* A rescan does not count, but a scheduled scan does */
+    j = create_job(u"scan-count-cfg", td->recipient, td->acc);
+    j->is_scan = true;
+    run_job(j, td->db_pool, NULL, lgr);
+    j->counts_toward_full_hash = true;
+    run_job(j, td->db_pool, NULL, lgr);
+    db = get_state_db_from_pool(td->db_pool, j->config_name);
+    assert_non_null(db);
+    assert_int_equal(increment_state_db_scan_count(db), 2);
+    destroy_job(j);
+    chucho_release_logger(lgr);
+}
+
+static void scoped(void** arg)
+{
+    test_data* td;
+    test_node* tn;
+    job* j;
+    attr_node* expect;
+    UFILE* uf;
+    uds name;
+    chucho_logger_t* lgr;
+
+    td = *arg;
+    lgr = chucho_get_logger("job_test");
+    j = create_job(u"scoped-cfg", td->recipient, td->acc);
+    yella_push_back_ptr_vector(j->includes, udscatprintf(udsempty(), u"%S**", td->data_dir));
+    j->attr_type_count = 1;
+    j->attr_types = malloc(sizeof(attribute_type));
+    j->attr_types[0] = ATTR_TYPE_FILE_TYPE;
+    j->is_scan = true;
+    j->scope = udscatprintf(udsempty(), u"%Sscoped-in", td->data_dir);
+    yella_ensure_dir_exists(j->scope);
+    tn = calloc(1, sizeof(test_node));
+    tn->file_name = udsdup(j->scope);
+    tn->cond = yella_fb_file_condition_ADDED;
+    tn->config_name = udsdup(j->config_name);
+    expect = malloc(sizeof(attr_node));
+    expect->attr.type = ATTR_TYPE_FILE_TYPE;
+    expect->attr.value.integer = YELLA_FILE_TYPE_DIRECTORY;
+    sglib_attr_node_add(&tn->attrs, expect);
+    sglib_test_node_add(&td->files, tn);
+    tn = calloc(1, sizeof(test_node));
+    tn->file_name = udscatprintf(udsempty(), u"%S/x", j->scope);
+    tn->cond = yella_fb_file_condition_ADDED;
+    tn->config_name = udsdup(j->config_name);
+    expect = malloc(sizeof(attr_node));
+    expect->attr.type = ATTR_TYPE_FILE_TYPE;
+    expect->attr.value.integer = YELLA_FILE_TYPE_REGULAR;
+    sglib_attr_node_add(&tn->attrs, expect);
+    sglib_test_node_add(&td->files, tn);
+    uf = u_fopen_u(tn->file_name, "w", NULL, NULL);
+    u_fclose(uf);
+    /* Nothing outside the scope is reported */
+    name = udscatprintf(udsempty(), u"%Sscoped-out", td->data_dir);
+    yella_ensure_dir_exists(name);
+    name = udscat(name, u"/x");
+    uf = u_fopen_u(name, "w", NULL, NULL);
+    u_fclose(uf);
+    udsfree(name);
+    run_job(j, td->db_pool, NULL, lgr);
+    yella_sleep_this_thread_milliseconds(1250);
+    destroy_job(j);
+    assert_int_equal(sglib_test_node_len(td->files), 0);
+    chucho_release_logger(lgr);
+}
+
 int main()
 {
     const struct CMUnitTest tests[] =
     {
+        cmocka_unit_test_setup_teardown(removed_dir, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(scan_count, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(scoped, set_up, tear_down),
         cmocka_unit_test_setup_teardown(single, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(started, set_up, tear_down),
         cmocka_unit_test_setup_teardown(wild, set_up, tear_down)
     };
 
@@ -354,5 +512,8 @@ int main()
     yella_settings_set_uint(u"file", u"max-spool-dbs", 10);
     yella_settings_set_byte_size(u"agent", u"max-message-size", u"1MB");
     yella_settings_set_uint(u"file", u"send-latency-seconds", 1);
+    yella_settings_set_uint(u"file", u"full-hash-scan-interval", 10);
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 5000);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 2000);
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
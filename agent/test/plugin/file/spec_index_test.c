@@ -0,0 +1,229 @@
+#include "plugin/file/spec_index.h"
+#include "plugin/file/file_name_matcher.h"
+#include "common/macro_util.h"
+#include "common/uds_util.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <cmocka.h>
+#include <unicode/ustdio.h>
+
+static event_source_spec* create_spec(const UChar* const name,
+                                      const UChar* const* includes,
+                                      size_t include_count,
+                                      const UChar* const* excludes,
+                                      size_t exclude_count)
+{
+    event_source_spec* result;
+    size_t i;
+
+    result = calloc(1, sizeof(event_source_spec));
+    result->name = udsnew(name);
+    result->includes = yella_create_uds_ptr_vector();
+    for (i = 0; i < include_count; i++)
+        yella_push_back_ptr_vector(result->includes, udsnew(includes[i]));
+    result->excludes = yella_create_uds_ptr_vector();
+    for (i = 0; i < exclude_count; i++)
+        yella_push_back_ptr_vector(result->excludes, udsnew(excludes[i]));
+    result->include_patterns = compile_file_name_patterns(result->includes);
+    return result;
+}
+
+static void destroy_spec(event_source_spec* spec)
+{
+    udsfree(spec->name);
+    yella_destroy_ptr_vector(spec->includes);
+    yella_destroy_ptr_vector(spec->excludes);
+    yella_destroy_ptr_vector(spec->include_patterns);
+    free(spec);
+}
+
+static void assert_match(const spec_index* const idx, const UChar* const fname, const UChar* const expected)
+{
+    const UChar* found;
+
+    found = spec_index_match(idx, fname);
+    if (expected == NULL)
+        assert_null(found);
+    else
+        assert_true(found != NULL && u_strcmp(found, expected) == 0);
+}
+
+static void excludes(void** arg)
+{
+    const UChar* incls[] = { u"/var/log/**" };
+    const UChar* excls[] = { u"/var/log/**/*.gz" };
+    event_source_spec* spec;
+    spec_index* idx;
+
+    spec = create_spec(u"logs", incls, YELLA_ARRAY_SIZE(incls), excls, YELLA_ARRAY_SIZE(excls));
+    idx = create_spec_index(&spec, 1);
+    assert_match(idx, u"/var/log/messages", u"logs");
+    assert_match(idx, u"/var/log/old/messages.1.gz", NULL);
+    destroy_spec_index(idx);
+    destroy_spec(spec);
+}
+
+static void exclude_veto(void** arg)
+{
+    const UChar* incls1[] = { u"/etc/**" };
+    const UChar* excls1[] = { u"/var/**/*.log" };
+    const UChar* incls2[] = { u"/var/**" };
+    const UChar* excls3[] = { u"/var/**" };
+    event_source_spec* spec1;
+    event_source_spec* spec2;
+    event_source_spec* spec3;
+    event_source_spec* specs[3];
+    spec_index* idx;
+
+    spec1 = create_spec(u"a", incls1, YELLA_ARRAY_SIZE(incls1), excls1, YELLA_ARRAY_SIZE(excls1));
+    spec2 = create_spec(u"b", incls2, YELLA_ARRAY_SIZE(incls2), NULL, 0);
+    spec3 = create_spec(u"c", incls2, YELLA_ARRAY_SIZE(incls2), excls3, YELLA_ARRAY_SIZE(excls3));
+    specs[0] = spec3;
+    specs[1] = spec2;
+    specs[2] = spec1;
+    idx = create_spec_index(specs, 3);
+    /* An earlier spec's exclude wins even though it does not include the file */
+    assert_match(idx, u"/var/app/server.log", NULL);
+    /* A later spec's exclude does not */
+    assert_match(idx, u"/var/app/server.txt", u"b");
+    assert_match(idx, u"/etc/app/server.log", u"a");
+    destroy_spec_index(idx);
+    destroy_spec(spec1);
+    destroy_spec(spec2);
+    destroy_spec(spec3);
+}
+
+static void literal(void** arg)
+{
+    const UChar* incls[] = { u"/etc/passwd", u"/etc/my\\*file" };
+    event_source_spec* spec;
+    spec_index* idx;
+
+    spec = create_spec(u"literal", incls, YELLA_ARRAY_SIZE(incls), NULL, 0);
+    idx = create_spec_index(&spec, 1);
+    assert_match(idx, u"/etc/passwd", u"literal");
+    assert_match(idx, u"/etc/my*file", u"literal");
+    assert_match(idx, u"/etc/passwd/more", NULL);
+    assert_match(idx, u"/etc/pass", NULL);
+    assert_match(idx, u"/etc", NULL);
+    destroy_spec_index(idx);
+    destroy_spec(spec);
+}
+
+static void many(void** arg)
+{
+    const UChar* incls[1];
+    const UChar* excls[1];
+    event_source_spec* specs[300];
+    UChar incl[64];
+    UChar excl[64];
+    UChar name[32];
+    UChar fname[64];
+    event_source_spec* spec;
+    spec_index* idx;
+    int i;
+
+    for (i = 0; i < YELLA_ARRAY_SIZE(specs); i++)
+    {
+        u_sprintf(name, "config %03d", i);
+        u_sprintf(incl, "/data/%d/**/*.txt", i);
+        incls[0] = incl;
+        /* The middle one excludes what all the others include */
+        if (i == 150)
+            u_sprintf(excl, "/data/**/veto.txt");
+        else
+            u_sprintf(excl, "/data/%d/**/skip.txt", i);
+        excls[0] = excl;
+        specs[i] = create_spec(name, incls, 1, excls, 1);
+    }
+    /* Added backwards, since the index orders the specs itself */
+    for (i = 0; i < YELLA_ARRAY_SIZE(specs) / 2; i++)
+    {
+        spec = specs[i];
+        specs[i] = specs[YELLA_ARRAY_SIZE(specs) - 1 - i];
+        specs[YELLA_ARRAY_SIZE(specs) - 1 - i] = spec;
+    }
+    idx = create_spec_index(specs, YELLA_ARRAY_SIZE(specs));
+    for (i = 0; i < YELLA_ARRAY_SIZE(specs); i++)
+    {
+        u_sprintf(name, "config %03d", i);
+        u_sprintf(fname, "/data/%d/some/where/file.txt", i);
+        assert_match(idx, fname, name);
+        u_sprintf(fname, "/data/%d/some/where/skip.txt", i);
+        assert_match(idx, fname, (i == 150) ? name : NULL);
+        u_sprintf(fname, "/data/%d/some/where/veto.txt", i);
+        assert_match(idx, fname, (i < 150) ? name : NULL);
+    }
+    assert_match(idx, u"/data/1000/file.txt", NULL);
+    assert_match(idx, u"/elsewhere/1/file.txt", NULL);
+    destroy_spec_index(idx);
+    for (i = 0; i < YELLA_ARRAY_SIZE(specs); i++)
+        destroy_spec(specs[i]);
+}
+
+static void name_order(void** arg)
+{
+    const UChar* incls1[] = { u"/home/*/docs/*" };
+    const UChar* incls2[] = { u"/home/**" };
+    event_source_spec* spec1;
+    event_source_spec* spec2;
+    event_source_spec* specs[2];
+    spec_index* idx;
+
+    spec1 = create_spec(u"b", incls1, YELLA_ARRAY_SIZE(incls1), NULL, 0);
+    spec2 = create_spec(u"a", incls2, YELLA_ARRAY_SIZE(incls2), NULL, 0);
+    specs[0] = spec1;
+    specs[1] = spec2;
+    idx = create_spec_index(specs, 2);
+    /* Both match, but the first spec by name wins, wherever it sits in the trie */
+    assert_match(idx, u"/home/will/docs/letter", u"a");
+    destroy_spec_index(idx);
+    destroy_spec(spec1);
+    idx = create_spec_index(&spec2, 1);
+    assert_match(idx, u"/home/will/docs/letter", u"a");
+    destroy_spec_index(idx);
+    destroy_spec(spec2);
+}
+
+static void prefix(void** arg)
+{
+    const UChar* incls1[] = { u"/usr/local/*" };
+    const UChar* incls2[] = { u"**/*.conf", u"rel*" };
+    event_source_spec* spec1;
+    event_source_spec* spec2;
+    event_source_spec* specs[2];
+    spec_index* idx;
+
+    spec1 = create_spec(u"local", incls1, YELLA_ARRAY_SIZE(incls1), NULL, 0);
+    spec2 = create_spec(u"anywhere", incls2, YELLA_ARRAY_SIZE(incls2), NULL, 0);
+    specs[0] = spec1;
+    specs[1] = spec2;
+    idx = create_spec_index(specs, 2);
+    assert_match(idx, u"/usr/local/bin", u"local");
+    assert_match(idx, u"/usr/lib/bin", NULL);
+    assert_match(idx, u"/usr/localbin", NULL);
+    assert_match(idx, u"/etc/my.conf", u"anywhere");
+    assert_match(idx, u"/usr/local/my.conf", u"anywhere");
+    assert_match(idx, u"relative", u"anywhere");
+    destroy_spec_index(idx);
+    destroy_spec(spec1);
+    destroy_spec(spec2);
+}
+
+int main()
+{
+    const struct CMUnitTest tests[] =
+    {
+        cmocka_unit_test(exclude_veto),
+        cmocka_unit_test(excludes),
+        cmocka_unit_test(literal),
+        cmocka_unit_test(many),
+        cmocka_unit_test(name_order),
+        cmocka_unit_test(prefix)
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -2,7 +2,6 @@
 #include "common/settings.h"
 #include "common/file.h"
 #include "common/uds_util.h"
-#include "common/thread.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -70,13 +69,11 @@ static void exceed_max(void** arg)
     assert_non_null(db);
     assert_int_equal(state_db_pool_size(pt->pool), 1);
     assert_int_equal(u_strcmp(state_db_name(db), u"one"), 0);
-    yella_sleep_this_thread_milliseconds(100);
     db = get_state_db_from_pool(pt->pool, u"two");
     assert_non_null(db);
     assert_int_equal(state_db_pool_size(pt->pool), 2);
     assert_int_equal(u_strcmp(state_db_name(db), u"two"), 0);
     yella_push_back_ptr_vector(pt->configs, udsnew(u"two"));
-    yella_sleep_this_thread_milliseconds(100);
     db = get_state_db_from_pool(pt->pool, u"three");
     assert_non_null(db);
     assert_int_equal(state_db_pool_size(pt->pool), 2);
@@ -90,6 +87,33 @@ static void exceed_max(void** arg)
     yella_push_back_ptr_vector(pt->configs, udsnew(u"one"));
 }
 
+static void lru(void** arg)
+{
+    pool_test* pt;
+    state_db_pool_stats stats;
+
+    pt = *arg;
+    assert_non_null(get_state_db_from_pool(pt->pool, u"one"));
+    assert_non_null(get_state_db_from_pool(pt->pool, u"two"));
+    /* Now two is the least recently used */
+    assert_non_null(get_state_db_from_pool(pt->pool, u"one"));
+    assert_non_null(get_state_db_from_pool(pt->pool, u"three"));
+    assert_int_equal(state_db_pool_size(pt->pool), 2);
+    get_state_db_pool_stats(pt->pool, &stats);
+    assert_int_equal(stats.hits, 1);
+    assert_int_equal(stats.misses, 3);
+    assert_int_equal(stats.evictions, 1);
+    /* One is still open and three is the newest */
+    assert_non_null(get_state_db_from_pool(pt->pool, u"one"));
+    assert_non_null(get_state_db_from_pool(pt->pool, u"three"));
+    get_state_db_pool_stats(pt->pool, &stats);
+    assert_int_equal(stats.hits, 3);
+    assert_int_equal(stats.misses, 3);
+    assert_int_equal(stats.evictions, 1);
+    yella_push_back_ptr_vector(pt->configs, udsnew(u"one"));
+    yella_push_back_ptr_vector(pt->configs, udsnew(u"three"));
+}
+
 static void repeated(void** arg)
 {
     pool_test* pt;
@@ -113,6 +137,7 @@ int main()
     {
         cmocka_unit_test_setup_teardown(get, set_up, tear_down),
         cmocka_unit_test_setup_teardown(exceed_max, set_up, tear_down),
+        cmocka_unit_test_setup_teardown(lru, set_up, tear_down),
         cmocka_unit_test_setup_teardown(repeated, set_up, tear_down)
     };
 
@@ -120,5 +145,7 @@ int main()
     yella_destroy_settings_doc();
     yella_settings_set_dir(u"file", u"data-dir", u"state-db-pool-test-data");
     yella_settings_set_uint(u"file", u"max-spool-dbs", 2);
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 5000);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 2000);
     return cmocka_run_group_tests(tests, NULL, NULL);
 }
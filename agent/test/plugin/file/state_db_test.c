@@ -1,14 +1,152 @@
 #include "plugin/file/state_db.h"
 #include "common/settings.h"
 #include "common/file.h"
+#include "common/time_util.h"
+#include "common/thread.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <stddef.h>
 #include <setjmp.h>
 #include <stdlib.h>
+#include <string.h>
 #include <cmocka.h>
 #include <plugin/file/attribute.h>
 #include <unicode/ustring.h>
+#include <sqlite3.h>
+#include <openssl/evp.h>
+#include <unicode/ustdio.h>
+#include <inttypes.h>
+
+typedef struct reader_arg
+{
+    state_db* db;
+    bool expect_uncommitted;
+    bool committed_found;
+    bool uncommitted_found;
+} reader_arg;
+
+/* The name create_state_db gives the file, so it can be opened directly */
+static uds db_file_name(const UChar* const config_name)
+{
+    uds result;
+    uint8_t sha1[EVP_MAX_MD_SIZE];
+    unsigned sz;
+    unsigned i;
+
+    result = udsnew(yella_settings_get_dir(u"file", u"data-dir"));
+    yella_ensure_dir_exists(result);
+    result = udscat(result, YELLA_DIR_SEP);
+    EVP_Digest(config_name, u_strlen(config_name) * sizeof(UChar), sha1, &sz, EVP_sha1(), NULL);
+    for (i = 0; i < sz; i++)
+        result = udscatprintf(result, u"%02x", sha1[i]);
+    result = udscat(result, u".sqlite");
+    return result;
+}
+
+static void read_from_other_thread(void* udata)
+{
+    reader_arg* ra;
+    element* elem;
+
+    ra = udata;
+    elem = get_element_from_state_db(ra->db, u"committed");
+    ra->committed_found = elem != NULL;
+    if (elem != NULL)
+        destroy_element(elem);
+    elem = get_element_from_state_db(ra->db, u"uncommitted");
+    ra->uncommitted_found = elem != NULL;
+    if (elem != NULL)
+        destroy_element(elem);
+    release_state_db_reader(ra->db);
+}
+
+static void write_from_other_thread(void* udata)
+{
+    state_db* db;
+    element* elem;
+
+    db = udata;
+    /* The other thread's batch does not keep this one from writing */
+    assert_true(begin_state_db_transaction(db));
+    elem = create_element(u"other");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    elem = get_element_from_state_db(db, u"other");
+    assert_non_null(elem);
+    destroy_element(elem);
+    assert_true(commit_state_db_transaction(db));
+    release_state_db_reader(db);
+}
+
+static void run_readers(state_db* db, bool expect_uncommitted)
+{
+    reader_arg args[4];
+    yella_thread* thrs[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+    {
+        args[i].db = db;
+        args[i].expect_uncommitted = expect_uncommitted;
+        thrs[i] = yella_create_thread(read_from_other_thread, &args[i]);
+    }
+    for (i = 0; i < 4; i++)
+    {
+        yella_join_thread(thrs[i]);
+        yella_destroy_thread(thrs[i]);
+        assert_true(args[i].committed_found);
+        assert_int_equal(args[i].expect_uncommitted, args[i].uncommitted_found);
+    }
+}
+
+static void concurrent_readers(void** arg)
+{
+    state_db* db;
+    element* elem;
+
+    db = create_state_db(u"concurrent readers");
+    elem = create_element(u"committed");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    assert_true(begin_state_db_transaction(db));
+    elem = create_element(u"uncommitted");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    /* This thread owns the transaction, so it sees its own write */
+    elem = get_element_from_state_db(db, u"uncommitted");
+    assert_non_null(elem);
+    destroy_element(elem);
+    /* Other threads only see what has been committed */
+    run_readers(db, false);
+    assert_true(commit_state_db_transaction(db));
+    run_readers(db, true);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
+static void concurrent_writers(void** arg)
+{
+    state_db* db;
+    element* elem;
+    yella_thread* thr;
+
+    db = create_state_db(u"concurrent writers");
+    assert_true(begin_state_db_transaction(db));
+    elem = create_element(u"uncommitted");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    thr = yella_create_thread(write_from_other_thread, db);
+    yella_join_thread(thr);
+    yella_destroy_thread(thr);
+    elem = get_element_from_state_db(db, u"other");
+    assert_non_null(elem);
+    destroy_element(elem);
+    assert_true(commit_state_db_transaction(db));
+    /* Both writes are committed, so this thread's reader sees them */
+    elem = get_element_from_state_db(db, u"uncommitted");
+    assert_non_null(elem);
+    destroy_element(elem);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
 
 static void delete(void** arg)
 {
@@ -83,6 +221,61 @@ static void insert(void** arg)
     destroy_state_db(db, STATE_DB_ACTION_REMOVE);
 }
 
+static int64_t directory_count(const UChar* const config_name)
+{
+    uds db_name;
+    sqlite3* sdb;
+    sqlite3_stmt* stmt;
+    int64_t result;
+
+    db_name = db_file_name(config_name);
+    assert_int_equal(sqlite3_open16(db_name, &sdb), SQLITE_OK);
+    udsfree(db_name);
+    assert_int_equal(sqlite3_prepare_v2(sdb, "SELECT COUNT(*) FROM 'directory';", -1, &stmt, NULL), SQLITE_OK);
+    assert_int_equal(sqlite3_step(stmt), SQLITE_ROW);
+    result = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    sqlite3_close(sdb);
+    return result;
+}
+
+static void orphaned_directories(void** arg)
+{
+    state_db* db;
+    element* elem;
+
+    db = create_state_db(u"orphans");
+    elem = create_element(u"/a/b/one");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    elem = create_element(u"/a/b/two");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    elem = create_element(u"/a/three");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    assert_int_equal(directory_count(u"orphans"), 2);
+    /* This thread reads through a connection that remembers /a/b */
+    elem = get_element_from_state_db(db, u"/a/b/one");
+    assert_non_null(elem);
+    destroy_element(elem);
+    assert_true(delete_from_state_db(db, u"/a/b/one"));
+    assert_int_equal(directory_count(u"orphans"), 2);
+    assert_true(delete_from_state_db(db, u"/a/b/two"));
+    assert_int_equal(directory_count(u"orphans"), 1);
+    /* The directory comes back with a new id */
+    elem = create_element(u"/a/b/four");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    elem = get_element_from_state_db(db, u"/a/b/four");
+    assert_non_null(elem);
+    destroy_element(elem);
+    assert_true(delete_from_state_db(db, u"/a/b/four"));
+    assert_true(delete_from_state_db(db, u"/a/three"));
+    assert_int_equal(directory_count(u"orphans"), 0);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
 static void name(void** arg)
 {
     state_db* db;
@@ -132,20 +325,302 @@ static void update(void** arg)
     destroy_state_db(db, STATE_DB_ACTION_REMOVE);
 }
 
+static void packed_attributes(void** arg)
+{
+    state_db* db;
+    element* elem1;
+    element* elem2;
+    file_stamp stmp;
+    yella_arena* arena;
+    const uint8_t* packed1;
+    const uint8_t* packed2;
+    uint8_t* expected;
+    size_t expected_size;
+
+    db = create_state_db(u"monkey balls");
+    arena = yella_create_arena(1024);
+    memset(&stmp, 0, sizeof(stmp));
+    stmp.inode = 1;
+    elem1 = create_element(u"/one");
+    set_element_file_stamp(elem1, &stmp);
+    assert_true(insert_into_state_db(db, elem1));
+    stmp.inode = 2;
+    elem2 = create_element(u"/two");
+    set_element_file_stamp(elem2, &stmp);
+    assert_true(insert_into_state_db(db, elem2));
+    assert_true(get_packed_attributes_from_state_db(db, u"/one", arena, &packed1));
+    assert_non_null(packed1);
+    /* The copy outlives later reads and writes */
+    assert_true(get_packed_attributes_from_state_db(db, u"/two", arena, &packed2));
+    assert_true(update_into_state_db(db, elem2));
+    assert_false(get_packed_attributes_from_state_db(db, u"/three", arena, &packed2));
+    expected = pack_element_attributes(elem1, &expected_size);
+    assert_memory_equal(packed1, expected, expected_size);
+    free(expected);
+    destroy_element(elem2);
+    destroy_element(elem1);
+    yella_destroy_arena(arena);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
+static void stamp_and_scan_count(void** arg)
+{
+    state_db* db;
+    element* elem1;
+    element* elem2;
+    file_stamp stmp;
+
+    db = create_state_db(u"monkey balls");
+    elem1 = create_element(u"funky smalls");
+    stmp.device = 1;
+    stmp.inode = 2;
+    stmp.size = 3;
+    stmp.modification_nanos = 4;
+    stmp.metadata_change_nanos = 5;
+    set_element_file_stamp(elem1, &stmp);
+    assert_true(insert_into_state_db(db, elem1));
+    elem2 = get_element_from_state_db(db, u"funky smalls");
+    assert_non_null(elem2);
+    assert_true(file_stamps_equal(element_file_stamp(elem1), element_file_stamp(elem2)));
+    destroy_element(elem2);
+    destroy_element(elem1);
+    assert_int_equal(increment_state_db_scan_count(db), 1);
+    assert_int_equal(increment_state_db_scan_count(db), 2);
+    destroy_state_db(db, STATE_DB_ACTION_KEEP);
+    db = create_state_db(u"monkey balls");
+    assert_int_equal(increment_state_db_scan_count(db), 3);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
+static void subtree(void** arg)
+{
+    state_db* db;
+    element* elem;
+    yella_ptr_vector* names;
+    const UChar* stored[] =
+    {
+        u"/one",
+        u"/one/two",
+        u"/one/two/three",
+        u"/one/twofold",
+        u"/one/two\u012f",
+        u"/uno/two"
+    };
+    int i;
+
+    db = create_state_db(u"monkey balls");
+    for (i = 0; i < sizeof(stored) / sizeof(stored[0]); i++)
+    {
+        elem = create_element(stored[i]);
+        assert_true(insert_into_state_db(db, elem));
+        destroy_element(elem);
+    }
+    names = get_state_db_names_under(db, u"/one/two");
+    assert_int_equal(yella_ptr_vector_size(names), 1);
+    assert_int_equal(u_strcmp(yella_ptr_vector_at(names, 0), u"/one/two/three"), 0);
+    yella_destroy_ptr_vector(names);
+    names = get_state_db_names_under(db, u"/one/");
+    assert_int_equal(yella_ptr_vector_size(names), 4);
+    yella_destroy_ptr_vector(names);
+    names = get_state_db_names_under(db, u"/");
+    assert_int_equal(yella_ptr_vector_size(names), 6);
+    yella_destroy_ptr_vector(names);
+    names = get_state_db_names_under(db, u"/nothing");
+    assert_int_equal(yella_ptr_vector_size(names), 0);
+    yella_destroy_ptr_vector(names);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
+static void migration(void** arg)
+{
+    uds db_name;
+    sqlite3* sdb;
+    sqlite3_stmt* stmt;
+    element* elem1;
+    element* elem2;
+    attribute* attr;
+    uint8_t* packed;
+    size_t packed_size;
+    state_db* db;
+    yella_ptr_vector* names;
+
+    /* Build a database the way it used to be stored */
+    db_name = db_file_name(u"old monkey");
+    assert_int_equal(sqlite3_open16(db_name, &sdb), SQLITE_OK);
+    udsfree(db_name);
+    assert_int_equal(sqlite3_exec(sdb, "CREATE TABLE 'state' (name TEXT UNIQUE, attributes BLOB);", NULL, NULL, NULL), SQLITE_OK);
+    elem1 = create_element(u"/old/funky smalls");
+    attr = malloc(sizeof(attribute));
+    attr->type = ATTR_TYPE_FILE_TYPE;
+    attr->value.integer = YELLA_FILE_TYPE_REGULAR;
+    add_element_attribute(elem1, attr);
+    packed = pack_element_attributes(elem1, &packed_size);
+    assert_int_equal(sqlite3_prepare_v2(sdb, "INSERT INTO 'state' (name, attributes) VALUES (?1, ?2);", -1, &stmt, NULL), SQLITE_OK);
+    sqlite3_bind_text16(stmt, 1, element_name(elem1), -1, SQLITE_STATIC);
+    sqlite3_bind_blob(stmt, 2, packed, packed_size, SQLITE_STATIC);
+    assert_int_equal(sqlite3_step(stmt), SQLITE_DONE);
+    sqlite3_finalize(stmt);
+    free(packed);
+    sqlite3_close(sdb);
+    db = create_state_db(u"old monkey");
+    assert_non_null(db);
+    elem2 = get_element_from_state_db(db, u"/old/funky smalls");
+    assert_non_null(elem2);
+    assert_int_equal(compare_element_attributes(elem1, elem2), 0);
+    destroy_element(elem2);
+    names = get_state_db_names_under(db, u"/old");
+    assert_int_equal(yella_ptr_vector_size(names), 1);
+    assert_int_equal(u_strcmp(yella_ptr_vector_at(names, 0), u"/old/funky smalls"), 0);
+    yella_destroy_ptr_vector(names);
+    destroy_element(elem1);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
+static void transactions(void** arg)
+{
+    state_db* db;
+    element* elem;
+    UChar name[32];
+    int i;
+
+    db = create_state_db(u"monkey balls");
+    assert_true(begin_state_db_transaction(db));
+    for (i = 0; i < 5; i++)
+    {
+        u_sprintf(name, "funky smalls %d", i);
+        elem = create_element(name);
+        assert_true(insert_into_state_db(db, elem));
+        destroy_element(elem);
+    }
+    /* The batch size is three, so the first three are already committed */
+    rollback_state_db_transaction(db);
+    for (i = 0; i < 5; i++)
+    {
+        u_sprintf(name, "funky smalls %d", i);
+        elem = get_element_from_state_db(db, name);
+        if (i < 3)
+            assert_non_null(elem);
+        else
+            assert_null(elem);
+        if (elem != NULL)
+            destroy_element(elem);
+    }
+    assert_true(begin_state_db_transaction(db));
+    elem = create_element(u"blah blah");
+    assert_true(insert_into_state_db(db, elem));
+    destroy_element(elem);
+    /* Destruction commits */
+    destroy_state_db(db, STATE_DB_ACTION_KEEP);
+    db = create_state_db(u"monkey balls");
+    elem = get_element_from_state_db(db, u"blah blah");
+    assert_non_null(elem);
+    destroy_element(elem);
+    destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+}
+
+static void benchmark(void** arg)
+{
+    const UChar* profiles[] = { u"sqlite-default", u"tuned" };
+    const int count = 20000;
+    state_db* db;
+    element* elem;
+    attribute* attr;
+    UChar name[64];
+    int i;
+    int j;
+    uint64_t start;
+    uint64_t elapsed[3];
+
+    /* The batch size of the other tests would commit every three rows, so
+     * the production defaults are used */
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 5000);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 2000);
+    for (i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++)
+    {
+        yella_settings_set_text(u"file", u"db-tuning", profiles[i]);
+        db = create_state_db(u"benchmark");
+        start = yella_microseconds_since_epoch();
+        assert_true(begin_state_db_transaction(db));
+        for (j = 0; j < count; j++)
+        {
+            u_sprintf(name, "/some/directory/that/is/deep/file-%d", j);
+            elem = create_element(name);
+            attr = malloc(sizeof(attribute));
+            attr->type = ATTR_TYPE_SIZE;
+            attr->value.size = j;
+            add_element_attribute(elem, attr);
+            assert_true(insert_into_state_db(db, elem));
+            destroy_element(elem);
+        }
+        assert_true(commit_state_db_transaction(db));
+        elapsed[0] = yella_microseconds_since_epoch() - start;
+        start = yella_microseconds_since_epoch();
+        for (j = 0; j < count; j++)
+        {
+            u_sprintf(name, "/some/directory/that/is/deep/file-%d", j);
+            elem = get_element_from_state_db(db, name);
+            assert_non_null(elem);
+            destroy_element(elem);
+        }
+        elapsed[1] = yella_microseconds_since_epoch() - start;
+        start = yella_microseconds_since_epoch();
+        assert_true(begin_state_db_transaction(db));
+        for (j = 0; j < count; j++)
+        {
+            u_sprintf(name, "/some/directory/that/is/deep/file-%d", j);
+            elem = create_element(name);
+            attr = malloc(sizeof(attribute));
+            attr->type = ATTR_TYPE_SIZE;
+            attr->value.size = j + 1;
+            add_element_attribute(elem, attr);
+            assert_true(update_into_state_db(db, elem));
+            destroy_element(elem);
+        }
+        assert_true(commit_state_db_transaction(db));
+        elapsed[2] = yella_microseconds_since_epoch() - start;
+        destroy_state_db(db, STATE_DB_ACTION_REMOVE);
+        print_message("%s: %d inserts in %" PRIu64 " us, lookups in %" PRIu64 " us, updates in %" PRIu64 " us\n",
+                      i == 0 ? "sqlite-default" : "tuned",
+                      count,
+                      elapsed[0],
+                      elapsed[1],
+                      elapsed[2]);
+    }
+    yella_settings_set_text(u"file", u"db-tuning", u"tuned");
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 3);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 60000);
+}
+
 int main()
 {
     const struct CMUnitTest tests[] =
     {
+        cmocka_unit_test(benchmark),
+        cmocka_unit_test(concurrent_readers),
+        cmocka_unit_test(concurrent_writers),
         cmocka_unit_test(delete),
         cmocka_unit_test(empty_attributes),
         cmocka_unit_test(insert),
+        cmocka_unit_test(migration),
         cmocka_unit_test(name),
+        cmocka_unit_test(orphaned_directories),
+        cmocka_unit_test(packed_attributes),
+        cmocka_unit_test(stamp_and_scan_count),
+        cmocka_unit_test(subtree),
+        cmocka_unit_test(transactions),
         cmocka_unit_test(update)
     };
 
     yella_load_settings_doc();
     yella_destroy_settings_doc();
     yella_settings_set_dir(u"file", u"data-dir", u"state-db-test-data");
+    yella_settings_set_uint(u"file", u"db-batch-max-rows", 3);
+    yella_settings_set_uint(u"file", u"db-batch-max-milliseconds", 60000);
+    yella_settings_set_text(u"file", u"db-tuning", u"tuned");
+    yella_settings_set_byte_size(u"file", u"db-cache-size", u"8MB");
+    yella_settings_set_byte_size(u"file", u"db-mmap-size", u"256MB");
+    yella_settings_set_byte_size(u"file", u"db-wal-size-limit", u"64MB");
+    yella_settings_set_uint(u"file", u"db-checkpoint-seconds", 1);
     yella_remove_all(yella_settings_get_dir(u"file", u"data-dir"));
     return cmocka_run_group_tests(tests, NULL, NULL);
 }